@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* ppoll() */
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -19,6 +20,7 @@
 #include <sys/ioctl.h>
 #include <sys/uio.h>
 #include <sys/time.h>
+#include <time.h>
 #include <signal.h>
 #ifdef WITH_NETMAP
 #include <libnetmap.h>
@@ -37,6 +39,9 @@
 #define be32_to_cpu(x) ntohl((x))
 #define cpu_to_be32(x) htonl((x))
 #include "mark_fun.h"
+#include "mark_rules.h"
+#include "mark_bpf.h"
+#include "conntrack.h"
 
 #include "backend.h"
 
@@ -302,6 +307,124 @@ netmap_send(BpfhvBackend *be, const struct iovec *iov, size_t iovcnt)
 //}
 #endif
 
+/* bp.hv_mark_burst_fun of the built in classifier */
+static void
+mark_packet_burst(uint8_t **data, const uint32_t *pkt_sz, uint32_t *marks,
+                  uint8_t *sticky, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        int s;
+
+        marks[i] = mark_packet_cls(data[i], pkt_sz[i], &s);
+        sticky[i] = s;
+    }
+}
+
+/*
+ * RX staging ring of a guest (see BpfhvRxStage), 'slots' frames of at
+ * most 'bufsz' bytes, plus one buffer to read the frames that find it
+ * full.
+ */
+static int
+rx_stage_init(BpfhvBackend *be, uint32_t slots, uint32_t bufsz)
+{
+    BpfhvRxStage *s = &be->rxs;
+
+    memset(s, 0, sizeof(*s));
+    s->slots = slots;
+    s->bufsz = bufsz;
+    s->len = calloc(slots, sizeof(*s->len));
+    s->buf = malloc((size_t)(slots + 1) * bufsz);
+    if (s->len == NULL || s->buf == NULL) {
+        free(s->len);
+        free(s->buf);
+        s->len = NULL;
+        s->buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+rx_stage_fini(BpfhvBackend *be)
+{
+    free(be->rxs.len);
+    free(be->rxs.buf);
+    memset(&be->rxs, 0, sizeof(be->rxs));
+}
+
+/* be->recv with a staging ring: the next staged frame, 0 if none */
+static ssize_t
+rx_stage_recv(BpfhvBackend *be, const struct iovec *iov, size_t iovcnt)
+{
+    BpfhvRxStage *s = &be->rxs;
+    uint32_t i = s->head & (s->slots - 1);
+    const char *src = s->buf + (size_t)i * s->bufsz;
+    size_t len, ofs = 0;
+
+    if (s->head == s->tail) {
+        errno = EAGAIN;
+        return 0;
+    }
+    len = s->len[i];
+    for (; iovcnt > 0 && ofs < len; iov++, iovcnt--) {
+        size_t copy = MIN(len - ofs, iov->iov_len);
+
+        memcpy(iov->iov_base, src + ofs, copy);
+        ofs += copy;
+    }
+    s->head++;
+
+    return ofs; /* truncated if the guest buffers are too small */
+}
+
+/*
+ * Read ahead from the backend interface into the staging ring, a
+ * batch of at most BPFHV_BE_RX_BUDGET frames. Frames that find the
+ * ring full are dropped, and counted as drops of the RX queue.
+ */
+static void
+rx_stage_fill(BpfhvBackend *be)
+{
+    BpfhvRxStage *s = &be->rxs;
+    unsigned int n;
+
+    for (n = 0; n < BPFHV_BE_RX_BUDGET; n++) {
+        int full = s->tail - s->head >= s->slots;
+        uint32_t i = full ? s->slots : s->tail & (s->slots - 1);
+        char *dst = s->buf + (size_t)i * s->bufsz;
+        struct iovec iov[2];
+        size_t iovcnt = 0;
+        ssize_t ret;
+
+        /* the virtio-net header goes in a buffer of its own */
+        if (be->vnet_hdr_len) {
+            iov[0].iov_base = dst;
+            iov[0].iov_len = be->vnet_hdr_len;
+            iovcnt++;
+        }
+        iov[iovcnt].iov_base = dst + be->vnet_hdr_len;
+        iov[iovcnt].iov_len = s->bufsz - be->vnet_hdr_len;
+        iovcnt++;
+
+        ret = s->recv(be, iov, iovcnt);
+        if (ret <= 0) {
+            if (unlikely(ret < 0 && errno != EAGAIN)) {
+                fprintf(stderr, "recv() failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+        if (unlikely(full)) {
+            be->q[0].stats.drops++;
+            continue;
+        }
+        s->len[i] = ret;
+        s->tail++;
+    }
+}
+
 static void
 process_packets_poll(BpfhvBackend *be)
 {
@@ -350,7 +473,7 @@ process_packets_poll(BpfhvBackend *be)
         /* Poll TAP interface for new receive packets only if we
          * can actually receive packets. If TAP send buffer is full we
          * also wait on more room. */
-        pfd_if->events = can_receive ? POLLIN : 0;
+        pfd_if->events = can_receive || be->rxs.recv ? POLLIN : 0;
         if (unlikely(!can_send)) {
             pfd_if->events |= POLLOUT;
         }
@@ -379,6 +502,9 @@ process_packets_poll(BpfhvBackend *be)
             BpfhvBackendQueue *rxq = be->q + 0;
             size_t count;
 
+            if (be->rxs.recv) {
+                rx_stage_fill(be);
+            }
             can_receive = 1;
             count = ops.rxq_push(be, rxq, &can_receive);
             if (rxq->notify) {
@@ -388,7 +514,7 @@ process_packets_poll(BpfhvBackend *be)
                     printf("Interrupt on %s\n", rxq->name);
                 }
             }
-            if (count >= BPFHV_BE_RX_BUDGET) {
+            if (count >= rxq->budget) {
                 /* Out of budget. Make sure next poll() does not block,
                  * so that we can keep processing. */
                 poll_timeout = 0;
@@ -413,7 +539,7 @@ process_packets_poll(BpfhvBackend *be)
                     printf("Interrupt on %s\n", txq->name);
                 }
             }
-            if (count >= BPFHV_BE_TX_BUDGET) {
+            if (count >= txq->budget) {
                 /* Out of budget. Make sure next poll() does not block,
                  * so that we can keep processing in the next iteration. */
                 poll_timeout = 0;
@@ -440,12 +566,92 @@ process_packets_poll(BpfhvBackend *be)
     free(pfd);
 }
 
+/*
+ * Adaptive budgets for the busy-wait loops. With a cap of
+ * bp->iter_cycles TSC ticks on the time spent in the queue routines
+ * per loop iteration, each queue gets a share of the cap, and a
+ * budget of as many buffers as fit in it at its average cost. The
+ * queues that had work in the last iteration are guaranteed an equal
+ * share; what the ones that emptied did not use goes to those that
+ * used up their budget. A flood of small packets then takes no more
+ * time than the other queues, and expensive packets do not stretch
+ * the iteration.
+ */
+typedef struct BpfhvBudget {
+    uint64_t used;      /* ticks used by the queues that emptied */
+    uint32_t active;    /* queues that had work */
+    uint32_t full;      /* queues that used up their budget */
+} BpfhvBudget;
+
+static inline void
+budget_set(const BpfhvBudget *last, BpfhvBackendQueue *q, uint32_t max)
+{
+    uint64_t cap = bp.iter_cycles, share;
+
+    if (cap == 0 || q->cyc_per_buf == 0) {
+        return;
+    }
+    share = cap / (last->active ? last->active : 1);
+    if (q->budget_full && last->full && last->used < cap &&
+            (cap - last->used) / last->full > share) {
+        share = (cap - last->used) / last->full;
+    }
+    share = (share << 4) / q->cyc_per_buf;
+    q->budget = share < BPFHV_BE_MIN_BUDGET ? BPFHV_BE_MIN_BUDGET :
+                share > max ? max : share;
+}
+
+static inline uint64_t
+budget_clock(void)
+{
+    return bp.iter_cycles ? rdtsc() : 0;
+}
+
+/* Account a call of a queue routine started at budget_clock() 't'. */
+static inline void
+budget_update(BpfhvBudget *cur, BpfhvBackendQueue *q, size_t count,
+              uint64_t t)
+{
+    uint64_t cycles;
+    int64_t sample;
+
+    if (bp.iter_cycles == 0) {
+        return;
+    }
+    if (count == 0) {
+        q->budget_full = 0;
+        return;
+    }
+    cycles = rdtsc() - t;
+    /* cyc_per_buf is 32 bits: clamp, then the average cannot wrap */
+    sample = cycles > (INT64_MAX >> 4) ? UINT32_MAX : (cycles << 4) / count;
+    if (sample > UINT32_MAX) {
+        sample = UINT32_MAX;
+    }
+    if (q->cyc_per_buf == 0) {
+        q->cyc_per_buf = sample;
+    } else {
+        q->cyc_per_buf += (sample - (int64_t)q->cyc_per_buf) / 8;
+    }
+    if (q->cyc_per_buf == 0) {
+        q->cyc_per_buf = 1;
+    }
+    q->budget_full = count >= q->budget;
+    cur->active++;
+    if (q->budget_full) {
+        cur->full++;
+    } else {
+        cur->used += cycles;
+    }
+}
+
 static void
 process_packets_spin(BpfhvBackend *be)
 {
     BeOps ops = be->ops;
     int very_verbose = (verbose >= 2);
     int sleep_usecs = bp.sleep_usecs;
+    BpfhvBudget last, cur;
     unsigned int i;
 
     /* Disable all guest-->host notifications. */
@@ -456,7 +662,9 @@ process_packets_spin(BpfhvBackend *be)
         ops.txq_kicks(be->q[i].ctx.tx, /*enable=*/0);
     }
 
+    memset(&last, 0, sizeof(last));
     while (ACCESS_ONCE(be->stopflag) == BPFHV_STOPFD_NOEVENT) {
+        memset(&cur, 0, sizeof(cur));
         if (be->sync) {
             be->sync(be);
         }
@@ -465,9 +673,16 @@ process_packets_spin(BpfhvBackend *be)
          * into the first receive queue. */
         {
             BpfhvBackendQueue *rxq = be->q + 0;
+            uint64_t t;
             size_t count;
 
+            if (be->rxs.recv) {
+                rx_stage_fill(be);
+            }
+            budget_set(&last, rxq, BPFHV_BE_RX_BUDGET);
+            t = budget_clock();
             count = ops.rxq_push(be, rxq, /*can_receive=*/NULL);
+            budget_update(&cur, rxq, count, t);
             if (rxq->notify) {
                 rxq->stats.irqs++;
                 eventfd_signal(rxq->irqfd);
@@ -484,9 +699,13 @@ process_packets_spin(BpfhvBackend *be)
          * to the backend interface. */
         for (i = TXI_BEGIN(be); i < TXI_END(be); i++) {
             BpfhvBackendQueue *txq = be->q + i;
+            uint64_t t;
             size_t count;
 
+            budget_set(&last, txq, BPFHV_BE_TX_BUDGET);
+            t = budget_clock();
             count = ops.txq_drain(be, txq, /*can_send=*/NULL);
+            budget_update(&cur, txq, count, t);
             if (txq->notify) {
                 txq->stats.irqs++;
                 eventfd_signal(txq->irqfd);
@@ -498,12 +717,312 @@ process_packets_spin(BpfhvBackend *be)
                 ops.txq_dump(txq->ctx.tx);
             }
         }
+        last = cur;
+
         if (sleep_usecs > 0) {
             usleep(sleep_usecs);
         }
     }
 }
 
+/*
+ * Block an idle scheduler thread until a guest kicks one of its TX
+ * queues (or the RX queue, if frames wait for it there), or for at
+ * most bp->sched_idle_usecs. Kicks are enabled only
+ * while we sleep, and the rings are checked again after enabling them
+ * to avoid losing a kick. Backends that cannot check their rings just
+ * sleep for the budget. Stop requests are seen within the budget.
+ */
+static void
+sched_idle_block(BpfhvBackendBatch *bc)
+{
+    struct BpfhvBackendProcess *bp = bc->parent_bp;
+    struct pollfd pfd[2 * BPFHV_MAX_THREAD_INSTANCES + SCHED_RX_MAX_FDS];
+    BpfhvBackendQueue *pq[2 * BPFHV_MAX_THREAD_INSTANCES + SCHED_RX_MAX_FDS];
+    BeOps *pops[BPFHV_MAX_THREAD_INSTANCES];
+    BpfhvBackend *prx[BPFHV_MAX_THREAD_INSTANCES];
+    struct timespec ts;
+    unsigned int nfds = 0, ntx, nrx = 0;
+    int avail = 0;
+    unsigned int i;
+    int n;
+
+    ts.tv_sec = bp->sched_idle_usecs / 1000000;
+    ts.tv_nsec = (bp->sched_idle_usecs % 1000000) * 1000;
+
+    for (size_t j = 0; j < bc->used_instances; ++j) {
+        BpfhvBackend *be = &(bc->instance[j]);
+
+        if (be->ops.txq_has_avail == NULL) {
+            nfds = 0;
+            break;
+        }
+        for (i = TXI_BEGIN(be); i < TXI_END(be) &&
+                                nfds < BPFHV_MAX_THREAD_INSTANCES; i++) {
+            be->ops.txq_kicks(be->q[i].ctx.tx, /*enable=*/1);
+            pfd[nfds].fd = be->q[i].kickfd;
+            pfd[nfds].events = POLLIN;
+            pfd[nfds].revents = 0;
+            pops[nfds] = &be->ops;
+            pq[nfds++] = be->q + i;
+        }
+    }
+
+    ntx = nfds;
+
+    /* Received frames wake us up too, and so do RX buffers posted by
+     * guests with frames waiting for them. */
+    if (nfds > 0 && bp->sched_rx) {
+        int fds[SCHED_RX_MAX_FDS];
+        unsigned int k, n;
+
+        for (size_t j = 0; j < bc->used_instances; ++j) {
+            BpfhvBackend *be = &(bc->instance[j]);
+
+            if (be->rxs.head != be->rxs.tail &&
+                    be->ops.rxq_has_avail != NULL) {
+                be->ops.rxq_kicks(be->q[0].ctx.rx, /*enable=*/1);
+                pfd[nfds].fd = be->q[0].kickfd;
+                pfd[nfds].events = POLLIN;
+                pfd[nfds].revents = 0;
+                pq[nfds++] = be->q + 0;
+                prx[nrx++] = be;
+            }
+        }
+        n = sched_rx_fds(bp->sched_f, fds, SCHED_RX_MAX_FDS);
+        for (k = 0; k < n; k++) {
+            pfd[nfds].fd = fds[k];
+            pfd[nfds].events = POLLIN;
+            pfd[nfds].revents = 0;
+            pq[nfds++] = NULL;
+        }
+    }
+
+    if (nfds == 0) {
+        nanosleep(&ts, NULL);
+    } else {
+        /* The guest checks the event suppression flags after
+         * publishing buffers: make sure it sees kicks enabled, or
+         * we see its buffers. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (i = 0; i < ntx && !avail; i++) {
+            avail = pops[i]->txq_has_avail(pq[i]->ctx.tx);
+        }
+        for (i = 0; i < nrx && !avail; i++) {
+            avail = prx[i]->ops.rxq_has_avail(prx[i]->q[0].ctx.rx);
+        }
+        if (!avail) {
+            n = ppoll(pfd, nfds, &ts, NULL);
+            if (unlikely(n < 0 && errno != EINTR)) {
+                fprintf(stderr, "ppoll() failed: %s\n", strerror(errno));
+            }
+        }
+        for (i = 0; i < nfds; i++) {
+            if ((pfd[i].revents & POLLIN) && pq[i] != NULL) {
+                pq[i]->stats.kicks++;
+                eventfd_drain(pfd[i].fd);
+            }
+        }
+    }
+
+    for (size_t j = 0; j < bc->used_instances; ++j) {
+        BpfhvBackend *be = &(bc->instance[j]);
+
+        for (i = TXI_BEGIN(be); i < TXI_END(be); i++) {
+            be->ops.txq_kicks(be->q[i].ctx.tx, /*enable=*/0);
+        }
+        if (bp->sched_rx) {
+            be->ops.rxq_kicks(be->q[0].ctx.rx, /*enable=*/0);
+        }
+    }
+}
+
+/*
+ * Scheduler RX. Frames received on the scheduler output are copied
+ * to the staging ring of the guest owning the destination address,
+ * then pushed to its RX queue by rxq_push(), which reads them with
+ * rx_stage_recv(). Broadcast, multicast and unknown destinations go
+ * to all guests, as in a learning bridge. Each guest has its own
+ * bounded ring and optional rate limit, and the shared output is
+ * always drained, so a slow or flooded receiver cannot hold back
+ * the others.
+ */
+static inline uint32_t
+mac_hash(const uint8_t *mac)
+{
+    uint32_t x = ((uint32_t)mac[2] << 24) | (mac[3] << 16) |
+                 (mac[4] << 8) | mac[5];
+
+    return ((x ^ mac[1]) * 2654435761u) >> 16;
+}
+
+void
+sched_mac_learn(BpfhvBackend *be, const uint8_t *mac)
+{
+    BpfhvBackendProcess *bp = be->parent_bp;
+    uint32_t h = mac_hash(mac), slot = h, i;
+    BpfhvMacEntry *e;
+
+    memcpy(be->learned_mac, mac, 6);
+    if (mac[0] & 1) {
+        return; /* not a unicast address */
+    }
+    /* the address may be past a slot freed by sched_mac_forget() */
+    for (i = 0; i < BPFHV_MAC_TABLE_PROBE; i++) {
+        e = &bp->mac_table[(h + i) & (BPFHV_MAC_TABLE_SIZE - 1)];
+        if (e->be != NULL && !memcmp(e->mac, mac, 6)) {
+            break;
+        }
+    }
+    if (i < BPFHV_MAC_TABLE_PROBE) {
+        slot = h + i;
+    } else {
+        for (i = 0; i < BPFHV_MAC_TABLE_PROBE; i++) {
+            e = &bp->mac_table[(h + i) & (BPFHV_MAC_TABLE_SIZE - 1)];
+            if (e->be == NULL) {
+                slot = h + i;
+                break;
+            }
+        }
+    }
+    /* if all taken, replace the first one */
+    e = &bp->mac_table[slot & (BPFHV_MAC_TABLE_SIZE - 1)];
+    memcpy(e->mac, mac, 6);
+    ACCESS_ONCE(e->be) = be;
+    if (verbose) {
+        printf("guest %d: %02x:%02x:%02x:%02x:%02x:%02x\n", be->cfd,
+               mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+}
+
+/* Drop the addresses of a guest that stopped, so that frames for them
+ * are flooded again and a new guest can take them over. */
+static void
+sched_mac_forget(BpfhvBackend *be)
+{
+    BpfhvBackendProcess *bp = be->parent_bp;
+    uint32_t i;
+
+    for (i = 0; i < BPFHV_MAC_TABLE_SIZE; i++) {
+        if (bp->mac_table[i].be == be) {
+            ACCESS_ONCE(bp->mac_table[i].be) = NULL;
+        }
+    }
+    memset(be->learned_mac, 0, sizeof(be->learned_mac));
+}
+
+static BpfhvBackend *
+sched_mac_lookup(BpfhvBackendProcess *bp, const uint8_t *mac)
+{
+    uint32_t h = mac_hash(mac), i;
+
+    for (i = 0; i < BPFHV_MAC_TABLE_PROBE; i++) {
+        BpfhvMacEntry *e = &bp->mac_table[(h + i) & (BPFHV_MAC_TABLE_SIZE - 1)];
+        BpfhvBackend *be = ACCESS_ONCE(e->be);
+
+        if (be != NULL && !memcmp(e->mac, mac, 6)) {
+            return be;
+        }
+    }
+    return NULL;
+}
+
+static void
+sched_rx_stage(BpfhvBackendProcess *bp, BpfhvBackend *be, const void *buf,
+               uint32_t len, uint64_t now)
+{
+    BpfhvRxStage *s = &be->rxs;
+    uint32_t i;
+
+    if (unlikely(s->tail - s->head >= s->slots ||
+                 len > s->bufsz || s->buf == NULL)) {
+        be->q[0].stats.drops++;
+        return;
+    }
+    if (bp->guest_rx_rate) {
+        if ((int64_t)(s->tb_tat - bp->guest_rx_burst - now) > 0) {
+            be->q[0].stats.drops++;
+            return;
+        }
+        if ((int64_t)(s->tb_tat - now) < 0) {
+            s->tb_tat = now; /* idle, the bucket is full */
+        }
+        s->tb_tat += (len * bp->guest_rx_tsc_per_byte) >> 16;
+    }
+    i = s->tail & (s->slots - 1);
+    memcpy(s->buf + (size_t)i * s->bufsz, buf, len);
+    s->len[i] = len;
+    s->tail++;
+}
+
+struct sched_rx_arg {
+    BpfhvBackendBatch *bc;
+    uint64_t now;
+};
+
+static void
+sched_rx_demux(void *opaque, const void *buf, uint32_t len)
+{
+    struct sched_rx_arg *a = opaque;
+    BpfhvBackendBatch *bc = a->bc;
+    const uint8_t *dst = buf;
+    BpfhvBackend *be;
+
+    if (unlikely(len < 14)) {
+        return;
+    }
+    if (!(dst[0] & 1) && (be = sched_mac_lookup(bc->parent_bp, dst)) != NULL) {
+        sched_rx_stage(bc->parent_bp, be, buf, len, a->now);
+        return;
+    }
+    for (size_t j = 0; j < bc->used_instances; ++j) {
+        sched_rx_stage(bc->parent_bp, &bc->instance[j], buf, len, a->now);
+    }
+}
+
+/* Receive a batch from the scheduler output and deliver it. */
+static uint32_t
+sched_rx_poll(BpfhvBackendBatch *bc, int very_verbose,
+              const BpfhvBudget *last, BpfhvBudget *cur)
+{
+    struct BpfhvBackendProcess *bp = bc->parent_bp;
+    struct sched_rx_arg a = {
+        .bc = bc,
+        .now = bp->guest_rx_rate ? rdtsc() : 0,
+    };
+    uint32_t n;
+
+    n = sched_rx(bp->sched_f, BPFHV_BE_RX_BUDGET * bc->used_instances,
+                 sched_rx_demux, &a);
+
+    for (size_t j = 0; j < bc->used_instances; ++j) {
+        BpfhvBackend *be = &(bc->instance[j]);
+        BpfhvBackendQueue *rxq = be->q + 0;
+        uint64_t t;
+        size_t count;
+
+        if (be->rxs.head == be->rxs.tail) {
+            continue;
+        }
+        budget_set(last, rxq, BPFHV_BE_RX_BUDGET);
+        t = budget_clock();
+        count = be->ops.rxq_push(be, rxq, /*can_receive=*/NULL);
+        budget_update(cur, rxq, count, t);
+        if (rxq->notify) {
+            rxq->stats.irqs++;
+            eventfd_signal(rxq->irqfd);
+            if (unlikely(very_verbose)) {
+                printf("Interrupt on %s\n", rxq->name);
+            }
+        }
+        if (unlikely(very_verbose && count > 0)) {
+            be->ops.rxq_dump(rxq->ctx.rx);
+        }
+    }
+
+    return n;
+}
+
 static void
 process_packets_spin_many(BpfhvBackendBatch *bc)
 {
@@ -511,6 +1030,7 @@ process_packets_spin_many(BpfhvBackendBatch *bc)
     int very_verbose = (verbose >= 2);
     int sleep_usecs = bp->sleep_usecs;
     struct sched_all *f = bp->sched_f;
+    BpfhvBudget last, cur;
     unsigned int i;
 
     /* Disable all guest-->host notifications. */
@@ -528,38 +1048,19 @@ process_packets_spin_many(BpfhvBackendBatch *bc)
         assert(be->num_queue_pairs == 1);
     }
 
-
+    memset(&last, 0, sizeof(last));
     while (ACCESS_ONCE(bc->stopflag) == BPFHV_STOPFD_NOEVENT) {
+        memset(&cur, 0, sizeof(cur));
+
         /* TODO: TX sync is made by scheduler functions, but not for RX */
         // if (bp->sync) {
         //     bp->sync(bp);
         // }
 
-        /* do all RX first */
-        /* TODO: we should reimplement this */
-        // for(size_t j = 0; j < bc->used_instances; ++j) {
-        //     BpfhvBackend *be = &(bc->instance[j]);
-        //     BeOps ops = be->ops;
-
-        //     /* Read packets from the backend interface (e.g. TAP, netmap)
-        //      * into the first receive queue. */
-        //     {
-        //         BpfhvBackendQueue *rxq = be->q + 0;
-        //         size_t count;
-
-        //         count = ops.rxq_push(be, rxq, /*can_receive=*/NULL);
-        //         if (rxq->notify) {
-        //             rxq->stats.irqs++;
-        //             eventfd_signal(rxq->irqfd);
-        //             if (unlikely(very_verbose)) {
-        //                 printf("Interrupt on %s\n", rxq->name);
-        //             }
-        //         }
-        //         if (unlikely(very_verbose && count > 0)) {
-        //             ops.rxq_dump(rxq->ctx.rx);
-        //         }
-        //     }
-        // }
+        /* do all RX first: frames received on the scheduler output
+         * go to the guests owning their destination address */
+        uint32_t nrx = bp->sched_rx ?
+                       sched_rx_poll(bc, very_verbose, &last, &cur) : 0;
 
         /* scheduler requires to know when routine starts */
         uint64_t now = rdtsc();
@@ -575,9 +1076,21 @@ process_packets_spin_many(BpfhvBackendBatch *bc)
             for (i = TXI_BEGIN(be); i < TXI_END(be); i++) {
                 BpfhvBackendQueue *txq = be->q + i;
                 size_t count, dr;
+                uint64_t t;
+
+                /* publish new guest mark rules, if any */
+                if (unlikely(bp->mark_mode == MARK_MODE_GUEST) &&
+                        ops.tx_ctx_mark_table &&
+                        txq->mark_table_version != mark_table_version()) {
+                    txq->mark_table_version = mark_table_publish(
+                        ops.tx_ctx_mark_table(txq->ctx.tx, be->num_tx_bufs));
+                }
 
                 /* acquire bufs and sends them to scheduler (already done by this txq_acquire) */
+                budget_set(&last, txq, BPFHV_BE_TX_BUDGET);
+                t = budget_clock();
                 count = ops.txq_acquire(be, txq, /*can_send=*/NULL, &dr);
+                budget_update(&cur, txq, count, t);
                 dropped += dr;
 
                 if (unlikely(very_verbose && count > 0)) {
@@ -587,8 +1100,10 @@ process_packets_spin_many(BpfhvBackendBatch *bc)
             }
         }
 
+        last = cur;
+
         /* dequeue packets from scheduler */
-        uint32_t ndeq = sched_dequeue(f, now);
+        uint32_t ndeq = sched_dequeue(f, now, &dropped);
         if (unlikely(very_verbose && ndeq > 0))
             printf("2) dequeued %u packets\n", ndeq);
 
@@ -628,7 +1143,9 @@ process_packets_spin_many(BpfhvBackendBatch *bc)
 
         /* TODO: is this useful if we are doing also RX on this thread? */
         /* sleep to match f->sched_interval_tsc */
-        sched_idle_sleep(f, now, ndeq);
+        if (sched_idle_sleep(f, now, ndeq + nrx) == SCHED_IDLE_BLOCK) {
+            sched_idle_block(bc);
+        }
 
         /* TODO: is this useful with multiple guests per thread? */
         if (sleep_usecs > 0) {
@@ -659,26 +1176,70 @@ process_packets(void *opaque)
         /* for now we have only one thread (batch) to fetch all the data */
         assert(BPFHV_K_THREADS == 1);
 
-        /* compute total mbufs as sum of client queues */
+        /* compute total mbufs as sum of client queues, and tell the
+         * scheduler about the queues */
         uint32_t num_mbufs = 0;
         for(size_t j = 0; j < bc->used_instances; ++j) {
             BpfhvBackend *be = &(bc->instance[j]);
             for (size_t i = TXI_BEGIN(be); i < TXI_END(be); i++) {
                 num_mbufs += be->num_tx_bufs;
+                sched_txq_register(f, be, &be->q[i]);
             }
         }
         if(unlikely(verbose))
             printf("num_bufs = %u\n", num_mbufs);
 
+        /* received frames are staged per guest, see sched_rx_poll() */
+        for(size_t j = 0; bp->sched_rx && j < bc->used_instances; ++j) {
+            BpfhvBackend *be = &(bc->instance[j]);
+
+            if (rx_stage_init(be, bp->rx_stage_slots ? bp->rx_stage_slots :
+                              BPFHV_RX_STAGE_SLOTS, BPFHV_RX_STAGE_BUF)) {
+                fprintf(stderr, "no memory for the RX ring of guest %d\n",
+                        be->cfd);
+            }
+            be->recv = rx_stage_recv;
+        }
+
         sched_all_start(f, num_mbufs);
         /* start packet processing */
         process_packets_spin_many(bc);
         /* finalize scheduler after finishing */
         sched_all_finish(f);
-    } else if (bp.busy_wait) {
-        process_packets_spin(be);
+        for(size_t j = 0; bp->sched_rx && j < bc->used_instances; ++j) {
+            sched_mac_forget(&bc->instance[j]);
+            rx_stage_fini(&bc->instance[j]);
+        }
     } else {
-        process_packets_poll(be);
+        /* with -x, read ahead from the backend interface; the source
+         * makes frames on demand, reading ahead would only drop them */
+        if (bp.rx_stage_slots && be->recv != NULL &&
+                be->recv != source_recv) {
+            uint32_t bufsz = BPFHV_RX_STAGE_BUF;
+
+            if (be->features_sel & (BPFHV_F_TCPv4_LRO | BPFHV_F_TCPv6_LRO |
+                                    BPFHV_F_UDP_LRO)) {
+                bufsz = be->vnet_hdr_len + 65536;
+            }
+            if (rx_stage_init(be, bp.rx_stage_slots, bufsz)) {
+                fprintf(stderr, "no memory for the RX ring of guest %d\n",
+                        be->cfd);
+            } else {
+                be->rxs.recv = be->recv;
+                be->recv = rx_stage_recv;
+            }
+        }
+        if (bp.busy_wait) {
+            process_packets_spin(be);
+        } else {
+            process_packets_poll(be);
+        }
+        /* frames still staged are lost */
+        if (be->rxs.recv) {
+            be->q[0].stats.drops += be->rxs.tail - be->rxs.head;
+            be->recv = be->rxs.recv;
+            rx_stage_fini(be);
+        }
     }
 
     return NULL;
@@ -822,6 +1383,8 @@ stats_show(BpfhvBackendProcess *bp)
                     double dbatches = ACCESS_ONCE(q->stats.batches) - q->pstats.batches;
                     double dkicks = ACCESS_ONCE(q->stats.kicks) - q->pstats.kicks;
                     double dirqs = ACCESS_ONCE(q->stats.irqs) - q->pstats.irqs;
+                    double dstops = ACCESS_ONCE(q->stats.stops) - q->pstats.stops;
+                    double ddrops = ACCESS_ONCE(q->stats.drops) - q->pstats.drops;
                     double pkt_batch = 0.0;
                     double buf_batch = 0.0;
 
@@ -831,6 +1394,8 @@ stats_show(BpfhvBackendProcess *bp)
                     dbatches /= mdiff;
                     dkicks /= mdiff;
                     dirqs /= mdiff;
+                    dstops /= mdiff;
+                    ddrops /= mdiff;
                     if (dbatches) {
                         pkt_batch = dpkts / dbatches;
                         buf_batch = dbufs / dbatches;
@@ -838,11 +1403,65 @@ stats_show(BpfhvBackendProcess *bp)
                     printf("    %s: %4.3f Kpps, %4.3f Kkicks/s, %4.3f Kirqs/s, "
                            " pkt_batch %3.1f buf_batch %3.1f\n",
                            q->name, dpkts, dkicks, dirqs, pkt_batch, buf_batch);
+                    if (dstops) {
+                        printf("    %s: %4.3f Kstops/s, %u bufs in scheduler\n",
+                               q->name, dstops, ACCESS_ONCE(q->sched_inflight));
+                    }
+                    if (ddrops) {
+                        printf("    %s: %4.3f Kdrops/s\n", q->name, ddrops);
+                    }
                 }
             }
         }
     }
 
+    if (bp->hv_mark_pkt_fun == mark_rules_fun) {
+        static uint64_t phits, pmisses;
+        uint64_t hits, misses;
+
+        mark_rules_stats(&hits, &misses);
+        if (hits + misses > phits + pmisses) {
+            printf("  Mark flow cache: %4.3f Khits/s, %4.3f Kmisses/s\n",
+                   (hits - phits) / mdiff, (misses - pmisses) / mdiff);
+        }
+        phits = hits;
+        pmisses = misses;
+    }
+
+    if (bp->conntrack) {
+        static struct conntrack_stats pst;
+        struct conntrack_stats st;
+
+        conntrack_get_stats(bp->conntrack, &st);
+        if (st.hits + st.misses > pst.hits + pst.misses) {
+            printf("  Conntrack: %4.3f Khits/s, %4.3f Kmisses/s, "
+                   "%4.3f Knew/s, %4.3f Kevicted/s\n",
+                   (st.hits - pst.hits) / mdiff,
+                   (st.misses - pst.misses) / mdiff,
+                   (st.created - pst.created) / mdiff,
+                   (st.evicted - pst.evicted) / mdiff);
+        }
+        pst = st;
+    }
+
+    if (ACCESS_ONCE(bp->mark_prog)) {
+        static uint64_t pfaults;
+        uint64_t faults = 0;
+        struct mark_bpf *prog;
+        int me = mark_reader_enter();
+
+        prog = __atomic_load_n(&bp->mark_prog, __ATOMIC_ACQUIRE);
+        if (prog) {
+            faults = mark_bpf_faults(prog);
+        }
+        mark_reader_exit(me);
+        if (faults > pfaults) {
+            printf("  Mark program: %4.3f Kfaults/s\n",
+                   (faults - pfaults) / mdiff);
+        }
+        pfaults = faults;
+    }
+
     bp->stats_ts = t;
 
     if(bp->scheduler_mode && bp->thread_batch[0].th_running)
@@ -872,6 +1491,7 @@ sigint_handler(int signum)
         unlink(bp.status_file);
     }
     unlink(BPFHV_SERVER_PATH);
+    unlink(BPFHV_CTL_PATH);
     exit(EXIT_SUCCESS);
 }
 
@@ -1101,6 +1721,9 @@ process_guest_message(BpfhvBackend *be)
             for (i = TXI_BEGIN(be); i < TXI_END(be); i++) {
                 snprintf(be->q[i].name, sizeof(be->q[i].name),
                          "TX%u", i-be->num_queue_pairs);
+                be->q[i].sched_inflight = 0;
+                be->q[i].sched_stopped = 0;
+                be->q[i].tb_tat = 0;
             }
         }
         break;
@@ -1231,6 +1854,10 @@ process_guest_message(BpfhvBackend *be)
             ctx = NULL;
         }
 
+        be->q[queue_idx].budget = is_rx ? BPFHV_BE_RX_BUDGET :
+                                          BPFHV_BE_TX_BUDGET;
+        be->q[queue_idx].cyc_per_buf = 0;
+        be->q[queue_idx].budget_full = 0;
         if (is_rx) {
             be->q[queue_idx].ctx.rx = (struct bpfhv_rx_context *)ctx;
             if (ctx) {
@@ -1239,6 +1866,8 @@ process_guest_message(BpfhvBackend *be)
             }
         } else {
             be->q[queue_idx].ctx.tx = (struct bpfhv_tx_context *)ctx;
+            be->q[queue_idx].mark_table_version = 0;
+            be->q[queue_idx].mark_next = be->q[queue_idx].mark_num = 0;
             if (ctx) {
                 be->ops.tx_ctx_init(be->q[queue_idx].ctx.tx,
                                   be->num_tx_bufs);
@@ -1556,8 +2185,29 @@ usage(const char *progname)
            "    -B (run in busy-wait mode)\n"
            "    -S (show run-time statistics)\n"
            "    -u MICROSECONDS (per iteration sleep)\n"
+           "    -b BUFFERS (scheduler backpressure threshold per TX queue, 0 to drop)\n"
+           "    -r RATE (scheduler per guest TX rate limit in bit/s, K M G suffixes)\n"
+           "    -R RATE (scheduler per guest RX rate limit in bit/s)\n"
+           "    -I MICROSECONDS (scheduler idle wake-up latency budget, 0 to always spin)\n"
+           "    -T MICROSECONDS (busy-wait cap on the queue processing time per loop\n"
+           "       iteration, shared by adapting the queue budgets, 0 for fixed budgets)\n"
+           "    -n IFNAME[@RATE],... (one scheduler shard per output interface or ring)\n"
+           "    -p guest|mark (map packets to shards by guest or by mark)\n"
+           "    -e delay=T,jitter=T,dist=uniform|normal|pareto,loss=P[%%],reorder\n"
+           "       (emulate a link after the sink output)\n"
+           "    -F RULE_FILE (with -f hv, mark packets with the rules, see mark_rules.h;\n"
+           "       with -f guest, publish them to the guests, see mark_table.h)\n"
+           "    -M PROG.o[:SECTION] (with -f hv, mark packets with an eBPF program, see mark_bpf.h)\n"
+           "    -C FLOWS[:SECONDS] (with -f hv, track connections so that marks stick to them,\n"
+           "       K M suffixes, default 120 s idle timeout, see conntrack.h)\n"
+           "    -x SLOTS (per guest RX staging ring, read ahead from the backend\n"
+           "       interface, counting overflows as drops, not for the source interface;\n"
+           "       in scheduler mode default 256)\n"
+           "    -k DEVICE:DESC:HDR (prefetch descriptors and buffers ahead, per device,\n"
+           "       e.g. vring_packed:16:8, 0 to disable, at most %u, repeatable;\n"
+           "       the sink interface never prefetches buffers)\n"
            "    -v (increase verbosity level)\n",
-            progname);
+            progname, BPFHV_PREFETCH_MAX);
 }
 
 BpfhvBackend* assign_backend() {
@@ -1714,6 +2364,9 @@ setup_backend(BpfhvBackend *be, const char *ifimpl,
     } else if (!strcmp(be->backend, "sink")) {
         be->recv = null_recv;
         be->send = sink_send;
+        /* Nothing reads the frames sent to the sink: prefetching them
+         * only costs page walks (a quarter of the rate in txq_bench). */
+        be->ops.prefetch_hdr = 0;
         be->befd = eventfd(0, 0);
         if (be->befd < 0) {
             fprintf(stderr, "failed to allocate eventfd device");
@@ -1840,6 +2493,155 @@ BpfhvBackend* get_backend_from_sd(int sd) {
     return be;
 }
 
+/*
+ * Scheduler control channel: one command per line (see
+ * sched_all_ctl()), each answered with "ok", "error: ..." or the
+ * requested configuration. Changes are applied by the scheduler
+ * threads between two iterations, so traffic keeps flowing, e.g.
+ *     echo "weight 1 40" | nc -U /tmp/server.ctl
+ * With -f hv or -f guest, "rules PATH" replaces the packet
+ * classification rules. With -f hv, "bpf [GUEST] PROG.o[:SECTION]|none"
+ * replaces the eBPF mark program of a guest (as numbered in the
+ * statistics) or, without GUEST, of the guests that have none.
+ */
+static void
+sched_ctl_rules(char *path, char *reply, size_t len)
+{
+    char err[256];
+
+    path[strcspn(path, "\r\n")] = '\0';
+    if (bp.mark_mode == MARK_MODE_GUEST) {
+        /* the packet threads publish them to the guests */
+        if (mark_table_install(path, err, sizeof(err))) {
+            snprintf(reply, len, "error: %s\n", err);
+            return;
+        }
+        snprintf(reply, len, "ok\n");
+        return;
+    }
+    if (bp.mark_mode != MARK_MODE_HV) {
+        snprintf(reply, len, "error: packets are not marked\n");
+        return;
+    }
+    if (mark_rules_install(path, err, sizeof(err))) {
+        snprintf(reply, len, "error: %s\n", err);
+        return;
+    }
+    __atomic_store_n(&bp.hv_mark_pkt_fun, mark_rules_fun, __ATOMIC_RELEASE);
+    __atomic_store_n(&bp.hv_mark_burst_fun, mark_rules_burst, __ATOMIC_RELEASE);
+    if (bp.conntrack) {
+        /* connections are marked again under the new rules */
+        conntrack_flush(bp.conntrack);
+    }
+    snprintf(reply, len, "ok\n");
+}
+
+static void
+sched_ctl_bpf(char *args, char *reply, size_t len)
+{
+    struct mark_bpf **slot = &bp.mark_prog;
+    char err[256], *spec = args, *end;
+    long guest;
+
+    args[strcspn(args, "\r\n")] = '\0';
+    if (bp.mark_mode != MARK_MODE_HV) {
+        snprintf(reply, len, "error: marks are not set by the hypervisor\n");
+        return;
+    }
+    guest = strtol(args, &end, 10);
+    if (end != args && *end == ' ') {
+        BpfhvBackend *be = NULL;
+
+        if (guest >= 0 && guest < BPFHV_MAX_SOCKET_DESCR) {
+            be = get_backend_from_sd(guest);
+        }
+        if (be == NULL) {
+            snprintf(reply, len, "error: no guest %ld\n", guest);
+            return;
+        }
+        slot = &be->mark_prog;
+        spec = end + 1;
+    }
+    if (mark_bpf_install(slot, spec, err, sizeof(err))) {
+        snprintf(reply, len, "error: %s\n", err);
+        return;
+    }
+    if (bp.conntrack) {
+        conntrack_flush(bp.conntrack);
+    }
+    snprintf(reply, len, "ok\n");
+}
+
+static void *
+sched_ctl_thread(void *opaque)
+{
+    int sock_serv = (int)(intptr_t)opaque;
+
+    for (;;) {
+        char cmd[4096], reply[4096];
+        FILE *f;
+        int sd;
+
+        sd = accept(sock_serv, NULL, NULL);
+        if (sd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept() failed on control socket");
+            break;
+        }
+        f = fdopen(sd, "r+");
+        if (f == NULL) {
+            close(sd);
+            continue;
+        }
+        while (fgets(cmd, sizeof(cmd), f) != NULL) {
+            if (!strncmp(cmd, "rules ", 6))
+                sched_ctl_rules(cmd + 6, reply, sizeof(reply));
+            else if (!strncmp(cmd, "bpf ", 4))
+                sched_ctl_bpf(cmd + 4, reply, sizeof(reply));
+            else
+                sched_all_ctl(bp.sched_f, cmd, reply, sizeof(reply));
+            fputs(reply, f);
+            fflush(f);
+        }
+        fclose(f);
+    }
+    close(sock_serv);
+    return NULL;
+}
+
+static int
+sched_ctl_start(void)
+{
+    struct sockaddr_un addr;
+    pthread_t th;
+    int sd;
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        perror("socket() failed");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, BPFHV_CTL_PATH);
+    unlink(BPFHV_CTL_PATH);
+    if (bind(sd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0 ||
+        listen(sd, 4) < 0) {
+        perror("cannot listen on the control socket");
+        close(sd);
+        return -1;
+    }
+    if (pthread_create(&th, NULL, sched_ctl_thread, (void *)(intptr_t)sd)) {
+        fprintf(stderr, "pthread_create() failed\n");
+        close(sd);
+        unlink(BPFHV_CTL_PATH);
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
 int main_server_select() {
     int sock_serv = -1;
     struct sockaddr_un serveraddr;
@@ -1962,6 +2764,7 @@ int main_server_select() {
 
     /* remove server UNIX path name*/
     unlink(BPFHV_SERVER_PATH);
+    unlink(BPFHV_CTL_PATH);
 }
 
 int update_status_file(BpfhvBackendProcess *bp) {
@@ -1985,6 +2788,85 @@ int update_status_file(BpfhvBackendProcess *bp) {
 
 #define DEFAULT_SCH_IFNAME "vale0:x}1"
 
+/*
+ * Shards are a comma-separated list of IFNAME[@RATE], each one with
+ * its own scheduler, output interface (ignored for the sink) and
+ * rate in bit/s. Shard threads go on the cores after the one of the
+ * main scheduler thread, if it is pinned.
+ */
+static int
+sched_shards_create(struct sched_all *f, const char *spec, int argc,
+                    char **argv, uint iftype)
+{
+    char *s = strdup(spec), *next = s, *cur;
+    int n = 0;
+
+    if (s == NULL) {
+        return -1;
+    }
+    while ((cur = strsep(&next, ",")) != NULL) {
+        char *ifname = strsep(&cur, "@");
+        uint64_t rate = 0;
+
+        if (cur != NULL) {
+            rate = parse_bw(cur);
+            if (rate == U_PARSE_ERR) {
+                fprintf(stderr, "invalid shard rate %s\n", cur);
+                free(s);
+                return -1;
+            }
+        }
+        if (sched_all_add_shard(f, argc, argv, ifname, iftype, rate,
+                                bp.sched_cpu >= 0 ? bp.sched_cpu + 1 + n : -1)) {
+            fprintf(stderr, "cannot create shard %s\n", ifname);
+            free(s);
+            return -1;
+        }
+        n++;
+    }
+    free(s);
+
+    return n;
+}
+
+/*
+ * Prefetch distances are DEVICE:DESC:HDR, in slots ahead of the next
+ * descriptor to process, 0 to disable, and apply to the backends
+ * created afterwards.
+ */
+static int
+set_prefetch(const char *spec)
+{
+    char *s = strdup(spec), *next = s;
+    char *device, *desc, *hdr;
+    BeOps *ops = NULL;
+    int ret = -1;
+
+    if (s == NULL) {
+        return -1;
+    }
+    device = strsep(&next, ":");
+    desc = strsep(&next, ":");
+    hdr = strsep(&next, ":");
+    if (!strcmp(device, "sring")) {
+        ops = &sring_ops;
+    } else if (!strcmp(device, "sring_gso")) {
+        ops = &sring_gso_ops;
+    } else if (!strcmp(device, "vring_packed")) {
+        ops = &vring_packed_ops;
+    }
+    if (ops != NULL && desc != NULL && hdr != NULL && next == NULL &&
+        atoi(desc) >= 0 && atoi(desc) <= BPFHV_PREFETCH_MAX &&
+        atoi(hdr) >= 0 && atoi(hdr) <= BPFHV_PREFETCH_MAX) {
+        ops->prefetch_desc = atoi(desc);
+        ops->prefetch_hdr = atoi(hdr);
+        ret = 0;
+    }
+    free(s);
+
+    return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1994,6 +2876,15 @@ main(int argc, char **argv)
     const char* sch_ifname = DEFAULT_SCH_IFNAME;
     uint sch_iftype = PSPAT_IF_TYPE_SINK;
     uint8_t sch_mark_mode = MARK_MODE_NO_MARK;
+    const char *sch_shards = NULL;
+    int sch_shard_policy = SCHED_SHARD_GUEST;
+    int n_shards = 0;
+    const char *sch_pipe = NULL;
+    const char *sch_rules = NULL;
+    const char *sch_prog = NULL;
+    uint64_t ct_flows = 0;
+    int ct_timeout = 120;
+    int iter_usecs = 0;
 
     check_alignments();
 
@@ -2003,7 +2894,7 @@ main(int argc, char **argv)
     bp.collect_stats = 0;
     bp.sched_cpu = -1;
 
-    while ((opt = getopt(argc, argv, "hP:vBw:Su:i:m:f:a:s:")) != -1) {
+    while ((opt = getopt(argc, argv, "hP:vBw:Su:i:m:f:F:M:C:a:s:b:r:R:I:T:n:p:e:k:x:")) != -1) {
         switch (opt) {
         case 'h':
             usage(argv[0]);
@@ -2051,8 +2942,12 @@ main(int argc, char **argv)
                 sch_iftype = PSPAT_IF_TYPE_SINK;
             else if(!strcmp(optarg, "netmap"))
                 sch_iftype = PSPAT_IF_TYPE_NETMAP;
+            else if(!strcmp(optarg, "tap"))
+                sch_iftype = PSPAT_IF_TYPE_TAP;
+            else if(!strcmp(optarg, "packet"))
+                sch_iftype = PSPAT_IF_TYPE_PACKET;
             else {
-                fprintf(stderr, "Invalid backend type. can be sink or netmap\n");
+                fprintf(stderr, "Invalid backend type. can be sink, netmap, tap or packet\n");
                 usage(argv[0]);
                 return -1;
             }
@@ -2071,6 +2966,30 @@ main(int argc, char **argv)
                 return -1;
             }
             break;
+
+        case 'F':
+            sch_rules = optarg;
+            break;
+
+        case 'M':
+            sch_prog = optarg;
+            break;
+
+        case 'C': {
+            char *colon = strchr(optarg, ':');
+
+            if (colon) {
+                *colon = '\0';
+                ct_timeout = atoi(colon + 1);
+            }
+            ct_flows = parse_qsize(optarg);
+            if (ct_flows == U_PARSE_ERR || ct_flows == 0 || ct_timeout <= 0) {
+                fprintf(stderr, "invalid connection tracking %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        }
         case 'a':
             bp.sched_cpu = atoi(optarg);
             if(bp.sched_cpu < 0) {
@@ -2084,6 +3003,88 @@ main(int argc, char **argv)
             bp.status_file = optarg;
             break;
 
+        case 'b':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "backpressure threshold must be >= 0. %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            bp.sched_backpressure = atoi(optarg);
+            break;
+
+        case 'r':
+            bp.guest_rate = parse_bw(optarg);
+            if (bp.guest_rate == U_PARSE_ERR) {
+                fprintf(stderr, "invalid guest rate %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+
+        case 'R':
+            bp.guest_rx_rate = parse_bw(optarg);
+            if (bp.guest_rx_rate == U_PARSE_ERR) {
+                fprintf(stderr, "invalid guest RX rate %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+
+        case 'I':
+            if (atoi(optarg) < 0 || atoi(optarg) > 1000000) {
+                fprintf(stderr, "idle budget must be in [0, 1000000] us. %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            bp.sched_idle_usecs = atoi(optarg);
+            break;
+
+        case 'T':
+            iter_usecs = atoi(optarg);
+            if (iter_usecs < 0 || iter_usecs > 1000000) {
+                fprintf(stderr, "iteration cap must be in [0, 1000000] us. %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+
+        case 'n':
+            sch_shards = optarg;
+            break;
+
+        case 'p':
+            if (!strcmp(optarg, "guest"))
+                sch_shard_policy = SCHED_SHARD_GUEST;
+            else if (!strcmp(optarg, "mark"))
+                sch_shard_policy = SCHED_SHARD_MARK;
+            else {
+                fprintf(stderr, "Invalid shard policy. can be guest or mark\n");
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+
+        case 'e':
+            sch_pipe = optarg;
+            break;
+
+        case 'x':
+            if (!num_bufs_valid(atoi(optarg))) {
+                fprintf(stderr, "staging slots must be a power of 2 in [16, 8192]. %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            bp.rx_stage_slots = atoi(optarg);
+            break;
+
+        case 'k':
+            if (set_prefetch(optarg)) {
+                fprintf(stderr, "invalid prefetch distances %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+
         default:
             /* hack to pass arguments to sched_all_create */
             if(bp.scheduler_mode != 1) {
@@ -2112,36 +3113,156 @@ main(int argc, char **argv)
     }
 
     if(bp.scheduler_mode == 1) {
-        bp.sched_f = sched_all_create(argc, argv, sch_ifname, sch_iftype);
+        /* with shards, the main instance only dispatches packets */
+        bp.sched_f = sched_all_create(argc, argv, sch_ifname,
+                                      sch_shards ? PSPAT_IF_TYPE_SINK : sch_iftype);
         if(!bp.sched_f) {
             fprintf(stderr, "Cannot initialize scheduler, exiting.\n");
             return -1;
         }
+        if (sch_shards) {
+            n_shards = sched_shards_create(bp.sched_f, sch_shards, argc, argv,
+                                           sch_iftype);
+            if (n_shards < 0) {
+                return -1;
+            }
+            sched_all_set_shard_policy(bp.sched_f, sch_shard_policy);
+        }
+        if (sch_pipe && sched_all_set_pipe(bp.sched_f, sch_pipe)) {
+            fprintf(stderr, "Invalid link emulation %s\n", sch_pipe);
+            return -1;
+        }
         bp.sched_enqueue = fun_sched_enqueue;
+        sched_all_set_idle(bp.sched_f, 1000ULL * bp.sched_idle_usecs);
 
         bp.mark_mode = sch_mark_mode;
         switch(sch_mark_mode) {
             case MARK_MODE_NO_MARK:
                 bp.hv_mark_pkt_fun = NULL; break;
             case MARK_MODE_HV:
-                bp.hv_mark_pkt_fun = mark_packet_fun; break;
+                bp.hv_mark_pkt_fun = mark_packet_fun;
+                bp.hv_mark_burst_fun = mark_packet_burst; break;
             case MARK_MODE_GUEST:
                 bp.hv_mark_pkt_fun = NULL; break;
         }
 
+        if (sch_rules && sch_mark_mode == MARK_MODE_GUEST) {
+            char err[256];
+
+            if (mark_table_install(sch_rules, err, sizeof(err))) {
+                fprintf(stderr, "%s\n", err);
+                return -1;
+            }
+        } else if (sch_rules) {
+            char err[256];
+
+            if (sch_mark_mode != MARK_MODE_HV) {
+                fprintf(stderr, "-F needs -f hv or -f guest\n");
+                return -1;
+            }
+            if (mark_rules_install(sch_rules, err, sizeof(err))) {
+                fprintf(stderr, "%s\n", err);
+                return -1;
+            }
+            bp.hv_mark_pkt_fun = mark_rules_fun;
+            bp.hv_mark_burst_fun = mark_rules_burst;
+        }
+
+        if (sch_prog) {
+            char err[256];
+
+            if (sch_mark_mode != MARK_MODE_HV) {
+                fprintf(stderr, "-M needs -f hv\n");
+                return -1;
+            }
+            if (mark_bpf_install(&bp.mark_prog, sch_prog, err, sizeof(err))) {
+                fprintf(stderr, "%s: %s\n", sch_prog, err);
+                return -1;
+            }
+        }
+
+        if (ct_flows) {
+            if (sch_mark_mode != MARK_MODE_HV) {
+                fprintf(stderr, "-C needs -f hv\n");
+                return -1;
+            }
+            bp.conntrack = conntrack_create(ct_flows, ct_timeout);
+            if (bp.conntrack == NULL) {
+                fprintf(stderr, "no memory for %" PRIu64 " connections\n",
+                        ct_flows);
+                return -1;
+            }
+        }
+
         printf("Scheduler mode enabled, config:\n");
         printf("\tnic type:\t%s\n", (sch_iftype == PSPAT_IF_TYPE_SINK) ? "sink" :
-                                    (sch_iftype == PSPAT_IF_TYPE_NETMAP) ? "netmap" : "??");
-        if(sch_iftype != PSPAT_IF_TYPE_SINK)
+                                    (sch_iftype == PSPAT_IF_TYPE_NETMAP) ? "netmap" :
+                                    (sch_iftype == PSPAT_IF_TYPE_TAP) ? "tap" :
+                                    (sch_iftype == PSPAT_IF_TYPE_PACKET) ? "packet" : "??");
+        if(n_shards)
+            printf("\tshards:\t\t%d by %s (%s)\n", n_shards,
+                   sch_shard_policy == SCHED_SHARD_MARK ? "mark" : "guest",
+                   sch_shards);
+        else if(sch_iftype != PSPAT_IF_TYPE_SINK)
             printf("\tnic name:\t%s\n", sch_ifname);
+        if(sch_pipe)
+            printf("\tlink emulation:\t%s\n", sch_pipe);
         printf("\tmark on:\t%s\n", (bp.mark_mode == MARK_MODE_NO_MARK) ? "no mark" :
                                     (bp.mark_mode == MARK_MODE_HV) ? "hypervisor" :
                                     (bp.mark_mode == MARK_MODE_GUEST) ? "guest" : "??");
+        if(sch_rules)
+            printf("\tmark rules:\t%s\n", sch_rules);
+        if(sch_prog)
+            printf("\tmark program:\t%s (%u insns, %s)\n", sch_prog,
+                   mark_bpf_insns(bp.mark_prog),
+                   mark_bpf_jitted(bp.mark_prog) ? "jit" : "interpreted");
+        if(bp.conntrack)
+            printf("\tconntrack:\t%" PRIu64 " connections, %d s idle timeout\n",
+                   conntrack_size(bp.conntrack), ct_timeout);
         printf("\t#clients:\t%u\n", bp.client_threshold_activation);
+        if(bp.sched_backpressure)
+            printf("\tbackpressure:\t%u bufs\n", bp.sched_backpressure);
+        else
+            printf("\tbackpressure:\toff (drop)\n");
+        if(bp.guest_rate) {
+            /* 1ms of traffic, at least a few full sized frames */
+            uint64_t burst = bp.guest_rate / 8 / 1000;
+
+            if (burst < 4 * 1514)
+                burst = 4 * 1514;
+            bp.guest_tsc_per_byte = ((double)ticks_per_second * 8 / bp.guest_rate) * (1 << 16);
+            bp.guest_burst = (burst * bp.guest_tsc_per_byte) >> 16;
+            printf("\tguest rate:\t%.3e bps\n", (double)bp.guest_rate);
+        }
+        /* the sink has nothing to receive */
+        bp.sched_rx = sch_iftype != PSPAT_IF_TYPE_SINK;
+        if(bp.sched_rx && bp.guest_rx_rate) {
+            uint64_t burst = bp.guest_rx_rate / 8 / 1000;
+
+            if (burst < 4 * 1514)
+                burst = 4 * 1514;
+            bp.guest_rx_tsc_per_byte = ((double)ticks_per_second * 8 / bp.guest_rx_rate) * (1 << 16);
+            bp.guest_rx_burst = (burst * bp.guest_rx_tsc_per_byte) >> 16;
+            printf("\tguest RX rate:\t%.3e bps\n", (double)bp.guest_rx_rate);
+        }
+        if(bp.sched_idle_usecs)
+            printf("\tidle budget:\t%u us\n", bp.sched_idle_usecs);
+        else
+            printf("\tidle budget:\toff (spin)\n");
+        if(sched_ctl_start() == 0)
+            printf("\tcontrol:\t%s\n", BPFHV_CTL_PATH);
 
         update_status_file(&bp);
     }
 
+    if (iter_usecs > 0) {
+        /* the scheduler has calibrated the TSC already */
+        if (!bp.scheduler_mode) {
+            calibrate_tsc();
+        }
+        bp.iter_cycles = NS2TSC(1000ULL * iter_usecs);
+    }
+
     if (bp.pidfile != NULL) {
         FILE *f = fopen(bp.pidfile, "w");
 
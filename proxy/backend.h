@@ -1,6 +1,9 @@
 #ifndef __BACKEND_H__
 #define __BACKEND_H__
 
+#include <string.h>
+#include <sys/uio.h>
+
 #include "bpfhv-proxy.h"
 #include "bpfhv.h"
 
@@ -22,6 +25,7 @@
 #endif
 
 #define BPFHV_SERVER_PATH       "/tmp/server"
+#define BPFHV_CTL_PATH          BPFHV_SERVER_PATH ".ctl"
 #define BPFHV_MAX_QUEUES        16
 #define BPFHV_MAX_INSTANCES     128
 #define BPFHV_K_THREADS         1
@@ -55,8 +59,12 @@ typedef struct BpfhvBackendQueueStats {
     uint64_t    batches;
     uint64_t    kicks;
     uint64_t    irqs;
+    uint64_t    stops;
+    uint64_t    drops;
 } BpfhvBackendQueueStats;
 
+#define BPFHV_MARK_BURST        16  /* packets marked together */
+
 typedef struct BpfhvBackendQueue {
     union {
         struct bpfhv_rx_context *rx;
@@ -69,8 +77,79 @@ typedef struct BpfhvBackendQueue {
     BpfhvBackendQueueStats pstats;
     struct iovec *iov;
     char name[8];
+
+    /* Scheduler mode only: buffers of this queue currently held by the
+     * scheduler, and set if acquisition is suspended (backpressure). */
+    uint32_t sched_inflight;
+    int sched_stopped;
+
+    /* Scheduler mode only: index of this queue in the scheduler, as
+     * stored in its mbufs (see sched_txq_register()). */
+    uint32_t sched_idx;
+
+    /* Scheduler mode only: virtual clock of the per guest rate
+     * limiter (TSC ticks). */
+    uint64_t tb_tat;
+
+    /* Scheduler mode only: version of the mark rules published in
+     * the context, see mark_table.h. */
+    uint32_t mark_table_version;
+
+    /* MARK_MODE_HV, vring_packed only: marks and buffers computed
+     * ahead for the avail descriptors from 'mark_idx' on, that the
+     * acquire loop did not take yet (see vring_packed_txq_mark()). */
+    uint16_t mark_idx;
+    uint16_t mark_next;
+    uint16_t mark_num;
+    uint32_t mark[BPFHV_MARK_BURST];
+    struct iovec mark_iov[BPFHV_MARK_BURST];
+
+    /* At most 'budget' buffers are processed per call of the queue
+     * routines. In the busy-wait modes it is adapted by budget_update()
+     * from the average cost of a buffer in TSC ticks (4 fractional
+     * bits); 'budget_full' is set if the last call used it up. */
+    uint32_t budget;
+    uint32_t cyc_per_buf;
+    int budget_full;
 } BpfhvBackendQueue;
 
+/* Frames received for one guest, copied here until the guest posts
+ * RX buffers: in scheduler mode from the scheduler output, otherwise
+ * (with -x) read ahead from the backend interface. The ring is bounded
+ * and preallocated, and frames that find it full are counted as drops
+ * of the RX queue, so a guest that does not keep up only loses its
+ * own frames, and the loss shows in the statistics. */
+#define BPFHV_RX_STAGE_SLOTS    256     /* default, power of 2 */
+#define BPFHV_RX_STAGE_BUF      2048
+
+struct BpfhvBackend;
+
+typedef struct BpfhvRxStage {
+    uint32_t    head;       /* next frame to deliver, free running */
+    uint32_t    tail;       /* next free slot, free running */
+    uint32_t    slots;      /* power of 2 */
+    uint32_t    bufsz;
+    uint32_t    *len;
+    char        *buf;       /* slots + 1 buffers of bufsz bytes */
+
+    /* be->recv of the backend interface, if read ahead */
+    ssize_t     (*recv)(struct BpfhvBackend *be, const struct iovec *iov,
+                        size_t iovcnt);
+
+    /* virtual clock of the ingress rate limiter (TSC ticks) */
+    uint64_t    tb_tat;
+} BpfhvRxStage;
+
+/* Scheduler mode only: guest MAC addresses, learned from the source
+ * address of transmitted frames, to deliver received frames. */
+#define BPFHV_MAC_TABLE_SIZE    256     /* power of 2 */
+#define BPFHV_MAC_TABLE_PROBE   8
+
+typedef struct BpfhvMacEntry {
+    uint8_t     mac[6];
+    struct BpfhvBackend *be;
+} BpfhvMacEntry;
+
 struct BpfhvBackend;
 
 typedef ssize_t (*BeSendFun)(struct BpfhvBackend *be, const struct iovec *iov,
@@ -93,6 +172,9 @@ typedef struct BeOps {
     void (*rx_ctx_init)(struct bpfhv_rx_context *ctx, size_t num_rx_bufs);
     void (*tx_ctx_init)(struct bpfhv_tx_context *ctx, size_t num_tx_bufs);
     void (*tx_ctx_init_mark)(struct bpfhv_tx_context *ctx, uint mark_mode);
+    /* optional, where the guest looks for the MARK_MODE_GUEST rules */
+    struct mark_table *(*tx_ctx_mark_table)(struct bpfhv_tx_context *ctx,
+                                            size_t num_tx_bufs);
     size_t (*rxq_push)(struct BpfhvBackend *be,
                       BpfhvBackendQueue *rxq, int *can_receive);
     /* do acquire, consume and notify packets for in-order buffer consumption */
@@ -107,6 +189,10 @@ typedef struct BeOps {
 
     void (*rxq_kicks)(struct bpfhv_rx_context *ctx, int enable);
     void (*txq_kicks)(struct bpfhv_tx_context *ctx, int enable);
+    /* optional, nonzero if the guest has published more tx buffers */
+    int (*txq_has_avail)(struct bpfhv_tx_context *ctx);
+    /* optional, nonzero if the guest has published more rx buffers */
+    int (*rxq_has_avail)(struct bpfhv_rx_context *ctx);
     void (*rxq_dump)(struct bpfhv_rx_context *ctx);
     void (*txq_dump)(struct bpfhv_tx_context *ctx);
 
@@ -115,8 +201,18 @@ typedef struct BeOps {
 
     /* Path of the object file containing the ebpf programs. */
     char *progfile;
+
+    /* Software pipeline of the queue routines: while processing a
+     * descriptor they prefetch the descriptor 'prefetch_desc' slots
+     * ahead and the buffer of the one 'prefetch_hdr' slots ahead, so
+     * that the cache misses on guest memory overlap with the work on
+     * the packets in between (0 disables either, see -k). */
+    unsigned int prefetch_desc;
+    unsigned int prefetch_hdr;
 } BeOps;
 
+#define BPFHV_PREFETCH_MAX      64
+
 struct BpfhvBackendBatch;
 
 /* Main data structure supporting a single bpfhv vNIC. */
@@ -199,6 +295,15 @@ typedef struct BpfhvBackend {
 
     /* RX and TX queues (in this order). */
     BpfhvBackendQueue q[BPFHV_MAX_QUEUES];
+
+    /* Scheduler mode only: received frames waiting for the guest,
+     * and the last source address learned from it. */
+    BpfhvRxStage rxs;
+    uint8_t learned_mac[6];
+
+    /* MARK_MODE_HV: eBPF mark program of this guest, or NULL to use
+     * the one of the process. */
+    struct mark_bpf *mark_prog;
 } BpfhvBackend;
 
  
@@ -264,10 +369,56 @@ typedef struct BpfhvBackendProcess {
 #define MARK_MODE_GUEST    2
     uint8_t mark_mode;
     uint32_t (*hv_mark_pkt_fun)(uint8_t *data, uint32_t pkt_sz);
+    /* optional, marks 'n' packets at once, hv_mark_pkt_fun otherwise,
+     * and sets 'sticky' for the marks that hold for the connection */
+    void (*hv_mark_burst_fun)(uint8_t **data, const uint32_t *pkt_sz,
+                              uint32_t *marks, uint8_t *sticky,
+                              unsigned int n);
+    /* eBPF mark program of the guests that have none of their own
+     * (see mark_bpf.h), used in place of the functions above */
+    struct mark_bpf *mark_prog;
+    /* optional, gives every packet the mark of its connection */
+    struct conntrack *conntrack;
 
     /* Send and receive to scheduler */
     SchedEnqueueFun sched_enqueue;
 
+    /* Stop acquiring from a TX queue when the scheduler holds this
+     * many of its buffers, instead of dropping on full scheduler
+     * queues. 0 disables backpressure. */
+    uint32_t sched_backpressure;
+
+    /* Per guest rate limit in bits/s (0 means unlimited), applied
+     * when acquiring from TX queues: cost of a byte in TSC ticks
+     * (16 fractional bits) and bucket depth in TSC ticks. */
+    uint64_t guest_rate;
+    uint64_t guest_tsc_per_byte;
+    uint64_t guest_burst;
+
+    /* Same for frames received on the scheduler output, applied
+     * when delivering them to each guest (0 means unlimited). */
+    uint64_t guest_rx_rate;
+    uint64_t guest_rx_tsc_per_byte;
+    uint64_t guest_rx_burst;
+
+    /* Set if the scheduler output can receive: frames are then
+     * delivered to the guests by destination MAC address. */
+    int sched_rx;
+    BpfhvMacEntry mac_table[BPFHV_MAC_TABLE_SIZE];
+
+    /* Slots of the per guest RX staging rings, 0 for the default in
+     * scheduler mode and for no staging otherwise (see BpfhvRxStage). */
+    uint32_t rx_stage_slots;
+
+    /* Wake-up latency budget in microseconds of an idle scheduler
+     * thread, 0 means always spin (see sched_idle_sleep()). */
+    uint32_t sched_idle_usecs;
+
+    /* Cap in TSC ticks on the time spent in the queue routines per
+     * busy-wait loop iteration, shared among the queues by adapting
+     * their budgets, 0 for fixed budgets (see budget_update()). */
+    uint64_t iter_cycles;
+
     /* Scheduler waits for a predefined number of clients
      * before starting, and doesn't accept more of them */
     int client_threshold_activation;
@@ -300,8 +451,9 @@ struct virtio_net_hdr_v1 {
     uint16_t num_buffers; /* Number of merged rx buffers */
 };
 
-#define BPFHV_BE_TX_BUDGET      128
+#define BPFHV_BE_TX_BUDGET      128     /* maximum per queue */
 #define BPFHV_BE_RX_BUDGET      128
+#define BPFHV_BE_MIN_BUDGET     8
 
 /* Translate guest physical address into host virtual address.
  * This is not thread-safe at the moment being. */
@@ -333,6 +485,91 @@ translate_addr(BpfhvBackend *be, uint64_t gpa, uint64_t len)
     return re->va_start + (gpa - re->gpa_start);
 }
 
+/* Prefetch the first cache line of a guest buffer, for writing if
+ * 'write' is set. */
+static inline void
+prefetch_buf(BpfhvBackend *be, uint64_t gpa, uint64_t len, int write)
+{
+    void *p = translate_addr(be, gpa, len);
+
+    if (unlikely(p == NULL)) {
+        return;
+    }
+    if (write) {
+        __builtin_prefetch(p, 1);
+    } else {
+        __builtin_prefetch(p);
+    }
+}
+
+/* Scheduler backpressure: return 1 if no more buffers should be acquired
+ * from txq. Acquisition is suspended when the scheduler holds
+ * sched_backpressure buffers of the queue, and resumes once half of
+ * them have been released, so that the guest sees a full ring rather
+ * than drops. */
+static inline int
+txq_backpressure(struct BpfhvBackendProcess *bp, BpfhvBackendQueue *txq)
+{
+    if (likely(bp->sched_backpressure == 0)) {
+        return 0;
+    }
+
+    if (txq->sched_stopped) {
+        if (txq->sched_inflight > bp->sched_backpressure / 2) {
+            return 1;
+        }
+        txq->sched_stopped = 0;
+        return 0;
+    }
+
+    if (unlikely(txq->sched_inflight >= bp->sched_backpressure)) {
+        txq->sched_stopped = 1;
+        txq->stats.stops++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Per guest rate limit: return 1 if txq is ahead of its rate by more
+ * than the bucket depth, so that no more buffers should be acquired
+ * until 'now' catches up. Packets stay in the guest ring meanwhile,
+ * and other guests are not affected. */
+static inline int
+txq_rate_limited(struct BpfhvBackendProcess *bp, BpfhvBackendQueue *txq,
+                 uint64_t now)
+{
+    return bp->guest_rate &&
+           (int64_t)(txq->tb_tat - bp->guest_burst - now) > 0;
+}
+
+static inline void
+txq_rate_charge(struct BpfhvBackendProcess *bp, BpfhvBackendQueue *txq,
+                uint64_t now, uint32_t len)
+{
+    if (likely(bp->guest_rate == 0)) {
+        return;
+    }
+    if ((int64_t)(txq->tb_tat - now) < 0) {
+        txq->tb_tat = now; /* idle, the bucket is full */
+    }
+    txq->tb_tat += (len * bp->guest_tsc_per_byte) >> 16;
+}
+
+void sched_mac_learn(BpfhvBackend *be, const uint8_t *mac);
+
+/* Scheduler RX: learn the source address of a frame sent by be.
+ * Guests rarely change it, so this is one compare per frame. */
+static inline void
+sched_mac_check(struct BpfhvBackendProcess *bp, BpfhvBackend *be,
+                const uint8_t *frame, size_t len)
+{
+    if (bp->sched_rx && likely(len >= 12) &&
+        unlikely(memcmp(frame + 6, be->learned_mac, 6) != 0)) {
+        sched_mac_learn(be, frame + 6);
+    }
+}
+
 extern int verbose;
 extern BeOps sring_ops;
 extern BeOps sring_gso_ops;
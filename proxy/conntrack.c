@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "conntrack.h"
+
+#define CT_WAYS             2
+#define CT_BURST            16
+#define CT_CLOSE_TIMEOUT    5   /* seconds, after a FIN or RST */
+#define CT_ETH_HLEN         14
+#define CT_TCP_FIN          0x01
+#define CT_TCP_RST          0x04
+
+/*
+ * 'state' is 0 while an entry is being written, or expire << 3 | flags.
+ * CT_FLIP changes whenever the entry is taken by another connection, so
+ * that readers see a different state even within the same second.
+ */
+#define CT_STICKY           1   /* 'mark' is the mark of the connection */
+#define CT_CLOSING          2
+#define CT_FLIP             4
+#define CT_FLAGS            7
+#define CT_EXPIRE(st)       ((st) >> 3)
+
+/*
+ * The key is the connection itself: 'k0' holds the lower endpoint
+ * (address << 16 | port), the protocol and CT_USED, 'k1' the upper
+ * endpoint and the generation of the classifier. 'k0' is 0 if free.
+ */
+#define CT_USED             (1ULL << 56)
+#define CT_GEN_SHIFT        48
+#define CT_GEN(k1)          ((uint32_t)((k1) >> CT_GEN_SHIFT))
+#define CT_GEN_MASK         0xffff
+
+struct ct_entry {
+    uint64_t k0, k1;
+    uint32_t mark;
+    uint32_t state;
+};
+
+struct ct_key {
+    uint64_t k0, k1;            /* k0 is 0 if not tracked */
+    uint64_t h;                 /* picks the sets */
+};
+
+struct ct_set {
+    struct ct_entry e[CT_WAYS];
+} __attribute__((aligned(64)));
+
+struct conntrack {
+    struct ct_set *sets;
+    uint64_t n_sets;
+    unsigned int shift;         /* set index from the top hash bits */
+    uint32_t timeout;
+    uint32_t gen;               /* of the classifier, see conntrack_flush() */
+    time_t start;
+    struct conntrack_stats st __attribute__((aligned(64)));
+};
+
+struct conntrack *
+conntrack_create(uint64_t flows, uint32_t timeout)
+{
+    struct conntrack *ct;
+    unsigned int bits = 1;
+    struct timespec ts;
+
+    while (((uint64_t)CT_WAYS << bits) < flows && bits < 40) {
+        bits++;
+    }
+    ct = aligned_alloc(64, sizeof(*ct));
+    if (ct == NULL) {
+        return NULL;
+    }
+    memset(ct, 0, sizeof(*ct));
+    ct->n_sets = 1ULL << bits;
+    ct->shift = 64 - bits;
+    ct->timeout = timeout ? timeout : 1;
+    /* zero pages, only touched when connections land there */
+    ct->sets = mmap(NULL, ct->n_sets * sizeof(*ct->sets),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ct->sets == MAP_FAILED) {
+        free(ct);
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    ct->start = ts.tv_sec;
+
+    return ct;
+}
+
+void
+conntrack_free(struct conntrack *ct)
+{
+    if (ct == NULL) {
+        return;
+    }
+    munmap(ct->sets, ct->n_sets * sizeof(*ct->sets));
+    free(ct);
+}
+
+uint64_t
+conntrack_size(const struct conntrack *ct)
+{
+    return ct->n_sets * CT_WAYS;
+}
+
+static inline uint64_t
+ct_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * The key of the connection of an IPv4 frame, the same for both
+ * directions, with 'gen' (already shifted) in it. 'key->k0' is 0 for
+ * frames that are not tracked, otherwise '*closing' tells whether a
+ * FIN or RST was seen.
+ */
+static inline void
+ct_key(const uint8_t *p, uint32_t len, uint64_t gen, struct ct_key *key,
+       int *closing)
+{
+    uint64_t a, b, t;
+    uint32_t ihl, l4, src, dst;
+    uint16_t sport = 0, dport = 0;
+    uint8_t proto;
+
+    key->k0 = 0;
+    if (len < CT_ETH_HLEN + 20 || p[12] != 0x08 || p[13] != 0x00 ||
+            (p[CT_ETH_HLEN] >> 4) != 4) {
+        return;
+    }
+    ihl = (p[CT_ETH_HLEN] & 0xf) * 4;
+    l4 = CT_ETH_HLEN + ihl;
+    if (ihl < 20 || l4 > len) {
+        return;
+    }
+    proto = p[CT_ETH_HLEN + 9];
+    memcpy(&src, p + CT_ETH_HLEN + 12, 4);
+    memcpy(&dst, p + CT_ETH_HLEN + 16, 4);
+    *closing = 0;
+    if (proto == 6) {
+        uint32_t doff;
+
+        if (l4 + 20 > len) {
+            return;
+        }
+        doff = (p[l4 + 12] >> 4) * 4;
+        if (doff < 20 || l4 + doff > len) {
+            return;
+        }
+        *closing = (p[l4 + 13] & (CT_TCP_FIN | CT_TCP_RST)) != 0;
+        sport = p[l4] << 8 | p[l4 + 1];
+        dport = p[l4 + 2] << 8 | p[l4 + 3];
+    } else if (proto == 17) {
+        if (l4 + 8 > len) {
+            return;
+        }
+        sport = p[l4] << 8 | p[l4 + 1];
+        dport = p[l4 + 2] << 8 | p[l4 + 3];
+    }
+
+    a = (uint64_t)src << 16 | sport;
+    b = (uint64_t)dst << 16 | dport;
+    if (a > b) {
+        t = a;
+        a = b;
+        b = t;
+    }
+    key->k0 = a | (uint64_t)proto << 48 | CT_USED;
+    key->k1 = b | gen;
+    key->h = ct_mix(ct_mix(key->k0) ^ b);
+}
+
+/*
+ * A connection can live in two sets, picked by different hash bits:
+ * new connections go where there is room, so the table fills up
+ * before live connections get evicted.
+ */
+static inline struct ct_set *
+ct_set(const struct conntrack *ct, const struct ct_key *key, int k)
+{
+    return &ct->sets[k ? key->h & (ct->n_sets - 1) : key->h >> ct->shift];
+}
+
+static inline int
+ct_match(const struct ct_entry *e, const struct ct_key *key)
+{
+    return __atomic_load_n(&e->k0, __ATOMIC_RELAXED) == key->k0 &&
+           __atomic_load_n(&e->k1, __ATOMIC_RELAXED) == key->k1;
+}
+
+/*
+ * The live entry of 'key', with its state in '*state'. The key is
+ * compared again after reading the state, so that it is not one
+ * being written; the caller checks that the state did not change
+ * after reading the mark.
+ */
+static inline struct ct_entry *
+ct_find(const struct conntrack *ct, const struct ct_key *key, uint32_t now,
+        uint32_t *state)
+{
+    int k, w;
+
+    for (k = 0; k < 2; k++) {
+        struct ct_set *s = ct_set(ct, key, k);
+
+        for (w = 0; w < CT_WAYS; w++) {
+            struct ct_entry *e = &s->e[w];
+            uint32_t st;
+
+            if (!ct_match(e, key)) {
+                continue;
+            }
+            st = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+            if (st == 0 || CT_EXPIRE(st) < now || !ct_match(e, key)) {
+                return NULL;
+            }
+            *state = st;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Take an entry for 'key': a free or expired one (as are those of an
+ * older generation), or else the live one closest to expiry. Returns
+ * NULL if another thread got there first, and leaves the entry with
+ * state 0, 'k0' set and the CT_FLIP to use next in '*flip'.
+ */
+static struct ct_entry *
+ct_claim(const struct conntrack *ct, const struct ct_key *key, uint32_t now,
+         int *evicted, uint32_t *flip)
+{
+    struct ct_entry *v = NULL;
+    uint64_t old_k0 = 0, old_k1 = 0;
+    uint32_t old = 0;
+    int w;
+
+    for (w = 0; w < 2 * CT_WAYS; w++) {
+        struct ct_entry *e = &ct_set(ct, key, w / CT_WAYS)->e[w % CT_WAYS];
+        uint64_t k0 = __atomic_load_n(&e->k0, __ATOMIC_RELAXED);
+        uint64_t k1 = __atomic_load_n(&e->k1, __ATOMIC_RELAXED);
+        uint32_t st = __atomic_load_n(&e->state, __ATOMIC_RELAXED);
+
+        if (k0 == 0 || (st && CT_EXPIRE(st) < now) ||
+                (st && CT_GEN(k1) != CT_GEN(key->k1))) {
+            v = e;
+            old_k0 = k0;
+            old_k1 = k1;
+            old = st;
+            break;
+        }
+        if (st == 0) {
+            continue;           /* being written */
+        }
+        if (v == NULL || CT_EXPIRE(st) < CT_EXPIRE(old)) {
+            v = e;
+            old_k0 = k0;
+            old_k1 = k1;
+            old = st;
+        }
+    }
+    if (v == NULL) {
+        return NULL;
+    }
+    *evicted = old_k0 && (old_k0 != key->k0 || old_k1 != key->k1) &&
+               CT_EXPIRE(old) >= now && CT_GEN(old_k1) == CT_GEN(key->k1);
+    *flip = (old & CT_FLIP) ^ CT_FLIP;
+    /* the state decides for the taken entries, k0 for the free ones */
+    if (!__atomic_compare_exchange_n(&v->state, &old, 0, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&v->k0, &old_k0, key->k0, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (old) {
+            /* rewritten meanwhile, with the same state */
+            __atomic_store_n(&v->state, old, __ATOMIC_RELEASE);
+        }
+        return NULL;
+    }
+
+    return v;
+}
+
+static inline uint32_t
+ct_state(const struct conntrack *ct, uint32_t now, uint32_t flags)
+{
+    uint32_t timeout = ct->timeout;
+
+    if ((flags & CT_CLOSING) && timeout > CT_CLOSE_TIMEOUT) {
+        timeout = CT_CLOSE_TIMEOUT;
+    }
+    return (now + timeout) << 3 | flags;
+}
+
+static void
+ct_burst(struct conntrack *ct, uint32_t now, uint64_t gen, uint8_t **data,
+         const uint32_t *pkt_sz, uint32_t *marks, unsigned int n,
+         conntrack_cls_t cls, void *opaque, struct conntrack_stats *st)
+{
+    struct ct_key key[CT_BURST];
+    int closing[CT_BURST];
+    uint8_t *mdata[CT_BURST];
+    uint32_t mlen[CT_BURST], mmarks[CT_BURST];
+    uint8_t msticky[CT_BURST];
+    unsigned int miss[CT_BURST], n_miss = 0, i;
+
+    for (i = 0; i < n; i++) {
+        ct_key(data[i], pkt_sz[i], gen, &key[i], &closing[i]);
+        if (key[i].k0) {
+            __builtin_prefetch(ct_set(ct, &key[i], 0));
+            __builtin_prefetch(ct_set(ct, &key[i], 1));
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        struct ct_entry *e;
+        uint32_t state, next;
+
+        if (key[i].k0 == 0) {
+            goto classify;
+        }
+        e = ct_find(ct, &key[i], now, &state);
+        if (e == NULL || !(state & CT_STICKY)) {
+            goto classify;
+        }
+        marks[i] = __atomic_load_n(&e->mark, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->state, __ATOMIC_RELAXED) != state) {
+            goto classify;      /* written meanwhile */
+        }
+        next = ct_state(ct, now, (state & CT_FLAGS) |
+                                 (closing[i] ? CT_CLOSING : 0));
+        if (next != state) {
+            /* at most once a second per connection */
+            __atomic_compare_exchange_n(&e->state, &state, next, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+        st->hits++;
+        continue;
+classify:
+        mdata[n_miss] = data[i];
+        mlen[n_miss] = pkt_sz[i];
+        miss[n_miss++] = i;
+    }
+    if (n_miss == 0) {
+        return;
+    }
+    st->misses += n_miss;
+    cls(opaque, mdata, mlen, mmarks, msticky, n_miss);
+
+    for (i = 0; i < n_miss; i++) {
+        unsigned int k = miss[i];
+        struct ct_entry *e;
+        uint32_t state = 0, flags, flip;
+        int evicted;
+
+        marks[k] = mmarks[i];
+        if (key[k].k0 == 0) {
+            continue;
+        }
+        flags = (closing[k] ? CT_CLOSING : 0) | (msticky[i] ? CT_STICKY : 0);
+        e = ct_find(ct, &key[k], now, &state);
+        if (e) {
+            flags |= state & (CT_CLOSING | CT_FLIP);
+            if ((state & CT_STICKY) || (flags == (state & CT_FLAGS) &&
+                                        ct_state(ct, now, flags) == state)) {
+                continue;       /* nothing to add */
+            }
+            if (!__atomic_compare_exchange_n(&e->state, &state, 0, 0,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED)) {
+                continue;
+            }
+        } else {
+            e = ct_claim(ct, &key[k], now, &evicted, &flip);
+            if (e == NULL) {
+                continue;
+            }
+            flags |= flip;
+            st->created++;
+            st->evicted += evicted;
+        }
+        /* readers that see these stores see state 0 after them */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&e->k1, key[k].k1, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->mark, mmarks[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&e->state, ct_state(ct, now, flags), __ATOMIC_RELEASE);
+    }
+}
+
+void
+conntrack_mark(struct conntrack *ct, uint8_t **data, const uint32_t *pkt_sz,
+               uint32_t *marks, unsigned int n, conntrack_cls_t cls,
+               void *opaque)
+{
+    struct conntrack_stats st = { 0 };
+    struct timespec ts;
+    unsigned int i;
+    uint64_t gen;
+    uint32_t now;
+
+    /* 0 is never a valid expiry time */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec - ct->start + 1;
+    /* read before classifying, so marks of older rules are not kept */
+    gen = (uint64_t)(__atomic_load_n(&ct->gen, __ATOMIC_ACQUIRE) &
+                     CT_GEN_MASK) << CT_GEN_SHIFT;
+
+    for (i = 0; i < n; i += CT_BURST) {
+        ct_burst(ct, now, gen, data + i, pkt_sz + i, marks + i,
+                 n - i < CT_BURST ? n - i : CT_BURST, cls, opaque, &st);
+    }
+    if (st.hits) {
+        __atomic_fetch_add(&ct->st.hits, st.hits, __ATOMIC_RELAXED);
+    }
+    if (st.misses) {
+        __atomic_fetch_add(&ct->st.misses, st.misses, __ATOMIC_RELAXED);
+    }
+    if (st.created) {
+        __atomic_fetch_add(&ct->st.created, st.created, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ct->st.evicted, st.evicted, __ATOMIC_RELAXED);
+    }
+}
+
+void
+conntrack_flush(struct conntrack *ct)
+{
+    __atomic_add_fetch(&ct->gen, 1, __ATOMIC_RELEASE);
+}
+
+void
+conntrack_get_stats(struct conntrack *ct, struct conntrack_stats *st)
+{
+    st->hits = __atomic_load_n(&ct->st.hits, __ATOMIC_RELAXED);
+    st->misses = __atomic_load_n(&ct->st.misses, __ATOMIC_RELAXED);
+    st->created = __atomic_load_n(&ct->st.created, __ATOMIC_RELAXED);
+    st->evicted = __atomic_load_n(&ct->st.evicted, __ATOMIC_RELAXED);
+}
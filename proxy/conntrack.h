@@ -0,0 +1,69 @@
+#ifndef __CONNTRACK_H__
+#define __CONNTRACK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Connection tracking for MARK_MODE_HV, so that a mark the classifier
+ * gives for the whole connection, i.e. decided by the payload (an
+ * HTTP request that mark_packet_fun() does not take for a small TCP
+ * packet, or a rule with a payload pattern), sticks to all the packets
+ * that follow, in both directions, until the classifier changes.
+ * Until then packets are marked one by one, and so are all the packets
+ * of the connections that never get such a mark: marks that depend on
+ * the length or the TCP flags of a packet, or come from an eBPF
+ * program, never stick. IPv4 connections are identified by protocol,
+ * addresses and TCP/UDP ports; other frames are always marked one by
+ * one.
+ *
+ * The table has a fixed number of entries, grouped two to a cache
+ * line by hash, and is shared by the packet threads without locks:
+ * a packet of a known connection costs one cache line lookup. Entries
+ * hold the addresses, ports and protocol, and are matched on all of
+ * them, so different connections never share a mark by hashing. A
+ * connection expires after 'timeout' seconds without packets (or a
+ * few seconds after a TCP FIN or RST); expired entries are reused in
+ * place, and a new connection that finds its line full evicts the one
+ * closest to expiry.
+ */
+
+struct conntrack;
+
+/*
+ * Marks 'n' packets, like BpfhvBackendProcess.hv_mark_burst_fun, and
+ * sets 'sticky' for the marks that hold for the whole connection.
+ */
+typedef void (*conntrack_cls_t)(void *opaque, uint8_t **data,
+                                const uint32_t *pkt_sz, uint32_t *marks,
+                                uint8_t *sticky, unsigned int n);
+
+struct conntrack_stats {
+    uint64_t hits;          /* marked from the table */
+    uint64_t misses;        /* classified */
+    uint64_t created;       /* connections added */
+    uint64_t evicted;       /* live connections pushed out */
+};
+
+/* room for at least 'flows' connections, NULL if out of memory */
+struct conntrack *conntrack_create(uint64_t flows, uint32_t timeout);
+void conntrack_free(struct conntrack *ct);
+uint64_t conntrack_size(const struct conntrack *ct);
+
+/*
+ * Mark 'n' packets: from the table for the known connections, with
+ * 'cls' (called once, for the other packets) otherwise.
+ */
+void conntrack_mark(struct conntrack *ct, uint8_t **data,
+                    const uint32_t *pkt_sz, uint32_t *marks, unsigned int n,
+                    conntrack_cls_t cls, void *opaque);
+
+/*
+ * Forget the marks of all connections, after the classifier changed:
+ * the entries stay, but are reused as if expired.
+ */
+void conntrack_flush(struct conntrack *ct);
+
+void conntrack_get_stats(struct conntrack *ct, struct conntrack_stats *st);
+
+#endif  /* __CONNTRACK_H__ */
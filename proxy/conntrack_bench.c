@@ -0,0 +1,268 @@
+/*
+ * Checks and times the connection table (conntrack.c).
+ *
+ * Sends 'packets' TCP and UDP frames of 'conns' random connections,
+ * in random directions and bursts of 32, through conntrack_mark()
+ * from 'threads' threads, with a classifier that gives every
+ * connection a sticky mark computed from its addresses and ports.
+ * Each mark returned, from the table or from the classifier, is
+ * checked against the one computed here. Clients talk to a few
+ * servers, so most connections share the lower endpoint and differ
+ * only in the other one. Between rounds the classifier changes and
+ * the table is flushed, so marks of older rules must not come back.
+ *
+ * usage: conntrack_bench [-n conns] [-e entries] [-p packets]
+ *                        [-r rounds] [-t threads] [-s servers]
+ * Exits with 1 if any mark is wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "conntrack.h"
+
+#define BURST       32
+#define FRAME_LEN   64
+
+struct conn {
+    uint32_t caddr, saddr;
+    uint16_t cport, sport;
+    uint8_t proto;
+};
+
+static struct conntrack *ct;
+static struct conn *conns;
+static uint64_t n_conns = 3000000, n_packets = 10000000;
+static unsigned int n_rounds = 2, n_threads = 1, n_servers = 4;
+static uint64_t per_thread;     /* packets per thread and round */
+static uint32_t salt;           /* changes the marks at each round */
+static uint64_t wrong;
+static pthread_barrier_t barrier;
+
+static inline uint64_t
+xrand(uint64_t *s)              /* xorshift, cheaper than random() */
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* the mark of a connection, the same in both directions */
+static uint32_t
+conn_mark(uint32_t a1, uint16_t p1, uint32_t a2, uint16_t p2, uint8_t proto,
+          uint32_t s)
+{
+    uint64_t x = (uint64_t)(a1 ^ a2) << 32 | (uint32_t)(p1 ^ p2) << 8 |
+                 proto;
+
+    x += (uint64_t)(a1 + a2) * 0x9e3779b97f4a7c15ULL + s;
+    x ^= x >> 29;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 32;
+    return 1 + x % 1000;
+}
+
+static void
+frame_build(uint8_t *f, const struct conn *c, int reply)
+{
+    memset(f, 0, FRAME_LEN);
+    f[12] = 0x08;
+    f[14] = 0x45;
+    f[14 + 9] = c->proto;
+    put32(f + 14 + 12, reply ? c->saddr : c->caddr);
+    put32(f + 14 + 16, reply ? c->caddr : c->saddr);
+    f[34] = (reply ? c->sport : c->cport) >> 8;
+    f[35] = (reply ? c->sport : c->cport);
+    f[36] = (reply ? c->cport : c->sport) >> 8;
+    f[37] = (reply ? c->cport : c->sport);
+    if (c->proto == 6) {
+        f[34 + 12] = 5 << 4;    /* data offset */
+        f[34 + 13] = 0x10;      /* ACK */
+    }
+}
+
+static uint32_t
+frame_mark(const uint8_t *f, uint32_t s)
+{
+    return conn_mark(get32(f + 14 + 12), f[34] << 8 | f[35],
+                     get32(f + 14 + 16), f[36] << 8 | f[37], f[14 + 9], s);
+}
+
+static void
+classify(void *opaque, uint8_t **data, const uint32_t *pkt_sz,
+         uint32_t *marks, uint8_t *sticky, unsigned int n)
+{
+    uint32_t s = __atomic_load_n(&salt, __ATOMIC_RELAXED);
+    unsigned int i;
+
+    (void)opaque;
+    (void)pkt_sz;
+    for (i = 0; i < n; i++) {
+        marks[i] = frame_mark(data[i], s);
+        sticky[i] = 1;
+    }
+}
+
+static void *
+worker(void *opaque)
+{
+    uintptr_t id = (uintptr_t)opaque;
+    uint64_t seed = 0x2545f4914f6cdd1dULL * (id + 1), sent;
+    uint8_t buf[BURST][FRAME_LEN], *data[BURST];
+    uint32_t len[BURST], marks[BURST];
+    unsigned int r, i;
+
+    for (i = 0; i < BURST; i++) {
+        data[i] = buf[i];
+        len[i] = FRAME_LEN;
+    }
+    for (r = 0; r < n_rounds; r++) {
+        uint32_t s;
+
+        pthread_barrier_wait(&barrier);
+        s = __atomic_load_n(&salt, __ATOMIC_RELAXED);
+        for (sent = 0; sent < per_thread; sent += BURST) {
+            for (i = 0; i < BURST; i++) {
+                uint64_t x = xrand(&seed);
+
+                frame_build(buf[i], &conns[(x >> 1) % n_conns], x & 1);
+            }
+            conntrack_mark(ct, data, len, marks, BURST, classify, NULL);
+            for (i = 0; i < BURST; i++) {
+                if (marks[i] != frame_mark(buf[i], s)) {
+                    __atomic_fetch_add(&wrong, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t entries = 0, seed = 88172645463325252ULL, i;
+    pthread_t th[64];
+    struct conntrack_stats st, last = { 0 };
+    unsigned int r, t;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:e:p:r:t:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_conns = strtoull(optarg, NULL, 0);
+            break;
+        case 'e':
+            entries = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            n_packets = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            n_rounds = atoi(optarg);
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+        case 's':
+            n_servers = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n conns] [-e entries] "
+                    "[-p packets] [-r rounds] [-t threads] "
+                    "[-s servers]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (n_conns == 0 || n_threads == 0 || n_threads > 64 ||
+            n_servers == 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 2;
+    }
+    per_thread = (n_packets / n_threads + BURST - 1) / BURST * BURST;
+    conns = calloc(n_conns, sizeof(*conns));
+    ct = conntrack_create(entries ? entries : n_conns, 3600);
+    if (conns == NULL || ct == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    /* servers at 1.0.0.x, always the lower endpoint */
+    for (i = 0; i < n_conns; i++) {
+        uint64_t x = xrand(&seed);
+
+        conns[i].saddr = 0x01000000 | (uint32_t)(x % n_servers);
+        conns[i].sport = (x >> 16) & 1 ? 443 : 80;
+        conns[i].caddr = 0x0a000000 | (uint32_t)(x >> 20 & 0xffffff);
+        conns[i].cport = 1024 + (x >> 44) % 64512;
+        conns[i].proto = (x >> 60) & 1 ? 17 : 6;
+    }
+    printf("%" PRIu64 " connections, %" PRIu64 " entries, %u threads\n",
+           n_conns, conntrack_size(ct), n_threads);
+
+    pthread_barrier_init(&barrier, NULL, n_threads + 1);
+    for (t = 0; t < n_threads; t++) {
+        pthread_create(&th[t], NULL, worker, (void *)(uintptr_t)t);
+    }
+    for (r = 0; r < n_rounds; r++) {
+        double t0;
+
+        if (r > 0) {
+            /* new rules: the marks of the last round must go */
+            __atomic_store_n(&salt, salt + 1, __ATOMIC_RELAXED);
+            conntrack_flush(ct);
+        }
+        t0 = now_ns();
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+        t0 = now_ns() - t0;
+        conntrack_get_stats(ct, &st);
+        /* per packet and thread */
+        printf("round %u: %.1f ns/packet, hits %" PRIu64 " misses %"
+               PRIu64 " created %" PRIu64 " evicted %" PRIu64
+               ", wrong marks %" PRIu64 "\n", r,
+               t0 / per_thread,
+               st.hits - last.hits, st.misses - last.misses,
+               st.created - last.created, st.evicted - last.evicted,
+               __atomic_load_n(&wrong, __ATOMIC_RELAXED));
+        last = st;
+    }
+    for (t = 0; t < n_threads; t++) {
+        pthread_join(th[t], NULL);
+    }
+    conntrack_free(ct);
+    free(conns);
+
+    return wrong ? 1 : 0;
+}
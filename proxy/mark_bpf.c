@@ -0,0 +1,1129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <linux/bpf.h>
+
+#include "mark_bpf.h"
+#include "mark_rules.h"
+
+#define MARK_BPF_MAX_INSNS  4096
+#define MARK_BPF_STACK      512
+#define MARK_BPF_SECTION    "mark"
+#define MARK_BPF_MAX_DATA   (1U << 24)
+
+#if defined(__x86_64__)
+#define MARK_BPF_JIT
+#endif
+
+struct mark_bpf {
+    struct bpf_insn *insns;
+    uint32_t n_insns;
+    uint8_t *data;              /* data sections of the object */
+    uint32_t data_len;
+    uint8_t *jit;               /* native code, NULL if interpreted */
+    size_t jit_size;
+    uint64_t faults;            /* out of bounds accesses */
+};
+
+/* native code: returns r0, counts faults in '*faults' */
+typedef uint64_t (*mark_bpf_jit_fn)(uint8_t *data, uint64_t pkt_sz,
+                                    uint64_t *faults);
+
+/*
+ * Copy the program section and the data sections out of the object,
+ * and point the lddw instructions that reference data to the copy.
+ */
+static int
+mark_bpf_elf(struct mark_bpf *p, const uint8_t *img, size_t size,
+             const char *secname, char *err, size_t errlen)
+{
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)img;
+    const Elf64_Shdr *sh, *strs;
+    uint32_t *base = NULL;
+    int prog = -1, i;
+
+    if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+            eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+            eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_BPF ||
+            eh->e_shentsize != sizeof(*sh) || eh->e_shstrndx >= eh->e_shnum ||
+            eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(*sh) > size) {
+        snprintf(err, errlen, "not an eBPF object");
+        return -1;
+    }
+    sh = (const Elf64_Shdr *)(img + eh->e_shoff);
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_NOBITS &&
+                sh[i].sh_offset + sh[i].sh_size > size) {
+            snprintf(err, errlen, "truncated section %d", i);
+            return -1;
+        }
+    }
+    strs = &sh[eh->e_shstrndx];
+    for (i = 0; i < eh->e_shnum; i++) {
+        const char *name = (const char *)img + strs->sh_offset +
+                           sh[i].sh_name;
+
+        if (sh[i].sh_name < strs->sh_size &&
+                strnlen(name, strs->sh_size - sh[i].sh_name) <
+                strs->sh_size - sh[i].sh_name &&
+                !strcmp(name, secname) && sh[i].sh_type == SHT_PROGBITS &&
+                (sh[i].sh_flags & SHF_EXECINSTR)) {
+            prog = i;
+        }
+    }
+    if (prog < 0) {
+        snprintf(err, errlen, "no program section '%s'", secname);
+        return -1;
+    }
+    if (sh[prog].sh_size == 0 || sh[prog].sh_size % sizeof(*p->insns) ||
+            sh[prog].sh_size / sizeof(*p->insns) > MARK_BPF_MAX_INSNS) {
+        snprintf(err, errlen, "section '%s' has a bad size", secname);
+        return -1;
+    }
+    p->n_insns = sh[prog].sh_size / sizeof(*p->insns);
+    p->insns = malloc(sh[prog].sh_size);
+    base = calloc(eh->e_shnum, sizeof(*base));
+    if (p->insns == NULL || base == NULL) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    memcpy(p->insns, img + sh[prog].sh_offset, sh[prog].sh_size);
+
+    /* the data sections, one after the other, 8 byte aligned */
+    for (i = 0; i < eh->e_shnum; i++) {
+        base[i] = ~0U;
+        if ((sh[i].sh_type == SHT_PROGBITS || sh[i].sh_type == SHT_NOBITS) &&
+                (sh[i].sh_flags & SHF_ALLOC) &&
+                !(sh[i].sh_flags & SHF_EXECINSTR)) {
+            if (sh[i].sh_size > MARK_BPF_MAX_DATA - p->data_len) {
+                snprintf(err, errlen, "data sections too large");
+                goto fail;
+            }
+            base[i] = p->data_len;
+            p->data_len += (sh[i].sh_size + 7) & ~7ULL;
+        }
+    }
+    if (p->data_len) {
+        p->data = calloc(1, p->data_len);
+        if (p->data == NULL) {
+            snprintf(err, errlen, "out of memory");
+            goto fail;
+        }
+    }
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (base[i] != ~0U && sh[i].sh_type == SHT_PROGBITS) {
+            memcpy(p->data + base[i], img + sh[i].sh_offset, sh[i].sh_size);
+        }
+    }
+
+    for (i = 0; i < eh->e_shnum; i++) {
+        const Elf64_Rel *rel = (const Elf64_Rel *)(img + sh[i].sh_offset);
+        const Elf64_Shdr *symtab;
+        const Elf64_Sym *syms;
+        uint64_t j, nsyms;
+
+        if (sh[i].sh_info != (uint32_t)prog ||
+                (sh[i].sh_type != SHT_REL && sh[i].sh_type != SHT_RELA)) {
+            continue;
+        }
+        if (sh[i].sh_type == SHT_RELA || sh[i].sh_link >= eh->e_shnum ||
+                sh[sh[i].sh_link].sh_type != SHT_SYMTAB) {
+            snprintf(err, errlen, "unsupported relocations");
+            goto fail;
+        }
+        symtab = &sh[sh[i].sh_link];
+        syms = (const Elf64_Sym *)(img + symtab->sh_offset);
+        nsyms = symtab->sh_size / sizeof(*syms);
+        for (j = 0; j < sh[i].sh_size / sizeof(*rel); j++) {
+            uint64_t k = rel[j].r_offset / sizeof(*p->insns);
+            uint64_t sym = ELF64_R_SYM(rel[j].r_info);
+            struct bpf_insn *in = p->insns + k;
+            uint64_t off, addr;
+
+            if (rel[j].r_offset % sizeof(*p->insns) || k + 1 >= p->n_insns ||
+                    ELF64_R_TYPE(rel[j].r_info) != R_BPF_64_64 ||
+                    in->code != (BPF_LD | BPF_IMM | BPF_DW) ||
+                    sym >= nsyms || syms[sym].st_shndx >= eh->e_shnum ||
+                    base[syms[sym].st_shndx] == ~0U) {
+                snprintf(err, errlen, "unsupported relocation at insn %u "
+                         "(only data, no calls or maps)", (unsigned)k);
+                goto fail;
+            }
+            off = syms[sym].st_value + (uint32_t)in->imm;
+            if (off > sh[syms[sym].st_shndx].sh_size) {
+                snprintf(err, errlen, "bad relocation at insn %u", (unsigned)k);
+                goto fail;
+            }
+            addr = (uintptr_t)(p->data + base[syms[sym].st_shndx] + off);
+            in[0].imm = (uint32_t)addr;
+            in[1].imm = (uint32_t)(addr >> 32);
+            in[0].src_reg = 0;
+        }
+    }
+    free(base);
+
+    return 0;
+
+fail:
+    free(base);
+    return -1;
+}
+
+/*
+ * Verifier lite: known instructions only, forward jumps that stay in
+ * the program, an exit at the end, so every path ends in an exit.
+ * Stack accesses through r10 are checked here, the others at run time.
+ */
+static int
+mark_bpf_check(const struct mark_bpf *p, char *err, size_t errlen)
+{
+    static const int sizes[] = { 4, 2, 1, 8 };  /* W H B DW */
+    uint8_t *second;
+    uint32_t i;
+
+    second = calloc(p->n_insns + 1, 1);
+    if (second == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return -1;
+    }
+    for (i = 0; i < p->n_insns; i++) {
+        if (p->insns[i].code == (BPF_LD | BPF_IMM | BPF_DW)) {
+            second[++i] = 1;
+        }
+    }
+    for (i = 0; i < p->n_insns; i++) {
+        const struct bpf_insn *in = &p->insns[i];
+        uint8_t cls = BPF_CLASS(in->code), op = BPF_OP(in->code);
+        const char *bad = NULL;
+        int size = sizes[BPF_SIZE(in->code) >> 3];
+
+        if (second[i]) {
+            continue;
+        }
+        if (in->dst_reg > BPF_REG_10 || in->src_reg > BPF_REG_10) {
+            bad = "invalid register";
+        }
+        switch (cls) {
+        case BPF_ALU:
+        case BPF_ALU64:
+            if (in->dst_reg == BPF_REG_10) {
+                bad = "r10 is read only";
+            } else if (in->off != 0) {
+                bad = "unsupported ALU instruction";
+            } else if (op == BPF_END) {
+                if (cls != BPF_ALU ||
+                        (in->imm != 16 && in->imm != 32 && in->imm != 64)) {
+                    bad = "bad byte swap";
+                }
+            } else if (op == BPF_NEG) {
+                if (BPF_SRC(in->code) != BPF_K) {
+                    bad = "bad neg";
+                }
+            } else if (op > BPF_END) {
+                bad = "unknown ALU instruction";
+            } else if (BPF_SRC(in->code) == BPF_K) {
+                if ((op == BPF_DIV || op == BPF_MOD) && in->imm == 0) {
+                    bad = "division by zero";
+                } else if ((op == BPF_LSH || op == BPF_RSH ||
+                            op == BPF_ARSH) &&
+                           (uint32_t)in->imm >= (cls == BPF_ALU64 ? 64 : 32)) {
+                    bad = "shift out of range";
+                }
+            }
+            break;
+
+        case BPF_JMP:
+        case BPF_JMP32:
+            if (op == BPF_CALL) {
+                bad = "calls are not supported";
+            } else if (op == BPF_EXIT) {
+                if (cls != BPF_JMP) {
+                    bad = "bad exit";
+                }
+            } else if (op > BPF_JSLE || (op == BPF_JA && cls != BPF_JMP)) {
+                bad = "unknown jump";
+            } else if (in->off < 0) {
+                bad = "backward jump (loops must be unrolled)";
+            } else if (i + 1 + in->off >= p->n_insns ||
+                       second[i + 1 + in->off]) {
+                bad = "jump out of the program";
+            }
+            break;
+
+        case BPF_LDX:
+        case BPF_ST:
+        case BPF_STX:
+            if (BPF_MODE(in->code) != BPF_MEM) {
+                bad = "unsupported memory access";
+            } else if (cls == BPF_LDX && in->dst_reg == BPF_REG_10) {
+                bad = "r10 is read only";
+            } else if ((cls == BPF_LDX ? in->src_reg : in->dst_reg) ==
+                       BPF_REG_10 &&
+                       (in->off < -MARK_BPF_STACK || in->off > -size)) {
+                bad = "stack access out of bounds";
+            }
+            break;
+
+        case BPF_LD:
+            if (in->code != (BPF_LD | BPF_IMM | BPF_DW) ||
+                    i + 1 >= p->n_insns || p->insns[i + 1].code != 0 ||
+                    in->src_reg != 0) {
+                bad = "unsupported load (no maps or packet loads)";
+            } else if (in->dst_reg == BPF_REG_10) {
+                bad = "r10 is read only";
+            }
+            break;
+
+        default:
+            bad = "unknown instruction";
+            break;
+        }
+        if (bad) {
+            snprintf(err, errlen, "insn %u: %s", i, bad);
+            free(second);
+            return -1;
+        }
+    }
+    free(second);
+    if (p->insns[p->n_insns - 1].code != (BPF_JMP | BPF_EXIT)) {
+        snprintf(err, errlen, "the program does not end with an exit");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* where an access of 'size' bytes at 'addr' may go, NULL if nowhere */
+static inline void *
+mark_bpf_mem(struct mark_bpf *p, const uint8_t *data, uint32_t pkt_sz,
+             const uint8_t *stack, uint64_t addr, int size, int store)
+{
+    if (!store && addr - (uintptr_t)data + size <= pkt_sz &&
+            addr >= (uintptr_t)data) {
+        return (void *)addr;
+    }
+    if (addr - (uintptr_t)stack + size <= MARK_BPF_STACK &&
+            addr >= (uintptr_t)stack) {
+        return (void *)addr;
+    }
+    if (!store && addr - (uintptr_t)p->data + size <= p->data_len &&
+            addr >= (uintptr_t)p->data) {
+        return (void *)addr;
+    }
+    return NULL;
+}
+
+static uint64_t
+mark_bpf_interp(struct mark_bpf *p, uint8_t *data, uint32_t pkt_sz)
+{
+    static const int sizes[] = { 4, 2, 1, 8 };
+    uint64_t stack[MARK_BPF_STACK / sizeof(uint64_t)];
+    const struct bpf_insn *in = p->insns;
+    uint64_t r[BPF_REG_10 + 1] = { 0 };
+
+    r[BPF_REG_1] = (uintptr_t)data;
+    r[BPF_REG_2] = pkt_sz;
+    r[BPF_REG_10] = (uintptr_t)stack + sizeof(stack);
+
+    for (;; in++) {
+        uint64_t src = BPF_SRC(in->code) == BPF_X ? r[in->src_reg] :
+                       (uint64_t)(int64_t)in->imm;
+        uint64_t *dst = &r[in->dst_reg];
+        uint32_t s32 = src, d32 = *dst;
+        int size = sizes[BPF_SIZE(in->code) >> 3];
+        int jump = 0;
+        void *m;
+
+        switch (BPF_CLASS(in->code)) {
+        case BPF_ALU64:
+            switch (BPF_OP(in->code)) {
+            case BPF_ADD:  *dst += src; break;
+            case BPF_SUB:  *dst -= src; break;
+            case BPF_MUL:  *dst *= src; break;
+            case BPF_DIV:  *dst = src ? *dst / src : 0; break;
+            case BPF_MOD:  *dst = src ? *dst % src : *dst; break;
+            case BPF_OR:   *dst |= src; break;
+            case BPF_AND:  *dst &= src; break;
+            case BPF_XOR:  *dst ^= src; break;
+            case BPF_LSH:  *dst <<= src & 63; break;
+            case BPF_RSH:  *dst >>= src & 63; break;
+            case BPF_ARSH: *dst = (int64_t)*dst >> (src & 63); break;
+            case BPF_NEG:  *dst = -*dst; break;
+            case BPF_MOV:  *dst = src; break;
+            }
+            break;
+
+        case BPF_ALU:
+            switch (BPF_OP(in->code)) {
+            case BPF_ADD:  d32 += s32; break;
+            case BPF_SUB:  d32 -= s32; break;
+            case BPF_MUL:  d32 *= s32; break;
+            case BPF_DIV:  d32 = s32 ? d32 / s32 : 0; break;
+            case BPF_MOD:  d32 = s32 ? d32 % s32 : d32; break;
+            case BPF_OR:   d32 |= s32; break;
+            case BPF_AND:  d32 &= s32; break;
+            case BPF_XOR:  d32 ^= s32; break;
+            case BPF_LSH:  d32 <<= s32 & 31; break;
+            case BPF_RSH:  d32 >>= s32 & 31; break;
+            case BPF_ARSH: d32 = (int32_t)d32 >> (s32 & 31); break;
+            case BPF_NEG:  d32 = -d32; break;
+            case BPF_MOV:  d32 = s32; break;
+            case BPF_END:
+                if (BPF_SRC(in->code) == BPF_TO_BE) {
+                    *dst = in->imm == 16 ? __builtin_bswap16(*dst) :
+                           in->imm == 32 ? __builtin_bswap32(*dst) :
+                           __builtin_bswap64(*dst);
+                } else if (in->imm != 64) {
+                    *dst &= in->imm == 16 ? 0xffff : 0xffffffff;
+                }
+                continue;
+            }
+            *dst = d32;
+            break;
+
+        case BPF_JMP32:
+            src = (int32_t)s32;
+            d32 = *dst;
+            /* fallthrough */
+        case BPF_JMP: {
+            uint64_t d = BPF_CLASS(in->code) == BPF_JMP ? *dst :
+                         (uint64_t)(int32_t)d32;
+            uint64_t ud = BPF_CLASS(in->code) == BPF_JMP ? *dst : d32;
+            uint64_t us = BPF_CLASS(in->code) == BPF_JMP ? src : s32;
+
+            switch (BPF_OP(in->code)) {
+            case BPF_JA:   jump = 1; break;
+            case BPF_JEQ:  jump = ud == us; break;
+            case BPF_JNE:  jump = ud != us; break;
+            case BPF_JGT:  jump = ud > us; break;
+            case BPF_JGE:  jump = ud >= us; break;
+            case BPF_JLT:  jump = ud < us; break;
+            case BPF_JLE:  jump = ud <= us; break;
+            case BPF_JSET: jump = (ud & us) != 0; break;
+            case BPF_JSGT: jump = (int64_t)d > (int64_t)src; break;
+            case BPF_JSGE: jump = (int64_t)d >= (int64_t)src; break;
+            case BPF_JSLT: jump = (int64_t)d < (int64_t)src; break;
+            case BPF_JSLE: jump = (int64_t)d <= (int64_t)src; break;
+            case BPF_EXIT: return r[BPF_REG_0];
+            }
+            if (jump) {
+                in += in->off;
+            }
+            break;
+        }
+
+        case BPF_LDX:
+            m = mark_bpf_mem(p, data, pkt_sz, (uint8_t *)stack,
+                             r[in->src_reg] + in->off, size, 0);
+            if (m == NULL) {
+                goto fault;
+            }
+            *dst = 0;
+            memcpy(dst, m, size);   /* little endian */
+            break;
+
+        case BPF_ST:
+        case BPF_STX:
+            m = mark_bpf_mem(p, data, pkt_sz, (uint8_t *)stack,
+                             *dst + in->off, size, 1);
+            if (m == NULL) {
+                goto fault;
+            }
+            if (BPF_CLASS(in->code) == BPF_ST) {
+                src = (int64_t)in->imm;
+            } else {
+                src = r[in->src_reg];
+            }
+            memcpy(m, &src, size);
+            break;
+
+        case BPF_LD:
+            *dst = (uint32_t)in[0].imm | (uint64_t)(uint32_t)in[1].imm << 32;
+            in++;
+            break;
+        }
+    }
+
+fault:
+    p->faults++;
+    return 0;
+}
+
+#ifdef MARK_BPF_JIT
+/*
+ * x86-64 JIT. eBPF registers live in x86 registers, r10 is rbp and
+ * points to the top of a 512 byte stack, with a pointer to the fault
+ * counter right above it. r10 and r11 keep the frame and its length
+ * for the bounds checks, r9 and r12 are scratch.
+ */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+static const uint8_t jit_reg[BPF_REG_10 + 1] = {
+    RAX, RDI, RSI, RDX, RCX, R8, RBX, R13, R14, R15, RBP
+};
+
+#define JIT_AUX     R9
+#define JIT_AUX2    R12
+#define JIT_PKT     R10
+#define JIT_LEN     R11
+#define JIT_FRAME   (MARK_BPF_STACK + 8)
+#define JIT_MAX_INSN    160     /* bytes of code per instruction, at most */
+
+struct jit {
+    uint8_t *buf;
+    size_t len;
+    uint32_t *addr;             /* code offset of each instruction */
+    size_t epilogue;
+    size_t fault;
+};
+
+static inline void
+jit_b(struct jit *j, uint8_t b)
+{
+    j->buf[j->len++] = b;
+}
+
+static inline void
+jit_w(struct jit *j, uint32_t v)
+{
+    memcpy(j->buf + j->len, &v, 4);
+    j->len += 4;
+}
+
+static void
+jit_rex(struct jit *j, int w, int reg, int rm, int force)
+{
+    uint8_t b = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+
+    if (b != 0x40 || force) {
+        jit_b(j, b);
+    }
+}
+
+static void
+jit_modrm(struct jit *j, int reg, int rm)
+{
+    jit_b(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* [base + disp32] */
+static void
+jit_mem(struct jit *j, int reg, int base, int32_t disp)
+{
+    jit_b(j, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        jit_b(j, 0x24);
+    }
+    jit_w(j, disp);
+}
+
+/* op r/m, reg */
+static void
+jit_rr(struct jit *j, int w, uint8_t op, int dst, int src)
+{
+    jit_rex(j, w, src, dst, 0);
+    jit_b(j, op);
+    jit_modrm(j, src, dst);
+}
+
+/* group 1 op r/m, imm32 */
+static void
+jit_ri(struct jit *j, int w, int ext, int dst, int32_t imm)
+{
+    jit_rex(j, w, 0, dst, 0);
+    jit_b(j, 0x81);
+    jit_modrm(j, ext, dst);
+    jit_w(j, imm);
+}
+
+static void
+jit_mov_imm(struct jit *j, int w, int dst, int32_t imm)
+{
+    if (w) {
+        jit_rex(j, 1, 0, dst, 0);
+        jit_b(j, 0xc7);
+        jit_modrm(j, 0, dst);
+    } else {
+        jit_rex(j, 0, 0, dst, 0);
+        jit_b(j, 0xb8 + (dst & 7));
+    }
+    jit_w(j, imm);
+}
+
+static void
+jit_mov_imm64(struct jit *j, int dst, uint64_t imm)
+{
+    jit_rex(j, 1, 0, dst, 0);
+    jit_b(j, 0xb8 + (dst & 7));
+    jit_w(j, (uint32_t)imm);
+    jit_w(j, (uint32_t)(imm >> 32));
+}
+
+static void
+jit_push(struct jit *j, int r)
+{
+    jit_rex(j, 0, 0, r, 0);
+    jit_b(j, 0x50 + (r & 7));
+}
+
+static void
+jit_pop(struct jit *j, int r)
+{
+    jit_rex(j, 0, 0, r, 0);
+    jit_b(j, 0x58 + (r & 7));
+}
+
+/* jcc (or jmp if cc < 0) to a code offset, returns where rel32 is */
+static size_t
+jit_jump(struct jit *j, int cc, size_t target)
+{
+    if (cc < 0) {
+        jit_b(j, 0xe9);
+    } else {
+        jit_b(j, 0x0f);
+        jit_b(j, 0x80 + cc);
+    }
+    jit_w(j, (uint32_t)(target - (j->len + 4)));
+    return j->len - 4;
+}
+
+/* point a jump emitted with jit_jump() here */
+static void
+jit_here(struct jit *j, size_t rel)
+{
+    uint32_t v = j->len - (rel + 4);
+
+    memcpy(j->buf + rel, &v, 4);
+}
+
+#define CC_B    0x2
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_BE   0x6
+#define CC_A    0x7
+#define CC_L    0xc
+#define CC_GE   0xd
+#define CC_LE   0xe
+#define CC_G    0xf
+
+/*
+ * Leave in JIT_AUX the address 'base + off', jumping to the fault
+ * path unless 'size' bytes there are in the frame (loads only), the
+ * stack or the data sections (loads only).
+ */
+static void
+jit_check(struct jit *j, const struct mark_bpf *p, int base, int16_t off,
+          int size, int store)
+{
+    size_t ok[3], next;
+    int n = 0, i;
+
+    jit_rex(j, 1, JIT_AUX, base, 0);
+    jit_b(j, 0x8d);                             /* lea aux, [base + off] */
+    jit_mem(j, JIT_AUX, base, off);
+    if (!store) {
+        jit_rr(j, 1, 0x89, JIT_AUX2, JIT_AUX);  /* aux2 = addr - data */
+        jit_rr(j, 1, 0x29, JIT_AUX2, JIT_PKT);
+        jit_ri(j, 1, 0, JIT_AUX2, size);
+        next = jit_jump(j, CC_B, 0);
+        jit_rr(j, 1, 0x39, JIT_AUX2, JIT_LEN);
+        ok[n++] = jit_jump(j, CC_BE, 0);
+        jit_here(j, next);
+    }
+    jit_rr(j, 1, 0x89, JIT_AUX2, JIT_AUX);      /* aux2 = addr - stack */
+    jit_rr(j, 1, 0x29, JIT_AUX2, RBP);
+    jit_ri(j, 1, 0, JIT_AUX2, MARK_BPF_STACK);
+    jit_ri(j, 1, 0, JIT_AUX2, size);
+    next = jit_jump(j, CC_B, 0);
+    jit_ri(j, 1, 7, JIT_AUX2, MARK_BPF_STACK);
+    ok[n++] = jit_jump(j, CC_BE, 0);
+    jit_here(j, next);
+    if (!store && p->data_len) {
+        jit_mov_imm64(j, JIT_AUX2, -(uint64_t)(uintptr_t)p->data);
+        jit_rr(j, 1, 0x01, JIT_AUX2, JIT_AUX);  /* aux2 = addr - data sections */
+        jit_ri(j, 1, 0, JIT_AUX2, size);
+        next = jit_jump(j, CC_B, 0);
+        jit_ri(j, 1, 7, JIT_AUX2, p->data_len);
+        ok[n++] = jit_jump(j, CC_BE, 0);
+        jit_here(j, next);
+    }
+    jit_jump(j, -1, j->fault);
+    for (i = 0; i < n; i++) {
+        jit_here(j, ok[i]);
+    }
+}
+
+/* dst = dst / src or dst % src, 0 or dst if src is 0 */
+static void
+jit_div(struct jit *j, const struct bpf_insn *in, int w)
+{
+    int dst = jit_reg[in->dst_reg];
+    size_t nz, done;
+
+    if (BPF_SRC(in->code) == BPF_X) {
+        jit_rr(j, w, 0x89, JIT_AUX, jit_reg[in->src_reg]);
+    } else {
+        jit_mov_imm(j, w, JIT_AUX, in->imm);
+    }
+    jit_rr(j, w, 0x85, JIT_AUX, JIT_AUX);
+    nz = jit_jump(j, CC_NE, 0);
+    if (BPF_OP(in->code) == BPF_DIV) {
+        jit_rr(j, 0, 0x31, dst, dst);
+    } else if (!w) {
+        jit_rr(j, 0, 0x89, dst, dst);
+    }
+    done = jit_jump(j, -1, 0);
+    jit_here(j, nz);
+    jit_push(j, RAX);
+    jit_push(j, RDX);
+    jit_rr(j, w, 0x89, RAX, dst);
+    jit_rr(j, 0, 0x31, RDX, RDX);
+    jit_rex(j, w, 0, JIT_AUX, 0);
+    jit_b(j, 0xf7);                             /* div aux */
+    jit_modrm(j, 6, JIT_AUX);
+    jit_rr(j, 1, 0x89, JIT_AUX2, BPF_OP(in->code) == BPF_DIV ? RAX : RDX);
+    jit_pop(j, RDX);
+    jit_pop(j, RAX);
+    jit_rr(j, w, 0x89, dst, JIT_AUX2);
+    jit_here(j, done);
+}
+
+static void
+jit_shift(struct jit *j, const struct bpf_insn *in, int w, int ext)
+{
+    int dst = jit_reg[in->dst_reg], src = jit_reg[in->src_reg], t = dst;
+
+    if (BPF_SRC(in->code) == BPF_K) {
+        jit_rex(j, w, 0, dst, 0);
+        jit_b(j, 0xc1);
+        jit_modrm(j, ext, dst);
+        jit_b(j, in->imm);
+        return;
+    }
+    if (src != RCX) {
+        jit_rr(j, 1, 0x89, JIT_AUX, RCX);
+        jit_rr(j, 1, 0x89, RCX, src);
+        if (dst == RCX) {
+            t = JIT_AUX;
+        }
+    }
+    jit_rex(j, w, 0, t, 0);
+    jit_b(j, 0xd3);
+    jit_modrm(j, ext, t);
+    if (src != RCX) {
+        jit_rr(j, 1, 0x89, RCX, JIT_AUX);
+    }
+}
+
+static void
+jit_insn(struct jit *j, const struct mark_bpf *p, uint32_t i)
+{
+    static const uint8_t alu_rr[] = {
+        [BPF_ADD >> 4] = 0x01, [BPF_SUB >> 4] = 0x29, [BPF_OR >> 4] = 0x09,
+        [BPF_AND >> 4] = 0x21, [BPF_XOR >> 4] = 0x31, [BPF_MOV >> 4] = 0x89,
+    };
+    static const uint8_t alu_ext[] = {
+        [BPF_ADD >> 4] = 0, [BPF_SUB >> 4] = 5, [BPF_OR >> 4] = 1,
+        [BPF_AND >> 4] = 4, [BPF_XOR >> 4] = 6,
+    };
+    static const int8_t jcc[] = {
+        [BPF_JA >> 4] = -1, [BPF_JEQ >> 4] = CC_E, [BPF_JNE >> 4] = CC_NE,
+        [BPF_JGT >> 4] = CC_A, [BPF_JGE >> 4] = CC_AE, [BPF_JLT >> 4] = CC_B,
+        [BPF_JLE >> 4] = CC_BE, [BPF_JSET >> 4] = CC_NE,
+        [BPF_JSGT >> 4] = CC_G, [BPF_JSGE >> 4] = CC_GE,
+        [BPF_JSLT >> 4] = CC_L, [BPF_JSLE >> 4] = CC_LE,
+    };
+    const struct bpf_insn *in = &p->insns[i];
+    int dst = jit_reg[in->dst_reg], src = jit_reg[in->src_reg];
+    int w = BPF_CLASS(in->code) == BPF_ALU64 ||
+            BPF_CLASS(in->code) == BPF_JMP;
+    int x = BPF_SRC(in->code) == BPF_X;
+    uint8_t op = BPF_OP(in->code);
+    int size;
+
+    switch (BPF_CLASS(in->code)) {
+    case BPF_ALU:
+    case BPF_ALU64:
+        switch (op) {
+        case BPF_ADD: case BPF_SUB: case BPF_OR: case BPF_AND: case BPF_XOR:
+            if (x) {
+                jit_rr(j, w, alu_rr[op >> 4], dst, src);
+            } else {
+                jit_ri(j, w, alu_ext[op >> 4], dst, in->imm);
+            }
+            break;
+        case BPF_MOV:
+            if (x) {
+                jit_rr(j, w, 0x89, dst, src);
+            } else {
+                jit_mov_imm(j, w, dst, in->imm);
+            }
+            break;
+        case BPF_MUL:
+            if (x) {
+                jit_rex(j, w, dst, src, 0);
+                jit_b(j, 0x0f);
+                jit_b(j, 0xaf);
+                jit_modrm(j, dst, src);
+            } else {
+                jit_rex(j, w, dst, dst, 0);
+                jit_b(j, 0x69);
+                jit_modrm(j, dst, dst);
+                jit_w(j, in->imm);
+            }
+            break;
+        case BPF_DIV: case BPF_MOD:
+            jit_div(j, in, w);
+            break;
+        case BPF_LSH:
+            jit_shift(j, in, w, 4);
+            break;
+        case BPF_RSH:
+            jit_shift(j, in, w, 5);
+            break;
+        case BPF_ARSH:
+            jit_shift(j, in, w, 7);
+            break;
+        case BPF_NEG:
+            jit_rex(j, w, 0, dst, 0);
+            jit_b(j, 0xf7);
+            jit_modrm(j, 3, dst);
+            break;
+        case BPF_END:
+            if (BPF_SRC(in->code) == BPF_TO_BE && in->imm == 16) {
+                jit_b(j, 0x66);                 /* rol dst16, 8 */
+                jit_rex(j, 0, 0, dst, 0);
+                jit_b(j, 0xc1);
+                jit_modrm(j, 0, dst);
+                jit_b(j, 8);
+            } else if (BPF_SRC(in->code) == BPF_TO_BE) {
+                jit_rex(j, in->imm == 64, 0, dst, 0);
+                jit_b(j, 0x0f);                 /* bswap */
+                jit_b(j, 0xc8 + (dst & 7));
+                break;
+            } else if (in->imm == 32) {
+                jit_rr(j, 0, 0x89, dst, dst);
+                break;
+            } else if (in->imm == 64) {
+                break;
+            }
+            jit_rex(j, 0, dst, dst, 0);         /* movzx dst32, dst16 */
+            jit_b(j, 0x0f);
+            jit_b(j, 0xb7);
+            jit_modrm(j, dst, dst);
+            break;
+        }
+        break;
+
+    case BPF_JMP:
+    case BPF_JMP32:
+        if (op == BPF_EXIT) {
+            jit_jump(j, -1, j->epilogue);
+            break;
+        }
+        if (op == BPF_JSET) {
+            if (x) {
+                jit_rr(j, w, 0x85, dst, src);
+            } else {
+                jit_rex(j, w, 0, dst, 0);
+                jit_b(j, 0xf7);
+                jit_modrm(j, 0, dst);
+                jit_w(j, in->imm);
+            }
+        } else if (op != BPF_JA) {
+            if (x) {
+                jit_rr(j, w, 0x39, dst, src);
+            } else {
+                jit_ri(j, w, 7, dst, in->imm);
+            }
+        }
+        jit_jump(j, jcc[op >> 4], j->addr[i + 1 + in->off]);
+        break;
+
+    case BPF_LDX:
+        size = BPF_SIZE(in->code);
+        if (in->src_reg != BPF_REG_10) {
+            jit_check(j, p, src, in->off,
+                      size == BPF_DW ? 8 : size == BPF_W ? 4 :
+                      size == BPF_H ? 2 : 1, 0);
+            src = JIT_AUX;
+        }
+        jit_rex(j, size == BPF_DW, dst, src, 0);
+        if (size == BPF_B || size == BPF_H) {
+            jit_b(j, 0x0f);                     /* movzx */
+            jit_b(j, size == BPF_B ? 0xb6 : 0xb7);
+        } else {
+            jit_b(j, 0x8b);
+        }
+        jit_mem(j, dst, src, src == JIT_AUX ? 0 : in->off);
+        break;
+
+    case BPF_ST:
+    case BPF_STX:
+        size = BPF_SIZE(in->code);
+        if (in->dst_reg != BPF_REG_10) {
+            jit_check(j, p, dst, in->off,
+                      size == BPF_DW ? 8 : size == BPF_W ? 4 :
+                      size == BPF_H ? 2 : 1, 1);
+            dst = JIT_AUX;
+        }
+        if (size == BPF_H) {
+            jit_b(j, 0x66);
+        }
+        if (BPF_CLASS(in->code) == BPF_STX) {
+            jit_rex(j, size == BPF_DW, src, dst, size == BPF_B);
+            jit_b(j, size == BPF_B ? 0x88 : 0x89);
+            jit_mem(j, src, dst, dst == JIT_AUX ? 0 : in->off);
+        } else {
+            jit_rex(j, size == BPF_DW, 0, dst, 0);
+            jit_b(j, size == BPF_B ? 0xc6 : 0xc7);
+            jit_mem(j, 0, dst, dst == JIT_AUX ? 0 : in->off);
+            if (size == BPF_B) {
+                jit_b(j, in->imm);
+            } else if (size == BPF_H) {
+                jit_b(j, in->imm);
+                jit_b(j, in->imm >> 8);
+            } else {
+                jit_w(j, in->imm);
+            }
+        }
+        break;
+
+    case BPF_LD:
+        jit_mov_imm64(j, dst, (uint32_t)in[0].imm |
+                      (uint64_t)(uint32_t)in[1].imm << 32);
+        break;
+    }
+}
+
+static void
+jit_program(struct jit *j, const struct mark_bpf *p)
+{
+    static const uint8_t saved[] = { RBP, RBX, R12, R13, R14, R15 };
+    static const uint8_t zero[] = { RAX, RDX, RCX, R8, RBX, R13, R14, R15 };
+    uint32_t i;
+    int k;
+
+    j->len = 0;
+    for (k = 0; k < (int)sizeof(saved); k++) {
+        jit_push(j, saved[k]);
+    }
+    jit_ri(j, 1, 5, RSP, JIT_FRAME);            /* sub rsp, frame */
+    jit_rex(j, 1, RBP, RSP, 0);
+    jit_b(j, 0x8d);                             /* lea rbp, [rsp + 512] */
+    jit_mem(j, RBP, RSP, MARK_BPF_STACK);
+    jit_rex(j, 1, RDX, RBP, 0);
+    jit_b(j, 0x89);                             /* mov [rbp], faults */
+    jit_mem(j, RDX, RBP, 0);
+    jit_rr(j, 1, 0x89, JIT_PKT, RDI);
+    jit_rr(j, 1, 0x89, JIT_LEN, RSI);
+    for (k = 0; k < (int)sizeof(zero); k++) {
+        jit_rr(j, 0, 0x31, zero[k], zero[k]);
+    }
+
+    for (i = 0; i < p->n_insns; i++) {
+        j->addr[i] = j->len;
+        jit_insn(j, p, i);
+        if (p->insns[i].code == (BPF_LD | BPF_IMM | BPF_DW)) {
+            j->addr[++i] = j->len;
+        }
+    }
+
+    j->fault = j->len;
+    jit_rex(j, 1, JIT_AUX, RBP, 0);
+    jit_b(j, 0x8b);                             /* mov aux, [rbp] */
+    jit_mem(j, JIT_AUX, RBP, 0);
+    jit_rex(j, 1, 0, JIT_AUX, 0);
+    jit_b(j, 0xff);                             /* inc qword [aux] */
+    jit_mem(j, 0, JIT_AUX, 0);
+    jit_rr(j, 0, 0x31, RAX, RAX);
+
+    j->epilogue = j->len;
+    jit_ri(j, 1, 0, RSP, JIT_FRAME);            /* add rsp, frame */
+    for (k = sizeof(saved) - 1; k >= 0; k--) {
+        jit_pop(j, saved[k]);
+    }
+    jit_b(j, 0xc3);
+}
+
+static int
+mark_bpf_jit(struct mark_bpf *p, char *err, size_t errlen)
+{
+    struct jit j = { 0 };
+    size_t size = (size_t)p->n_insns * JIT_MAX_INSN + 256;
+
+    j.addr = calloc(p->n_insns + 1, sizeof(*j.addr));
+    j.buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j.addr == NULL || j.buf == MAP_FAILED) {
+        snprintf(err, errlen, "out of memory");
+        free(j.addr);
+        if (j.buf != MAP_FAILED) {
+            munmap(j.buf, size);
+        }
+        return -1;
+    }
+    /* all jumps are rel32, so the second pass only fixes targets */
+    jit_program(&j, p);
+    jit_program(&j, p);
+    free(j.addr);
+    if (mprotect(j.buf, size, PROT_READ | PROT_EXEC)) {
+        snprintf(err, errlen, "mprotect() failed: %s", strerror(errno));
+        munmap(j.buf, size);
+        return -1;
+    }
+    p->jit = j.buf;
+    p->jit_size = size;
+
+    return 0;
+}
+#endif  /* MARK_BPF_JIT */
+
+struct mark_bpf *
+mark_bpf_load(const char *spec, int jit, char *err, size_t errlen)
+{
+    char path[256];
+    const char *secname = MARK_BPF_SECTION, *colon = strrchr(spec, ':');
+    struct mark_bpf *p = NULL;
+    uint8_t *img = NULL;
+    long size;
+    FILE *f;
+
+    if (colon) {
+        secname = colon + 1;
+    }
+    snprintf(path, sizeof(path), "%.*s",
+             colon ? (int)(colon - spec) : (int)strlen(spec), spec);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(err, errlen, "cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+            fseek(f, 0, SEEK_SET)) {
+        snprintf(err, errlen, "cannot read %s", path);
+        goto fail;
+    }
+    img = malloc(size + 1);
+    p = calloc(1, sizeof(*p));
+    if (img == NULL || p == NULL) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    if (fread(img, 1, size, f) != (size_t)size) {
+        snprintf(err, errlen, "cannot read %s", path);
+        goto fail;
+    }
+    if (mark_bpf_elf(p, img, size, secname, err, errlen) ||
+            mark_bpf_check(p, err, errlen)) {
+        goto fail;
+    }
+#ifdef MARK_BPF_JIT
+    if (jit && mark_bpf_jit(p, err, errlen)) {
+        goto fail;
+    }
+#endif
+    free(img);
+    fclose(f);
+
+    return p;
+
+fail:
+    free(img);
+    fclose(f);
+    mark_bpf_free(p);
+    return NULL;
+}
+
+void
+mark_bpf_free(struct mark_bpf *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (p->jit) {
+        munmap(p->jit, p->jit_size);
+    }
+    free(p->insns);
+    free(p->data);
+    free(p);
+}
+
+uint32_t
+mark_bpf_run(struct mark_bpf *p, uint8_t *data, uint32_t pkt_sz)
+{
+    if (p->jit) {
+        return ((mark_bpf_jit_fn)p->jit)(data, pkt_sz, &p->faults);
+    }
+    return mark_bpf_interp(p, data, pkt_sz);
+}
+
+uint32_t
+mark_bpf_insns(const struct mark_bpf *p)
+{
+    return p->n_insns;
+}
+
+uint64_t
+mark_bpf_faults(const struct mark_bpf *p)
+{
+    return p->faults;
+}
+
+int
+mark_bpf_jitted(const struct mark_bpf *p)
+{
+    return p->jit != NULL;
+}
+
+int
+mark_bpf_install(struct mark_bpf **slot, const char *spec, char *err,
+                 size_t errlen)
+{
+    struct mark_bpf *p = NULL, *old;
+
+    if (strcmp(spec, "none")) {
+        p = mark_bpf_load(spec, 1, err, errlen);
+        if (p == NULL) {
+            return -1;
+        }
+    }
+    old = __atomic_exchange_n(slot, p, __ATOMIC_SEQ_CST);
+    mark_reader_sync();
+    mark_bpf_free(old);
+
+    return 0;
+}
+
+int
+mark_bpf_burst(struct mark_bpf **slot, struct mark_bpf **dflt,
+               uint8_t **data, const uint32_t *pkt_sz, uint32_t *marks,
+               unsigned int n)
+{
+    struct mark_bpf *p;
+    unsigned int i;
+    int me = mark_reader_enter();
+
+    p = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (p == NULL) {
+        p = __atomic_load_n(dflt, __ATOMIC_ACQUIRE);
+    }
+    if (p == NULL) {
+        mark_reader_exit(me);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        __builtin_prefetch(data[i]);
+    }
+    for (i = 0; i < n; i++) {
+        marks[i] = mark_bpf_run(p, data[i], pkt_sz[i]);
+    }
+    mark_reader_exit(me);
+
+    return 0;
+}
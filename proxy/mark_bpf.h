@@ -0,0 +1,63 @@
+#ifndef __MARK_BPF_H__
+#define __MARK_BPF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * eBPF mark programs for MARK_MODE_HV, run by the proxy in place of
+ * the built in mark_packet_fun() or the rules of mark_rules.h.
+ *
+ * A program is a function in its own ELF section of an object built
+ * with 'clang -target bpf' (see mark_prog.c), taking the frame and
+ * its length and returning the mark:
+ *     __section("mark") uint32_t
+ *     mark(uint8_t *data, uint32_t len)
+ *     {
+ *         return mark_packet_fun(data, len);
+ *     }
+ * and is named as PATH[:SECTION], the section defaulting to "mark".
+ * Constant data (.rodata, .data, .bss) can be read through lddw
+ * relocations, but helper calls, BPF to BPF calls and maps are not
+ * supported.
+ *
+ * The loader checks that the program only uses known instructions,
+ * that every jump goes forward (so it ends: loops must be unrolled)
+ * and that the last instruction is an exit. Memory accesses are
+ * checked at run time: loads must hit the frame, the 512 bytes of
+ * stack or the data sections, stores must hit the stack. A program
+ * that goes out of bounds returns mark 0 and counts a fault.
+ *
+ * On x86-64 programs are compiled to native code, elsewhere they are
+ * interpreted.
+ */
+
+struct mark_bpf;
+
+/* NULL on error, with a message in 'err' */
+struct mark_bpf *mark_bpf_load(const char *spec, int jit, char *err,
+                               size_t errlen);
+void mark_bpf_free(struct mark_bpf *p);
+uint32_t mark_bpf_run(struct mark_bpf *p, uint8_t *data, uint32_t pkt_sz);
+uint32_t mark_bpf_insns(const struct mark_bpf *p);
+uint64_t mark_bpf_faults(const struct mark_bpf *p);
+int mark_bpf_jitted(const struct mark_bpf *p);
+
+/*
+ * Load the program named by 'spec' (no program if "none") into
+ * '*slot', freeing the previous one when no packet thread can be
+ * using it. Safe while packets flow, but one caller at a time.
+ * Returns 0, or -1 with a message in 'err'.
+ */
+int mark_bpf_install(struct mark_bpf **slot, const char *spec, char *err,
+                     size_t errlen);
+
+/*
+ * Mark 'n' packets with the program in '*slot', or in '*dflt' if
+ * there is none. Returns -1, with no marks, if both are empty.
+ */
+int mark_bpf_burst(struct mark_bpf **slot, struct mark_bpf **dflt,
+                   uint8_t **data, const uint32_t *pkt_sz, uint32_t *marks,
+                   unsigned int n);
+
+#endif  /* __MARK_BPF_H__ */
@@ -0,0 +1,538 @@
+/*
+ * Checks the x86-64 JIT of mark_bpf.c against its interpreter.
+ *
+ * Builds 'progs' random programs that pass the checker of mark_bpf.c,
+ * each in an eBPF object with a .data section, and loads every object
+ * twice, interpreted and compiled. Both run on 'frames' random frames,
+ * and must give the same marks and count the same faults. Before the
+ * exit, the programs fold r3-r8 into r0, so that any of them that the
+ * JIT gets wrong shows in the mark. Only r9 and r10 hold pointers to
+ * the stack or the data section, whose addresses differ between the
+ * two loads, and they are only used as the base of loads and stores.
+ *
+ * The programs stress the code that is easy to get wrong: divisions
+ * and modulos, also by a register that is 0, and of or by r0 and r3,
+ * which live in rax and rdx (jit_div()); shifts by a register, also
+ * of or by r4, which lives in rcx (jit_shift()); loads and stores
+ * through any register, in and out of the frame, the stack and the
+ * data section (jit_check()).
+ *
+ * usage: mark_bpf_bench [-n progs] [-f frames] [-s seed]
+ * Exits with 1 if the JIT and the interpreter disagree, and leaves
+ * the object of the first such program in /tmp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <elf.h>
+#include <linux/bpf.h>
+
+#include "mark_bpf.h"
+
+#define MAX_UNITS   240
+#define MAX_FRAMES  256
+#define FRAME_BUF   128
+#define DATA_LEN    64
+#define STACK       512
+#define FIRST_BODY  (7 + STACK / 8)    /* see prog_build() */
+#define FOLD_UNITS  10
+
+/* one or two instructions, a jump goes to the start of unit 'target' */
+struct unit {
+    struct bpf_insn in[2];
+    int n;
+    int target;
+    int reloc;              /* lddw of the .data section */
+};
+
+static uint64_t seed = 88172645463325252ULL;
+
+static inline uint64_t
+xrand(void)                 /* xorshift, cheaper than random() */
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int32_t
+rand_imm(void)
+{
+    switch (xrand() % 6) {
+    case 0:
+        return 0;
+    case 1:
+        return xrand() % 64;
+    case 2:
+        return -(int32_t)(xrand() % 64);
+    case 3:
+        return INT32_MAX;
+    case 4:
+        return INT32_MIN;
+    default:
+        return (int32_t)xrand();
+    }
+}
+
+/* registers to write: no pointers, r1 and r2 (the frame) seldom */
+static int
+rand_dst(void)
+{
+    static const int r[] = { 0, 3, 4, 5, 6, 7, 8, 0, 3, 4 };
+
+    return xrand() % 16 ? r[xrand() % 10] : (int)(1 + xrand() % 2);
+}
+
+/* registers to read as values */
+static int
+rand_src(void)
+{
+    return xrand() % BPF_REG_9;
+}
+
+static void
+unit_alu(struct unit *u)
+{
+    static const uint8_t ops[] = {
+        BPF_ADD, BPF_SUB, BPF_MUL, BPF_DIV, BPF_OR, BPF_AND, BPF_LSH,
+        BPF_RSH, BPF_NEG, BPF_MOD, BPF_XOR, BPF_MOV, BPF_ARSH,
+    };
+    static const uint8_t hard[] = {
+        BPF_DIV, BPF_MOD, BPF_LSH, BPF_RSH, BPF_ARSH,
+    };
+    struct bpf_insn *in = u->in;
+    int cls = xrand() % 2 ? BPF_ALU64 : BPF_ALU;
+    int reg = xrand() % 2;
+    uint8_t op = xrand() % 5 < 2 ? hard[xrand() % 5] : ops[xrand() % 13];
+
+    in->code = cls | op | (reg ? BPF_X : BPF_K);
+    in->dst_reg = rand_dst();
+    in->src_reg = reg ? rand_src() : 0;
+    in->imm = reg ? 0 : rand_imm();
+    if (op == BPF_NEG) {
+        in->code = cls | op;
+        in->src_reg = 0;
+    } else if (reg) {
+        return;
+    } else if ((op == BPF_DIV || op == BPF_MOD) && in->imm == 0) {
+        in->imm = 7;
+    } else if (op == BPF_LSH || op == BPF_RSH || op == BPF_ARSH) {
+        in->imm = (uint32_t)in->imm % (cls == BPF_ALU64 ? 64 : 32);
+    }
+}
+
+static void
+unit_load(struct unit *u)
+{
+    static const int sizes[] = { 4, 2, 1, 8 };
+    struct bpf_insn *in = u->in;
+    int s = xrand() % 4, where = xrand() % 10;
+
+    in->code = BPF_LDX | BPF_MEM | (s << 3);
+    in->dst_reg = rand_dst();
+    if (where < 5) {            /* the frame, sometimes past its end */
+        in->src_reg = BPF_REG_1;
+        in->off = xrand() % 8 ? (int)(xrand() % 40) :
+                  (int)(xrand() % 100) - 4;
+    } else if (where < 8) {     /* the stack */
+        in->src_reg = BPF_REG_10;
+        in->off = -(int)(sizes[s] + xrand() % (STACK - sizes[s] + 1));
+    } else {                    /* anywhere, r9 often points somewhere */
+        in->src_reg = xrand() % 2 ? BPF_REG_9 : rand_src();
+        in->off = xrand() % 16;
+    }
+}
+
+static void
+unit_store(struct unit *u)
+{
+    static const int sizes[] = { 4, 2, 1, 8 };
+    struct bpf_insn *in = u->in;
+    int s = xrand() % 4;
+
+    in->code = (xrand() % 2 ? BPF_STX : BPF_ST) | BPF_MEM | (s << 3);
+    in->src_reg = BPF_CLASS(in->code) == BPF_STX ? rand_src() : 0;
+    in->imm = BPF_CLASS(in->code) == BPF_ST ? rand_imm() : 0;
+    if (xrand() % 8) {
+        in->dst_reg = BPF_REG_10;
+        in->off = -(int)(sizes[s] + xrand() % (32 - sizes[s] + 1));
+    } else {                    /* the frame or r9, may fault */
+        in->dst_reg = xrand() % 2 ? BPF_REG_1 : BPF_REG_9;
+        in->off = -(int)(xrand() % 20);
+    }
+}
+
+/* r9 = a pointer in the stack or in the data section */
+static void
+unit_pointer(struct unit *u)
+{
+    struct bpf_insn *in = u->in;
+
+    u->n = 2;
+    if (xrand() % 2) {
+        in[0].code = BPF_ALU64 | BPF_MOV | BPF_X;
+        in[0].dst_reg = BPF_REG_9;
+        in[0].src_reg = BPF_REG_10;
+        in[1].code = BPF_ALU64 | BPF_ADD | BPF_K;
+        in[1].dst_reg = BPF_REG_9;
+        in[1].imm = -(int32_t)(xrand() % 40);
+    } else {
+        in[0].code = BPF_LD | BPF_IMM | BPF_DW;
+        in[0].dst_reg = BPF_REG_9;
+        in[0].imm = xrand() % (DATA_LEN + 1);
+        u->reloc = 1;
+    }
+}
+
+static void
+unit_jump(struct unit *u, int i, int fold)
+{
+    static const uint8_t ops[] = {
+        BPF_JA, BPF_JEQ, BPF_JGT, BPF_JGE, BPF_JSET, BPF_JNE, BPF_JSGT,
+        BPF_JSGE, BPF_JLT, BPF_JLE, BPF_JSLT, BPF_JSLE,
+    };
+    struct bpf_insn *in = u->in;
+    uint8_t op = ops[xrand() % 12];
+    int reg = xrand() % 2;
+
+    if (xrand() % 10 == 0) {    /* leave, folding the registers or not */
+        if (xrand() % 2) {
+            in->code = BPF_JMP | BPF_EXIT;
+        } else {
+            in->code = BPF_JMP | BPF_JA;
+            u->target = fold;
+        }
+        return;
+    }
+    if (op == BPF_JA) {
+        reg = 0;
+    }
+    in->code = (op != BPF_JA && xrand() % 2 ? BPF_JMP32 : BPF_JMP) | op |
+               (reg ? BPF_X : BPF_K);
+    in->dst_reg = rand_src();
+    in->src_reg = reg ? rand_src() : 0;
+    in->imm = reg ? 0 : rand_imm();
+    u->target = i + 1 + xrand() % 6;
+    if (u->target > fold) {
+        u->target = fold;
+    }
+}
+
+/*
+ * A random program of 'nu' units: constants in r0 and r3-r8, the
+ * stack filled (FIRST_BODY units), a random body, then
+ * r0 ^= r3 ^ ... ^ r8, r0 ^= r0 >> 32 and the exit (FOLD_UNITS units).
+ */
+static void
+prog_build(struct unit *u, int nu)
+{
+    int fold = nu - FOLD_UNITS, i;
+
+    memset(u, 0, nu * sizeof(*u));
+    for (i = 0; i < nu; i++) {
+        u[i].n = 1;
+        u[i].target = -1;
+    }
+    for (i = 0; i < 7; i++) {
+        uint64_t v = xrand() % 3 ? xrand() % 100 : xrand();
+
+        u[i].n = 2;
+        u[i].in[0].code = BPF_LD | BPF_IMM | BPF_DW;
+        u[i].in[0].dst_reg = i == 0 ? BPF_REG_0 : i + 2;
+        u[i].in[0].imm = (uint32_t)v;
+        u[i].in[1].imm = (uint32_t)(v >> 32);
+    }
+    for (; i < FIRST_BODY; i++) {
+        u[i].in[0].code = BPF_ST | BPF_MEM | BPF_DW;
+        u[i].in[0].dst_reg = BPF_REG_10;
+        u[i].in[0].off = -8 * (i - 6);
+        u[i].in[0].imm = rand_imm();
+    }
+    for (; i < fold; i++) {
+        int k = xrand() % 100;
+
+        if (k < 35) {
+            unit_alu(&u[i]);
+        } else if (k < 40) {
+            static const int w[] = { 16, 32, 64 };
+
+            u[i].in[0].code = BPF_ALU | BPF_END |
+                              (xrand() % 2 ? BPF_TO_BE : BPF_TO_LE);
+            u[i].in[0].dst_reg = rand_dst();
+            u[i].in[0].imm = w[xrand() % 3];
+        } else if (k < 55) {
+            unit_load(&u[i]);
+        } else if (k < 65) {
+            unit_store(&u[i]);
+        } else if (k < 70) {
+            unit_pointer(&u[i]);
+        } else {
+            unit_jump(&u[i], i, fold);
+        }
+    }
+    for (; i < fold + 6; i++) {
+        u[i].in[0].code = BPF_ALU64 | BPF_XOR | BPF_X;
+        u[i].in[0].dst_reg = BPF_REG_0;
+        u[i].in[0].src_reg = i - fold + 3;
+    }
+    u[i].in[0].code = BPF_ALU64 | BPF_MOV | BPF_X;
+    u[i].in[0].dst_reg = BPF_REG_3;
+    u[i++].in[0].src_reg = BPF_REG_0;
+    u[i].in[0].code = BPF_ALU64 | BPF_RSH | BPF_K;
+    u[i].in[0].dst_reg = BPF_REG_3;
+    u[i++].in[0].imm = 32;
+    u[i].in[0].code = BPF_ALU64 | BPF_XOR | BPF_X;
+    u[i].in[0].dst_reg = BPF_REG_0;
+    u[i++].in[0].src_reg = BPF_REG_3;
+    u[i].in[0].code = BPF_JMP | BPF_EXIT;
+}
+
+/*
+ * Write the units as an eBPF object: the program in section "mark",
+ * the data in .data, and a relocation for each lddw of .data.
+ */
+static int
+prog_write(const char *path, const struct unit *u, int nu,
+           const uint8_t *data)
+{
+    static const char strs[48] =
+        "\0.shstrtab\0mark\0.data\0.symtab\0.rel.mark";
+    struct bpf_insn insns[2 * MAX_UNITS];
+    Elf64_Rel rel[MAX_UNITS];
+    Elf64_Sym sym[2];
+    Elf64_Shdr sh[6];
+    Elf64_Ehdr eh;
+    int start[MAX_UNITS + 1], n = 0, nrel = 0, i, ok;
+    uint64_t ofs;
+    FILE *f;
+
+    for (i = 0; i < nu; i++) {
+        start[i] = n;
+        n += u[i].n;
+    }
+    start[nu] = n;
+    for (i = 0; i < nu; i++) {
+        memcpy(&insns[start[i]], u[i].in, u[i].n * sizeof(*insns));
+        if (u[i].target >= 0) {
+            insns[start[i]].off = start[u[i].target] - (start[i] + 1);
+        }
+        if (u[i].reloc) {
+            rel[nrel].r_offset = start[i] * sizeof(*insns);
+            rel[nrel++].r_info = ELF64_R_INFO(1, R_BPF_64_64);
+        }
+    }
+
+    memset(sym, 0, sizeof(sym));
+    sym[1].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    sym[1].st_shndx = 3;
+
+    memset(&eh, 0, sizeof(eh));
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_BPF;
+    eh.e_version = EV_CURRENT;
+    eh.e_ehsize = sizeof(eh);
+    eh.e_shentsize = sizeof(*sh);
+    eh.e_shnum = 6;
+    eh.e_shstrndx = 1;
+
+    /* header, strings, program, data, symbols, relocations, sections */
+    memset(sh, 0, sizeof(sh));
+    ofs = sizeof(eh);
+    sh[1].sh_name = 1;
+    sh[1].sh_type = SHT_STRTAB;
+    sh[1].sh_offset = ofs;
+    sh[1].sh_size = sizeof(strs);
+    ofs += sizeof(strs);
+    sh[2].sh_name = 11;
+    sh[2].sh_type = SHT_PROGBITS;
+    sh[2].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    sh[2].sh_offset = ofs;
+    sh[2].sh_size = n * sizeof(*insns);
+    ofs += sh[2].sh_size;
+    sh[3].sh_name = 16;
+    sh[3].sh_type = SHT_PROGBITS;
+    sh[3].sh_flags = SHF_ALLOC | SHF_WRITE;
+    sh[3].sh_offset = ofs;
+    sh[3].sh_size = DATA_LEN;
+    ofs += DATA_LEN;
+    sh[4].sh_name = 22;
+    sh[4].sh_type = SHT_SYMTAB;
+    sh[4].sh_offset = ofs;
+    sh[4].sh_size = sizeof(sym);
+    sh[4].sh_link = 1;
+    sh[4].sh_info = 2;
+    sh[4].sh_entsize = sizeof(*sym);
+    ofs += sizeof(sym);
+    sh[5].sh_name = 30;
+    sh[5].sh_type = SHT_REL;
+    sh[5].sh_offset = ofs;
+    sh[5].sh_size = nrel * sizeof(*rel);
+    sh[5].sh_link = 4;
+    sh[5].sh_info = 2;
+    sh[5].sh_entsize = sizeof(*rel);
+    ofs += sh[5].sh_size;
+    eh.e_shoff = ofs;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    ok = fwrite(&eh, sizeof(eh), 1, f) == 1 &&
+         fwrite(strs, sizeof(strs), 1, f) == 1 &&
+         fwrite(insns, sizeof(*insns), n, f) == (size_t)n &&
+         fwrite(data, DATA_LEN, 1, f) == 1 &&
+         fwrite(sym, sizeof(sym), 1, f) == 1 &&
+         fwrite(rel, sizeof(*rel), nrel, f) == (size_t)nrel &&
+         fwrite(sh, sizeof(sh), 1, f) == 1;
+
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    static uint8_t frame[MAX_FRAMES][FRAME_BUF];
+    static struct unit u[MAX_UNITS];
+    uint32_t len[MAX_FRAMES], marks[MAX_FRAMES], jmarks[MAX_FRAMES];
+    uint64_t nf[MAX_FRAMES], jf[MAX_FRAMES];  /* faults so far */
+    uint64_t n_progs = 10000, wrong = 0, runs = 0, faults = 0, p;
+    unsigned int n_frames = 20, i;
+    double t_interp = 0, t_jit = 0, t;
+    char path[] = "/tmp/mark_bpf_benchXXXXXX", err[256];
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "n:f:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_progs = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            n_frames = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n progs] [-f frames] [-s seed]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (n_frames == 0 || n_frames > MAX_FRAMES || seed == 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 2;
+    }
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 2;
+    }
+    close(fd);
+
+    for (p = 0; p < n_progs; p++) {
+        struct mark_bpf *interp, *jit;
+        uint8_t data[DATA_LEN];
+        int nu = FIRST_BODY + FOLD_UNITS + 16 +
+                 xrand() % (MAX_UNITS - FIRST_BODY - FOLD_UNITS - 16);
+
+        for (i = 0; i < DATA_LEN; i++) {
+            data[i] = xrand();
+        }
+        prog_build(u, nu);
+        if (prog_write(path, u, nu, data)) {
+            fprintf(stderr, "cannot write %s\n", path);
+            unlink(path);
+            return 2;
+        }
+        interp = mark_bpf_load(path, 0, err, sizeof(err));
+        jit = interp ? mark_bpf_load(path, 1, err, sizeof(err)) : NULL;
+        if (jit == NULL) {
+            fprintf(stderr, "program %" PRIu64 ": %s (kept in %s)\n", p,
+                    err, path);
+            return 2;
+        }
+        if (!mark_bpf_jitted(jit)) {
+            printf("no JIT on this machine\n");
+            mark_bpf_free(interp);
+            mark_bpf_free(jit);
+            unlink(path);
+            return 0;
+        }
+        for (i = 0; i < n_frames; i++) {
+            unsigned int k;
+
+            for (k = 0; k < FRAME_BUF; k++) {
+                frame[i][k] = xrand();
+            }
+            len[i] = 40 + xrand() % 60;
+        }
+
+        t = now_ns();
+        for (i = 0; i < n_frames; i++) {
+            marks[i] = mark_bpf_run(interp, frame[i], len[i]);
+            nf[i] = mark_bpf_faults(interp);
+        }
+        t_interp += now_ns() - t;
+        t = now_ns();
+        for (i = 0; i < n_frames; i++) {
+            jmarks[i] = mark_bpf_run(jit, frame[i], len[i]);
+            jf[i] = mark_bpf_faults(jit);
+        }
+        t_jit += now_ns() - t;
+
+        for (i = 0; i < n_frames; i++) {
+            if (jmarks[i] != marks[i] || jf[i] != nf[i]) {
+                if (wrong++ == 0) {
+                    fprintf(stderr, "program %" PRIu64 " frame %u: "
+                            "interpreter %08x jit %08x, faults %" PRIu64
+                            " and %" PRIu64 " (kept in %s)\n", p, i,
+                            marks[i], jmarks[i], nf[i], jf[i], path);
+                }
+                break;
+            }
+        }
+        runs += n_frames;
+        faults += mark_bpf_faults(interp);
+        mark_bpf_free(interp);
+        mark_bpf_free(jit);
+        if (i < n_frames && wrong == 1) {
+            /* keep that object, write the next ones elsewhere */
+            strcpy(path, "/tmp/mark_bpf_benchXXXXXX");
+            fd = mkstemp(path);
+            if (fd < 0) {
+                perror("mkstemp");
+                return 2;
+            }
+            close(fd);
+        }
+    }
+    unlink(path);
+
+    printf("%" PRIu64 " programs, %" PRIu64 " runs, %" PRIu64 " faults, "
+           "%" PRIu64 " programs differ\n", n_progs, runs, faults, wrong);
+    if (runs) {
+        printf("interpreter %.1f ns/run, jit %.1f ns/run\n",
+               t_interp / runs, t_jit / runs);
+    }
+
+    return wrong ? 1 : 0;
+}
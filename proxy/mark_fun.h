@@ -72,10 +72,16 @@ find_prefix(const uint8_t *buf, uint16_t buf_len, const char *prefix) {
 
 #define IPADDR(a1,a2,a3,a4) (a1 << 24 | a2 << 16 | a3 << 8 | a4)
 
+/*
+ * '*sticky' is set if the mark was decided by the payload, and so can
+ * be kept for the rest of the connection (see conntrack.h).
+ */
 static inline uint32_t
-mark_packet_fun(uint8_t *data, uint32_t pkt_sz) {
+mark_packet_cls(uint8_t *data, uint32_t pkt_sz, int *sticky) {
     uint16_t data_offset = 0;
 
+    *sticky = 0;
+
     /* extract data from packet for marking */
     /* L2 rules */
     struct ethhdr *mac = (struct ethhdr *)data;
@@ -193,14 +199,23 @@ mark_packet_fun(uint8_t *data, uint32_t pkt_sz) {
         return STREAM_BY_CLASS(ipclass, 3);
 
     /* Low priority targets */
-    /* HTTP init on other ports (we cannot track connections yet for payload marking) */
+    /* HTTP init on other ports (sticky) */
     char http_prefix[] = "GET / HTTP/1.1";
     if(iph->protocol == IPPROTO_TCP &&
-                find_prefix(l7_payload, payload_size, http_prefix))
+                find_prefix(l7_payload, payload_size, http_prefix)) {
+        *sticky = 1;
         return STREAM_B1;
+    }
 
     /* junk */
     return DEFAULT_CLASS;
 }
 
+static inline uint32_t
+mark_packet_fun(uint8_t *data, uint32_t pkt_sz) {
+    int sticky;
+
+    return mark_packet_cls(data, pkt_sz, &sticky);
+}
+
 #endif
\ No newline at end of file
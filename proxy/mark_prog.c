@@ -0,0 +1,19 @@
+/*
+ * eBPF mark program for the proxy (-M proxy/mark_prog.o), see
+ * mark_bpf.h. It marks like the built in classifier, and is meant
+ * as a starting point for custom programs.
+ */
+#include "bpfhv.h"
+#include "net_headers.h" /* dependency for mark_fun.h */
+#include "mark_fun.h"
+
+#ifndef __section
+# define __section(NAME)                  \
+   __attribute__((section(NAME), used))
+#endif
+
+__section("mark")
+uint32_t mark(uint8_t *data, uint32_t pkt_sz)
+{
+    return mark_packet_fun(data, pkt_sz);
+}
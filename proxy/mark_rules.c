@@ -0,0 +1,1704 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define MARK_SSSE3
+#endif
+
+#include "mark_rules.h"
+#include "mark_table.h"
+
+#define MARK_KEY_WORDS      5
+#define MARK_MAX_READERS    16
+#define MARK_EXPAND         16  /* port ranges up to this size are hashed */
+#define MARK_MAX_LENS       32  /* length boundaries for the flow cache */
+#define MARK_FLOW_SETS      1024
+#define MARK_FLOW_WAYS      4
+#define MARK_BURST          16
+#define MARK_ETH_HLEN       14
+#define MARK_ETH_P_IP       0x0800
+#define MARK_ETH_P_ARP      0x0806
+#define MARK_MAX_PATTERNS   256
+#define MARK_PM_WORDS       (MARK_MAX_PATTERNS / 64)
+#define MARK_MAX_PAT_LEN    64
+#define MARK_CACHE_PATS     16  /* patterns of a bucket for the flow cache */
+#define MARK_DEPTH          128 /* payload bytes searched by default */
+#define MARK_MAX_DEPTH      65535
+#define MARK_PF_BUCKETS     8
+
+/* packet fields used by the rules, host byte order */
+struct mark_key {
+    union {
+        struct {
+            uint32_t src;
+            uint32_t dst;
+            uint16_t sport;
+            uint16_t dport;
+            uint16_t ethertype;
+            uint8_t proto;
+            uint8_t tos;
+            uint8_t tcpflags;
+            uint8_t lenclass;   /* only in flow cache keys */
+            uint16_t pmatch;    /* only in flow cache keys */
+        };
+        uint32_t w[MARK_KEY_WORDS];
+    };
+};
+
+struct mark_rule {
+    struct mark_key val;        /* already masked */
+    struct mark_key mask;
+    /* checked on hash hits */
+    uint16_t sport_lo, sport_hi;
+    uint16_t dport_lo, dport_hi;
+    uint32_t len_lo, len_hi;
+    uint32_t pattern;           /* payload pattern + 1, 0 if none */
+    uint32_t prio;
+    uint32_t line;
+    uint32_t order;             /* rank, lower wins */
+    uint32_t mark;
+};
+
+struct mark_link {
+    const struct mark_rule *rule;
+    struct mark_link *next;     /* same masked key, by order */
+};
+
+struct mark_entry {
+    struct mark_key key;
+    struct mark_link *head;     /* NULL if the slot is free */
+};
+
+/* the rules with the same masks */
+struct mark_tuple {
+    struct mark_key mask;
+    uint32_t words;             /* bitmap of the words in the mask */
+    uint32_t best;              /* order of the first rule */
+    uint32_t nslots;            /* power of 2 */
+    struct mark_entry *slot;
+};
+
+/* the rules that can match an IPv4 protocol, or other frames */
+struct mark_bucket {
+    uint32_t n_tuples;
+    struct mark_tuple *tuples;
+    struct mark_link *links;
+    /* the fields the marks depend on, for the flow cache, and the
+     * bounds of the length ranges, n_lens > MARK_MAX_LENS if too many */
+    struct mark_key flow;
+    uint32_t n_lens;
+    uint32_t lens[MARK_MAX_LENS];
+    /* the payload patterns of the rules, the packets of the bucket
+     * are only searched if there are any; n_pats > MARK_CACHE_PATS
+     * if too many for the flow cache */
+    uint32_t n_pats;
+    uint16_t pats[MARK_CACHE_PATS];
+};
+
+struct mark_pattern {
+    uint8_t s[MARK_MAX_PAT_LEN];
+    uint32_t len;
+    int anchored;               /* at the start of the payload */
+};
+
+/*
+ * Aho-Corasick automaton of the payload patterns, as a DFA over byte
+ * classes (the bytes in no pattern share a class), so a byte costs one
+ * table lookup whatever the number of patterns. For the anchored
+ * patterns it is just the trie, and state 0 after a step means that
+ * nothing can match any more.
+ */
+struct mark_ac {
+    uint32_t n_states;
+    uint32_t n_classes;
+    uint16_t cls[256];
+    uint16_t *next;             /* n_states * n_classes */
+    uint8_t *final;             /* patterns end in this state */
+    uint64_t (*out)[MARK_PM_WORDS];
+};
+
+struct mark_rules {
+    uint64_t gen;               /* set by mark_rules_install() */
+    uint32_t dflt;
+    uint32_t err;
+    uint32_t n_rules;
+    struct mark_rule *rules;
+    /* 0 for frames other than IPv4, 1 for the protocols that no
+     * rule names, then one per protocol */
+    uint32_t n_buckets;
+    struct mark_bucket *bucket;
+    uint8_t ip_bucket[256];
+    /* payload patterns */
+    uint32_t n_pats;
+    struct mark_pattern *pats;
+    uint32_t depth;
+    struct mark_ac ac;          /* anywhere */
+    struct mark_ac ac_start;    /* anchored */
+    /* prefilter: nibble tables of the first two bytes of the patterns
+     * in ac, one bit per bucket of patterns (Teddy) */
+    uint8_t pf[4][16] __attribute__((aligned(16)));
+};
+
+/* hash and compare only the words in the mask, the others are 0 */
+static inline uint32_t
+mark_hash(const struct mark_key *k, uint32_t words)
+{
+    uint32_t h = 0;
+    int i;
+
+    for (i = 0; i < MARK_KEY_WORDS; i++) {
+        if (words & (1U << i)) {
+            h = (h ^ k->w[i]) * 0x9e3779b1;
+        }
+    }
+    return h ^ (h >> 16);
+}
+
+static inline void
+mark_key_and(struct mark_key *d, const struct mark_key *k,
+             const struct mark_key *m)
+{
+    int i;
+
+    for (i = 0; i < MARK_KEY_WORDS; i++) {
+        d->w[i] = k->w[i] & m->w[i];
+    }
+}
+
+static inline int
+mark_key_eq(const struct mark_key *a, const struct mark_key *b,
+            uint32_t words)
+{
+    int i;
+
+    for (i = 0; i < MARK_KEY_WORDS; i++) {
+        if ((words & (1U << i)) && a->w[i] != b->w[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Extract the fields of an Ethernet frame. Returns the payload
+ * length, or -1 if the frame is truncated.
+ */
+static int
+mark_parse(const uint8_t *data, uint32_t pkt_sz, struct mark_key *k)
+{
+    uint32_t off = MARK_ETH_HLEN, ihl;
+
+    memset(k, 0, sizeof(*k));
+    if (pkt_sz < MARK_ETH_HLEN) {
+        return -1;
+    }
+    k->ethertype = (data[12] << 8) | data[13];
+    if (k->ethertype != MARK_ETH_P_IP) {
+        return pkt_sz - off;
+    }
+    if (pkt_sz < off + 20) {
+        return -1;
+    }
+    if ((data[off] >> 4) != 4) {
+        k->ethertype = 0;   /* not IPv4 after all */
+        return pkt_sz - off;
+    }
+    ihl = (data[off] & 0xf) << 2;
+    if (ihl < 20 || pkt_sz < off + ihl) {
+        return -1;
+    }
+    k->tos = data[off + 1];
+    k->proto = data[off + 9];
+    memcpy(&k->src, data + off + 12, 4);
+    memcpy(&k->dst, data + off + 16, 4);
+    k->src = ntohl(k->src);
+    k->dst = ntohl(k->dst);
+    off += ihl;
+
+    switch (k->proto) {
+    case IPPROTO_UDP:
+        if (pkt_sz < off + 8) {
+            return -1;
+        }
+        k->sport = (data[off] << 8) | data[off + 1];
+        k->dport = (data[off + 2] << 8) | data[off + 3];
+        off += 8;
+        break;
+    case IPPROTO_TCP: {
+        uint32_t doff;
+
+        if (pkt_sz < off + 20) {
+            return -1;
+        }
+        k->sport = (data[off] << 8) | data[off + 1];
+        k->dport = (data[off + 2] << 8) | data[off + 3];
+        k->tcpflags = data[off + 13];
+        doff = (data[off + 12] >> 4) << 2;
+        if (doff < 20 || pkt_sz < off + doff) {
+            return -1;
+        }
+        off += doff;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return pkt_sz - off;
+}
+
+#ifdef MARK_SSSE3
+/*
+ * mark_parse() for the common case, IPv4 without options in a frame
+ * of at least 42 bytes: two 16 byte loads, each shuffled to put the
+ * fields in place and in host order. Returns -2 for other frames.
+ */
+__attribute__((target("ssse3"))) static int
+mark_parse_ssse3(const uint8_t *data, uint32_t pkt_sz, struct mark_key *k)
+{
+    /* from bytes 12-27: ethertype, protocol, TOS */
+    const __m128i sa = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                     -1, -1, -1, -1, 1, 0, 11, 3);
+    /* from bytes 26-41: addresses and ports */
+    const __m128i sb = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                     9, 8, 11, 10, -1, -1, -1, -1);
+    const __m128i noports = _mm_setr_epi32(-1, -1, 0, -1);
+    uint32_t off = MARK_ETH_HLEN + 20, l4 = 0;
+    __m128i v;
+
+    if (pkt_sz < off + 8 || data[12] != (MARK_ETH_P_IP >> 8) ||
+            data[13] != (MARK_ETH_P_IP & 0xff) || data[MARK_ETH_HLEN] != 0x45) {
+        return -2;
+    }
+    v = _mm_or_si128(
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 12)), sa),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 26)), sb));
+    k->w[4] = 0;
+    switch (data[23]) {
+    case IPPROTO_UDP:
+        l4 = 8;
+        break;
+    case IPPROTO_TCP:
+        if (pkt_sz < off + 20) {
+            return -1;
+        }
+        l4 = (data[off + 12] >> 4) << 2;
+        if (l4 < 20 || pkt_sz < off + l4) {
+            return -1;
+        }
+        k->tcpflags = data[off + 13];
+        break;
+    default:
+        v = _mm_and_si128(v, noports);
+        break;
+    }
+    _mm_storeu_si128((__m128i *)k->w, v);
+
+    return pkt_sz - off - l4;
+}
+#endif
+
+/* the first position where a pattern of 'ac' can start, or 'n' */
+static uint32_t
+mark_prefilter(const struct mark_rules *r, const uint8_t *p, uint32_t n,
+               uint32_t i)
+{
+    for (; i < n; i++) {
+        uint8_t b0 = p[i], b1 = i + 1 < n ? p[i + 1] : 0;
+
+        if (r->pf[0][b0 & 0xf] & r->pf[1][b0 >> 4] &
+                r->pf[2][b1 & 0xf] & r->pf[3][b1 >> 4]) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef MARK_SSSE3
+/* the same, 16 positions at a time */
+__attribute__((target("ssse3"))) static uint32_t
+mark_prefilter_ssse3(const struct mark_rules *r, const uint8_t *p, uint32_t n)
+{
+    const __m128i lo0 = _mm_load_si128((const __m128i *)r->pf[0]);
+    const __m128i hi0 = _mm_load_si128((const __m128i *)r->pf[1]);
+    const __m128i lo1 = _mm_load_si128((const __m128i *)r->pf[2]);
+    const __m128i hi1 = _mm_load_si128((const __m128i *)r->pf[3]);
+    const __m128i nib = _mm_set1_epi8(0xf);
+    uint32_t i;
+
+    for (i = 0; i + 17 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 1));
+        __m128i c;
+        uint32_t m;
+
+        c = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_shuffle_epi8(lo0, _mm_and_si128(a, nib)),
+                    _mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(a, 4), nib))),
+                _mm_and_si128(
+                    _mm_shuffle_epi8(lo1, _mm_and_si128(b, nib)),
+                    _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(b, 4), nib))));
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_setzero_si128())) ^ 0xffff;
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return mark_prefilter(r, p, n, i);
+}
+#endif
+
+static inline void
+mark_ac_out(const struct mark_ac *ac, uint32_t s, uint64_t *pm)
+{
+    int i;
+
+    for (i = 0; i < MARK_PM_WORDS; i++) {
+        pm[i] |= ac->out[s][i];
+    }
+}
+
+/*
+ * Set in 'pm' the bits of the patterns found in the first bytes of
+ * the payload. The prefilter skips to the first position where a
+ * pattern may start, the automaton takes it from there.
+ */
+static void
+mark_payload(const struct mark_rules *r, const uint8_t *p, uint32_t n,
+             uint64_t *pm, int ssse3)
+{
+    const struct mark_ac *ac;
+    uint32_t i, s;
+
+    memset(pm, 0, MARK_PM_WORDS * sizeof(*pm));
+    if (n > r->depth) {
+        n = r->depth;
+    }
+    ac = &r->ac_start;
+    if (ac->n_states > 1) {
+        for (i = 0, s = 0; i < n; i++) {
+            s = ac->next[s * ac->n_classes + ac->cls[p[i]]];
+            if (s == 0) {
+                break;
+            }
+            if (ac->final[s]) {
+                mark_ac_out(ac, s, pm);
+            }
+        }
+    }
+    ac = &r->ac;
+    if (ac->n_states <= 1) {
+        return;
+    }
+#ifdef MARK_SSSE3
+    if (ssse3) {
+        i = mark_prefilter_ssse3(r, p, n);
+    } else
+#endif
+    {
+        (void)ssse3;
+        i = mark_prefilter(r, p, n, 0);
+    }
+    for (s = 0; i < n; i++) {
+        s = ac->next[s * ac->n_classes + ac->cls[p[i]]];
+        if (ac->final[s]) {
+            mark_ac_out(ac, s, pm);
+        }
+    }
+}
+
+static inline int
+mark_rule_check(const struct mark_rule *r, const struct mark_key *k,
+                uint32_t len, const uint64_t *pm)
+{
+    uint32_t pat = r->pattern - 1;
+
+    return k->sport >= r->sport_lo && k->sport <= r->sport_hi &&
+           k->dport >= r->dport_lo && k->dport <= r->dport_hi &&
+           len >= r->len_lo && len <= r->len_hi &&
+           (r->pattern == 0 || ((pm[pat >> 6] >> (pat & 63)) & 1));
+}
+
+static inline const struct mark_bucket *
+mark_bucket_of(const struct mark_rules *r, const struct mark_key *k)
+{
+    return &r->bucket[k->ethertype == MARK_ETH_P_IP ? r->ip_bucket[k->proto] :
+                      0];
+}
+
+/* '*sticky' is set if the rule that matched has a payload pattern */
+static uint32_t
+mark_search(const struct mark_rules *r, const struct mark_bucket *b,
+            const struct mark_key *k, uint32_t len, const uint64_t *pm,
+            uint8_t *sticky)
+{
+    const struct mark_rule *best = NULL;
+    struct mark_key mk;
+    uint32_t i;
+
+    for (i = 0; i < b->n_tuples; i++) {
+        const struct mark_tuple *t = &b->tuples[i];
+        uint32_t h;
+
+        if (best != NULL && t->best >= best->order) {
+            break;  /* tuples are sorted, none can do better */
+        }
+        mark_key_and(&mk, k, &t->mask);
+        for (h = mark_hash(&mk, t->words);; h++) {
+            const struct mark_entry *e = &t->slot[h & (t->nslots - 1)];
+            const struct mark_link *x;
+
+            if (e->head == NULL) {
+                break;
+            }
+            if (!mark_key_eq(&e->key, &mk, t->words)) {
+                continue;
+            }
+            for (x = e->head; x != NULL; x = x->next) {
+                if (best != NULL && x->rule->order >= best->order) {
+                    break;
+                }
+                if (mark_rule_check(x->rule, k, len, pm)) {
+                    best = x->rule;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    *sticky = best != NULL && best->pattern != 0;
+    return best ? best->mark : r->dflt;
+}
+
+uint32_t
+mark_rules_classify(const struct mark_rules *r, const uint8_t *data,
+                    uint32_t pkt_sz)
+{
+    const struct mark_bucket *b;
+    uint64_t pm[MARK_PM_WORDS];
+    struct mark_key k;
+    uint8_t sticky;
+    int len;
+
+    len = mark_parse(data, pkt_sz, &k);
+    if (len < 0) {
+        return r->err;
+    }
+    b = mark_bucket_of(r, &k);
+    if (b->n_pats) {
+        mark_payload(r, data + pkt_sz - len, len, pm, 0);
+    }
+    return mark_search(r, b, &k, len, pm, &sticky);
+}
+
+uint32_t
+mark_rules_count(const struct mark_rules *r)
+{
+    return r->n_rules;
+}
+
+void
+mark_rules_free(struct mark_rules *r)
+{
+    uint32_t i, j;
+
+    if (r == NULL) {
+        return;
+    }
+    for (i = 0; i < r->n_buckets; i++) {
+        struct mark_bucket *b = &r->bucket[i];
+
+        for (j = 0; j < b->n_tuples; j++) {
+            free(b->tuples[j].slot);
+        }
+        free(b->tuples);
+        free(b->links);
+    }
+    free(r->bucket);
+    free(r->rules);
+    free(r->pats);
+    free(r->ac.next);
+    free(r->ac.final);
+    free(r->ac.out);
+    free(r->ac_start.next);
+    free(r->ac_start.final);
+    free(r->ac_start.out);
+    free(r);
+}
+
+/* parse a number at most 'max', followed by 'sep' or the end */
+static int
+mark_parse_num(const char *s, char sep, uint32_t max, uint32_t *v,
+               const char **end)
+{
+    unsigned long x;
+    char *e;
+
+    x = strtoul(s, &e, 0);
+    if (e == s || *s == '-' || x > max || (*e != '\0' && *e != sep)) {
+        return -1;
+    }
+    *v = x;
+    *end = e;
+    return 0;
+}
+
+/* parse N or N-M into [lo, hi] */
+static int
+mark_parse_range(const char *s, uint32_t max, uint32_t *lo, uint32_t *hi)
+{
+    const char *e;
+
+    if (mark_parse_num(s, '-', max, lo, &e)) {
+        return -1;
+    }
+    *hi = *lo;
+    if (*e == '-' && (mark_parse_num(e + 1, '\0', max, hi, &e) || *lo > *hi)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* parse V or V/M, the mask defaults to all ones */
+static int
+mark_parse_masked(const char *s, uint32_t max, uint32_t *v, uint32_t *m)
+{
+    const char *e;
+
+    if (mark_parse_num(s, '/', max, v, &e)) {
+        return -1;
+    }
+    *m = max;
+    if (*e == '/' && mark_parse_num(e + 1, '\0', max, m, &e)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+mark_parse_prefix(const char *s, uint32_t *addr, uint32_t *mask)
+{
+    char buf[32], *slash;
+    struct in_addr a;
+    uint32_t len = 32;
+
+    if (strlen(s) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, s);
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        char *e;
+
+        *slash++ = '\0';
+        len = strtoul(slash, &e, 10);
+        if (e == slash || *e != '\0' || len > 32) {
+            return -1;
+        }
+    }
+    if (inet_pton(AF_INET, buf, &a) != 1) {
+        return -1;
+    }
+    *mask = len ? ~0U << (32 - len) : 0;
+    *addr = ntohl(a.s_addr) & *mask;
+    return 0;
+}
+
+static int
+mark_parse_name(const char *s, const char *const *names, const uint32_t *vals,
+                uint32_t max, uint32_t *v)
+{
+    const char *e;
+
+    for (; *names != NULL; names++, vals++) {
+        if (!strcmp(s, *names)) {
+            *v = *vals;
+            return 0;
+        }
+    }
+    return mark_parse_num(s, '\0', max, v, &e);
+}
+
+/*
+ * Parse a payload pattern, ^ first to anchor it, with \s, \t, \\
+ * and \xHH escapes. Returns its number + 1, the same for the same
+ * pattern, or 0 if invalid or too many.
+ */
+static uint32_t
+mark_parse_pattern(const char *s, struct mark_rules *rs)
+{
+    struct mark_pattern pat;
+    uint32_t i;
+
+    memset(&pat, 0, sizeof(pat));
+    if (*s == '^') {
+        pat.anchored = 1;
+        s++;
+    }
+    while (*s != '\0') {
+        uint8_t c = *s++;
+
+        if (pat.len == MARK_MAX_PAT_LEN) {
+            return 0;
+        }
+        if (c == '\\') {
+            c = *s++;
+            if (c == 's') {
+                c = ' ';
+            } else if (c == 't') {
+                c = '\t';
+            } else if (c == 'x' && isxdigit((unsigned char)s[0]) &&
+                       isxdigit((unsigned char)s[1])) {
+                char hex[3] = { s[0], s[1], '\0' };
+
+                c = strtoul(hex, NULL, 16);
+                s += 2;
+            } else if (c != '\\') {
+                return 0;
+            }
+        }
+        pat.s[pat.len++] = c;
+    }
+    if (pat.len == 0) {
+        return 0;
+    }
+    for (i = 0; i < rs->n_pats; i++) {
+        if (!memcmp(&rs->pats[i], &pat, sizeof(pat))) {
+            return i + 1;
+        }
+    }
+    if (rs->n_pats == MARK_MAX_PATTERNS) {
+        return 0;
+    }
+    if (rs->n_pats % 16 == 0) {
+        struct mark_pattern *n;
+
+        n = realloc(rs->pats, (rs->n_pats + 16) * sizeof(*n));
+        if (n == NULL) {
+            return 0;
+        }
+        rs->pats = n;
+    }
+    rs->pats[rs->n_pats++] = pat;
+    return rs->n_pats;
+}
+
+/* parse the fields of a rule line, tokenized by strtok_r */
+static int
+mark_parse_rule(char *tok, char **save, struct mark_rule *r,
+                struct mark_rules *rs, const char **bad)
+{
+    static const char *const proto_names[] = { "icmp", "tcp", "udp", NULL };
+    static const uint32_t proto_vals[] = { IPPROTO_ICMP, IPPROTO_TCP, IPPROTO_UDP };
+    static const char *const ether_names[] = { "ip", "arp", NULL };
+    static const uint32_t ether_vals[] = { MARK_ETH_P_IP, MARK_ETH_P_ARP };
+    int has_mark = 0, ip = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->sport_hi = r->dport_hi = 0xffff;
+    r->len_hi = ~0U;
+    for (; tok != NULL; tok = strtok_r(NULL, " \t\r\n", save)) {
+        char *arg = strtok_r(NULL, " \t\r\n", save);
+        const char *e;
+        uint32_t v = 0, m = 0;
+        int ret = -1;
+
+        *bad = tok;
+        if (arg == NULL) {
+            return -1;
+        }
+        if (!strcmp(tok, "mark")) {
+            ret = mark_parse_num(arg, '\0', ~0U, &r->mark, &e);
+            has_mark = 1;
+        } else if (!strcmp(tok, "prio")) {
+            ret = mark_parse_num(arg, '\0', 0xffff, &r->prio, &e);
+        } else if (!strcmp(tok, "ether")) {
+            ret = mark_parse_name(arg, ether_names, ether_vals, 0xffff, &v);
+            r->val.ethertype = v;
+            r->mask.ethertype = 0xffff;
+        } else if (!strcmp(tok, "proto")) {
+            ret = mark_parse_name(arg, proto_names, proto_vals, 0xff, &v);
+            r->val.proto = v;
+            r->mask.proto = 0xff;
+            ip = 1;
+        } else if (!strcmp(tok, "src")) {
+            ret = mark_parse_prefix(arg, &r->val.src, &r->mask.src);
+            ip = 1;
+        } else if (!strcmp(tok, "dst")) {
+            ret = mark_parse_prefix(arg, &r->val.dst, &r->mask.dst);
+            ip = 1;
+        } else if (!strcmp(tok, "sport") || !strcmp(tok, "dport")) {
+            int src = tok[0] == 's';
+
+            ret = mark_parse_range(arg, 0xffff, &v, &m);
+            if (ret == 0 && (v == m || (m - v < MARK_EXPAND &&
+                    !(src ? r->dport_hi > r->dport_lo && r->mask.dport :
+                            r->sport_hi > r->sport_lo && r->mask.sport)))) {
+                /* exact ports and small ranges go in the hash key,
+                 * one entry per port, only for one of the two */
+                *(src ? &r->val.sport : &r->val.dport) = v;
+                *(src ? &r->mask.sport : &r->mask.dport) = 0xffff;
+            }
+            *(src ? &r->sport_lo : &r->dport_lo) = v;
+            *(src ? &r->sport_hi : &r->dport_hi) = m;
+            ip = 1;
+        } else if (!strcmp(tok, "tos")) {
+            ret = mark_parse_masked(arg, 0xff, &v, &m);
+            r->val.tos = v & m;
+            r->mask.tos = m;
+            ip = 1;
+        } else if (!strcmp(tok, "tcpflags")) {
+            ret = mark_parse_masked(arg, 0xff, &v, &m);
+            r->val.tcpflags = v & m;
+            r->mask.tcpflags = m;
+            ip = 1;
+        } else if (!strcmp(tok, "len")) {
+            ret = mark_parse_range(arg, ~0U, &r->len_lo, &r->len_hi);
+        } else if (!strcmp(tok, "payload") && r->pattern == 0) {
+            r->pattern = mark_parse_pattern(arg, rs);
+            ret = r->pattern ? 0 : -1;
+        }
+        if (ret) {
+            return -1;
+        }
+    }
+    if (!has_mark) {
+        *bad = "missing mark";
+        return -1;
+    }
+    if (ip) {
+        if (r->mask.ethertype && r->val.ethertype != MARK_ETH_P_IP) {
+            *bad = "ether";
+            return -1;
+        }
+        r->val.ethertype = MARK_ETH_P_IP;
+        r->mask.ethertype = 0xffff;
+    }
+    return 0;
+}
+
+static int
+mark_rule_cmp(const void *a, const void *b)
+{
+    const struct mark_rule *x = a, *y = b;
+
+    if (x->prio != y->prio) {
+        return x->prio < y->prio ? -1 : 1;
+    }
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/*
+ * A rule with a small port range in the hash key has one entry per
+ * port, see mark_parse_rule(). Returns the number of entries.
+ */
+static uint32_t
+mark_rule_nkeys(const struct mark_rule *x)
+{
+    if (x->mask.dport && x->dport_hi > x->dport_lo) {
+        return x->dport_hi - x->dport_lo + 1;
+    }
+    if (x->mask.sport && x->sport_hi > x->sport_lo) {
+        return x->sport_hi - x->sport_lo + 1;
+    }
+    return 1;
+}
+
+static void
+mark_rule_key(const struct mark_rule *x, uint32_t i, struct mark_key *key)
+{
+    *key = x->val;
+    if (x->mask.dport && x->dport_hi > x->dport_lo) {
+        key->dport = x->dport_lo + i;
+    } else if (x->mask.sport && x->sport_hi > x->sport_lo) {
+        key->sport = x->sport_lo + i;
+    }
+}
+
+static int
+mark_rule_in(const struct mark_rule *x, int ip, uint32_t proto)
+{
+    if (!ip) {
+        return !x->mask.ethertype || x->val.ethertype != MARK_ETH_P_IP;
+    }
+    return (!x->mask.ethertype || x->val.ethertype == MARK_ETH_P_IP) &&
+           (!x->mask.proto || x->val.proto == proto);
+}
+
+/*
+ * Add the fields of a rule to the flow mask of a bucket. Ports are
+ * hashed only when exact, so a port range needs the whole port.
+ */
+static void
+mark_flow_add(struct mark_bucket *b, const struct mark_rule *x)
+{
+    uint32_t i, j, bound[2], n = 0;
+
+    for (i = 0; i < MARK_KEY_WORDS; i++) {
+        b->flow.w[i] |= x->mask.w[i];
+    }
+    if (x->sport_lo > 0 || x->sport_hi < 0xffff) {
+        b->flow.sport = 0xffff;
+    }
+    if (x->dport_lo > 0 || x->dport_hi < 0xffff) {
+        b->flow.dport = 0xffff;
+    }
+    if (x->len_lo > 0) {
+        bound[n++] = x->len_lo;
+    }
+    if (x->len_hi < ~0U) {
+        bound[n++] = x->len_hi + 1;
+    }
+    for (i = 0; i < n && b->n_lens <= MARK_MAX_LENS; i++) {
+        for (j = 0; j < b->n_lens && b->lens[j] != bound[i]; j++)
+            ;
+        if (j < b->n_lens) {
+            continue;
+        }
+        if (b->n_lens++ == MARK_MAX_LENS) {
+            break;              /* too many, no caching */
+        }
+        /* keep them sorted */
+        for (j = b->n_lens - 1; j > 0 && b->lens[j - 1] > bound[i]; j--) {
+            b->lens[j] = b->lens[j - 1];
+        }
+        b->lens[j] = bound[i];
+    }
+}
+
+/* note the payload pattern of a rule in its bucket */
+static void
+mark_pats_add(struct mark_bucket *b, const struct mark_rule *x)
+{
+    uint32_t i;
+
+    if (x->pattern == 0 || b->n_pats > MARK_CACHE_PATS) {
+        return;
+    }
+    for (i = 0; i < b->n_pats && b->pats[i] != x->pattern - 1; i++)
+        ;
+    if (i < b->n_pats) {
+        return;
+    }
+    if (b->n_pats++ < MARK_CACHE_PATS) {
+        b->pats[i] = x->pattern - 1;
+    }
+}
+
+/*
+ * Build the automaton of the anchored patterns, or of the others:
+ * the trie first, then (not anchored) the failure links in breadth
+ * first order, which fill in the missing transitions and merge the
+ * outputs of the suffixes.
+ */
+static int
+mark_ac_build(struct mark_ac *ac, const struct mark_rules *r, int anchored)
+{
+    uint32_t i, j, max = 1, head = 0, tail = 0, *fail = NULL, *queue = NULL;
+
+    for (i = 0; i < r->n_pats; i++) {
+        const struct mark_pattern *pat = &r->pats[i];
+
+        if (pat->anchored != anchored) {
+            continue;
+        }
+        for (j = 0; j < pat->len; j++) {
+            if (ac->cls[pat->s[j]] == 0) {
+                ac->cls[pat->s[j]] = ++ac->n_classes;
+            }
+        }
+        max += pat->len;
+    }
+    ac->n_classes++;            /* the bytes in no pattern */
+    ac->n_states = 1;
+    ac->next = calloc((size_t)max * ac->n_classes, sizeof(*ac->next));
+    ac->final = calloc(max, sizeof(*ac->final));
+    ac->out = calloc(max, sizeof(*ac->out));
+    if (ac->next == NULL || ac->final == NULL || ac->out == NULL) {
+        return -1;
+    }
+    for (i = 0; i < r->n_pats; i++) {
+        const struct mark_pattern *pat = &r->pats[i];
+        uint32_t s = 0;
+
+        if (pat->anchored != anchored) {
+            continue;
+        }
+        for (j = 0; j < pat->len; j++) {
+            uint16_t *t = &ac->next[s * ac->n_classes + ac->cls[pat->s[j]]];
+
+            if (*t == 0) {
+                *t = ac->n_states++;
+            }
+            s = *t;
+        }
+        ac->final[s] = 1;
+        ac->out[s][i >> 6] |= 1ULL << (i & 63);
+    }
+    if (anchored) {
+        return 0;
+    }
+
+    fail = calloc(ac->n_states, sizeof(*fail));
+    queue = calloc(ac->n_states, sizeof(*queue));
+    if (fail == NULL || queue == NULL) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+    queue[tail++] = 0;
+    while (head < tail) {
+        uint32_t s = queue[head++];
+
+        for (j = 0; j < ac->n_classes; j++) {
+            uint16_t *t = &ac->next[s * ac->n_classes + j];
+            uint32_t f = s ? ac->next[fail[s] * ac->n_classes + j] : 0;
+
+            if (*t == 0) {
+                *t = f;         /* fill in the missing transition */
+                continue;
+            }
+            fail[*t] = f;
+            if (ac->final[f]) {
+                ac->final[*t] = 1;
+                for (i = 0; i < MARK_PM_WORDS; i++) {
+                    ac->out[*t][i] |= ac->out[f][i];
+                }
+            }
+            queue[tail++] = *t;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    return 0;
+}
+
+/* the nibble tables of the first two bytes of the unanchored patterns */
+static void
+mark_pf_build(struct mark_rules *r)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < r->n_pats; i++) {
+        const struct mark_pattern *pat = &r->pats[i];
+        uint8_t bit = 1 << (i % MARK_PF_BUCKETS);
+
+        if (pat->anchored) {
+            continue;
+        }
+        r->pf[0][pat->s[0] & 0xf] |= bit;
+        r->pf[1][pat->s[0] >> 4] |= bit;
+        if (pat->len > 1) {
+            r->pf[2][pat->s[1] & 0xf] |= bit;
+            r->pf[3][pat->s[1] >> 4] |= bit;
+        } else {
+            for (j = 0; j < 16; j++) {
+                r->pf[2][j] |= bit;
+                r->pf[3][j] |= bit;
+            }
+        }
+    }
+}
+
+/*
+ * Build the tuple space of a bucket from the rules that can match
+ * it, visited by order. 'proto' is 256 for the protocols that no
+ * rule names.
+ */
+static int
+mark_compile(struct mark_bucket *b, const struct mark_rules *r, int ip,
+             uint32_t proto)
+{
+    uint32_t i, j, k, n_links = 0, *count;
+
+    b->tuples = calloc(r->n_rules + 1, sizeof(*b->tuples));
+    count = calloc(r->n_rules + 1, sizeof(*count));
+    if (b->tuples == NULL || count == NULL) {
+        free(count);
+        return -1;
+    }
+    /* the flow cache keeps buckets apart by ethertype and protocol */
+    b->flow.ethertype = 0xffff;
+    b->flow.proto = 0xff;
+    /* distinct masks, in order of their first rule */
+    for (i = 0; i < r->n_rules; i++) {
+        const struct mark_rule *x = &r->rules[i];
+        uint32_t n = mark_rule_nkeys(x);
+
+        if (!mark_rule_in(x, ip, proto)) {
+            continue;
+        }
+        mark_flow_add(b, x);
+        mark_pats_add(b, x);
+        for (j = 0; j < b->n_tuples; j++) {
+            if (mark_key_eq(&b->tuples[j].mask, &x->mask, ~0U)) {
+                break;
+            }
+        }
+        if (j == b->n_tuples) {
+            b->tuples[j].mask = x->mask;
+            b->tuples[j].best = x->order;
+            for (k = 0; k < MARK_KEY_WORDS; k++) {
+                if (x->mask.w[k]) {
+                    b->tuples[j].words |= 1U << k;
+                }
+            }
+            b->n_tuples++;
+        }
+        count[j] += n;
+        n_links += n;
+    }
+    b->links = calloc(n_links + 1, sizeof(*b->links));
+    if (b->links == NULL) {
+        free(count);
+        return -1;
+    }
+    for (j = 0; j < b->n_tuples; j++) {
+        struct mark_tuple *t = &b->tuples[j];
+
+        for (t->nslots = 4; t->nslots < 2 * count[j]; t->nslots <<= 1)
+            ;
+        t->slot = calloc(t->nslots, sizeof(*t->slot));
+        if (t->slot == NULL) {
+            free(count);
+            return -1;
+        }
+    }
+    free(count);
+    n_links = 0;
+    for (i = 0; i < r->n_rules; i++) {
+        const struct mark_rule *x = &r->rules[i];
+        uint32_t n = mark_rule_nkeys(x);
+        struct mark_tuple *t;
+
+        if (!mark_rule_in(x, ip, proto)) {
+            continue;
+        }
+        for (j = 0; !mark_key_eq(&b->tuples[j].mask, &x->mask, ~0U); j++)
+            ;
+        t = &b->tuples[j];
+        for (k = 0; k < n; k++) {
+            struct mark_link *l = &b->links[n_links++];
+            struct mark_key key;
+            uint32_t h;
+
+            mark_rule_key(x, k, &key);
+            l->rule = x;
+            for (h = mark_hash(&key, t->words);; h++) {
+                struct mark_entry *e = &t->slot[h & (t->nslots - 1)];
+
+                if (e->head == NULL) {
+                    e->key = key;
+                    e->head = l;
+                    break;
+                }
+                if (mark_key_eq(&e->key, &key, t->words)) {
+                    struct mark_link **p = &e->head;
+
+                    while (*p != NULL) {
+                        p = &(*p)->next;
+                    }
+                    *p = l;
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* one bucket for non IPv4 frames, one for each protocol in the rules */
+static int
+mark_compile_all(struct mark_rules *r)
+{
+    uint32_t i, protos[256], n = 0;
+
+    for (i = 0; i < r->n_rules; i++) {
+        const struct mark_rule *x = &r->rules[i];
+
+        r->rules[i].order = i;
+        if (x->mask.proto && r->ip_bucket[x->val.proto] == 0) {
+            r->ip_bucket[x->val.proto] = 2 + n;
+            protos[n++] = x->val.proto;
+        }
+    }
+    for (i = 0; i < 256; i++) {
+        if (r->ip_bucket[i] == 0) {
+            r->ip_bucket[i] = 1;
+        }
+    }
+    r->n_buckets = 2 + n;
+    r->bucket = calloc(r->n_buckets, sizeof(*r->bucket));
+    if (r->bucket == NULL || mark_ac_build(&r->ac, r, 0) ||
+            mark_ac_build(&r->ac_start, r, 1)) {
+        return -1;
+    }
+    mark_pf_build(r);
+    for (i = 0; i < r->n_buckets; i++) {
+        if (mark_compile(&r->bucket[i], r, i > 0,
+                         i > 1 ? protos[i - 2] : 256)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct mark_rules *
+mark_rules_load(const char *path, char *err, size_t errlen)
+{
+    struct mark_rules *r;
+    uint32_t max = 0, line = 0;
+    int has_err = 0;
+    char buf[1024];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(err, errlen, "cannot open %s", path);
+        return NULL;
+    }
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        snprintf(err, errlen, "out of memory");
+        fclose(f);
+        return NULL;
+    }
+    r->depth = MARK_DEPTH;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        char *save, *tok, *hash = strchr(buf, '#');
+        const char *bad = NULL;
+
+        line++;
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        tok = strtok_r(buf, " \t\r\n", &save);
+        if (tok == NULL) {
+            continue;
+        }
+        if (!strcmp(tok, "depth")) {
+            char *arg = strtok_r(NULL, " \t\r\n", &save);
+            const char *e;
+
+            if (arg == NULL ||
+                    mark_parse_num(arg, '\0', MARK_MAX_DEPTH, &r->depth, &e)) {
+                snprintf(err, errlen, "%s:%u: invalid depth", path, line);
+                goto fail;
+            }
+            continue;
+        }
+        if (!strcmp(tok, "default") || !strcmp(tok, "error")) {
+            char *arg = strtok_r(NULL, " \t\r\n", &save);
+            const char *e;
+            uint32_t v;
+
+            if (arg == NULL || mark_parse_num(arg, '\0', ~0U, &v, &e)) {
+                snprintf(err, errlen, "%s:%u: invalid %s", path, line, tok);
+                goto fail;
+            }
+            if (tok[0] == 'd') {
+                r->dflt = v;
+            } else {
+                r->err = v;
+                has_err = 1;
+            }
+            continue;
+        }
+        if (r->n_rules == max) {
+            struct mark_rule *n;
+
+            max = max ? 2 * max : 64;
+            n = realloc(r->rules, max * sizeof(*n));
+            if (n == NULL) {
+                snprintf(err, errlen, "out of memory");
+                goto fail;
+            }
+            r->rules = n;
+        }
+        if (mark_parse_rule(tok, &save, &r->rules[r->n_rules], r, &bad)) {
+            snprintf(err, errlen, "%s:%u: invalid rule at '%s'", path, line, bad);
+            goto fail;
+        }
+        r->rules[r->n_rules++].line = line;
+    }
+    fclose(f);
+    f = NULL;
+    if (!has_err) {
+        r->err = r->dflt;
+    }
+    qsort(r->rules, r->n_rules, sizeof(*r->rules), mark_rule_cmp);
+    if (mark_compile_all(r)) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    return r;
+
+fail:
+    if (f != NULL) {
+        fclose(f);
+    }
+    mark_rules_free(r);
+    return NULL;
+}
+
+/*
+ * Flow cache of a packet thread, in front of the tuple space search:
+ * the fields of a packet under the flow mask of its bucket, plus the
+ * length range it falls in, always give the same mark. Each set is a
+ * cache line with the signatures and the marks of its ways, the keys
+ * are only read on a signature match. Entries computed with other
+ * rules are dropped a set at a time, when the set is next used.
+ */
+struct mark_flow_set {
+    uint32_t sig[MARK_FLOW_WAYS];       /* 0 if free */
+    uint32_t mark[MARK_FLOW_WAYS];
+    uint8_t sticky[MARK_FLOW_WAYS];
+    uint64_t gen;                       /* rules of the entries */
+    uint32_t victim;
+} __attribute__((aligned(64)));
+
+struct mark_flow_cache {
+    struct mark_flow_set set[MARK_FLOW_SETS];
+    struct mark_key key[MARK_FLOW_SETS][MARK_FLOW_WAYS];
+};
+
+/* bitmap of the ways of a set with signature 'sig' */
+static inline uint32_t
+mark_flow_match(const struct mark_flow_set *s, uint32_t sig)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)s->sig),
+                                _mm_set1_epi32(sig));
+
+    return _mm_movemask_ps(_mm_castsi128_ps(v));
+#else
+    uint32_t i, m = 0;
+
+    for (i = 0; i < MARK_FLOW_WAYS; i++) {
+        m |= (s->sig[i] == sig) << i;
+    }
+    return m;
+#endif
+}
+
+static uint32_t
+mark_flow_lookup(struct mark_flow_cache *c, const struct mark_rules *r,
+                 const struct mark_bucket *b, const struct mark_key *k,
+                 uint32_t len, const uint64_t *pm, uint8_t *sticky,
+                 uint64_t *hits, uint64_t *misses)
+{
+    struct mark_flow_set *s;
+    struct mark_key fk;
+    uint32_t h, sig, m, i;
+
+    if (b->n_lens > MARK_MAX_LENS || b->n_pats > MARK_CACHE_PATS) {
+        return mark_search(r, b, k, len, pm, sticky);
+    }
+    mark_key_and(&fk, k, &b->flow);
+    for (i = 0; i < b->n_lens && len >= b->lens[i]; i++)
+        ;
+    fk.lenclass = i;
+    for (i = 0; i < b->n_pats; i++) {
+        fk.pmatch |= ((pm[b->pats[i] >> 6] >> (b->pats[i] & 63)) & 1) << i;
+    }
+    h = mark_hash(&fk, (1U << MARK_KEY_WORDS) - 1);
+    sig = h | 1;
+    s = &c->set[(h >> 7) & (MARK_FLOW_SETS - 1)];
+    if (s->gen != r->gen) {
+        memset(s->sig, 0, sizeof(s->sig));
+        s->gen = r->gen;
+    }
+    for (m = mark_flow_match(s, sig); m; m &= m - 1) {
+        i = __builtin_ctz(m);
+        if (mark_key_eq(&c->key[s - c->set][i], &fk, ~0U)) {
+            (*hits)++;
+            *sticky = s->sticky[i];
+            return s->mark[i];
+        }
+    }
+    (*misses)++;
+    i = s->victim++ & (MARK_FLOW_WAYS - 1);
+    s->sig[i] = sig;
+    s->mark[i] = mark_search(r, b, k, len, pm, sticky);
+    s->sticky[i] = *sticky;
+    c->key[s - c->set][i] = fk;
+
+    return s->mark[i];
+}
+
+/*
+ * The installed rules, and the mark programs of mark_bpf.c. Packet
+ * threads announce the epoch they saw before reading the pointers,
+ * and clear it when done, so after a swap the old state is freed
+ * once no thread is in an older epoch.
+ * Threads beyond MARK_MAX_READERS share a counter instead, and have
+ * no flow cache. A burst enters and leaves the epoch once.
+ */
+static struct mark_rules *mark_rules_cur;
+static uint64_t mark_epoch = 1;
+static uint64_t mark_gen;
+static uint32_t mark_nreaders;
+static uint32_t mark_spill;
+static struct {
+    uint64_t epoch;             /* 0 when outside */
+    struct mark_flow_cache *cache;
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64))) mark_readers[MARK_MAX_READERS];
+static __thread int mark_reader = -1;
+
+int
+mark_reader_enter(void)
+{
+    int me = mark_reader;
+
+    if (__builtin_expect(me < 0, 0)) {
+        me = __atomic_fetch_add(&mark_nreaders, 1, __ATOMIC_RELAXED);
+        mark_reader = me = me < MARK_MAX_READERS ? me : MARK_MAX_READERS;
+    }
+    if (me < MARK_MAX_READERS) {
+        __atomic_store_n(&mark_readers[me].epoch,
+                         __atomic_load_n(&mark_epoch, __ATOMIC_ACQUIRE),
+                         __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_fetch_add(&mark_spill, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return me;
+}
+
+void
+mark_reader_exit(int me)
+{
+    if (me < MARK_MAX_READERS) {
+        __atomic_store_n(&mark_readers[me].epoch, 0, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_sub(&mark_spill, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void
+mark_reader_sync(void)
+{
+    uint64_t epoch;
+    uint32_t i;
+
+    epoch = __atomic_add_fetch(&mark_epoch, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < MARK_MAX_READERS; i++) {
+        for (;;) {
+            uint64_t e = __atomic_load_n(&mark_readers[i].epoch,
+                                         __ATOMIC_ACQUIRE);
+            if (e == 0 || e >= epoch) {
+                break;
+            }
+            usleep(10);
+        }
+    }
+    while (__atomic_load_n(&mark_spill, __ATOMIC_ACQUIRE) != 0) {
+        usleep(10);
+    }
+}
+
+/* parse and classify a burst, the headers are prefetched first */
+static void
+mark_rules_burst_cls(const struct mark_rules *r, int me, uint8_t **data,
+                     const uint32_t *pkt_sz, uint32_t *marks,
+                     uint8_t *sticky, unsigned int n)
+{
+    struct mark_flow_cache *c = NULL;
+    struct mark_key k[MARK_BURST];
+    int len[MARK_BURST];
+    unsigned int i;
+    int simd = 0;
+#ifdef MARK_SSSE3
+    static int ssse3 = -1;
+
+    if (__builtin_expect(ssse3 < 0, 0)) {
+        ssse3 = __builtin_cpu_supports("ssse3");
+    }
+    simd = ssse3;
+#endif
+
+    for (i = 0; i < n; i++) {
+        __builtin_prefetch(data[i]);
+    }
+    for (i = 0; i < n; i++) {
+        len[i] = -2;
+#ifdef MARK_SSSE3
+        if (simd) {
+            len[i] = mark_parse_ssse3(data[i], pkt_sz[i], &k[i]);
+        }
+#endif
+        if (len[i] == -2) {
+            len[i] = mark_parse(data[i], pkt_sz[i], &k[i]);
+        }
+    }
+    if (me < MARK_MAX_READERS) {
+        c = mark_readers[me].cache;
+        if (__builtin_expect(c == NULL, 0)) {
+            c = aligned_alloc(64, sizeof(*c));
+            if (c != NULL) {
+                memset(c, 0, sizeof(*c));
+                mark_readers[me].cache = c;
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        const struct mark_bucket *b;
+        uint64_t pm[MARK_PM_WORDS];
+
+        if (len[i] < 0) {
+            marks[i] = r->err;
+            sticky[i] = 0;
+            continue;
+        }
+        b = mark_bucket_of(r, &k[i]);
+        if (b->n_pats) {
+            mark_payload(r, data[i] + pkt_sz[i] - len[i], len[i], pm, simd);
+        }
+        if (c != NULL) {
+            marks[i] = mark_flow_lookup(c, r, b, &k[i], len[i], pm,
+                                        &sticky[i], &mark_readers[me].hits,
+                                        &mark_readers[me].misses);
+        } else {
+            marks[i] = mark_search(r, b, &k[i], len[i], pm, &sticky[i]);
+        }
+    }
+}
+
+void
+mark_rules_burst(uint8_t **data, const uint32_t *pkt_sz, uint32_t *marks,
+                 uint8_t *sticky, unsigned int n)
+{
+    struct mark_rules *r;
+    unsigned int i;
+    int me = mark_reader_enter();
+
+    r = __atomic_load_n(&mark_rules_cur, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i += MARK_BURST) {
+        unsigned int m = n - i < MARK_BURST ? n - i : MARK_BURST;
+
+        if (r == NULL) {
+            memset(marks + i, 0, m * sizeof(*marks));
+            memset(sticky + i, 0, m * sizeof(*sticky));
+        } else {
+            mark_rules_burst_cls(r, me, data + i, pkt_sz + i, marks + i,
+                                 sticky + i, m);
+        }
+    }
+    mark_reader_exit(me);
+}
+
+uint32_t
+mark_rules_fun(uint8_t *data, uint32_t pkt_sz)
+{
+    uint32_t mark;
+    uint8_t sticky;
+
+    mark_rules_burst(&data, &pkt_sz, &mark, &sticky, 1);
+
+    return mark;
+}
+
+void
+mark_rules_stats(uint64_t *hits, uint64_t *misses)
+{
+    uint32_t i;
+
+    *hits = *misses = 0;
+    for (i = 0; i < MARK_MAX_READERS; i++) {
+        *hits += __atomic_load_n(&mark_readers[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&mark_readers[i].misses,
+                                   __ATOMIC_RELAXED);
+    }
+}
+
+int
+mark_rules_install(const char *path, char *err, size_t errlen)
+{
+    struct mark_rules *r, *old;
+
+    r = mark_rules_load(path, err, errlen);
+    if (r == NULL) {
+        return -1;
+    }
+    /* the flow caches drop what older rules computed */
+    r->gen = ++mark_gen;
+    old = __atomic_exchange_n(&mark_rules_cur, r, __ATOMIC_SEQ_CST);
+    mark_reader_sync();
+    mark_rules_free(old);
+
+    return 0;
+}
+
+/* the rule can match frames of class 'cls' (see mark_table.h) */
+static int
+mark_table_in(const struct mark_rule *x, uint32_t cls)
+{
+    switch (cls) {
+    case MARK_TABLE_NOT_IP:
+        return mark_rule_in(x, 0, 0);
+    case MARK_TABLE_IP:
+        return mark_rule_in(x, 1, 0) &&
+               (!x->mask.proto || (x->val.proto != IPPROTO_ICMP &&
+                                   x->val.proto != IPPROTO_TCP &&
+                                   x->val.proto != IPPROTO_UDP));
+    case MARK_TABLE_ICMP:
+        return mark_rule_in(x, 1, IPPROTO_ICMP);
+    case MARK_TABLE_TCP:
+        return mark_rule_in(x, 1, IPPROTO_TCP);
+    default:
+        return mark_rule_in(x, 1, IPPROTO_UDP);
+    }
+}
+
+/* the rule can match a destination port in bin 'b' */
+static int
+mark_table_in_bin(const struct mark_rule *x, uint32_t cls, uint32_t b)
+{
+    uint32_t p;
+
+    if (cls != MARK_TABLE_TCP && cls != MARK_TABLE_UDP) {
+        return b == 0 && x->dport_lo == 0;     /* no ports, dport is 0 */
+    }
+    if (x->dport_hi - x->dport_lo >= MARK_TABLE_BINS - 1) {
+        return 1;
+    }
+    for (p = x->dport_lo; p <= x->dport_hi; p++) {
+        if ((p & (MARK_TABLE_BINS - 1)) == b) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+mark_table_build(const struct mark_rules *r, struct mark_table *t,
+                 char *err, size_t errlen)
+{
+    uint32_t i, c, b, n = 0;
+
+    if (r->n_pats) {
+        snprintf(err, errlen, "payload patterns need -f hv");
+        return -1;
+    }
+    if (r->n_rules > MARK_TABLE_MAX_RULES) {
+        snprintf(err, errlen, "more than %u rules", MARK_TABLE_MAX_RULES);
+        return -1;
+    }
+    memset(t, 0, sizeof(*t));
+    t->n_rules = r->n_rules;
+    t->dflt = r->dflt;
+    t->err = r->err;
+    for (i = 0; i < r->n_rules; i++) {
+        const struct mark_rule *x = &r->rules[i];
+        struct mark_table_rule *y = &t->rule[i];
+
+        y->addr = ((uint64_t)x->val.src << 32) | x->val.dst;
+        y->addr_mask = ((uint64_t)x->mask.src << 32) | x->mask.dst;
+        y->hdr = mark_table_hdr(x->val.ethertype, x->val.proto,
+                                x->val.tos, x->val.tcpflags);
+        y->hdr_mask = mark_table_hdr(x->mask.ethertype, x->mask.proto,
+                                     x->mask.tos, x->mask.tcpflags);
+        y->len_lo = x->len_lo;
+        y->len_span = x->len_hi - x->len_lo;
+        y->sport_lo = x->sport_lo;
+        y->sport_span = x->sport_hi - x->sport_lo;
+        y->dport_lo = x->dport_lo;
+        y->dport_span = x->dport_hi - x->dport_lo;
+        y->mark = x->mark;
+    }
+    for (c = 0; c < MARK_TABLE_CLASSES; c++) {
+        for (b = 0; b < MARK_TABLE_BINS; b++) {
+            t->bin[c][b][0] = n;
+            for (i = 0; i < r->n_rules; i++) {
+                if (!mark_table_in(&r->rules[i], c) ||
+                        !mark_table_in_bin(&r->rules[i], c, b)) {
+                    continue;
+                }
+                if (n == MARK_TABLE_MAX_INDEX) {
+                    snprintf(err, errlen, "rules too wide for the guest table");
+                    return -1;
+                }
+                t->index[n++] = i;
+            }
+            t->bin[c][b][1] = n - t->bin[c][b][0];
+        }
+    }
+
+    return 0;
+}
+
+/* the table of MARK_MODE_GUEST, read under the epochs above */
+static struct mark_table *mark_table_cur;
+static uint32_t mark_table_ver;
+
+int
+mark_table_install(const char *path, char *err, size_t errlen)
+{
+    struct mark_table *t, *old;
+    struct mark_rules *r;
+
+    r = mark_rules_load(path, err, errlen);
+    if (r == NULL) {
+        return -1;
+    }
+    t = malloc(sizeof(*t));
+    if (t == NULL) {
+        snprintf(err, errlen, "out of memory");
+        mark_rules_free(r);
+        return -1;
+    }
+    if (mark_table_build(r, t, err, errlen)) {
+        mark_rules_free(r);
+        free(t);
+        return -1;
+    }
+    mark_rules_free(r);
+    t->version = mark_table_ver + 1;
+    old = __atomic_exchange_n(&mark_table_cur, t, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&mark_table_ver, t->version, __ATOMIC_RELEASE);
+    mark_reader_sync();
+    free(old);
+
+    return 0;
+}
+
+uint32_t
+mark_table_version(void)
+{
+    return __atomic_load_n(&mark_table_ver, __ATOMIC_ACQUIRE);
+}
+
+uint32_t
+mark_table_publish(struct mark_table *dst)
+{
+    const struct mark_table *t;
+    uint32_t seq, version = 0;
+    int me = mark_reader_enter();
+
+    t = __atomic_load_n(&mark_table_cur, __ATOMIC_ACQUIRE);
+    if (t != NULL) {
+        /* 'seq' odd while the rest changes, see mark_table_run() */
+        seq = __atomic_load_n(&dst->seq, __ATOMIC_RELAXED) | 1;
+        __atomic_store_n(&dst->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy((char *)dst + sizeof(dst->seq), (const char *)t + sizeof(t->seq),
+               sizeof(*t) - sizeof(t->seq));
+        __atomic_store_n(&dst->seq, seq + 1, __ATOMIC_RELEASE);
+        version = t->version;
+    }
+    mark_reader_exit(me);
+
+    return version;
+}
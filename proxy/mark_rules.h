@@ -0,0 +1,121 @@
+#ifndef __MARK_RULES_H__
+#define __MARK_RULES_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Packet classification rules for MARK_MODE_HV, loaded at run time
+ * in place of the built in mark_packet_fun().
+ *
+ * A rule file has one rule per line, a list of 'field value' pairs
+ * ending with 'mark M', e.g.
+ *     proto udp dst 8.8.8.8 dport 53 mark 0
+ *     prio 5 tos 0xb8/0xfc proto udp dport 1853 mark 0
+ *     proto tcp tcpflags 0x02/0x02 len 0-199 mark 1
+ * Fields:
+ *     ether arp|ip|N       ethertype
+ *     proto icmp|tcp|udp|N IPv4 protocol
+ *     src A.B.C.D[/len]    IPv4 source prefix (dst for destination)
+ *     sport N[-M]          TCP/UDP source port or range (dport)
+ *     tos V[/M]            TOS byte under a mask
+ *     tcpflags V[/M]       TCP flags byte under a mask
+ *     len N[-M]            payload bytes after the L4 header
+ *     payload [^]STR       STR in the first 'depth' bytes of the
+ *                          payload, at its start with ^; STR takes
+ *                          the escapes \s, \t, \\ and \xHH (\x23 for #)
+ *     prio N               lower values are tried first (default 0)
+ * Rules with the same prio match in file order. Any IPv4 field
+ * implies 'ether ip'. Three more lines set the mark of packets that
+ * match no rule and of truncated packets, and how far into the
+ * payload to look:
+ *     default M
+ *     error M              (defaults to the default mark)
+ *     depth N              (defaults to 128 bytes)
+ *
+ * Rules are compiled into a tuple space: rules with the same field
+ * masks share a hash table keyed by the masked fields, so a packet
+ * costs one lookup per distinct mask, not one test per rule. There
+ * is one tuple space per IPv4 protocol named in the rules (plus one
+ * for the others and one for non IPv4 frames), holding only the
+ * rules that can match it. Port ranges of up to 16 ports get one
+ * hash entry per port, longer ones and length ranges are checked on
+ * the hash hits. Tables are visited in order of their best rule and
+ * the search stops once no table can beat the match found so far.
+ *
+ * The payload is searched only if a rule of the protocol has a
+ * pattern, and then once for all of them (up to 256, of at most 64
+ * bytes): a prefilter, with SSSE3 when the CPU has it, looks for the
+ * first two bytes of any pattern 16 positions at a time, and an
+ * Aho-Corasick automaton takes over from the first candidate. The
+ * rules then only test the bits of the patterns found.
+ */
+
+struct mark_rules;
+
+/* NULL on error, with a message in 'err' */
+struct mark_rules *mark_rules_load(const char *path, char *err, size_t errlen);
+void mark_rules_free(struct mark_rules *r);
+uint32_t mark_rules_classify(const struct mark_rules *r, const uint8_t *data,
+                             uint32_t pkt_sz);
+uint32_t mark_rules_count(const struct mark_rules *r);
+
+/*
+ * Load a rule file and make it the one used by mark_rules_fun(),
+ * replacing the previous one when no packet thread can be using it.
+ * Safe while packets flow, but one caller at a time. Returns 0, or
+ * -1 with a message in 'err'.
+ */
+int mark_rules_install(const char *path, char *err, size_t errlen);
+
+/*
+ * Classify with the installed rules, for bp.hv_mark_pkt_fun. Each
+ * packet thread has a flow cache in front of the tuple space: the
+ * fields that some rule of the protocol looks at, plus the length
+ * range the payload falls in, map to the mark, so packets of a known
+ * flow skip the search. Installing new rules invalidates the caches.
+ */
+uint32_t mark_rules_fun(uint8_t *data, uint32_t pkt_sz);
+
+/*
+ * The same for 'n' packets, for bp.hv_mark_burst_fun: the headers are
+ * prefetched and parsed together, with SSSE3 when the CPU has it, and
+ * the rules are pinned once for the whole burst. 'sticky' is set for
+ * the marks of rules with a payload pattern, which hold for the rest
+ * of the connection (see conntrack.h).
+ */
+void mark_rules_burst(uint8_t **data, const uint32_t *pkt_sz, uint32_t *marks,
+                      uint8_t *sticky, unsigned int n);
+
+/* flow cache hits and misses, summed over the packet threads */
+void mark_rules_stats(uint64_t *hits, uint64_t *misses);
+
+/*
+ * Packet threads use the installed marking state (these rules, or
+ * the programs of mark_bpf.h) between mark_reader_enter() and
+ * mark_reader_exit(). After replacing a pointer, mark_reader_sync()
+ * returns once no thread can still see the old value.
+ */
+int mark_reader_enter(void);
+void mark_reader_exit(int me);
+void mark_reader_sync(void);
+
+struct mark_table;
+
+/*
+ * MARK_MODE_GUEST: compile a rule file, without payload patterns,
+ * into the table of mark_table.h and make it the current one. Returns
+ * 0, or -1 with a message in 'err'.
+ */
+int mark_table_install(const char *path, char *err, size_t errlen);
+
+/* version of the current table, 0 if none */
+uint32_t mark_table_version(void);
+
+/*
+ * Copy the current table to 'dst', in a transmit context, while the
+ * guest may be reading it. Returns the version copied, 0 if none.
+ */
+uint32_t mark_table_publish(struct mark_table *dst);
+
+#endif  /* __MARK_RULES_H__ */
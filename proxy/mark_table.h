@@ -0,0 +1,186 @@
+#ifndef __MARK_TABLE_H__
+#define __MARK_TABLE_H__
+
+#include <stdint.h>
+
+/*
+ * Packet classification table for MARK_MODE_GUEST, published by the
+ * hv in the transmit context and looked up by the guest programs that
+ * mark packets, shared between the two.
+ *
+ * It holds the rules of a rule file (see mark_rules.h) without payload
+ * patterns, in priority order, as compiled by mark_table_install().
+ * A frame falls in a class by IPv4 protocol and in a bin by the low
+ * bits of its destination port, and only the rules listed for its
+ * bin are tried, so the guest program does a short bounded scan on
+ * the fields it extracts instead of running mark_packet_fun().
+ *
+ * The hv rewrites the table in place when the rules change: 'seq' is
+ * odd while it does, and a guest that sees 'seq' odd or changed
+ * across its lookup uses mark_packet_fun() for that packet. A table
+ * with 'version' 0 holds no rules.
+ */
+#define MARK_TABLE_MAX_RULES    128     /* power of 2 */
+#define MARK_TABLE_MAX_INDEX    2048    /* power of 2 */
+#define MARK_TABLE_BINS         64      /* power of 2 */
+
+/* classes of frames */
+#define MARK_TABLE_NOT_IP       0
+#define MARK_TABLE_IP           1       /* other IPv4 protocols */
+#define MARK_TABLE_ICMP         2
+#define MARK_TABLE_TCP          3
+#define MARK_TABLE_UDP          4
+#define MARK_TABLE_CLASSES      5
+
+/*
+ * Fields and masks in host byte order, packed so that a rule is
+ * tried with two masked compares and three range checks: 'addr' is
+ * src << 32 | dst, 'hdr' is as mark_table_hdr() builds it, and a
+ * range matches x if x - lo <= span.
+ */
+struct mark_table_rule {
+    uint64_t addr, addr_mask;
+    uint64_t hdr, hdr_mask;
+    uint32_t len_lo, len_span;
+    uint16_t sport_lo, sport_span;
+    uint16_t dport_lo, dport_span;
+    uint32_t mark;
+    uint32_t pad;
+};
+
+struct mark_table {
+    uint32_t seq;
+    uint32_t version;
+    uint32_t n_rules;
+    uint32_t dflt;
+    uint32_t err;
+    uint32_t pad[3];
+    /* first entry of 'index' and number of rules for each bin */
+    uint16_t bin[MARK_TABLE_CLASSES][MARK_TABLE_BINS][2];
+    uint8_t index[MARK_TABLE_MAX_INDEX];
+    struct mark_table_rule rule[MARK_TABLE_MAX_RULES];
+};
+
+#define MARK_TABLE_READ_ONCE(x)     (*(volatile typeof(x) *)&(x))
+#define MARK_TABLE_BARRIER()        __asm__ __volatile__("" ::: "memory")
+
+static inline uint64_t
+mark_table_hdr(uint16_t ethertype, uint8_t proto, uint8_t tos,
+               uint8_t tcpflags)
+{
+    return ((uint64_t)ethertype << 24) | ((uint32_t)proto << 16) |
+           ((uint32_t)tos << 8) | tcpflags;
+}
+
+static inline int
+mark_table_match(const struct mark_table_rule *x, uint64_t addr,
+                 uint64_t hdr, uint16_t sport, uint16_t dport, uint32_t len)
+{
+    return (addr & x->addr_mask) == x->addr &&
+           (hdr & x->hdr_mask) == x->hdr &&
+           (uint16_t)(dport - x->dport_lo) <= x->dport_span &&
+           (uint16_t)(sport - x->sport_lo) <= x->sport_span &&
+           len - x->len_lo <= x->len_span;
+}
+
+/*
+ * Mark an Ethernet frame, with the fields extracted as mark_rules.c
+ * does. All the table indices are masked, so a torn table can give a
+ * wrong mark but never a read out of it.
+ */
+static inline uint32_t
+mark_table_lookup(const struct mark_table *t, const uint8_t *data,
+                  uint32_t pkt_sz)
+{
+    uint32_t src = 0, dst = 0, off = 14, ihl, n, first, i;
+    uint16_t sport = 0, dport = 0, ethertype;
+    uint8_t proto = 0, tos = 0, tcpflags = 0, cls = MARK_TABLE_NOT_IP;
+    uint64_t addr, hdr;
+
+    if (pkt_sz < off) {
+        return t->err;
+    }
+    ethertype = (data[12] << 8) | data[13];
+    if (ethertype == 0x0800) {
+        if (pkt_sz < off + 20) {
+            return t->err;
+        }
+        if ((data[off] >> 4) != 4) {
+            ethertype = 0;
+            goto lookup;
+        }
+        ihl = (data[off] & 0xf) << 2;
+        if (ihl < 20 || pkt_sz < off + ihl) {
+            return t->err;
+        }
+        tos = data[off + 1];
+        proto = data[off + 9];
+        src = ((uint32_t)data[off + 12] << 24) | (data[off + 13] << 16) |
+              (data[off + 14] << 8) | data[off + 15];
+        dst = ((uint32_t)data[off + 16] << 24) | (data[off + 17] << 16) |
+              (data[off + 18] << 8) | data[off + 19];
+        off += ihl;
+        cls = MARK_TABLE_IP;
+        if (proto == 1) {
+            cls = MARK_TABLE_ICMP;
+        } else if (proto == 6 || proto == 17) {
+            uint32_t hlen = 8;
+
+            if (pkt_sz < off + (proto == 6 ? 20 : 8)) {
+                return t->err;
+            }
+            sport = (data[off] << 8) | data[off + 1];
+            dport = (data[off + 2] << 8) | data[off + 3];
+            cls = MARK_TABLE_UDP;
+            if (proto == 6) {
+                tcpflags = data[off + 13];
+                hlen = (data[off + 12] >> 4) << 2;
+                if (hlen < 20 || pkt_sz < off + hlen) {
+                    return t->err;
+                }
+                cls = MARK_TABLE_TCP;
+            }
+            off += hlen;
+        }
+    }
+lookup:
+    addr = ((uint64_t)src << 32) | dst;
+    hdr = mark_table_hdr(ethertype, proto, tos, tcpflags);
+    first = t->bin[cls][dport & (MARK_TABLE_BINS - 1)][0];
+    n = t->bin[cls][dport & (MARK_TABLE_BINS - 1)][1];
+    for (i = 0; i < n && i < MARK_TABLE_MAX_RULES; i++) {
+        const struct mark_table_rule *x = &t->rule[
+                t->index[(first + i) & (MARK_TABLE_MAX_INDEX - 1)] &
+                (MARK_TABLE_MAX_RULES - 1)];
+
+        if (mark_table_match(x, addr, hdr, sport, dport, pkt_sz - off)) {
+            return x->mark;
+        }
+    }
+    return t->dflt;
+}
+
+/*
+ * For the guest programs: mark a frame with the table, if it has
+ * rules and was not being rewritten. Returns 0, or -1 if the caller
+ * has to mark the frame by other means.
+ */
+static inline int
+mark_table_run(const struct mark_table *t, const uint8_t *data,
+               uint32_t pkt_sz, uint32_t *mark)
+{
+    uint32_t seq = MARK_TABLE_READ_ONCE(t->seq);
+
+    if (seq & 1) {
+        return -1;
+    }
+    MARK_TABLE_BARRIER();
+    if (t->version == 0) {
+        return -1;
+    }
+    *mark = mark_table_lookup(t, data, pkt_sz);
+    MARK_TABLE_BARRIER();
+    return MARK_TABLE_READ_ONCE(t->seq) == seq ? 0 : -1;
+}
+
+#endif  /* __MARK_TABLE_H__ */
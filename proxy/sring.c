@@ -13,6 +13,8 @@
 #include "sring.h"
 
 #define MY_CACHELINE_SIZE   64
+#define SRING_PREFETCH_DESC 16
+#define SRING_PREFETCH_HDR  8
 
 static void
 sring_rx_check_alignment(void)
@@ -127,6 +129,39 @@ sring_txq_dump(struct bpfhv_tx_context *ctx)
            ACCESS_ONCE(priv->intr_at));
 }
 
+/* Prefetch ahead of slot 'cons', see BeOps.prefetch_desc. */
+static inline void
+sring_rxq_prefetch(BpfhvBackend *be, struct sring_rx_context *priv,
+                   uint32_t cons, uint32_t prod)
+{
+    uint32_t k = be->ops.prefetch_desc, j = be->ops.prefetch_hdr;
+
+    if (k && (uint32_t)(prod - cons) > k) {
+        __builtin_prefetch(priv->desc + ((cons + k) & priv->qmask));
+    }
+    if (j && (uint32_t)(prod - cons) > j) {
+        struct sring_rx_desc *rxd = priv->desc + ((cons + j) & priv->qmask);
+
+        prefetch_buf(be, rxd->paddr, rxd->len, /*write=*/1);
+    }
+}
+
+static inline void
+sring_txq_prefetch(BpfhvBackend *be, struct sring_tx_context *priv,
+                   uint32_t cons, uint32_t prod)
+{
+    uint32_t k = be->ops.prefetch_desc, j = be->ops.prefetch_hdr;
+
+    if (k && (uint32_t)(prod - cons) > k) {
+        __builtin_prefetch(priv->desc + ((cons + k) & priv->qmask));
+    }
+    if (j && (uint32_t)(prod - cons) > j) {
+        struct sring_tx_desc *txd = priv->desc + ((cons + j) & priv->qmask);
+
+        prefetch_buf(be, txd->paddr, txd->len, /*write=*/0);
+    }
+}
+
 static size_t
 sring_rxq_push(BpfhvBackend *be, BpfhvBackendQueue *rxq,
                int *can_receive)
@@ -174,10 +209,11 @@ sring_rxq_push(BpfhvBackend *be, BpfhvBackendQueue *rxq,
             __atomic_thread_fence(__ATOMIC_ACQUIRE);
         }
 
-        if (unlikely(count >= BPFHV_BE_RX_BUDGET)) {
+        if (unlikely(count >= rxq->budget)) {
             break;
         }
 
+        sring_rxq_prefetch(be, priv, cons, prod);
         rxd = priv->desc + (cons & priv->qmask);
         iov.iov_base = translate_addr(be, rxd->paddr, rxd->len);
         if (unlikely(iov.iov_base == NULL)) {
@@ -278,10 +314,11 @@ sring_txq_drain(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send)
             __atomic_thread_fence(__ATOMIC_ACQUIRE);
         }
 
-        if (unlikely(count >= BPFHV_BE_TX_BUDGET)) {
+        if (unlikely(count >= txq->budget)) {
             break;
         }
 
+        sring_txq_prefetch(be, priv, cons, prod);
         iov.iov_base = translate_addr(be, txd->paddr, txd->len);
         iov.iov_len = txd->len;
         if (unlikely(iov.iov_base == NULL)) {
@@ -349,4 +386,6 @@ BeOps sring_ops = {
     .txq_dump = sring_txq_dump,
     .features_avail = 0,
     .progfile = "proxy/sring_progs.o",
+    .prefetch_desc = SRING_PREFETCH_DESC,
+    .prefetch_hdr = SRING_PREFETCH_HDR,
 };
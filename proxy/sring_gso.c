@@ -13,6 +13,8 @@
 #include "sring_gso.h"
 
 #define MY_CACHELINE_SIZE   64
+#define SRING_GSO_PREFETCH_DESC 16
+#define SRING_GSO_PREFETCH_HDR  8
 
 static void
 sring_gso_rx_check_alignment(void)
@@ -127,6 +129,41 @@ sring_gso_txq_dump(struct bpfhv_tx_context *ctx)
            ACCESS_ONCE(priv->intr_at));
 }
 
+/* Prefetch ahead of slot 'cons', see BeOps.prefetch_desc. */
+static inline void
+sring_gso_rxq_prefetch(BpfhvBackend *be, struct sring_gso_rx_context *priv,
+                       uint32_t cons, uint32_t prod)
+{
+    uint32_t k = be->ops.prefetch_desc, j = be->ops.prefetch_hdr;
+
+    if (k && (uint32_t)(prod - cons) > k) {
+        __builtin_prefetch(priv->desc + ((cons + k) & priv->qmask));
+    }
+    if (j && (uint32_t)(prod - cons) > j) {
+        struct sring_gso_rx_desc *rxd =
+                            priv->desc + ((cons + j) & priv->qmask);
+
+        prefetch_buf(be, rxd->paddr, rxd->len, /*write=*/1);
+    }
+}
+
+static inline void
+sring_gso_txq_prefetch(BpfhvBackend *be, struct sring_gso_tx_context *priv,
+                       uint32_t cons, uint32_t prod)
+{
+    uint32_t k = be->ops.prefetch_desc, j = be->ops.prefetch_hdr;
+
+    if (k && (uint32_t)(prod - cons) > k) {
+        __builtin_prefetch(priv->desc + ((cons + k) & priv->qmask));
+    }
+    if (j && (uint32_t)(prod - cons) > j) {
+        struct sring_gso_tx_desc *txd =
+                            priv->desc + ((cons + j) & priv->qmask);
+
+        prefetch_buf(be, txd->paddr, txd->len, /*write=*/0);
+    }
+}
+
 static size_t
 sring_gso_rxq_push(BpfhvBackend *be, BpfhvBackendQueue *rxq,
                    int *can_receive)
@@ -190,6 +227,7 @@ sring_gso_rxq_push(BpfhvBackend *be, BpfhvBackendQueue *rxq,
                 __atomic_thread_fence(__ATOMIC_ACQUIRE);
             }
 
+            sring_gso_rxq_prefetch(be, priv, cons, prod);
             rxd = priv->desc + (cons & priv->qmask);
             iov[iovcnt].iov_base = translate_addr(be, rxd->paddr, rxd->len);
             if (unlikely(iov[iovcnt].iov_base == NULL)) {
@@ -208,7 +246,7 @@ sring_gso_rxq_push(BpfhvBackend *be, BpfhvBackendQueue *rxq,
             cons++;
         } while (iovsize < max_pkt_size && iovcnt < BPFHV_MAX_RX_BUFS);
 
-        if (unlikely(count >= BPFHV_BE_RX_BUDGET)) {
+        if (unlikely(count >= rxq->budget)) {
             break;
         }
 
@@ -335,10 +373,11 @@ sring_gso_txq_drain(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send)
             __atomic_thread_fence(__ATOMIC_ACQUIRE);
         }
 
-        if (unlikely(count >= BPFHV_BE_TX_BUDGET)) {
+        if (unlikely(count >= txq->budget)) {
             break;
         }
 
+        sring_gso_txq_prefetch(be, priv, cons, prod);
         cons++;
 
         iov[iovcnt].iov_base = translate_addr(be, txd->paddr, txd->len);
@@ -440,4 +479,6 @@ BeOps sring_gso_ops = {
                         | BPFHV_F_TSOv6 | BPFHV_F_TCPv6_LRO
                         | BPFHV_F_UFO   | BPFHV_F_UDP_LRO,
     .progfile = "proxy/sring_gso_progs.o",
+    .prefetch_desc = SRING_GSO_PREFETCH_DESC,
+    .prefetch_hdr = SRING_GSO_PREFETCH_HDR,
 };
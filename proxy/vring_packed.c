@@ -9,6 +9,12 @@
 
 #include "backend.h"
 #include "vring_packed.h"
+#include "mark_bpf.h"
+#include "conntrack.h"
+#include "../sched16/tsc.h"
+
+#define VRING_PACKED_PREFETCH_DESC  16
+#define VRING_PACKED_PREFETCH_HDR   8
 
 static void
 vring_packed_rx_check_alignment(void)
@@ -57,7 +63,8 @@ static size_t
 vring_packed_tx_ctx_size(size_t num_tx_bufs)
 {
     return sizeof(struct bpfhv_tx_context)
-            + vring_packed_priv_size(num_tx_bufs);
+            + vring_packed_priv_size(num_tx_bufs)
+            + ROUNDUP(sizeof(struct mark_table), MY_CACHELINE_SIZE);
 }
 
 static inline void
@@ -143,12 +150,26 @@ vring_packed_rx_ctx_init(struct bpfhv_rx_context *ctx, size_t num_rx_bufs)
     vring_packed_init(vq, num_rx_bufs);
 }
 
+/*
+ * The mark table of a transmit queue, at the offset computed here: the
+ * guest can write 'mark_table_ofs', so the hv does not read it back.
+ */
+static inline struct mark_table *
+vring_packed_hv_mark_table(struct vring_packed_virtq *vq, size_t num_tx_bufs)
+{
+    return (struct mark_table *)((char *)vq +
+                                 vring_packed_priv_size(num_tx_bufs));
+}
+
 static void
 vring_packed_tx_ctx_init(struct bpfhv_tx_context *ctx, size_t num_tx_bufs)
 {
     struct vring_packed_virtq *vq = (struct vring_packed_virtq *)ctx->opaque;
 
     vring_packed_init(vq, num_tx_bufs);
+    vq->mark_table_ofs = vring_packed_priv_size(num_tx_bufs);
+    memset(vring_packed_hv_mark_table(vq, num_tx_bufs), 0,
+           sizeof(struct mark_table));
 }
 
 static void
@@ -158,6 +179,15 @@ vring_packed_tx_ctx_init_mark(struct bpfhv_tx_context *ctx, uint mark_mode)
     vq->mark_on_guest = (mark_mode == MARK_MODE_GUEST);
 }
 
+static struct mark_table *
+vring_packed_tx_ctx_mark_table(struct bpfhv_tx_context *ctx,
+                               size_t num_tx_bufs)
+{
+    struct vring_packed_virtq *vq = (struct vring_packed_virtq *)ctx->opaque;
+
+    return vring_packed_hv_mark_table(vq, num_tx_bufs);
+}
+
 static void
 vring_packed_rxq_notification(struct bpfhv_rx_context *ctx, int enable)
 {
@@ -208,15 +238,72 @@ vring_packed_txq_dump(struct bpfhv_tx_context *ctx)
 }
 
 static inline int
-vring_packed_more_avail(struct vring_packed_virtq *vq)
+vring_packed_desc_avail(struct vring_packed_virtq *vq, uint16_t idx,
+                        int wrap_counter)
 {
-    uint16_t flags = vq->desc[vq->h.next_avail_idx].flags;
+    uint16_t flags = vq->desc[idx].flags;
     int avail, used;
 
     avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
     used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
 
-    return avail != used && avail == vq->h.avail_wrap_counter;
+    return avail != used && avail == wrap_counter;
+}
+
+static inline int
+vring_packed_more_avail(struct vring_packed_virtq *vq)
+{
+    return vring_packed_desc_avail(vq, vq->h.next_avail_idx,
+                                   vq->h.avail_wrap_counter);
+}
+
+/*
+ * Prefetch ahead of the next avail descriptor (see BeOps.prefetch_desc),
+ * and the buffer 'j' slots ahead if its descriptor is avail.
+ */
+static inline void
+vring_packed_prefetch(BpfhvBackend *be, struct vring_packed_virtq *vq,
+                      unsigned int j, int write)
+{
+    unsigned int k = be->ops.prefetch_desc;
+    uint32_t idx;
+
+    if (k && k < vq->num_desc) {
+        idx = vq->h.next_avail_idx + k;
+        if (idx >= vq->num_desc) {
+            idx -= vq->num_desc;
+        }
+        __builtin_prefetch(&vq->desc[idx]);
+    }
+    if (j && j < vq->num_desc) {
+        int wrap_counter = vq->h.avail_wrap_counter;
+
+        idx = vq->h.next_avail_idx + j;
+        if (idx >= vq->num_desc) {
+            idx -= vq->num_desc;
+            wrap_counter ^= 1;
+        }
+        if (vring_packed_desc_avail(vq, idx, wrap_counter)) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            prefetch_buf(be, vq->desc[idx].addr, vq->desc[idx].len, write);
+        }
+    }
+}
+
+static int
+vring_packed_txq_has_avail(struct bpfhv_tx_context *ctx)
+{
+    struct vring_packed_virtq *vq = (struct vring_packed_virtq *)ctx->opaque;
+
+    return vring_packed_more_avail(vq);
+}
+
+static int
+vring_packed_rxq_has_avail(struct bpfhv_rx_context *ctx)
+{
+    struct vring_packed_virtq *vq = (struct vring_packed_virtq *)ctx->opaque;
+
+    return vring_packed_more_avail(vq);
 }
 
 static inline void
@@ -301,11 +388,12 @@ vring_packed_rxq_push(BpfhvBackend *be, BpfhvBackendQueue *rxq,
             vring_packed_notification(vq, /*enable=*/0);
         }
 
-        if (unlikely(count >= BPFHV_BE_RX_BUDGET)) {
+        if (unlikely(count >= rxq->budget)) {
             break;
         }
 
         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        vring_packed_prefetch(be, vq, be->ops.prefetch_hdr, /*write=*/1);
         desc = vq->desc + avail_idx;
         iov.iov_base = translate_addr(be, desc->addr, desc->len);
         if (unlikely(avail_idx != used_idx)) {
@@ -392,11 +480,12 @@ vring_packed_txq_drain(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send)
             vring_packed_notification(vq, /*enable=*/0);
         }
 
-        if (unlikely(count >= BPFHV_BE_TX_BUDGET)) {
+        if (unlikely(count >= txq->budget)) {
             break;
         }
 
         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        vring_packed_prefetch(be, vq, be->ops.prefetch_hdr, /*write=*/0);
 
         /* Get the next avail descriptor and process it. */
         iov.iov_base = translate_addr(be, vq->desc[avail_idx].addr,
@@ -459,6 +548,99 @@ vring_packed_txq_drain(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send)
     return count;
 }
 
+/* conntrack_cls_t for MARK_MODE_HV, 'opaque' is the backend */
+static void
+vring_packed_classify(void *opaque, uint8_t **data, const uint32_t *len,
+                      uint32_t *marks, uint8_t *sticky, unsigned int n)
+{
+    BpfhvBackend *be = opaque;
+    BpfhvBackendProcess *bp = be->parent_bp;
+    unsigned int i;
+
+    /* the marks of eBPF programs are per packet */
+    if ((ACCESS_ONCE(be->mark_prog) || ACCESS_ONCE(bp->mark_prog)) &&
+            mark_bpf_burst(&be->mark_prog, &bp->mark_prog, data, len, marks,
+                           n) == 0) {
+        memset(sticky, 0, n * sizeof(*sticky));
+        return;
+    }
+    if (bp->hv_mark_burst_fun) {
+        bp->hv_mark_burst_fun(data, len, marks, sticky, n);
+    } else {
+        for (i = 0; i < n; i++) {
+            marks[i] = bp->hv_mark_pkt_fun(data[i], len[i]);
+            sticky[i] = 0;
+        }
+    }
+}
+
+/*
+ * MARK_MODE_HV: compute the marks of up to 'n' avail descriptors in
+ * one call to the mark function, and prefetch the headers of as many
+ * descriptors after them, which are marked on the next call. Nothing
+ * is consumed: the marks and the translated buffers are kept in the
+ * queue, from txq->mark_idx on, and the acquire loop takes them in
+ * the same order, in this call or in a later one. The eBPF program
+ * of the guest, if any, takes precedence, and otherwise with
+ * connection tracking only the packets of connections that have no
+ * mark yet are classified. Returns the number of marks, at least 1
+ * if there is an avail descriptor.
+ */
+static unsigned int
+vring_packed_txq_mark(BpfhvBackend *be, BpfhvBackendQueue *txq,
+                      struct vring_packed_virtq *vq, unsigned int n)
+{
+    BpfhvBackendProcess *bp = be->parent_bp;
+    uint8_t *data[2 * BPFHV_MARK_BURST];
+    uint32_t len[2 * BPFHV_MARK_BURST];
+    uint8_t sticky[BPFHV_MARK_BURST];
+    uint16_t idx = vq->h.next_avail_idx;
+    int wrap_counter = vq->h.avail_wrap_counter;
+    unsigned int i, ahead;
+
+    for (ahead = 0; ahead < 2 * n; ahead++) {
+        struct vring_packed_desc *desc = &vq->desc[idx];
+
+        if (!vring_packed_desc_avail(vq, idx, wrap_counter)) {
+            break;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        len[ahead] = desc->len;
+        data[ahead] = translate_addr(be, desc->addr, len[ahead]);
+        if (ahead < n) {
+            txq->mark_iov[ahead].iov_base = data[ahead];
+            txq->mark_iov[ahead].iov_len = len[ahead];
+        }
+        if (unlikely(data[ahead] == NULL)) {
+            /* skipped by the caller, any mark will do */
+            data[ahead] = (uint8_t *)vq;
+            len[ahead] = 0;
+        }
+        if (unlikely(++idx >= vq->num_desc)) {
+            idx = 0;
+            wrap_counter ^= 1;
+        }
+    }
+    for (i = n; i < ahead; i++) {
+        __builtin_prefetch(data[i]);
+    }
+    if (ahead > n) {
+        ahead = n;
+    }
+    /* the table is shared, guests with a program of their own skip it */
+    if (bp->conntrack && ACCESS_ONCE(be->mark_prog) == NULL) {
+        conntrack_mark(bp->conntrack, data, len, txq->mark, ahead,
+                       vring_packed_classify, be);
+    } else {
+        vring_packed_classify(be, data, len, txq->mark, sticky, ahead);
+    }
+    txq->mark_idx = vq->h.next_avail_idx;
+    txq->mark_next = 0;
+    txq->mark_num = ahead;
+
+    return ahead;
+}
+
 /* return number of acquired packets */
 static size_t
 vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send, size_t *dropped)
@@ -467,7 +649,8 @@ vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send
     struct vring_packed_virtq *vq = (struct vring_packed_virtq *)ctx->opaque;
     size_t count = 0, _dropped = 0;
     struct BpfhvBackendProcess *bp = be->parent_bp;
-    uint32_t mark;
+    uint64_t now = bp->guest_rate ? rdtsc() : 0;
+    uint32_t mark = 0;
 
     if (can_send) {
         /* Disable further kicks and start processing. */
@@ -476,8 +659,15 @@ vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send
 
     txq->notify = 0;
 
+    /* marks left by the last call are for the next descriptors */
+    if (txq->mark_next != txq->mark_num &&
+            txq->mark_idx != vq->h.next_avail_idx) {
+        txq->mark_next = txq->mark_num = 0;
+    }
+
     for (;;) {
         uint16_t avail_idx = vq->h.next_avail_idx;
+        struct vring_packed_desc *avail_desc;
         struct iovec iov;
 
         if (!vring_packed_more_avail(vq)) {
@@ -497,16 +687,44 @@ vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send
             vring_packed_notification(vq, /*enable=*/0);
         }
 
-        if (unlikely(count >= BPFHV_BE_TX_BUDGET)) {
+        if (unlikely(count >= txq->budget)) {
+            *dropped = _dropped;
+            break;
+        }
+
+        /* Leave descriptors in the ring while the scheduler is holding
+         * too many buffers of this queue, or the guest is over its rate.
+         * Acquisition resumes on a later call. */
+        if (txq_backpressure(bp, txq) || txq_rate_limited(bp, txq, now)) {
+            *dropped = _dropped;
             break;
         }
 
         __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-        /* Get the next avail descriptor and process it. */
-        struct vring_packed_desc *avail_desc = &vq->desc[avail_idx];
-        iov.iov_base = translate_addr(be, avail_desc->addr, avail_desc->len);
-        iov.iov_len = avail_desc->len;
+        /* With MARK_MODE_HV, the headers are prefetched for marking. */
+        vring_packed_prefetch(be, vq, bp->mark_mode == MARK_MODE_HV ? 0 :
+                              be->ops.prefetch_hdr, /*write=*/0);
+
+        /* Get the next avail descriptor and process it. With
+         * MARK_MODE_HV, marks are computed a burst at a time, and the
+         * buffer was translated while marking. */
+        avail_desc = &vq->desc[avail_idx];
+        if (bp->mark_mode == MARK_MODE_HV) {
+            if (txq->mark_next == txq->mark_num) {
+                size_t n = txq->budget - count;
+
+                vring_packed_txq_mark(be, txq, vq,
+                                      n < BPFHV_MARK_BURST ? n :
+                                      BPFHV_MARK_BURST);
+            }
+            mark = txq->mark[txq->mark_next];
+            iov = txq->mark_iov[txq->mark_next++];
+        } else {
+            iov.iov_base = translate_addr(be, avail_desc->addr,
+                                          avail_desc->len);
+            iov.iov_len = avail_desc->len;
+        }
         if (unlikely(iov.iov_base == NULL)) {
             /* Invalid descriptor, just skip it. */
             if (verbose) {
@@ -525,12 +743,14 @@ vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send
             /* Implement mark mode. Mark here if MARK_MODE_HV is selected,
              * use guest provided mark if MARK_MODE_GUEST is used, use
              * null mark if no mark is selected. */
+            sched_mac_check(bp, be, iov.iov_base, iov.iov_len);
+
             switch(bp->mark_mode) {
                 case MARK_MODE_GUEST:
                     mark = avail_desc->mark;
                     break;
                 case MARK_MODE_HV:
-                    mark = bp->hv_mark_pkt_fun(iov.iov_base, iov.iov_len);
+                    /* already computed */
                     break;
                 case MARK_MODE_NO_MARK:
                     mark = 0;
@@ -552,6 +772,8 @@ vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send
                 _dropped++;
                 /* update stats */
                 vq->g.avail_dropped++;
+            } else {
+                txq_rate_charge(bp, txq, now, iov.iov_len);
             }
 
             /* TODO: can_send does not have any meaning when enqueuing to scheduler */
@@ -576,6 +798,7 @@ vring_packed_txq_acquire(BpfhvBackend *be, BpfhvBackendQueue *txq, int *can_send
 
         /* Advance avail index */
         vring_packed_advance_avail(vq);
+        txq->mark_idx = vq->h.next_avail_idx;
 
         txq->stats.bufs++;
         count++;
@@ -682,8 +905,11 @@ BeOps vring_packed_ops = {
     .rx_ctx_init = vring_packed_rx_ctx_init,
     .tx_ctx_init = vring_packed_tx_ctx_init,
     .tx_ctx_init_mark = vring_packed_tx_ctx_init_mark,
+    .tx_ctx_mark_table = vring_packed_tx_ctx_mark_table,
     .rxq_kicks = vring_packed_rxq_notification,
     .txq_kicks = vring_packed_txq_notification,
+    .txq_has_avail = vring_packed_txq_has_avail,
+    .rxq_has_avail = vring_packed_rxq_has_avail,
     .rxq_push = vring_packed_rxq_push,
     .txq_drain = vring_packed_txq_drain,
     .txq_acquire = vring_packed_txq_acquire,
@@ -693,4 +919,6 @@ BeOps vring_packed_ops = {
     .txq_dump = vring_packed_txq_dump,
     .features_avail = 0,
     .progfile = "proxy/vring_packed_progs.o",
+    .prefetch_desc = VRING_PACKED_PREFETCH_DESC,
+    .prefetch_hdr = VRING_PACKED_PREFETCH_HDR,
 };
\ No newline at end of file
@@ -24,6 +24,8 @@
 
 #include <stdint.h>
 
+#include "mark_table.h"
+
 /* This marks a buffer as continuing via the next field. */
 #define VRING_DESC_F_NEXT	1
 /* This marks a buffer as write-only (otherwise read-only). */
@@ -131,6 +133,8 @@ struct vring_packed_virtq {
     uint32_t num_desc;
     uint64_t hv_map_ofs;
     uint8_t mark_on_guest;
+    /* Transmit queues only, see mark_table.h. */
+    uint64_t mark_table_ofs;
 
     /* Notification suppression information. Shared, owned by the guest. */
     MY_CACHELINE_ALIGNED
@@ -159,16 +163,22 @@ vring_need_event(uint16_t old_idx, uint16_t event_idx, uint16_t new_idx)
 
 
 /* Only valid after initialization. */
-struct vring_packed_desc_state *
+static inline struct vring_packed_desc_state *
 vring_packed_state(const struct vring_packed_virtq *vq)
 {
     return (struct vring_packed_desc_state *)(((char *)vq) + vq->state_ofs);
 }
 
-struct vring_packed_desc_hv_map *
+static inline struct vring_packed_desc_hv_map *
 vring_packed_hv_map(const struct vring_packed_virtq *vq)
 {
     return (struct vring_packed_desc_hv_map *)(((char *)vq) + vq->hv_map_ofs);
 }
 
+static inline struct mark_table *
+vring_packed_mark_table(const struct vring_packed_virtq *vq)
+{
+    return (struct mark_table *)(((char *)vq) + vq->mark_table_ofs);
+}
+
 #endif  /* __BPFHV_VRING_PACKED_H__ */
@@ -88,9 +88,18 @@ vring_packed_kick_needed(struct vring_packed_virtq *vq, uint16_t num_published)
 #include "net_headers.h" /* dependency for mark_fun.h */
 #include "mark_fun.h"
 
+/* With the rules published by the hv if any, see mark_table.h. */
 static inline uint32_t
-vring_mark_packet(struct bpfhv_tx_context *ctx) {
-    return mark_packet_fun((uint8_t*)pkt_data(ctx), pkt_size(ctx));
+vring_mark_packet(struct bpfhv_tx_context *ctx,
+                  struct vring_packed_virtq *vq) {
+    uint8_t *data = (uint8_t*)pkt_data(ctx);
+    uint32_t len = pkt_size(ctx);
+    uint32_t mark;
+
+    if (vq->mark_table_ofs &&
+            mark_table_run(vring_packed_mark_table(vq), data, len, &mark) == 0)
+        return mark;
+    return mark_packet_fun(data, len);
 }
 
 __section("txp")
@@ -104,7 +113,7 @@ int vring_packed_txp(struct bpfhv_tx_context *ctx)
         return -1;
     }
 
-    mark = (vq->mark_on_guest) ? vring_mark_packet(ctx) : 0;
+    mark = (vq->mark_on_guest) ? vring_mark_packet(ctx, vq) : 0;
 
     vring_packed_add(vq, txb, 0, mark);
     smp_mb_full();
@@ -0,0 +1,128 @@
+/*
+ * BSD license
+ */
+
+/*
+ * CoDel active queue management (RFC 8289) for dummynet queues.
+ *
+ * The AQM is not a scheduler: it sits between a dn_alg and its
+ * queues. Packets are timestamped on enqueue, and each packet
+ * returned by the scheduler dequeue is checked against the
+ * sojourn time of its own flow, so any algorithm can use it.
+ * State is a few words per flow (struct codel_status, embedded
+ * in dn_queue) and the parameters are per flowset.
+ * Times are in TSC ticks.
+ */
+
+#ifndef _DN_AQM_CODEL_H
+#define _DN_AQM_CODEL_H
+
+#define CODEL_DEFAULT_TARGET_US		5000	/* 5 ms */
+#define CODEL_DEFAULT_INTERVAL_US	100000	/* 100 ms */
+
+struct codel_parms {	/* per flowset, target == 0 disables */
+	uint64_t	target;		/* acceptable sojourn time */
+	uint64_t	interval;	/* width of the moving window */
+};
+
+struct codel_status {	/* per flow */
+	uint64_t	first_above_time; /* 0, or when we may start dropping */
+	uint64_t	drop_next;	/* time of the next drop */
+	uint32_t	count;		/* drops since entering dropping state */
+	uint32_t	last_count;	/* count when we last left dropping state */
+	uint16_t	dropping;	/* set if in dropping state */
+	uint16_t	rec_inv_sqrt;	/* 1/sqrt(count), 0.16 fixed point */
+};
+
+/*
+ * 1/sqrt(count) is kept with one Newton step per count update
+ * instead of a division and a square root, as in the linux codel.
+ */
+#define CODEL_REC_INV_SQRT_SHIFT	16
+
+static inline void
+codel_newton_step(struct codel_status *cst)
+{
+	uint32_t invsqrt = ((uint32_t)cst->rec_inv_sqrt) << CODEL_REC_INV_SQRT_SHIFT;
+	uint32_t invsqrt2 = ((uint64_t)invsqrt * invsqrt) >> 32;
+	uint64_t val = (3ULL << 32) - ((uint64_t)cst->count * invsqrt2);
+
+	val >>= 2; /* avoid overflow in the following multiply */
+	val = (val * invsqrt) >> (32 - 2 + 1);
+	cst->rec_inv_sqrt = val >> CODEL_REC_INV_SQRT_SHIFT;
+}
+
+/* t + interval / sqrt(count) */
+static inline uint64_t
+codel_control_law(uint64_t t, uint64_t interval, uint16_t rec_inv_sqrt)
+{
+	return t + ((interval * rec_inv_sqrt) >> 16);
+}
+
+static inline void
+codel_config(struct codel_parms *cp, uint32_t target_us, uint32_t interval_us)
+{
+	if (interval_us == 0)
+		interval_us = CODEL_DEFAULT_INTERVAL_US;
+	cp->target = NS2TSC(1000ULL * target_us);
+	cp->interval = NS2TSC(1000ULL * interval_us);
+}
+
+/*
+ * Called on every packet extracted from a flow, with the time
+ * the packet was enqueued and the residual backlog of the flow.
+ * Return 1 if the packet must be dropped.
+ */
+static inline int
+codel_drop(struct codel_status *cst, const struct codel_parms *cp,
+	uint64_t enq_time, uint64_t now, uint32_t backlog)
+{
+	int ok_to_drop = 0;
+
+	/* never drop the last packet of a flow */
+	if (now - enq_time < cp->target || backlog == 0) {
+		cst->first_above_time = 0;
+	} else if (cst->first_above_time == 0) {
+		/* above target: allow one interval to get back below */
+		cst->first_above_time = now + cp->interval;
+	} else if (DN_KEY_LEQ(cst->first_above_time, now)) {
+		ok_to_drop = 1;
+	}
+
+	if (cst->dropping) {
+		if (!ok_to_drop) {
+			cst->dropping = 0;
+			return 0;
+		}
+		if (DN_KEY_LT(now, cst->drop_next))
+			return 0;
+		cst->count++;
+		codel_newton_step(cst);
+		cst->drop_next = codel_control_law(cst->drop_next,
+		    cp->interval, cst->rec_inv_sqrt);
+		return 1;
+	}
+
+	if (!ok_to_drop)
+		return 0;
+
+	/*
+	 * Enter dropping state. If we were dropping recently, restart
+	 * from the previous drop rate rather than from scratch.
+	 */
+	cst->dropping = 1;
+	if (cst->count - cst->last_count > 1 &&
+	    DN_KEY_LT(now, cst->drop_next + 16 * cp->interval)) {
+		cst->count -= cst->last_count;
+		codel_newton_step(cst);
+	} else {
+		cst->count = 1;
+		cst->rec_inv_sqrt = ~0U >> CODEL_REC_INV_SQRT_SHIFT;
+	}
+	cst->last_count = cst->count;
+	cst->drop_next = codel_control_law(now, cp->interval,
+	    cst->rec_inv_sqrt);
+	return 1;
+}
+
+#endif /* _DN_AQM_CODEL_H */
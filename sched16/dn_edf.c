@@ -0,0 +1,120 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Bucketed deadline queue for the EDF class, see dn_edf.h
+ */
+
+#include <dn_test.h>
+
+#define EDF_MIN_BUCKETS	64
+#define EDF_SPAN	256	/* buckets per max relative deadline */
+
+/*
+ * Deadlines of queued flows are at most max_rel ahead of the
+ * earliest one, so a ring covering max_rel plus one bucket never
+ * needs to clamp, unless a flow stays queued past its deadline
+ * for long, in which case later deadlines go to the last bucket.
+ */
+int
+edf_init(struct dn_edf *e, uint64_t max_rel)
+{
+	uint64_t gran = max_rel / EDF_SPAN, n;
+
+	if (gran < NS2TSC(1000))	/* no point in going below 1us */
+		gran = NS2TSC(1000);
+	if (gran == 0)
+		gran = 1;
+	for (n = EDF_MIN_BUCKETS; n < max_rel / gran + 2; n <<= 1)
+		;
+	bzero(e, sizeof(*e));
+	e->b = calloc(n, sizeof(*e->b));
+	e->map = calloc(n / 64, sizeof(*e->map));
+	if (e->b == NULL || e->map == NULL) {
+		edf_free(e);
+		return ENOMEM;
+	}
+	e->nbuckets = n;
+	e->gran = gran;
+	return 0;
+}
+
+void
+edf_free(struct dn_edf *e)
+{
+	free(e->b);
+	free(e->map);
+	bzero(e, sizeof(*e));
+}
+
+void
+edf_insert(struct dn_edf *e, struct dn_edf_flow *f, uint64_t deadline)
+{
+	uint64_t i = deadline / e->gran;
+	struct dn_edf_bucket *b;
+
+	if (e->active == 0) {
+		e->cur = e->last = i;
+	} else if (i < e->cur) {
+		/* earlier than all others, move the ring back if we can */
+		if (e->last - i < e->nbuckets)
+			e->cur = i;
+		else
+			i = e->cur;
+	} else if (i - e->cur >= e->nbuckets) {
+		i = e->cur + e->nbuckets - 1;
+	}
+	if (i > e->last)
+		e->last = i;
+
+	f->deadline = deadline;
+	f->queued = 1;
+	f->next = NULL;
+	i &= e->nbuckets - 1;
+	b = &e->b[i];
+	if (b->head == NULL) {
+		b->head = f;
+		e->map[i / 64] |= 1ULL << (i & 63);
+	} else {
+		b->tail->next = f;
+	}
+	b->tail = f;
+	e->active++;
+}
+
+/* remove and return the flow with the earliest deadline */
+struct dn_edf_flow *
+edf_extract(struct dn_edf *e)
+{
+	uint32_t mask = e->nbuckets - 1, wmask = e->nbuckets / 64 - 1;
+	uint32_t start = e->cur & mask, w = start / 64, i;
+	uint64_t bits;
+	struct dn_edf_bucket *b;
+	struct dn_edf_flow *f;
+
+	if (e->active == 0)
+		return NULL;
+	/* buckets from cur to the end of its word, then the other
+	 * words, then back to the low part of the first one.
+	 */
+	bits = e->map[w] & (~0ULL << (start & 63));
+	while (bits == 0) {
+		w = (w + 1) & wmask;
+		bits = e->map[w];
+	}
+	i = w * 64 + __builtin_ctzll(bits);
+	e->cur += (i - start) & mask;
+
+	b = &e->b[i];
+	f = b->head;
+	b->head = f->next;
+	if (b->head == NULL) {
+		b->tail = NULL;
+		e->map[w] &= ~(1ULL << (i & 63));
+	}
+	f->next = NULL;
+	f->queued = 0;
+	e->active--;
+	return f;
+}
@@ -0,0 +1,56 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Earliest deadline first class for latency critical flows.
+ *
+ * Flows (i.e. marks) with a relative deadline are served before all
+ * the others, in order of the deadline of their head packet, which
+ * is its arrival time plus the deadline of the flow. Flows without
+ * a deadline are best effort and go to the dn_alg (normally wf2qp
+ * or qfq), which gets the link whenever the EDF class is empty.
+ * EDF flows are not rate limited by the class itself, so they should
+ * be shaped to bound the capacity they can take from best effort.
+ *
+ * Backlogged EDF flows wait in a bucketed deadline queue: bucket i
+ * holds the flows whose head deadline is in [i*gran, (i+1)*gran),
+ * and a bitmap of non empty buckets gives O(1) insertion and
+ * extraction (the scan covers at most nbuckets/64 words).
+ * Deadlines are rounded to gran, flows in the same bucket are
+ * served FIFO. All times are in TSC ticks.
+ */
+
+#ifndef _DN_EDF_H
+#define _DN_EDF_H
+
+struct dn_edf_flow {	/* per flow */
+	struct dn_queue	*q;
+	uint64_t	rel;	/* relative deadline, 0 for best effort */
+	uint64_t	deadline; /* of the head packet, while queued */
+	struct dn_edf_flow *next; /* chain in the bucket */
+	uint32_t	misses;	/* packets served after their deadline */
+	int		queued;
+};
+
+struct dn_edf_bucket {
+	struct dn_edf_flow *head, *tail;
+};
+
+struct dn_edf {
+	uint32_t	nbuckets;	/* power of 2, at least 64 */
+	uint64_t	gran;		/* tsc ticks per bucket */
+	uint64_t	cur;	/* first bucket that may be busy, in units of gran */
+	uint64_t	last;	/* last bucket that may be busy */
+	uint32_t	active;	/* flows in the queue */
+	uint64_t	misses;	/* total deadline misses */
+	uint64_t	*map;	/* one bit per non empty bucket */
+	struct dn_edf_bucket *b;
+};
+
+int edf_init(struct dn_edf *e, uint64_t max_rel);
+void edf_free(struct dn_edf *e);
+void edf_insert(struct dn_edf *e, struct dn_edf_flow *f, uint64_t deadline);
+struct dn_edf_flow *edf_extract(struct dn_edf *e);
+
+#endif /* _DN_EDF_H */
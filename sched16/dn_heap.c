@@ -43,6 +43,7 @@ __FBSDID("$FreeBSD$");
 #ifndef log
 #define log(x, arg...)
 #endif
+#define malloc_aligned(s, t, w)	malloc(s, t, w)
 
 #else /* !_KERNEL */
 
@@ -57,7 +58,13 @@ __FBSDID("$FreeBSD$");
 #define MALLOC_DEFINE(a, b, c)	volatile int __dummy__ ## a __attribute__((__unused__))
 static void *my_malloc(int s) {	return malloc(s); }
 static void my_free(void *p) {	free(p); }
+#define HEAP_ALIGN	64	/* cache line */
+static void *my_malloc_aligned(int s) {
+	void *p;
+	return posix_memalign(&p, HEAP_ALIGN, s) ? NULL : p;
+}
 #define malloc(s, t, w)	my_malloc(s)
+#define malloc_aligned(s, t, w)	my_malloc_aligned(s)
 #define free(p, t)	my_free(p)
 #endif /* !_KERNEL */
 
@@ -78,10 +85,41 @@ static MALLOC_DEFINE(M_DN_HEAP, "dummynet", "dummynet heap");
 #define	HEAP_SWAP(a, b, buffer) { buffer = a ; a = b ; b = buffer ; }
 #define HEAP_INCREMENT	15
 
+/* 4-ary heap, children of i are 4i+1 .. 4i+4 */
+#define HEAP4_FATHER(x)	( ( (x) - 1 ) >> 2 )
+#define HEAP4_FIRST(x)	( ( (x) << 2 ) + 1 )
+/*
+ * The 4-ary array starts HEAP4_PAD entries into a cache aligned
+ * block, so that children 4i+1 .. 4i+4 are at offsets 4(i+1) .. 4(i+1)+3
+ * and fill exactly one cache line (4 entries of 16 bytes).
+ */
+#define HEAP4_PAD	3
+
+int dn_heap_type = DN_HEAP_DEFAULT;
+
+int
+dn_heap_type_parse(const char *name)
+{
+	if (!strcmp(name, "binary") || !strcmp(name, "2"))
+		return DN_HEAP_BINARY;
+	if (!strcmp(name, "4ary") || !strcmp(name, "4"))
+		return DN_HEAP_4ARY;
+	if (!strcmp(name, "calendar") || !strcmp(name, "cq"))
+		return DN_HEAP_CALENDAR;
+	return -1;
+}
+
+static int cq_init(struct dn_heap *h, int size);
+static int cq_insert(struct dn_heap *h, uint64_t key1, void *p);
+static void cq_extract(struct dn_heap *h, void *obj);
+static int cq_scan(struct dn_heap *, int (*)(void *, uintptr_t), uintptr_t);
+static void cq_free(struct dn_heap *h);
+
 static int
 heap_resize(struct dn_heap *h, unsigned int new_size)
 {
 	struct dn_heap_entry *p;
+	void *base;
 
 	if ((unsigned int)h->size >= new_size )	/* have enough room */
 		return 0;
@@ -94,16 +132,23 @@ heap_resize(struct dn_heap *h, unsigned int new_size)
 #else
 	new_size = (new_size + HEAP_INCREMENT ) & ~HEAP_INCREMENT;
 #endif
-	p = malloc(new_size * sizeof(*p), M_DN_HEAP, M_NOWAIT);
+	if (h->type == DN_HEAP_4ARY) {
+		base = malloc_aligned((new_size + HEAP4_PAD) * sizeof(*p),
+			M_DN_HEAP, M_NOWAIT);
+		p = base ? (struct dn_heap_entry *)base + HEAP4_PAD : NULL;
+	} else {
+		base = p = malloc(new_size * sizeof(*p), M_DN_HEAP, M_NOWAIT);
+	}
 	if (p == NULL) {
 		printf("--- %s, resize %d failed\n", __func__, new_size );
 		return 1; /* error */
 	}
 	if (h->size > 0) {
 		bcopy(h->p, p, h->size * sizeof(*p) );
-		free(h->p, M_DN_HEAP);
+		free(h->base, M_DN_HEAP);
 	}
 	h->p = p;
+	h->base = base;
 	h->size = new_size;
 	return 0;
 }
@@ -111,10 +156,14 @@ heap_resize(struct dn_heap *h, unsigned int new_size)
 int
 heap_init(struct dn_heap *h, int size, int ofs)
 {
+	if (h->size == 0)	/* fresh heap, pick the implementation */
+		h->type = dn_heap_type;
+	h->ofs = ofs;
+	if (h->type == DN_HEAP_CALENDAR)
+		return cq_init(h, size);
 	if (heap_resize(h, size))
 		return 1;
 	h->elements = 0;
-	h->ofs = ofs;
 	return 0;
 }
 
@@ -141,8 +190,8 @@ heap_init(struct dn_heap *h, int size, int ofs)
 	    *((int32_t *)((char *)(h->p[i].object) + h->ofs)) = -16;	\
 	} while (0)
 
-int
-heap_insert(struct dn_heap *h, uint64_t key1, void *p)
+static int
+heap2_insert(struct dn_heap *h, uint64_t key1, void *p)
 {
 	int son = h->elements;
 
@@ -175,30 +224,34 @@ heap_insert(struct dn_heap *h, uint64_t key1, void *p)
 	return 0;
 }
 
+/* index of the element to extract, the top one if obj == NULL */
+static int
+heap_index(struct dn_heap *h, void *obj)
+{
+	int i;
+
+	if (obj == NULL)
+		return 0;
+	if (h->ofs <= 0)
+		panic("%s: extract from middle not set on %p\n",
+			__FUNCTION__, h);
+	i = *((int *)((char *)obj + h->ofs));
+	if (i < 0 || i >= h->elements) {
+		panic("%s: father %d out of bound 0..%d\n",
+			__FUNCTION__, i, h->elements);
+	}
+	return i;
+}
+
 /*
  * remove top element from heap, or obj if obj != NULL
  */
-void
-heap_extract(struct dn_heap *h, void *obj)
+static void
+heap2_extract(struct dn_heap *h, void *obj)
 {
 	int child, father, max = h->elements - 1;
 
-	if (max < 0) {
-		printf("--- %s: empty heap 0x%p\n", __FUNCTION__, h);
-		return;
-	}
-	if (obj == NULL)
-		father = 0; /* default: move up smallest child */
-	else { /* extract specific element, index is at offset */
-		if (h->ofs <= 0)
-			panic("%s: extract from middle not set on %p\n",
-				__FUNCTION__, h);
-		father = *((int *)((char *)obj + h->ofs));
-		if (father < 0 || father >= h->elements) {
-			panic("%s: father %d out of bound 0..%d\n",
-				__FUNCTION__, father, h->elements);
-		}
-	}
+	father = heap_index(h, obj);
 	/*
 	 * below, father is the index of the empty element, which
 	 * we replace at each step with the smallest child until we
@@ -221,10 +274,112 @@ heap_extract(struct dn_heap *h, void *obj)
 		 * reusing the insert code
 		 */
 		h->p[father] = h->p[max];
-		heap_insert(h, father, NULL);
+		heap2_insert(h, father, NULL);
+	}
+}
+
+/* move the entry at 'son' up to its place */
+static void
+heap4_up(struct dn_heap *h, int son)
+{
+	struct dn_heap_entry *p = h->p, e = p[son];
+
+	while (son > 0) {
+		int father = HEAP4_FATHER(son);
+
+		if (DN_KEY_LT(p[father].key, e.key))
+			break;
+		p[son] = p[father];
+		SET_OFFSET(h, son);
+		son = father;
+	}
+	p[son] = e;
+	SET_OFFSET(h, son);
+}
+
+/*
+ * index of the smallest of the children starting at c, without
+ * branches on the keys for a full group as they are unpredictable.
+ */
+static inline int
+heap4_min_child(struct dn_heap_entry *p, int c, int n)
+{
+	int a, b;
+
+	if (c + 4 <= n) {
+		a = DN_KEY_LT(p[c + 1].key, p[c].key) ? c + 1 : c;
+		b = DN_KEY_LT(p[c + 3].key, p[c + 2].key) ? c + 3 : c + 2;
+		return DN_KEY_LT(p[b].key, p[a].key) ? b : a;
+	}
+	for (a = c, b = c + 1; b < n; b++) {
+		if (DN_KEY_LT(p[b].key, p[a].key))
+			a = b;
+	}
+	return a;
+}
+
+static int
+heap4_insert(struct dn_heap *h, uint64_t key1, void *p)
+{
+	int son = h->elements;
+
+	if (son == h->size && heap_resize(h, h->elements + 16))
+		return 1;
+	h->p[son].object = p;
+	h->p[son].key = key1;
+	h->elements++;
+	heap4_up(h, son);
+	return 0;
+}
+
+/*
+ * As for the binary heap, move the smallest child into the hole
+ * down to the last level, then fill it with the last entry.
+ */
+static void
+heap4_extract(struct dn_heap *h, void *obj)
+{
+	struct dn_heap_entry *p = h->p;
+	int father = heap_index(h, obj), max = --h->elements, child;
+
+	RESET_OFFSET(h, father);
+	while ((child = HEAP4_FIRST(father)) < max) {
+		child = heap4_min_child(p, child, max);
+		p[father] = p[child];
+		SET_OFFSET(h, father);
+		father = child;
+	}
+	if (father != max) {
+		p[father] = p[max];
+		heap4_up(h, father);
 	}
 }
 
+int
+heap_insert(struct dn_heap *h, uint64_t key1, void *p)
+{
+	if (h->type == DN_HEAP_4ARY)
+		return heap4_insert(h, key1, p);
+	if (h->type == DN_HEAP_CALENDAR)
+		return cq_insert(h, key1, p);
+	return heap2_insert(h, key1, p);
+}
+
+void
+heap_extract(struct dn_heap *h, void *obj)
+{
+	if (h->elements <= 0) {
+		printf("--- %s: empty heap 0x%p\n", __FUNCTION__, h);
+		return;
+	}
+	if (h->type == DN_HEAP_4ARY)
+		heap4_extract(h, obj);
+	else if (h->type == DN_HEAP_CALENDAR)
+		cq_extract(h, obj);
+	else
+		heap2_extract(h, obj);
+}
+
 #if 0
 /*
  * change object position and update references
@@ -278,8 +433,13 @@ heapify(struct dn_heap *h)
 {
 	int i;
 
+	if (h->type == DN_HEAP_4ARY) {
+		for (i = 1; i < h->elements; i++)
+			heap4_up(h, i);
+		return;
+	}
 	for (i = 0; i < h->elements; i++ )
-		heap_insert(h, i , NULL);
+		heap2_insert(h, i , NULL);
 }
 
 int
@@ -288,6 +448,8 @@ heap_scan(struct dn_heap *h, int (*fn)(void *, uintptr_t),
 {
 	int i, ret, found;
 
+	if (h->type == DN_HEAP_CALENDAR)
+		return cq_scan(h, fn, arg);
 	for (i = found = 0 ; i < h->elements ;) {
 		ret = fn(h->p[i].object, arg);
 		if (ret & HEAP_SCAN_DEL) {
@@ -310,11 +472,357 @@ heap_scan(struct dn_heap *h, int (*fn)(void *, uintptr_t),
 void
 heap_free(struct dn_heap *h)
 {
-	if (h->size >0 )
-		free(h->p, M_DN_HEAP);
+	if (h->type == DN_HEAP_CALENDAR)
+		cq_free(h);
+	else if (h->size >0 )
+		free(h->base, M_DN_HEAP);
 	bzero(h, sizeof(*h) );
 }
 
+/*
+ * Calendar queue.
+ *
+ * Entries live in a pool of h->size records, and the index stored
+ * in the object (at h->ofs) is the position in the pool, which does
+ * not change while the entry is queued. Bucket b holds, sorted, the
+ * entries with (key >> shift) % nbuckets == b. Bucket widths are
+ * powers of 2 so that the mapping is continuous when keys wrap.
+ *
+ * We remember the bucket of the smallest entry (cur) and the end of
+ * its interval (top): the next smallest is the first head found
+ * scanning from cur whose key is below the top of its bucket in the
+ * current "year"; if there is none within a year we search directly.
+ * The number of buckets follows the number of entries, and the
+ * width is recomputed from the spread of the keys on each resize.
+ */
+struct dn_cq_entry {
+	struct dn_heap_entry e;	/* first, HEAP_TOP() points here */
+	int32_t next, prev;	/* bucket list, next also links free entries */
+	int32_t bucket;		/* -1 if free */
+};
+
+struct dn_cq {
+	uint32_t nbuckets;	/* power of 2 */
+	uint32_t shift;		/* bucket width is 1 << shift */
+	uint32_t cur;		/* bucket of the smallest entry */
+	uint64_t top;		/* end of the interval of cur */
+	int32_t min;		/* smallest entry, -1 if empty */
+	int32_t free;		/* free entries */
+	int32_t *head;		/* nbuckets sorted lists */
+	struct dn_cq_entry *e;	/* pool of h->size entries */
+};
+
+#define CQ_MIN_BUCKETS	16
+#define CQ_SHIFT	16	/* initial width, the ONE_FP of wf2q */
+
+#define CQ_SET_OFFSET(h, o, i) do {				\
+	if (h->ofs > 0)						\
+	    *((int32_t *)((char *)(o) + h->ofs)) = i;		\
+	} while (0)
+
+static inline uint32_t
+cq_bucket(struct dn_cq *cq, uint64_t key)
+{
+	return (key >> cq->shift) & (cq->nbuckets - 1);
+}
+
+/* make 'key' the smallest key, its bucket the current one */
+static inline void
+cq_set_cur(struct dn_cq *cq, uint64_t key)
+{
+	cq->cur = cq_bucket(cq, key);
+	cq->top = ((key >> cq->shift) + 1) << cq->shift;
+}
+
+/* insert entry i in its bucket, after entries with the same key */
+static void
+cq_link(struct dn_cq *cq, int32_t i)
+{
+	struct dn_cq_entry *e = cq->e;
+	uint64_t key = e[i].e.key;
+	uint32_t b = cq_bucket(cq, key);
+	int32_t j, prev = -1;
+
+	for (j = cq->head[b]; j >= 0 && DN_KEY_LEQ(e[j].e.key, key);
+	    j = e[j].next)
+		prev = j;
+	e[i].bucket = b;
+	e[i].prev = prev;
+	e[i].next = j;
+	if (prev < 0)
+		cq->head[b] = i;
+	else
+		e[prev].next = i;
+	if (j >= 0)
+		e[j].prev = i;
+}
+
+static void
+cq_unlink(struct dn_cq *cq, int32_t i)
+{
+	struct dn_cq_entry *e = cq->e;
+
+	if (e[i].prev < 0)
+		cq->head[e[i].bucket] = e[i].next;
+	else
+		e[e[i].prev].next = e[i].next;
+	if (e[i].next >= 0)
+		e[e[i].next].prev = e[i].prev;
+}
+
+/* grow the pool, putting new entries in the free list */
+static int
+cq_grow(struct dn_heap *h, unsigned int new_size)
+{
+	struct dn_cq *cq = h->base;
+	struct dn_cq_entry *e;
+	int i;
+
+	if ((unsigned int)h->size >= new_size)
+		return 0;
+	new_size |= new_size >> 1;
+	new_size |= new_size >> 2;
+	new_size |= new_size >> 4;
+	new_size |= new_size >> 8;
+	new_size |= new_size >> 16;
+	e = malloc(new_size * sizeof(*e), M_DN_HEAP, M_NOWAIT);
+	if (e == NULL) {
+		printf("--- %s, resize %d failed\n", __func__, new_size );
+		return 1;
+	}
+	if (h->size > 0) {
+		bcopy(cq->e, e, h->size * sizeof(*e));
+		free(cq->e, M_DN_HEAP);
+	}
+	for (i = new_size - 1; i >= h->size; i--) {
+		e[i].bucket = -1;
+		e[i].next = cq->free;
+		cq->free = i;
+	}
+	cq->e = e;
+	h->size = new_size;
+	h->p = cq->min >= 0 ? &e[cq->min].e : NULL;
+	return 0;
+}
+
+/*
+ * Rebuild the buckets with a new number of buckets and a width of
+ * about three times the average distance between keys.
+ */
+static int
+cq_rebucket(struct dn_heap *h, uint32_t nbuckets)
+{
+	struct dn_cq *cq = h->base;
+	struct dn_cq_entry *e = cq->e;
+	int32_t *head, i, min = -1;
+	uint64_t max = 0, width;
+	uint32_t b;
+
+	head = malloc(nbuckets * sizeof(*head), M_DN_HEAP, M_NOWAIT);
+	if (head == NULL)
+		return 1;	/* keep the old ones */
+	for (b = 0; b < nbuckets; b++)
+		head[b] = -1;
+	for (i = 0; i < h->size; i++) {
+		if (e[i].bucket >= 0 && (min < 0 ||
+		    DN_KEY_LT(e[i].e.key, e[min].e.key)))
+			min = i;
+	}
+	if (min >= 0 && h->elements > 1) {
+		for (i = 0; i < h->size; i++) {
+			if (e[i].bucket >= 0 && max < e[i].e.key - e[min].e.key)
+				max = e[i].e.key - e[min].e.key;
+		}
+		width = 3 * (max / h->elements);
+		for (cq->shift = 0; cq->shift < 63 &&
+		    (1ULL << cq->shift) < width; cq->shift++)
+			;
+	}
+	if (cq->head)
+		free(cq->head, M_DN_HEAP);
+	cq->head = head;
+	cq->nbuckets = nbuckets;
+	for (i = 0; i < h->size; i++) {
+		if (e[i].bucket >= 0)
+			cq_link(cq, i);
+	}
+	cq->min = min;
+	h->p = min >= 0 ? &e[min].e : NULL;
+	if (min >= 0)
+		cq_set_cur(cq, e[min].e.key);
+	return 0;
+}
+
+/* find the smallest entry after the previous one was removed */
+static void
+cq_find_min(struct dn_heap *h)
+{
+	struct dn_cq *cq = h->base;
+	struct dn_cq_entry *e = cq->e;
+	uint32_t mask = cq->nbuckets - 1, i, n;
+	uint64_t top = cq->top, w = 1ULL << cq->shift;
+	int32_t j, best = -1;
+
+	if (h->elements == 0) {
+		cq->min = -1;
+		h->p = NULL;
+		return;
+	}
+	for (i = cq->cur, n = 0; n < cq->nbuckets;
+	    n++, i = (i + 1) & mask, top += w) {
+		j = cq->head[i];
+		if (j >= 0 && DN_KEY_LT(e[j].e.key, top)) {
+			cq->cur = i;
+			cq->top = top;
+			cq->min = j;
+			h->p = &e[j].e;
+			return;
+		}
+	}
+	/* nothing within a year, look at all heads */
+	for (i = 0; i < cq->nbuckets; i++) {
+		j = cq->head[i];
+		if (j >= 0 && (best < 0 || DN_KEY_LT(e[j].e.key, e[best].e.key)))
+			best = j;
+	}
+	cq_set_cur(cq, e[best].e.key);
+	cq->min = best;
+	h->p = &e[best].e;
+}
+
+static int
+cq_init(struct dn_heap *h, int size)
+{
+	struct dn_cq *cq = h->base;
+	uint32_t b;
+	int i;
+
+	if (cq == NULL) {
+		cq = malloc(sizeof(*cq), M_DN_HEAP, M_NOWAIT);
+		if (cq == NULL)
+			return 1;
+		bzero(cq, sizeof(*cq));
+		cq->min = cq->free = -1;
+		cq->shift = CQ_SHIFT;
+		h->base = cq;
+		if (cq_rebucket(h, CQ_MIN_BUCKETS)) {
+			cq_free(h);
+			return 1;
+		}
+	} else {	/* drop all entries */
+		for (b = 0; b < cq->nbuckets; b++)
+			cq->head[b] = -1;
+		cq->free = -1;
+		for (i = h->size - 1; i >= 0; i--) {
+			cq->e[i].bucket = -1;
+			cq->e[i].next = cq->free;
+			cq->free = i;
+		}
+		cq->min = -1;
+		h->p = NULL;
+	}
+	h->elements = 0;
+	return cq_grow(h, size);
+}
+
+static int
+cq_insert(struct dn_heap *h, uint64_t key1, void *p)
+{
+	struct dn_cq *cq = h->base;
+	int32_t i;
+
+	if (cq->free < 0 && cq_grow(h, h->size + 16))
+		return 1;
+	i = cq->free;
+	cq->free = cq->e[i].next;
+	cq->e[i].e.key = key1;
+	cq->e[i].e.object = p;
+	cq_link(cq, i);
+	CQ_SET_OFFSET(h, p, i);
+	h->elements++;
+	if (cq->min < 0 || DN_KEY_LT(key1, cq->e[cq->min].e.key)) {
+		cq->min = i;
+		cq_set_cur(cq, key1);
+	}
+	h->p = &cq->e[cq->min].e;
+	if ((uint32_t)h->elements > 2 * cq->nbuckets)
+		cq_rebucket(h, 2 * cq->nbuckets);
+	return 0;
+}
+
+static void
+cq_remove(struct dn_heap *h, int32_t i)
+{
+	struct dn_cq *cq = h->base;
+
+	CQ_SET_OFFSET(h, cq->e[i].e.object, -16);
+	cq_unlink(cq, i);
+	cq->e[i].bucket = -1;
+	cq->e[i].next = cq->free;
+	cq->free = i;
+	h->elements--;
+}
+
+static void
+cq_extract(struct dn_heap *h, void *obj)
+{
+	struct dn_cq *cq = h->base;
+	int32_t i = cq->min;
+
+	if (obj != NULL) {
+		if (h->ofs <= 0)
+			panic("%s: extract from middle not set on %p\n",
+				__FUNCTION__, h);
+		i = *((int32_t *)((char *)obj + h->ofs));
+		if (i < 0 || i >= h->size || cq->e[i].bucket < 0)
+			panic("%s: entry %d not in use 0..%d\n",
+				__FUNCTION__, i, h->size);
+	}
+	cq_remove(h, i);
+	if (cq->nbuckets > CQ_MIN_BUCKETS &&
+	    (uint32_t)h->elements < cq->nbuckets / 2)
+		cq_rebucket(h, cq->nbuckets / 2);
+	else if (i == cq->min)
+		cq_find_min(h);
+}
+
+static int
+cq_scan(struct dn_heap *h, int (*fn)(void *, uintptr_t), uintptr_t arg)
+{
+	struct dn_cq *cq = h->base;
+	int i, ret, found = 0;
+
+	for (i = 0; i < h->size; i++) {
+		if (cq->e[i].bucket < 0)
+			continue;
+		ret = fn(cq->e[i].e.object, arg);
+		if (ret & HEAP_SCAN_DEL) {
+			cq_remove(h, i);
+			found++;
+		}
+		if (ret & HEAP_SCAN_END)
+			break;
+	}
+	if (found)	/* also finds the new minimum */
+		cq_rebucket(h, cq->nbuckets);
+	return found;
+}
+
+static void
+cq_free(struct dn_heap *h)
+{
+	struct dn_cq *cq = h->base;
+
+	if (cq == NULL)
+		return;
+	if (cq->e)
+		free(cq->e, M_DN_HEAP);
+	if (cq->head)
+		free(cq->head, M_DN_HEAP);
+	free(cq, M_DN_HEAP);
+	h->base = NULL;
+}
+
 /*
  * hash table support.
  */
@@ -63,8 +63,39 @@ struct dn_heap {
 	int elements;	/* elements in use */
 	int ofs;	/* offset in the object of heap index */
 	struct dn_heap_entry *p;	/* array of "size" entries */
+	int type;	/* DN_HEAP_*, set by heap_init() */
+	void *base;	/* memory block, or calendar queue state */
 };
 
+/*
+ * Available implementations, all behind the same API:
+ *
+ * DN_HEAP_BINARY	the classic binary heap.
+ * DN_HEAP_4ARY		4-ary heap, with the array aligned so that the
+ *	four children of a node share one cache line. Half the depth
+ *	of the binary heap, and one miss per level.
+ * DN_HEAP_CALENDAR	calendar queue (R. Brown, CACM 1988): a ring of
+ *	buckets of sorted lists, resized with the number of elements,
+ *	O(1) average insert and extract when keys are spread evenly.
+ *	Here 'p' points to the smallest entry rather than to an array,
+ *	so HEAP_TOP() works as for the heaps.
+ *
+ * heap_init() on a fresh (zeroed) heap uses dn_heap_type, whose
+ * default can be chosen at build time with -DDN_HEAP_DEFAULT=...
+ */
+enum {
+	DN_HEAP_BINARY = 0,
+	DN_HEAP_4ARY,
+	DN_HEAP_CALENDAR,
+};
+
+#ifndef DN_HEAP_DEFAULT
+#define DN_HEAP_DEFAULT	DN_HEAP_4ARY
+#endif
+
+extern int dn_heap_type;
+int dn_heap_type_parse(const char *name);
+
 enum {
 	HEAP_SCAN_DEL = 1,
 	HEAP_SCAN_END = 2,
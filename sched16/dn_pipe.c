@@ -0,0 +1,254 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Link emulation pipe, see dn_pipe.h
+ */
+
+#include <dn_test.h>
+
+#define PIPE_TABLE_SIZE	4096	/* jitter samples, power of 2 */
+#define PIPE_MAX_SLOTS	(1 << 20)
+#define PIPE_TAIL	8	/* longest jitter, in units of p->jitter */
+#define PIPE_NIL	~0U
+
+static inline uint64_t
+pipe_rand(struct dn_pipe *p)	/* xorshift */
+{
+	p->seed ^= p->seed << 13;
+	p->seed ^= p->seed >> 7;
+	p->seed ^= p->seed << 17;
+	return p->seed;
+}
+
+/* no libm here, the table is built once */
+static double
+pipe_sqrt(double x)
+{
+	double r = x > 1 ? x : 1;
+	int i;
+
+	for (i = 0; i < 64 && x > 0; i++)
+		r = (r + x / r) / 2;
+	return x > 0 ? r : 0;
+}
+
+/* a sample of the distribution, in units of p->jitter */
+static double
+pipe_sample(struct dn_pipe *p, int dist)
+{
+	double u = ((pipe_rand(p) >> 11) + 1) * (1.0 / (1ULL << 53));
+	double x = 0;
+	int i;
+
+	switch (dist) {
+	case PIPE_DIST_UNIFORM:	/* in [-1, 1] */
+		x = 2 * u - 1;
+		break;
+	case PIPE_DIST_NORMAL:	/* sum of 12 uniforms, sigma 1 */
+		for (i = 0; i < 12; i++)
+			x += ((pipe_rand(p) >> 11) * (1.0 / (1ULL << 53)));
+		x -= 6;
+		break;
+	case PIPE_DIST_PARETO:	/* alpha 2, mean 1, never negative */
+		x = 1 / pipe_sqrt(u) - 1;
+		break;
+	}
+	if (x > PIPE_TAIL)
+		x = PIPE_TAIL;
+	if (x < -PIPE_TAIL)
+		x = -PIPE_TAIL;
+	return x;
+}
+
+/*
+ * The spec is a comma-separated list of
+ *     delay=TIME jitter=TIME dist=uniform|normal|pareto loss=P[%] reorder
+ * Jitter defaults to a uniform distribution.
+ */
+int
+pipe_parse(struct dn_pipe_parms *p, const char *spec)
+{
+	char *s = strdup(spec), *next = s, *cur;
+	int ret = 0;
+
+	if (s == NULL)
+		return ENOMEM;
+	bzero(p, sizeof(*p));
+	while ((cur = strsep(&next, ",")) != NULL) {
+		char *key = strsep(&cur, "=");
+		uint64_t t;
+
+		if (!strcmp(key, "reorder")) {
+			p->reorder = 1;
+		} else if (cur == NULL) {
+			ret = EINVAL;
+		} else if (!strcmp(key, "delay") || !strcmp(key, "jitter")) {
+			t = parse_time(cur);
+			if (t == U_PARSE_ERR)
+				ret = EINVAL;
+			else if (key[0] == 'd')
+				p->delay = NS2TSC(t);
+			else
+				p->jitter = NS2TSC(t);
+		} else if (!strcmp(key, "dist")) {
+			if (!strcmp(cur, "uniform"))
+				p->dist = PIPE_DIST_UNIFORM;
+			else if (!strcmp(cur, "normal"))
+				p->dist = PIPE_DIST_NORMAL;
+			else if (!strcmp(cur, "pareto"))
+				p->dist = PIPE_DIST_PARETO;
+			else
+				ret = EINVAL;
+		} else if (!strcmp(key, "loss")) {
+			char *ep;
+			double d = strtod(cur, &ep);
+
+			if (*ep == '%')
+				d /= 100;
+			if (ep == cur || d < 0 || d > 1)
+				ret = EINVAL;
+			else
+				p->loss = d * 4294967295.0;
+		} else {
+			ret = EINVAL;
+		}
+		if (ret) {
+			D("invalid pipe parameter %s", key);
+			break;
+		}
+	}
+	free(s);
+	if (p->jitter && p->dist == PIPE_DIST_NONE)
+		p->dist = PIPE_DIST_UNIFORM;
+	return ret;
+}
+
+/* 'capacity' is the largest number of packets in the pipe */
+int
+pipe_init(struct dn_pipe *p, const struct dn_pipe_parms *parms,
+	uint32_t capacity, uint64_t now)
+{
+	uint64_t max = parms->delay + PIPE_TAIL * parms->jitter;
+	uint64_t gran = NS2TSC(1000);	/* 1us, unless too many slots */
+	uint32_t i, n;
+
+	bzero(p, sizeof(*p));
+	p->p = *parms;
+	if (gran == 0)
+		gran = 1;
+	while (max / gran + 2 > PIPE_MAX_SLOTS)
+		gran <<= 1;
+	for (n = 64; n < max / gran + 2; n <<= 1)
+		;
+	p->slot = malloc(n * sizeof(*p->slot));
+	p->ent = calloc(capacity, sizeof(*p->ent));
+	p->table = calloc(PIPE_TABLE_SIZE, sizeof(*p->table));
+	if (p->slot == NULL || p->ent == NULL || p->table == NULL) {
+		pipe_free(p);
+		return ENOMEM;
+	}
+	for (i = 0; i < n; i++)
+		p->slot[i].head = p->slot[i].tail = PIPE_NIL;
+	for (i = 0; i < capacity; i++)
+		p->ent[i].next = i + 1 < capacity ? i + 1 : PIPE_NIL;
+	p->free = capacity ? 0 : PIPE_NIL;
+	p->nslots = n;
+	p->gran = gran;
+	p->cur = now / gran;
+	p->last = now;
+	p->seed = 88172645463325252ULL ^ now;
+	for (i = 0; i < PIPE_TABLE_SIZE; i++)
+		p->table[i] = pipe_sample(p, parms->dist) * parms->jitter;
+	return 0;
+}
+
+void
+pipe_free(struct dn_pipe *p)
+{
+	free(p->slot);
+	free(p->ent);
+	free(p->table);
+	bzero(p, sizeof(*p));
+}
+
+/*
+ * Put a packet that finishes transmission at 'now' in the pipe.
+ * Returns nonzero if the packet is lost (or the pipe is full), in
+ * which case the caller still owns it.
+ */
+int
+pipe_insert(struct dn_pipe *p, struct mbuf *m, uint64_t now)
+{
+	uint64_t r = pipe_rand(p), due, i;
+	int64_t d = p->p.delay;
+	struct dn_pipe_slot *s;
+	uint32_t e;
+
+	if ((uint32_t)r < p->p.loss || p->free == PIPE_NIL) {
+		p->lost++;
+		return 1;
+	}
+	if (p->p.jitter) {
+		d += p->table[(r >> 32) & (PIPE_TABLE_SIZE - 1)];
+		if (d < 0)
+			d = 0;
+	}
+	due = now + d;
+	if (!p->p.reorder && DN_KEY_LT(due, p->last))
+		due = p->last;
+	p->last = due;
+	i = due / p->gran;
+	if (i < p->cur)
+		i = p->cur;
+	else if (i - p->cur >= p->nslots)	/* not with sane clocks */
+		i = p->cur + p->nslots - 1;
+
+	e = p->free;
+	p->free = p->ent[e].next;
+	p->ent[e].m = m;
+	p->ent[e].next = PIPE_NIL;
+	s = &p->slot[i & (p->nslots - 1)];
+	if (s->head == PIPE_NIL)
+		s->head = e;
+	else
+		p->ent[s->tail].next = e;
+	s->tail = e;
+	p->queued++;
+	return 0;
+}
+
+/*
+ * Call cb() on the packets due by 'now', in order, at most one slot
+ * late. Returns how many.
+ */
+uint32_t
+pipe_run(struct dn_pipe *p, uint64_t now, pipe_cb_t cb, void *arg)
+{
+	uint64_t end = now / p->gran;
+	uint32_t n = 0, e;
+
+	if (p->queued == 0) {
+		p->cur = end;
+		return 0;
+	}
+	for (; p->cur < end && p->queued > n; p->cur++) {
+		struct dn_pipe_slot *s = &p->slot[p->cur & (p->nslots - 1)];
+
+		for (e = s->head; e != PIPE_NIL;) {
+			uint32_t next = p->ent[e].next;
+
+			cb(arg, p->ent[e].m);
+			p->ent[e].next = p->free;
+			p->free = e;
+			e = next;
+			n++;
+		}
+		s->head = s->tail = PIPE_NIL;
+	}
+	p->queued -= n;
+	if (p->queued == 0)
+		p->cur = end;
+	return n;
+}
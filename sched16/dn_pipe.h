@@ -0,0 +1,70 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Link emulation pipe, applied to packets after they leave the
+ * scheduler: each packet is delayed by a fixed propagation delay
+ * plus a random jitter, and may be lost.
+ *
+ * Delayed packets sit in a delay line, a timing wheel where slot i
+ * holds the packets due in [i*gran, (i+1)*gran). The wheel covers
+ * the largest delay, so there are no later turns to skip, and slots
+ * are FIFO. Unless reordering is enabled a packet is never due
+ * before the previous one, as on a real link, so jitter only
+ * stretches the gaps between packets. Jitter comes from a table of
+ * samples of the distribution, as netem does, and random numbers
+ * from xorshift, so a packet costs a few ns.
+ * All times are in TSC ticks.
+ */
+
+#ifndef _DN_PIPE_H
+#define _DN_PIPE_H
+
+#define PIPE_DIST_NONE		0
+#define PIPE_DIST_UNIFORM	1
+#define PIPE_DIST_NORMAL	2
+#define PIPE_DIST_PARETO	3
+
+struct dn_pipe_parms {
+	uint64_t	delay;		/* propagation delay */
+	uint64_t	jitter;		/* scale of the distribution */
+	int		dist;		/* PIPE_DIST_* */
+	uint32_t	loss;		/* probability, in units of 2^-32 */
+	int		reorder;	/* let jitter reorder packets */
+};
+
+struct dn_pipe_ent {
+	struct mbuf	*m;
+	uint32_t	next;		/* in the slot, or in the freelist */
+};
+
+struct dn_pipe_slot {
+	uint32_t	head, tail;
+};
+
+struct dn_pipe {
+	struct dn_pipe_parms p;
+	uint32_t	nslots;		/* power of 2 */
+	uint64_t	gran;		/* tsc ticks per slot */
+	uint64_t	cur;		/* next slot to expire, in units of gran */
+	uint64_t	last;		/* due time of the last packet */
+	uint32_t	queued;		/* packets in the pipe */
+	uint32_t	free;		/* freelist of entries */
+	struct dn_pipe_slot *slot;
+	struct dn_pipe_ent *ent;
+	int64_t		*table;		/* jitter samples, PIPE_TABLE_SIZE */
+	uint64_t	seed;
+	uint64_t	lost;
+};
+
+typedef void (*pipe_cb_t)(void *arg, struct mbuf *m);
+
+int pipe_parse(struct dn_pipe_parms *p, const char *spec);
+int pipe_init(struct dn_pipe *p, const struct dn_pipe_parms *parms,
+	uint32_t capacity, uint64_t now);
+void pipe_free(struct dn_pipe *p);
+int pipe_insert(struct dn_pipe *p, struct mbuf *m, uint64_t now);
+uint32_t pipe_run(struct dn_pipe *p, uint64_t now, pipe_cb_t cb, void *arg);
+
+#endif /* _DN_PIPE_H */
@@ -159,11 +159,7 @@ int ipdn_bound_var(int *v, int dflt, int lo, int hi, const char *msg);
 static __inline struct mbuf *
 mq_peek(struct mq *q)
 {
-#ifdef MY_MQ_LEN /* array based implementation */
-	return (q->q_head == q->q_tail)  ? NULL : q->q[q->q_head];
-#else /* !MY_MQ_LEN */
-	return q->head;
-#endif /* !MY_MQ_LEN */
+	return q->head;	/* also in the array based implementation */
 }
 
 static __inline struct mbuf *
@@ -176,12 +172,12 @@ mq_dequeue(struct mq *q)
 		return NULL;
 	}
 #ifdef MY_MQ_LEN /* array based implementation */
-	D("q %d h %d t %d", q->fid, q->q_head, q->q_tail);
-	if (q->head != NULL) /* clear insert flag */
-		q->head = NULL;
 	q->q_head++;
-	if (q->q_head == q->q_len)
-		q->q_head = 0;
+	q->head = q->q_head == q->q_tail ? NULL :
+		q->q[q->q_head & (q->q_len - 1)];
+	/* the scheduler reads the next mbuf soon, to get its length */
+	if (q->head != NULL)
+		__builtin_prefetch(q->head);
 #else /* !MY_MQ_LEN */
 	q->head = m->m_nextpkt;
 	q->count--;
@@ -203,10 +199,10 @@ dn_dequeue(struct dn_queue *q)
 #if 1 // XXX this is racy ndef MY_MQ_LEN
 	/* Update stats for the queue */
 	q->ni.length--;
-	q->ni.len_bytes -= m->iov.iov_len;
+	q->ni.len_bytes -= m->len;
 	if (q->_si) {
 		q->_si->ni.length--;
-		q->_si->ni.len_bytes -= m->iov.iov_len;
+		q->_si->ni.len_bytes -= m->len;
 	}
 	if (q->ni.length == 0) /* queue is now idle */
 		q->q_time = dn_cfg.curr_time;
@@ -80,7 +80,12 @@ fifo_new_sched(struct dn_sch_inst *si)
         set_oid(&q->ni.oid, DN_QUEUE, sizeof(*q));
 	q->_si = si;
 	q->fs = si->sched->fs;
+#ifdef MY_MQ_LEN
+	/* one queue for all flows, as large as the limit in dn_enqueue() */
+	return mq_init(&q->mq, MY_MQ_MAX);
+#else
 	return 0;
+#endif
 }
 
 static int
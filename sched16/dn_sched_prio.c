@@ -0,0 +1,307 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Strict priority scheduler with weighted bands.
+ *
+ * Each flowset belongs to a band, fs.par[2] (0 is the highest
+ * priority, up to PRIO_MAX_BANDS - 1). Bands are served in strict
+ * priority order, and the flows within a band share it through a
+ * band scheduler, DRR ("prio") or QFQ ("prio_qfq"), so a class of
+ * marks can get low latency while the others keep their weights.
+ *
+ * The backlogged bands are a bitmap, and the next band is found
+ * with ffs() as QFQ does for its groups. A band can have a token
+ * bucket rate cap (see -bands): once over its cap the band is
+ * only served when no conforming band has traffic, so a busy high
+ * priority class cannot starve the lower ones, and the scheduler
+ * stays work conserving.
+ *
+ * The band schedulers are ordinary dn_alg instances: each band has
+ * its own instance, queues point to it through q->_si, and the
+ * parameters of the band scheduler sit right after dn_schk, where
+ * it expects them.
+ */
+
+#include <dn_test.h>
+
+#define DN_SCHED_PRIO	12
+#define DN_SCHED_PRIO_QFQ	13
+
+#define PRIO_MAX_BANDS	8
+#define PRIO_SCHK_DATA	64	/* room for the band scheduler parameters */
+#define PRIO_Q_DATA	64	/* room for the band scheduler queue data */
+#define PRIO_MIN_BURST	(2 * 1514)	/* bytes */
+#define PRIO_KF_BAND	0x8000	/* kflags of band instances */
+
+extern moduledata_t *_g_dn_rr;
+extern moduledata_t *_g_dn_qfq;
+
+/* right after dn_schk */
+struct prio_schk {
+	/* the parameters of the band scheduler, must be first */
+	uint64_t	sub_data[PRIO_SCHK_DATA / sizeof(uint64_t)];
+	struct dn_alg	*sub;		/* the band scheduler */
+	uint32_t	capped;		/* bitmap of the bands with a cap */
+	struct tb_parms	cap[PRIO_MAX_BANDS];
+};
+
+/* a band instance, followed by the data of the band scheduler */
+struct prio_band {
+	struct dn_sch_inst *parent;
+	struct dn_sch_inst si;		/* must be last */
+};
+
+/* right after dn_sch_inst */
+struct prio_si {
+	uint32_t	active;		/* bitmap of backlogged bands */
+	struct prio_band *band[PRIO_MAX_BANDS];
+	struct dn_shaper tb[PRIO_MAX_BANDS];	/* only tat is used */
+	uint64_t	borrowed;	/* packets sent over the cap */
+};
+
+static inline struct dn_sch_inst *
+prio_parent(struct dn_sch_inst *si)
+{
+	if (si->kflags & PRIO_KF_BAND)
+		return ((struct prio_band *)
+		    ((char *)si - offsetof(struct prio_band, si)))->parent;
+	return si;
+}
+
+static int
+prio_enqueue(struct dn_sch_inst *_si, struct dn_queue *q, struct mbuf *m)
+{
+	struct prio_si *si = (struct prio_si *)(_si + 1);
+	struct prio_schk *schk = (struct prio_schk *)(_si->sched + 1);
+
+	if (schk->sub->enqueue(q->_si, q, m))
+		return 1;
+	si->active |= 1U << q->fs->fs.par[2];
+	return 0;
+}
+
+/* dequeue from band b, forget the band when it is empty */
+static inline struct mbuf *
+prio_serve(struct prio_si *si, struct prio_schk *schk, int b, uint64_t now)
+{
+	struct mbuf *m = schk->sub->dequeue(&si->band[b]->si);
+
+	if (m == NULL)
+		si->active &= ~(1U << b);
+	else if (schk->capped & (1U << b))
+		tb_charge(&si->tb[b], &schk->cap[b], now, m->len);
+	return m;
+}
+
+static struct mbuf *
+prio_dequeue(struct dn_sch_inst *_si)
+{
+	struct prio_si *si = (struct prio_si *)(_si + 1);
+	struct prio_schk *schk = (struct prio_schk *)(_si->sched + 1);
+	uint32_t todo = si->active, over = 0;
+	uint64_t now = 0;
+	struct mbuf *m;
+	int b;
+
+	if (todo & schk->capped)
+		now = rdtsc();
+	while (todo) {
+		b = ffs(todo) - 1;
+		todo &= ~(1U << b);
+		if ((schk->capped & (1U << b)) &&
+		    !tb_conform(&si->tb[b], &schk->cap[b], now)) {
+			over |= 1U << b;
+			continue;
+		}
+		if ((m = prio_serve(si, schk, b, now)) != NULL)
+			return m;
+	}
+	/* only bands over their cap have traffic, do not idle */
+	while (over) {
+		b = ffs(over) - 1;
+		over &= ~(1U << b);
+		if ((m = prio_serve(si, schk, b, now)) != NULL) {
+			si->borrowed++;
+			return m;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The caps come from the extra parameters, rate (bit/s) and burst
+ * (bytes) of band b in par[2b] and par[2b+1]. The burst defaults to
+ * 1ms at the given rate.
+ */
+static int
+prio_config(struct dn_schk *_schk)
+{
+	struct prio_schk *schk = (struct prio_schk *)(_schk + 1);
+	struct dn_extra_parms *ep = (struct dn_extra_parms *)_schk->cfg;
+	uint32_t b;
+
+	schk->sub = _schk->fp->type == DN_SCHED_PRIO ?
+	    _g_dn_rr->p : _g_dn_qfq->p;
+	if (schk->sub->schk_datalen > sizeof(schk->sub_data) ||
+	    schk->sub->q_datalen > PRIO_Q_DATA) {
+		D("%s does not fit in a band", schk->sub->name);
+		return EINVAL;
+	}
+	schk->capped = 0;
+	for (b = 0; ep && b < PRIO_MAX_BANDS && 2 * b + 1 < ep->nr; b++) {
+		uint64_t rate = ep->par[2 * b], burst = ep->par[2 * b + 1];
+
+		if (rate == 0)
+			continue;
+		if (burst == 0)
+			burst = rate / 8 / 1000;
+		if (burst < PRIO_MIN_BURST)
+			burst = PRIO_MIN_BURST;
+		tb_config(&schk->cap[b], rate, burst);
+		schk->capped |= 1U << b;
+		DX(1, "band %u capped at %llu bps burst %llu bytes", b,
+			(unsigned long long)rate, (unsigned long long)burst);
+	}
+	if (schk->sub->config)
+		return schk->sub->config(_schk);
+	return 0;
+}
+
+static int
+prio_free_sched(struct dn_sch_inst *_si)
+{
+	struct prio_si *si = (struct prio_si *)(_si + 1);
+	struct prio_schk *schk = (struct prio_schk *)(_si->sched + 1);
+	int b;
+
+	for (b = 0; b < PRIO_MAX_BANDS; b++) {
+		if (si->band[b] == NULL)
+			continue;
+		if (schk->sub->free_sched)
+			schk->sub->free_sched(&si->band[b]->si);
+		free(si->band[b]);
+		si->band[b] = NULL;
+	}
+	return 0;
+}
+
+static int
+prio_new_sched(struct dn_sch_inst *_si)
+{
+	struct prio_si *si = (struct prio_si *)(_si + 1);
+	struct prio_schk *schk = (struct prio_schk *)(_si->sched + 1);
+	int b;
+
+	bzero(si, sizeof(*si));
+	for (b = 0; b < PRIO_MAX_BANDS; b++) {
+		struct prio_band *band = calloc(1,
+		    sizeof(*band) + schk->sub->si_datalen);
+
+		if (band == NULL) {
+			prio_free_sched(_si);
+			return ENOMEM;
+		}
+		band->parent = _si;
+		band->si.sched = _si->sched;
+		band->si.kflags = PRIO_KF_BAND;
+		si->band[b] = band;
+		if (schk->sub->new_sched)
+			schk->sub->new_sched(&band->si);
+	}
+	return 0;
+}
+
+static int
+prio_new_fsk(struct dn_fsk *fs)
+{
+	struct prio_schk *schk = (struct prio_schk *)(fs->sched + 1);
+
+	ipdn_bound_var(&fs->fs.par[2], 0, 0, PRIO_MAX_BANDS - 1,
+		"prio band");
+	if (schk->sub->new_fsk)
+		return schk->sub->new_fsk(fs);
+	return 0;
+}
+
+/*
+ * Called with q->_si pointing to the instance, or to the band it was
+ * in if the queue is being reconfigured.
+ */
+static int
+prio_new_queue(struct dn_queue *q)
+{
+	struct dn_sch_inst *_si = prio_parent(q->_si);
+	struct prio_si *si = (struct prio_si *)(_si + 1);
+	struct prio_schk *schk = (struct prio_schk *)(_si->sched + 1);
+	int b = q->fs->fs.par[2];
+
+	q->_si = &si->band[b]->si;
+	if (schk->sub->new_queue)
+		schk->sub->new_queue(q);
+	if (q->mq.head != NULL)
+		si->active |= 1U << b;
+	return 0;
+}
+
+static int
+prio_free_queue(struct dn_queue *q)
+{
+	struct prio_schk *schk = (struct prio_schk *)(q->_si->sched + 1);
+
+	/* the band bit goes away on the next dequeue, if empty */
+	if (schk->sub->free_queue)
+		return schk->sub->free_queue(q);
+	return 0;
+}
+
+/*
+ * PRIO scheduler descriptors, one per band scheduler.
+ */
+static struct dn_alg prio_desc = {
+	_SI( .type = ) DN_SCHED_PRIO,
+	_SI( .name = ) "PRIO",
+	_SI( .flags = ) DN_MULTIQUEUE,
+
+	_SI( .schk_datalen = ) sizeof(struct prio_schk),
+	_SI( .si_datalen = ) sizeof(struct prio_si),
+	_SI( .q_datalen = ) PRIO_Q_DATA,
+
+	_SI( .enqueue = ) prio_enqueue,
+	_SI( .dequeue = ) prio_dequeue,
+
+	_SI( .config = ) prio_config,
+	_SI( .destroy = ) NULL,
+	_SI( .new_sched = ) prio_new_sched,
+	_SI( .free_sched = ) prio_free_sched,
+	_SI( .new_fsk = ) prio_new_fsk,
+	_SI( .free_fsk = ) NULL,
+	_SI( .new_queue = ) prio_new_queue,
+	_SI( .free_queue = ) prio_free_queue,
+};
+
+static struct dn_alg prio_qfq_desc = {
+	_SI( .type = ) DN_SCHED_PRIO_QFQ,
+	_SI( .name = ) "PRIO_QFQ",
+	_SI( .flags = ) DN_MULTIQUEUE,
+
+	_SI( .schk_datalen = ) sizeof(struct prio_schk),
+	_SI( .si_datalen = ) sizeof(struct prio_si),
+	_SI( .q_datalen = ) PRIO_Q_DATA,
+
+	_SI( .enqueue = ) prio_enqueue,
+	_SI( .dequeue = ) prio_dequeue,
+
+	_SI( .config = ) prio_config,
+	_SI( .destroy = ) NULL,
+	_SI( .new_sched = ) prio_new_sched,
+	_SI( .free_sched = ) prio_free_sched,
+	_SI( .new_fsk = ) prio_new_fsk,
+	_SI( .free_fsk = ) NULL,
+	_SI( .new_queue = ) prio_new_queue,
+	_SI( .free_queue = ) prio_free_queue,
+};
+
+DECLARE_DNSCHED_MODULE(dn_prio, &prio_desc);
+DECLARE_DNSCHED_MODULE(dn_prio_qfq, &prio_qfq_desc);
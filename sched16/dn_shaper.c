@@ -0,0 +1,105 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Token bucket parameters and the timer wheel used by the shapers,
+ * see dn_shaper.h
+ */
+
+#include <dn_test.h>
+
+void
+tb_config(struct tb_parms *p, uint64_t rate, uint64_t burst_bytes)
+{
+	p->rate = rate;
+	if (rate == 0) {
+		p->tsc_per_byte = p->burst = 0;
+		return;
+	}
+	p->tsc_per_byte = ((double)ticks_per_second * 8 / rate) *
+		(1 << TB_SHIFT);
+	p->burst = (burst_bytes * p->tsc_per_byte) >> TB_SHIFT;
+}
+
+int
+wheel_init(struct dn_wheel *w, uint32_t nslots, uint64_t gran, uint64_t now)
+{
+	if (nslots == 0 || (nslots & (nslots - 1)) != 0 || gran == 0) {
+		D("invalid wheel %u slots gran %llu", nslots,
+			(unsigned long long)gran);
+		return EINVAL;
+	}
+	w->slot = calloc(nslots, sizeof(*w->slot));
+	if (w->slot == NULL)
+		return ENOMEM;
+	w->nslots = nslots;
+	w->gran = gran;
+	w->cur = now / gran;
+	w->next_time = (w->cur + 1) * gran;
+	return 0;
+}
+
+void
+wheel_free(struct dn_wheel *w)
+{
+	free(w->slot);
+	bzero(w, sizeof(*w));
+}
+
+void
+wheel_insert(struct dn_wheel *w, struct dn_shaper *s, uint64_t when)
+{
+	uint64_t i = when / w->gran;
+	struct dn_shaper **h;
+
+	if (i < w->cur) /* late, expire at the next run */
+		i = w->cur;
+	h = &w->slot[i & (w->nslots - 1)];
+	s->when = when;
+	s->on_wheel = 1;
+	s->next = *h;
+	*h = s;
+}
+
+/*
+ * Expire the entries of all slots that are entirely in the past,
+ * calling cb() on each of them, so entries fire at most one slot
+ * late. The callback can reinsert the entry. After a long idle
+ * period we visit each slot at most once.
+ */
+void
+wheel_run(struct dn_wheel *w, uint64_t now, wheel_cb_t cb, void *arg)
+{
+	uint64_t end;
+	uint32_t n;
+
+	if (DN_KEY_LT(now, w->next_time))
+		return;
+	end = now / w->gran;
+	for (n = 0; w->cur < end && n < w->nslots; n++) {
+		struct dn_shaper **h = &w->slot[w->cur & (w->nslots - 1)];
+		struct dn_shaper *s = *h;
+
+		/* detach the slot and advance first, so that entries
+		 * reinserted by cb() go to the next slot at least.
+		 */
+		*h = NULL;
+		w->cur++;
+		while (s) {
+			struct dn_shaper *next = s->next;
+
+			if (DN_KEY_LEQ(s->when, now)) {
+				s->on_wheel = 0;
+				cb(arg, s, now);
+			} else {	/* a later turn */
+				s->next = *h;
+				*h = s;
+			}
+			s = next;
+		}
+	}
+	if (w->cur < end)	/* idle for more than a turn */
+		w->cur = end;
+	w->next_time = (w->cur + 1) * w->gran;
+}
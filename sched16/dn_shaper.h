@@ -0,0 +1,87 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Token bucket shapers for dummynet flows.
+ *
+ * Shaping is a layer in front of the dn_alg: a packet of a shaped
+ * flow reaches the scheduler only when the flow has enough tokens,
+ * otherwise it waits in the shaper and the flow is put on a timer
+ * wheel at the time it becomes eligible. Unshaped flows go straight
+ * to the scheduler, so they are never delayed by shaped ones, and
+ * the scheduler only sees eligible packets.
+ *
+ * Buckets are implemented as a virtual clock (GCRA): 'tat' is the
+ * time at which the flow will have sent all its bytes at the
+ * configured rate, and a packet conforms if tat - burst <= now.
+ * All times are in TSC ticks.
+ */
+
+#ifndef _DN_SHAPER_H
+#define _DN_SHAPER_H
+
+#define TB_SHIFT	16	/* fixed point for tsc_per_byte */
+
+struct tb_parms {	/* per flowset, rate == 0 means unshaped */
+	uint64_t	rate;		/* bits per second */
+	uint64_t	tsc_per_byte;	/* cost of one byte, TB_SHIFT bits */
+	uint64_t	burst;		/* bucket depth in tsc ticks */
+};
+
+struct dn_shaper {	/* per flow */
+	struct mq	mq;	/* packets waiting for tokens */
+	uint64_t	tat;	/* theoretical arrival time */
+	uint64_t	when;	/* eligible time, while on the wheel */
+	struct dn_shaper *next;	/* chain in the wheel slot */
+	struct dn_queue	*q;	/* the flow we shape */
+	const struct tb_parms *tb; /* parameters of its flowset */
+	int		on_wheel;
+};
+
+/*
+ * Hashed timer wheel. Each slot covers 'gran' ticks, entries more
+ * than one turn in the future stay in their slot and are checked
+ * again at the next turn, so insertion and expiration are O(1).
+ */
+struct dn_wheel {
+	uint32_t	nslots;	/* power of 2 */
+	uint64_t	gran;	/* tsc ticks per slot */
+	uint64_t	cur;	/* next slot to expire, in units of gran */
+	uint64_t	next_time; /* end of slot cur, to skip wheel_run quickly */
+	struct dn_shaper **slot;
+};
+
+typedef void (*wheel_cb_t)(void *arg, struct dn_shaper *s, uint64_t now);
+
+void tb_config(struct tb_parms *p, uint64_t rate, uint64_t burst_bytes);
+int wheel_init(struct dn_wheel *w, uint32_t nslots, uint64_t gran,
+	uint64_t now);
+void wheel_free(struct dn_wheel *w);
+void wheel_insert(struct dn_wheel *w, struct dn_shaper *s, uint64_t when);
+void wheel_run(struct dn_wheel *w, uint64_t now, wheel_cb_t cb, void *arg);
+
+/* time at which the next packet of the flow conforms */
+static inline uint64_t
+tb_eligible(const struct dn_shaper *s, const struct tb_parms *p)
+{
+	return s->tat - p->burst;
+}
+
+static inline int
+tb_conform(const struct dn_shaper *s, const struct tb_parms *p, uint64_t now)
+{
+	return DN_KEY_LEQ(tb_eligible(s, p), now);
+}
+
+/* account for a packet of 'len' bytes sent at 'now' */
+static inline void
+tb_charge(struct dn_shaper *s, const struct tb_parms *p, uint64_t now,
+	uint32_t len)
+{
+	if (DN_KEY_LT(s->tat, now))
+		s->tat = now;	/* idle, the bucket is full */
+	s->tat += (len * p->tsc_per_byte) >> TB_SHIFT;
+}
+
+#endif /* _DN_SHAPER_H */
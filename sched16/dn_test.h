@@ -81,6 +81,11 @@ struct dn_fs {
          * Now we use 0: weight, 1: lmax, 2: priority
          */
 	int par[4];	/* flowset parameters */
+	/* CoDel parameters in microseconds, target 0 disables the AQM */
+	int codel_target;
+	int codel_interval;
+	/* most packets in each flow queue, 0 means MY_MQ_MAX */
+	int qlen;
 
 	/* simulation entries.
 	 * 'index' is not strictly necessary
@@ -106,6 +111,18 @@ struct dn_fs {
 struct dn_sch {
 };
 
+/* (from ip_dummynet.h, 10 parameters there)
+ * scheduler specific parameters, in dn_schk->cfg.
+ * Their meaning depends on the scheduler.
+ */
+#define DN_MAX_EXTRA_PARM	16
+struct dn_extra_parms {
+	struct dn_id oid;
+	char name[16];
+	uint32_t nr;
+	int64_t par[DN_MAX_EXTRA_PARM];
+};
+
 #if 0
 struct mbuf {
         struct {
@@ -185,34 +202,82 @@ typedef struct _md_t moduledata_t;
 #define MODULE_DEPEND(a, b, c, d, e)
 
 #include <dn_heap.h>
+#include <dn_aqm_codel.h>
 #include <ip_dn_private.h>
 #include <dn_sched.h>
+#include <dn_shaper.h>
+#include <dn_edf.h>
+#include <dn_pipe.h>
 
 #ifndef __FreeBSD__
 int fls(int);
 #endif
 
+#ifdef MY_MQ_LEN
+/*
+ * allocate the ring of an empty queue that holds up to len packets,
+ * len 0 means MY_MQ_MAX. The ring starts small, see mq_grow().
+ */
 static inline int
-mq_append(struct mq *q, struct mbuf *m)
+mq_init(struct mq *q, uint32_t len)
+{
+	uint32_t n;
+
+	if (len == 0)
+		len = MY_MQ_MAX;
+	for (n = 1; n < len && n < MY_MQ_LEN; n <<= 1)
+		;
+	free(q->q);
+	q->q_max = len;
+	q->q = calloc(n, sizeof(*q->q));
+	if (q->q == NULL) {
+		D("cannot allocate %u slots for queue %d", n, q->fid);
+		q->q_len = 0;
+		return ENOMEM;
+	}
+	q->q_len = n;
+	q->q_head = q->q_tail = 0;
+	q->head = NULL;
+	return 0;
+}
+
+/* double the ring of a full queue, keeping the packets in order */
+static inline int
+mq_grow(struct mq *q)
 {
-#ifdef MY_MQ_LEN /* XXX note this can fail! */
-	uint32_t i = q->q_tail + 1;
-	if (q->q_len ==0) {
-		D("initialize queue %d h %d t %d", q->fid, q->q_head, q->q_tail);
-		q->q_len = MY_MQ_LEN;
+	uint32_t i, n = q->q_tail - q->q_head;
+	struct mbuf **r = malloc(2 * q->q_len * sizeof(*r));
+
+	if (r == NULL) {
+		D("cannot grow queue %d to %u slots", q->fid, 2 * q->q_len);
+		return ENOMEM;
 	}
-	if (i == q->q_len)
-		i = 0;
-	if (i == q->q_head) { /* queue full */
-		D("queue full");
+	for (i = 0; i < n; i++)
+		r[i] = q->q[(q->q_head + i) & (q->q_len - 1)];
+	free(q->q);
+	q->q = r;
+	q->q_len *= 2;
+	q->q_head = 0;
+	q->q_tail = n;
+	return 0;
+}
+#endif /* MY_MQ_LEN */
+
+static inline int
+mq_append(struct mq *q, struct mbuf *m)
+{
+#ifdef MY_MQ_LEN
+	if (unlikely(q->q == NULL) && mq_init(q, q->q_max))
+		return 1;
+	if (q->q_tail - q->q_head == q->q_max) { /* queue full */
+		ND("queue full");
 		return 1;
 	}
-	q->q[q->q_tail] = m;
-	if (q->q_tail == q->q_head) /* first element */
+	if (unlikely(q->q_tail - q->q_head == q->q_len) && mq_grow(q))
+		return 1;
+	q->q[q->q_tail++ & (q->q_len - 1)] = m;
+	if (q->head == NULL) /* first element */
 		q->head = m;
-	q->q_tail = i;
-	ND("q %d h %d t %d %s", q->fid, q->q_head, q->q_tail,
-		(q->head == m) ? "FIRST" : "");
 #else
         if (q->head == NULL)
                 q->head = m;
@@ -0,0 +1,129 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Microbenchmark for the dn_heap implementations.
+ *
+ * Uses the "hold" model, which is what wf2q+ does with its heaps:
+ * N objects are in the heap, and at each step we extract the top
+ * one and reinsert it with a key a bit larger, as the finish time
+ * of a flow that sent a packet. One step every 'mid' also removes
+ * a random object from the middle and puts it back, as on a queue
+ * moving between the idle and eligible heaps.
+ * Extracted keys must come out in order, which is also checked.
+ *
+ * usage: heap_bench [-n steps] [-m mid] [-s spread] [N ...]
+ */
+
+#include <dn_test.h>
+#include <time.h>
+
+int debug = 0;
+
+struct obj {
+	uint32_t id;
+	int32_t heap_pos;	/* ofs must be > 0 */
+};
+
+static const char *names[] = { "binary", "4ary", "calendar" };
+
+static inline uint32_t
+xrand(uint64_t *s)	/* xorshift, cheaper than random() */
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (uint32_t)*s;
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+run(int type, int n, long steps, int mid, uint32_t spread)
+{
+	struct dn_heap h;
+	struct obj *o = calloc(n, sizeof(*o));
+	uint64_t seed = 88172645463325252ULL, last = 0, key;
+	double t;
+	long i;
+	int j, bad = 0;
+
+	bzero(&h, sizeof(h));
+	dn_heap_type = type;
+	if (o == NULL || heap_init(&h, 16, offsetof(struct obj, heap_pos))) {
+		D("cannot allocate %d objects", n);
+		return 1;
+	}
+	for (j = 0; j < n; j++) {
+		o[j].id = j;
+		heap_insert(&h, xrand(&seed) % spread, &o[j]);
+	}
+	t = now_ns();
+	for (i = 0; i < steps; i++) {
+		struct obj *x = HEAP_TOP(&h)->object;
+
+		key = HEAP_TOP(&h)->key;
+		if (DN_KEY_LT(key, last))
+			bad++;
+		last = key;
+		heap_extract(&h, NULL);
+		heap_insert(&h, key + 1 + xrand(&seed) % spread, x);
+		if (mid && i % mid == 0) {
+			x = &o[xrand(&seed) % n];
+			heap_extract(&h, x);
+			heap_insert(&h, last + xrand(&seed) % spread, x);
+		}
+	}
+	t = now_ns() - t;
+	printf("%-10s N %7d %8.1f ns/step%s\n", names[type], n, t / steps,
+		bad ? " OUT OF ORDER" : "");
+	heap_free(&h);
+	free(o);
+	return bad != 0;
+}
+
+int
+main(int ac, char *av[])
+{
+	long steps = 10000000;
+	int mid = 8, ch, i, type, ret = 0;
+	uint32_t spread = 1 << 20;
+	int sizes[] = { 16, 1000, 10000, 100000 };
+
+	while ((ch = getopt(ac, av, "n:m:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			steps = atol(optarg);
+			break;
+		case 'm':
+			mid = atoi(optarg);
+			break;
+		case 's':
+			spread = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n steps] [-m mid] "
+				"[-s spread] [N ...]\n", av[0]);
+			return 1;
+		}
+	}
+	if (spread == 0)
+		spread = 1;
+	for (i = optind; i < ac || (optind == ac && i < 4 + optind); i++) {
+		int n = optind == ac ? sizes[i - optind] : atoi(av[i]);
+
+		if (n <= 0)
+			continue;
+		for (type = DN_HEAP_BINARY; type <= DN_HEAP_CALENDAR; type++)
+			ret |= run(type, n, steps, mid, spread);
+	}
+	return ret;
+}
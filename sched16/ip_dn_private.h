@@ -84,18 +84,18 @@ SLIST_HEAD(dn_alg_head, dn_alg);
 /* XXX extension for testing and concurrent access */
 struct mq {	/* a basic queue of packets*/
 #ifdef MY_MQ_LEN
-	uint32_t q_len;
-	uint32_t q_tail; /* insert index */
-	uint32_t q_head; /* extract index */
-	struct mbuf *head; /* XXX empty->full indicator */
+	uint32_t q_len;	/* ring size, power of 2 */
+	uint32_t q_max;	/* most packets queued, the ring grows to it */
+	uint32_t q_tail; /* insert index, free running */
+	uint32_t q_head; /* extract index, free running */
 	/*
-	 * head has a special meaning in enqueue, see dn_sched.h.
-	 * In our case we use it to report the transition from
-	 * empty to full. Dequeue should set it to null at
-	 * the first extraction, enqueue set to m at the first
-	 * insertion on an empty queue.
+	 * head is the first packet or NULL, as in the list version:
+	 * schedulers peek at it, and compare it with the packet just
+	 * enqueued to tell if an idle queue became busy (see dn_sched.h).
+	 * It is refreshed from the ring on dequeue.
 	 */
-	struct mbuf *q[MY_MQ_LEN];
+	struct mbuf *head;
+	struct mbuf **q;	/* q_len slots, see mq_init() */
 #else
         struct mbuf *head, *tail;
 	int count;
@@ -249,6 +249,8 @@ struct dn_fsk { /* kernel side of a flowset */
 	int lookup_weight ;	/* equal to (1-w_q)^t / (1-w_q)^(t+1) */
 	int avg_pkt_size ;	/* medium packet size */
 	int max_pkt_size ;	/* max packet size */
+
+	struct codel_parms codel;	/* AQM parameters, in tsc ticks */
 };
 
 /*
@@ -272,6 +274,7 @@ struct dn_queue {
 	int random;		/* random value (scaled) */
 	uint64_t q_time;	/* start of queue idle time */
 
+	struct codel_status codel;	/* AQM state */
 };
 
 /*
@@ -0,0 +1,110 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Shared mbuf pool and per thread caches, see sched16.h
+ */
+
+#include "sched16.h"
+
+#ifdef MY_MQ_LEN
+_Static_assert(sizeof(struct mbuf) == 32, "struct mbuf must be 32 bytes");
+#endif
+
+#define MBUF_ALIGN	64
+
+static inline void
+pool_lock(struct mbuf_pool *p)
+{
+	while (__atomic_test_and_set(&p->lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&p->lock, __ATOMIC_RELAXED))
+			;
+	}
+}
+
+static inline void
+pool_unlock(struct mbuf_pool *p)
+{
+	__atomic_clear(&p->lock, __ATOMIC_RELEASE);
+}
+
+int
+mbuf_pool_init(struct mbuf_pool *p, uint32_t size)
+{
+	uint32_t i;
+
+	bzero(p, sizeof(*p));
+	if (posix_memalign((void **)&p->mbufs, MBUF_ALIGN,
+			size * sizeof(struct mbuf))) {
+		p->mbufs = NULL;
+		return ENOMEM;
+	}
+	p->free = calloc(size, sizeof(*p->free));
+	if (p->free == NULL) {
+		mbuf_pool_fini(p);
+		return ENOMEM;
+	}
+	bzero(p->mbufs, size * sizeof(struct mbuf));
+	/* first mbufs on top of the stack */
+	for (i = 0; i < size; i++)
+		p->free[i] = &p->mbufs[size - 1 - i];
+	p->size = p->nfree = size;
+	return 0;
+}
+
+void
+mbuf_pool_fini(struct mbuf_pool *p)
+{
+	free(p->mbufs);
+	free(p->free);
+	bzero(p, sizeof(*p));
+}
+
+uint32_t
+mbuf_pool_get_bulk(struct mbuf_pool *p, struct mbuf **m, uint32_t n)
+{
+	uint32_t i;
+
+	pool_lock(p);
+	if (n > p->nfree)
+		n = p->nfree;
+	p->nfree -= n;
+	for (i = 0; i < n; i++)
+		m[i] = p->free[p->nfree + i];
+	pool_unlock(p);
+	return n;
+}
+
+void
+mbuf_pool_put_bulk(struct mbuf_pool *p, struct mbuf **m, uint32_t n)
+{
+	uint32_t i;
+
+	pool_lock(p);
+	for (i = 0; i < n; i++)
+		p->free[p->nfree++] = m[i];
+	pool_unlock(p);
+}
+
+struct mbuf_cache *
+mbuf_cache_create(struct mbuf_pool *p)
+{
+	struct mbuf_cache *c;
+
+	if (posix_memalign((void **)&c, MBUF_ALIGN, sizeof(*c)))
+		return NULL;
+	c->pool = p;
+	c->count = 0;
+	return c;
+}
+
+/* give all cached mbufs back to the pool */
+void
+mbuf_cache_destroy(struct mbuf_cache *c)
+{
+	if (c == NULL)
+		return;
+	mbuf_pool_put_bulk(c->pool, c->m, c->count);
+	free(c);
+}
@@ -0,0 +1,126 @@
+/*
+ * BSD license
+ */
+
+/*
+ * Microbenchmark for the per flow packet queues (struct mq).
+ *
+ * Keeps 'backlog' packets queued on each flow and, at each step,
+ * dequeues one packet from the scheduler, reads the first bytes of
+ * its payload (as the backend does when it copies the packet out)
+ * and enqueues it again on the same flow. The mbufs and buffers are
+ * scattered in memory, as they come from different guests, so the
+ * cost is dominated by cache misses on the mbufs and headers.
+ *
+ * Build once with the default (rings) and once with -DMY_MQ_LEN=0
+ * (linked lists) to compare the two.
+ *
+ * usage: mq_bench [-n steps] [-b backlog] [-- scheduler options]
+ */
+
+#include <dn_test.h>
+#include <time.h>
+
+#define BUF_SIZE	2048
+
+static inline uint32_t
+xrand(uint64_t *s)	/* xorshift, cheaper than random() */
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (uint32_t)*s;
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main(int ac, char *av[])
+{
+	long steps = 10000000, i;
+	int backlog = 64, ch, nflows, n, j;
+	uint64_t seed = 88172645463325252ULL, sum = 0;
+	struct mbuf *mb, **order;
+	char *bufs;
+	void *s;
+	double t;
+
+	while ((ch = getopt(ac, av, "n:b:")) != -1) {
+		switch (ch) {
+		case 'n':
+			steps = atol(optarg);
+			break;
+		case 'b':
+			backlog = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n steps] [-b backlog] "
+				"[-- scheduler options]\n", av[0]);
+			return 1;
+		}
+	}
+	calibrate_tsc();
+	/* sched_init() skips av[0], which here is "--" or the program */
+	s = sched_init(ac - optind + 1, av + optind - 1);
+	if (s == NULL || backlog <= 0)
+		return 1;
+	nflows = get_flow_count(s);
+	n = nflows * backlog;
+	mb = calloc(n, sizeof(*mb));
+	order = calloc(n, sizeof(*order));
+	bufs = malloc((size_t)n * BUF_SIZE);
+	if (mb == NULL || order == NULL || bufs == NULL) {
+		D("cannot allocate %d packets", n);
+		return 1;
+	}
+	/* shuffle, so that consecutive packets of a flow are far apart */
+	for (j = 0; j < n; j++)
+		order[j] = &mb[j];
+	for (j = n - 1; j > 0; j--) {
+		int k = xrand(&seed) % (j + 1);
+		struct mbuf *x = order[j];
+
+		order[j] = order[k];
+		order[k] = x;
+	}
+	for (j = 0; j < n; j++) {
+		struct mbuf *m = order[j];
+
+		m->buf = bufs + (size_t)(m - mb) * BUF_SIZE;
+		m->len = 60 + xrand(&seed) % 1400;
+		m->flow_id = j % nflows;
+		memset(m->buf, j, 64);
+		if (sched_enq(s, m)) {
+			D("drop at %d, use a larger -ring", j);
+			return 1;
+		}
+	}
+
+	t = now_ns();
+	for (i = 0; i < steps; i++) {
+		struct mbuf *m = sched_deq(s);
+
+		if (m == NULL) {
+			D("empty scheduler at step %ld", i);
+			return 1;
+		}
+		sum += *(uint64_t *)m->buf;
+		sched_enq(s, m);
+	}
+	t = now_ns() - t;
+	printf("%s flows %5d backlog %4d %6.1f ns/pkt (%lx)\n",
+#ifdef MY_MQ_LEN
+		"ring",
+#else
+		"list",
+#endif
+		nflows, backlog, t / steps, (unsigned long)(sum & 0xf));
+	return 0;
+}
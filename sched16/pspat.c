@@ -1,12 +1,20 @@
 //#include "backend.h"
 #include "sched16.h"
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <arpa/inet.h>
 
 #define NETMAP_WITH_LIBS
 #include <libnetmap.h>
 
 #include "pspat.h"
+#include "dn_pipe.h"
 
 /*
  * a variant of the runon function that remaps core numbers.
@@ -73,32 +81,243 @@ again:
 }
 
 /*
- * A cache of mbufs which are needed by the scheduling algorithm.
+ * NS_INDIRECT is honoured by VALE ports only (not by pipes or NICs):
+ * the switch copies from slot->ptr into the destination port, so the
+ * scheduler thread no longer touches the payload.
  */
+static int
+netmap_indirect_ok(const char *ifname)
+{
+    return !strncmp(ifname, "vale", 4) && strpbrk(ifname, "{}") == NULL;
+}
+
+static void
+netmap_zerocopy_init(struct sched_all *f)
+{
+    struct netmap_ring *ring = NETMAP_TXRING(f->nmd->nifp, 0);
+
+    D("zero copy output, %u slots", ring->num_slots);
+    f->nm_slot_mbuf = SAFE_CALLOC(ring->num_slots * sizeof(struct mbuf *));
+    f->nm_done = ring->tail;
+}
+
+/* Packets to the TAP interface go to the host stack. */
 static void
-mbuf_cache_init(struct mbuf_cache *c, uint32_t size)
+tap_init_realsched(struct sched_all *f, const char *ifname)
 {
-    assert(size);
+    struct ifreq ifr;
+
+    D("Opening scheduler tap interface %s", ifname);
+
+    f->out_fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (f->out_fd < 0) {
+        D("open(/dev/net/tun): %s", strerror(errno));
+        exit(1);
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(f->out_fd, TUNSETIFF, (void *)&ifr) < 0) {
+        D("ioctl(TUNSETIFF, %s): %s", ifname, strerror(errno));
+        exit(1);
+    }
+}
 
-    c->first_free = c->cache = SAFE_CALLOC(sizeof(struct mbuf) * size);
+/*
+ * AF_PACKET socket with a TPACKET_V2 TX ring of one page per frame:
+ * packets are copied in the frames and sent with one send().
+ */
+#define SCHED_TXR_FRAMES        1024
+#define SCHED_TXR_FRAME_SIZE    4096
+#define SCHED_TXR_DATA          TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
 
-    for (size--; size > 0; size--)
-    c->cache[size - 1].m_freelist = c->cache + size;
+static inline struct tpacket2_hdr *
+packet_frame(struct sched_all *f, uint32_t i)
+{
+    return (struct tpacket2_hdr *)(f->txr_mem + (size_t)i * SCHED_TXR_FRAME_SIZE);
 }
 
-static inline struct mbuf *
-mbuf_cache_get(struct mbuf_cache *c)
+static void
+packet_init_realsched(struct sched_all *f, const char *ifname)
 {
-    struct mbuf *m = c->first_free;
-    c->first_free = m->m_freelist;
-    return m;
+    struct tpacket_req req;
+    struct sockaddr_ll sll;
+    int v = TPACKET_V2;
+
+    D("Opening scheduler packet socket on %s", ifname);
+
+    /* protocol 0, nothing is received before bind() */
+    f->out_fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (f->out_fd < 0) {
+        D("socket(AF_PACKET): %s", strerror(errno));
+        exit(1);
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = SCHED_TXR_FRAME_SIZE;
+    req.tp_block_nr = SCHED_TXR_FRAMES;
+    req.tp_frame_size = SCHED_TXR_FRAME_SIZE;
+    req.tp_frame_nr = SCHED_TXR_FRAMES;
+    if (setsockopt(f->out_fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0 ||
+        setsockopt(f->out_fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        D("cannot set up the TX ring: %s", strerror(errno));
+        exit(1);
+    }
+    f->txr_mem = mmap(NULL, (size_t)SCHED_TXR_FRAMES * SCHED_TXR_FRAME_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_SHARED, f->out_fd, 0);
+    if (f->txr_mem == MAP_FAILED) {
+        D("mmap(): %s", strerror(errno));
+        exit(1);
+    }
+#ifdef PACKET_IGNORE_OUTGOING
+    /* do not queue our own frames for sched_rx_packet() */
+    v = 1;
+    setsockopt(f->out_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &v, sizeof(v));
+#endif
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = if_nametoindex(ifname);
+    if (sll.sll_ifindex == 0 ||
+        bind(f->out_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        D("cannot bind to %s: %s", ifname, strerror(errno));
+        exit(1);
+    }
 }
 
 static inline void
-mbuf_cache_put(struct mbuf_cache *c, struct mbuf *m)
+packet_ring_kick(struct sched_all *f)
 {
-    m->m_freelist = c->first_free;
-    c->first_free = m;
+    if (send(f->out_fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS)
+        f->stat_tx_err++;
+}
+
+/* free frames from txr_head on, at most 'max' */
+static uint32_t
+packet_ring_free_space(struct sched_all *f, uint32_t max)
+{
+    uint32_t i = f->txr_head, space = 0;
+    int reclaim = 1;
+
+again:
+    for (; space < max; space++) {
+        struct tpacket2_hdr *h = packet_frame(f, i);
+        uint32_t st = __atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE);
+
+        if (st == TP_STATUS_WRONG_FORMAT) {
+            /* the kernel rejected it, the frame is ours again */
+            f->stat_tx_err++;
+            h->tp_status = TP_STATUS_AVAILABLE;
+        } else if (st != TP_STATUS_AVAILABLE) {
+            break;
+        }
+        if (++i == SCHED_TXR_FRAMES)
+            i = 0;
+    }
+    if (space == 0 && reclaim) {
+        /* Try to push out pending frames. */
+        packet_ring_kick(f);
+        reclaim = 0;
+        goto again;
+    }
+
+    return space;
+}
+
+/*
+ * mbufs needed by the scheduling algorithm come from f->pool, each
+ * thread that enqueues or releases packets has its own cache.
+ */
+static __thread struct mbuf_cache *sched_mbc;
+
+static inline struct mbuf_cache *
+sched_mbuf_cache(struct sched_all *f)
+{
+    if (unlikely(sched_mbc == NULL)) {
+        sched_mbc = mbuf_cache_create(&f->pool);
+        if (sched_mbc == NULL) {
+            D("cannot allocate the mbuf cache");
+            exit(1);
+        }
+    }
+    return sched_mbc;
+}
+
+/*
+ * Single producer, single consumer ring of mbufs between the
+ * dispatcher and a shard. Indices are free running.
+ */
+struct sched_ring {
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));	/* next slot to read */
+    uint32_t tail __attribute__((aligned(64)));	/* next slot to write */
+    struct mbuf *slot[0] __attribute__((aligned(64)));
+};
+
+static struct sched_ring *
+sched_ring_create(uint32_t size)
+{
+    struct sched_ring *r;
+    uint32_t n;
+
+    for (n = 1; n < size; n <<= 1)
+        ;
+    if (posix_memalign((void **)&r, 64, sizeof(*r) + n * sizeof(r->slot[0]))) {
+        D("cannot allocate a ring of %u mbufs", n);
+        exit(1);
+    }
+    memset(r, 0, sizeof(*r));
+    r->mask = n - 1;
+    return r;
+}
+
+static inline int
+sched_ring_put(struct sched_ring *r, struct mbuf *m)
+{
+    uint32_t t = r->tail;
+
+    if (unlikely(t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask))
+        return 1;
+    r->slot[t & r->mask] = m;
+    __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline uint32_t
+sched_ring_get_bulk(struct sched_ring *r, struct mbuf **m, uint32_t n)
+{
+    uint32_t h = r->head, avail, i;
+
+    avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - h;
+    if (n > avail)
+        n = avail;
+    for (i = 0; i < n; i++)
+        m[i] = r->slot[(h + i) & r->mask];
+    __atomic_store_n(&r->head, h + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Make a guest tx queue known to the scheduler, mbufs refer to it
+ * by the returned index.
+ */
+uint32_t
+sched_txq_register(struct sched_all *f, BpfhvBackend *be, BpfhvBackendQueue *txq)
+{
+    struct sched_txq *t = realloc(f->txqs, (f->n_txqs + 1) * sizeof(*t));
+
+    if (t == NULL) {
+        D("cannot register tx queue %s", txq->name);
+        exit(1);
+    }
+    f->txqs = t;
+    if (f->n_txqs == 0 || t[f->n_txqs - 1].be != be)
+        f->n_guests++;
+    t[f->n_txqs].be = be;
+    t[f->n_txqs].txq = txq;
+    t[f->n_txqs].shard = f->n_shards ? (f->n_guests - 1) % f->n_shards : 0;
+    txq->sched_idx = f->n_txqs;
+    return f->n_txqs++;
 }
 
 /* packet transmission time expressed in ticks */
@@ -114,9 +333,84 @@ ns2tsc(struct sched_all *f, unsigned long int ns)
     return (double)ns/1e9 * f->ticks_per_second;
 }
 
+/* Give a dequeued packet back to its client and recycle the mbuf.
+ * Shards hand it back to the dispatcher, which owns the guest queues. */
+static inline void
+sched_release_mbuf(struct sched_all *f, struct mbuf *m)
+{
+    if (f->parent != NULL) {
+        /* cannot fail, the ring holds all mbufs */
+        sched_ring_put(f->done, m);
+        return;
+    }
+
+    /* mark packet to client as dequeued (release it)
+     * we do it here to keep max mbufs equal to sum of cqueue sizes */
+    struct sched_txq *t = &f->txqs[m->txq];
+
+    t->be->ops.txq_release(t->be, t->txq, m->idx);
+    t->txq->sched_inflight--;
+
+    /* free mbuf */
+    mbuf_put(sched_mbuf_cache(f), m);
+}
+
+/* Packets dropped by the AQM on dequeue go back to the client too. */
+static void
+sched_drop_mbuf(void *arg, struct mbuf *m)
+{
+    struct sched_all *f = arg;
+
+    f->n_sch_dropped++;
+    sched_release_mbuf(f, m);
+}
+
+/* Packets out of the link emulation pipe, or lost in it. */
+static void
+sched_pipe_out(void *arg, struct mbuf *m)
+{
+    struct sched_all *f = arg;
+
+    f->n_out_released++;
+    sched_release_mbuf(f, m);
+}
+
+/*
+ * Release the mbufs of the TX slots netmap is done with, up to and
+ * including ring->tail: netmap keeps the slot at tail for itself,
+ * but it is always a completed one. With 'all' (at exit) release
+ * them all.
+ */
+static void
+netmap_reclaim(struct sched_all *f, struct netmap_ring *ring, int all)
+{
+    uint32_t i = f->nm_done, n = 0;
+    uint32_t end = all ? ring->head : nm_ring_next(ring, ring->tail);
+
+    for (; i != end; i = nm_ring_next(ring, i)) {
+        struct mbuf *m = f->nm_slot_mbuf[i];
+
+        if (m != NULL) {
+            f->nm_slot_mbuf[i] = NULL;
+            sched_release_mbuf(f, m);
+            n++;
+        }
+    }
+    f->nm_done = i;
+    f->nm_inflight -= n;
+    f->n_out_released += n;
+}
+
 #define SCH_BUSY_WAIT_USECS     30
 #define SCH_SLEEP_MSECS         500
 
+/* adaptive idle: after spinning for SCH_BUSY_WAIT_USECS we use pause,
+ * then tpause if available, then we let the caller block on guest
+ * kicks, if the latency budget allows a system call. */
+#define SCH_PAUSE_USECS         300
+#define SCH_TPAUSE_USECS        1000
+#define SCH_MIN_BLOCK_USECS     50
+
 #define TXI_BEGIN(_s)   (_s)->num_queue_pairs
 #define TXI_END(_s)     (_s)->num_queues
 
@@ -124,6 +418,9 @@ uint32_t
 sched_dequeue_release_all(struct sched_all *f) {
     uint32_t ndeq = 0;
 
+    /* packets still waiting in the shapers */
+    sched_flush(f->sched);
+
     while (1) {
         /* dequeue one packet */
         struct mbuf *m = sched_deq(f->sched);
@@ -131,14 +428,25 @@ sched_dequeue_release_all(struct sched_all *f) {
             break;
         ndeq++;
 
-        /* mark packet to client as dequeued (release it)
-         * we do it here to keep max mbufs equal to sum of cqueue sizes */
-        m->be->ops.txq_release(m->be, m->txq, m->idx);
+        sched_release_mbuf(f, m);
+    }
+
+    /* the one the TAP did not take */
+    if (f->out_pending) {
+        sched_release_mbuf(f, f->out_pending);
+        f->out_pending = NULL;
+    }
 
-        /* free mbuf */
-        mbuf_cache_put(&f->mbc, m);
+    /* and on the netmap ring, at the end */
+    if (f->nm_slot_mbuf) {
+        ioctl(f->nmd->fd, NIOCTXSYNC, NULL);
+        netmap_reclaim(f, NETMAP_TXRING(f->nmd->nifp, 0), 1);
     }
 
+    /* and in the pipe, which are delivered now */
+    if (f->pipe)
+        pipe_run(f->pipe, ~0ULL, sched_pipe_out, f);
+
     return ndeq;
 }
 
@@ -146,22 +454,24 @@ uint32_t
 sched_dequeue_sink(struct sched_all *f, uint64_t now) {
     uint32_t ndeq = 0;
 
+    if (f->pipe)
+        pipe_run(f->pipe, now, sched_pipe_out, f);
+
     while (f->next_link_idle <= now && ndeq < f->sched_batch_limit) {
         /* dequeue one packet */
         struct mbuf *m = sched_deq(f->sched);
         if (m == NULL)
             break;
-        f->next_link_idle += pkt_tsc(f, m->iov.iov_len);
+        f->next_link_idle += pkt_tsc(f, m->len);
         ndeq++;
 
-        f->n_sch_released_bytes += m->iov.iov_len;
-
-        /* mark packet to client as dequeued (release it)
-         * we do it here to keep max mbufs equal to sum of cqueue sizes */
-        m->be->ops.txq_release(m->be, m->txq, m->idx);
+        f->n_sch_released_bytes += m->len;
 
-        /* free mbuf */
-        mbuf_cache_put(&f->mbc, m);
+        /* the packet is on the wire until the end of transmission */
+        if (f->pipe == NULL)
+            sched_release_mbuf(f, m);
+        else if (pipe_insert(f->pipe, m, f->next_link_idle))
+            sched_pipe_out(f, m);
     }
 
     f->n_sch_released += ndeq;
@@ -182,6 +492,8 @@ sched_dequeue_netmap(struct sched_all *f, uint64_t now) {
     /* precompute available netmap ring space to avoid
      * dropping descheduled packets */
     space = netmap_ring_free_space(nmd, ring);
+    if (f->nm_slot_mbuf)
+        netmap_reclaim(f, ring, 0);
 
     for (j = 0; j < space; j++) {
         /* packet rate limiter + batch limit */
@@ -192,32 +504,37 @@ sched_dequeue_netmap(struct sched_all *f, uint64_t now) {
         struct mbuf *m = sched_deq(f->sched);
         if (m == NULL)
             break;
-        f->next_link_idle += pkt_tsc(f, m->iov.iov_len);
+        f->next_link_idle += pkt_tsc(f, m->len);
         ndeq++;
 
-        f->n_sch_released_bytes += m->iov.iov_len;
+        f->n_sch_released_bytes += m->len;
 
-        /* copy to netmap ring */
+        /* fill the netmap slot */
         struct netmap_slot *slot = ring->slot + head;
-        slot->len = m->iov.iov_len;
-        slot->flags = 0;
-        //fprintf(stderr, "sched: dequeued pkt p=%lu, len=%u \n", m->m_pkthdr.ptr, m->iov.iov_len);
-        memcpy(NETMAP_BUF(ring, slot->buf_idx), (void*)m->iov.iov_base,
-            m->iov.iov_len);
+        slot->len = m->len;
+        //fprintf(stderr, "sched: dequeued pkt p=%lu, len=%u \n", m->m_pkthdr.ptr, m->len);
+        if (f->nm_slot_mbuf) {
+            /* point the slot to the guest buffer, release it later */
+            slot->ptr = (uintptr_t)m->buf;
+            slot->flags = NS_INDIRECT;
+            f->nm_slot_mbuf[head] = m;
+            f->nm_inflight++;
+        } else {
+            slot->flags = 0;
+            memcpy(NETMAP_BUF(ring, slot->buf_idx), m->buf,
+                m->len);
+            sched_release_mbuf(f, m);
+        }
 
         head = nm_ring_next(ring, head);
-
-        /* mark packet to client as dequeued (release it)
-         * we do it here to keep max mbufs equal to sum of cqueue sizes */
-        m->be->ops.txq_release(m->be, m->txq, m->idx);
-
-        /* free nbuf */
-        mbuf_cache_put(&f->mbc, m);
     }
 
     if (ndeq > 0) {
         ring->head = ring->cur = head;
         ioctl(nmd->fd, NIOCTXSYNC, NULL);
+        /* VALE is done with the slots by now */
+        if (f->nm_slot_mbuf)
+            netmap_reclaim(f, ring, 0);
         //cq->n_cli_io++;
         /* update stats */
         f->n_sch_released += ndeq;
@@ -245,8 +562,353 @@ sched_dequeue_netmap(struct sched_all *f, uint64_t now) {
 }
 
 uint32_t
-sched_dequeue(struct sched_all *f, uint64_t now) {
-    return f->sched_deq_f(f,now);
+sched_dequeue_packet(struct sched_all *f, uint64_t now) {
+    uint32_t ndeq = 0, nreq = 0;
+    uint32_t j, space;
+
+    /* precompute available TX ring space to avoid
+     * dropping descheduled packets */
+    space = packet_ring_free_space(f, f->sched_batch_limit);
+
+    for (j = 0; j < space; j++) {
+        /* packet rate limiter + batch limit */
+        if (unlikely(!(f->next_link_idle <= now && ndeq < f->sched_batch_limit)))
+            break;
+
+        /* dequeue one packet */
+        struct mbuf *m = sched_deq(f->sched);
+        if (m == NULL)
+            break;
+        f->next_link_idle += pkt_tsc(f, m->len);
+        ndeq++;
+
+        f->n_sch_released_bytes += m->len;
+
+        /* copy to the TX ring */
+        if (likely(m->len <= SCHED_TXR_FRAME_SIZE - SCHED_TXR_DATA)) {
+            struct tpacket2_hdr *h = packet_frame(f, f->txr_head);
+
+            memcpy((char *)h + SCHED_TXR_DATA, m->buf, m->len);
+            h->tp_len = m->len;
+            __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST,
+                             __ATOMIC_RELEASE);
+            if (++f->txr_head == SCHED_TXR_FRAMES)
+                f->txr_head = 0;
+            nreq++;
+        } else {
+            f->stat_tx_err++; /* larger than a frame */
+        }
+
+        sched_release_mbuf(f, m);
+    }
+
+    /* one system call for the whole batch */
+    if (nreq > 0)
+        packet_ring_kick(f);
+    f->n_sch_released += ndeq;
+
+    return ndeq;
+}
+
+/*
+ * The TAP takes one packet per write(), there is no batched
+ * interface for it short of io_uring. A packet it cannot take now
+ * (EAGAIN) is kept in out_pending and written first next time, so
+ * it is not dropped.
+ */
+uint32_t
+sched_dequeue_tap(struct sched_all *f, uint64_t now) {
+    uint32_t ndeq = 0;
+
+    while (f->next_link_idle <= now && ndeq < f->sched_batch_limit) {
+        struct mbuf *m = f->out_pending;
+
+        if (m == NULL) {
+            /* dequeue one packet */
+            m = sched_deq(f->sched);
+            if (m == NULL)
+                break;
+            f->next_link_idle += pkt_tsc(f, m->len);
+        }
+        if (write(f->out_fd, m->buf, m->len) < 0) {
+            if (errno == EAGAIN) {
+                f->out_pending = m;
+                break;
+            }
+            f->stat_tx_err++;
+        }
+        f->out_pending = NULL;
+        ndeq++;
+
+        f->n_sch_released_bytes += m->len;
+
+        sched_release_mbuf(f, m);
+    }
+
+    f->n_sch_released += ndeq;
+
+    return ndeq;
+}
+
+/*
+ * Receive path. Frames arriving on the output are handed to cb() in
+ * batches, at most 'budget' of them, and are only valid during the
+ * call. Netmap frames are passed in place, TAP and packet socket
+ * frames are read into rx_buf first.
+ */
+#define SCHED_RX_BATCH      32
+#define SCHED_RX_BUF_SIZE   2048
+
+static uint32_t
+sched_rx_netmap(struct sched_all *f, uint32_t budget, sched_rx_cb_t cb, void *arg)
+{
+    struct netmap_ring *ring = NETMAP_RXRING(f->nmd->nifp, 0);
+    uint32_t n = 0, head;
+
+    if (nm_ring_empty(ring)) {
+        ioctl(f->nmd->fd, NIOCRXSYNC, NULL);
+        if (nm_ring_empty(ring))
+            return 0;
+    }
+    for (head = ring->head; head != ring->tail && n < budget; n++) {
+        struct netmap_slot *slot = &ring->slot[head];
+
+        cb(arg, NETMAP_BUF(ring, slot->buf_idx), slot->len);
+        head = nm_ring_next(ring, head);
+    }
+    /* the slots go back to netmap on the next sync */
+    ring->head = ring->cur = head;
+    return n;
+}
+
+static uint32_t
+sched_rx_tap(struct sched_all *f, uint32_t budget, sched_rx_cb_t cb, void *arg)
+{
+    uint32_t n;
+
+    for (n = 0; n < budget; n++) {
+        ssize_t len = read(f->out_fd, f->rx_buf, SCHED_RX_BUF_SIZE);
+
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN)
+                f->stat_rx_err++;
+            break;
+        }
+        cb(arg, f->rx_buf, len);
+    }
+    return n;
+}
+
+/* the socket also sees the frames we send, which are skipped */
+static uint32_t
+sched_rx_packet(struct sched_all *f, uint32_t budget, sched_rx_cb_t cb, void *arg)
+{
+    struct mmsghdr msg[SCHED_RX_BATCH];
+    struct iovec iov[SCHED_RX_BATCH];
+    struct sockaddr_ll sll[SCHED_RX_BATCH];
+    uint32_t n = 0, got = 0;
+    int i, r;
+
+    while (n < budget) {
+        int want = budget - n < SCHED_RX_BATCH ? budget - n : SCHED_RX_BATCH;
+
+        for (i = 0; i < want; i++) {
+            iov[i].iov_base = f->rx_buf + i * SCHED_RX_BUF_SIZE;
+            iov[i].iov_len = SCHED_RX_BUF_SIZE;
+            memset(&msg[i].msg_hdr, 0, sizeof(msg[i].msg_hdr));
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+            msg[i].msg_hdr.msg_name = &sll[i];
+            msg[i].msg_hdr.msg_namelen = sizeof(sll[i]);
+        }
+        r = recvmmsg(f->out_fd, msg, want, MSG_DONTWAIT, NULL);
+        if (r <= 0) {
+            if (r < 0 && errno != EAGAIN)
+                f->stat_rx_err++;
+            break;
+        }
+        for (i = 0; i < r; i++) {
+            if (sll[i].sll_pkttype == PACKET_OUTGOING)
+                continue;
+            if (msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                f->stat_rx_err++;
+                continue;
+            }
+            cb(arg, iov[i].iov_base, msg[i].msg_len);
+            got++;
+        }
+        n += r;
+        if (r < want)
+            break;
+    }
+    return got;
+}
+
+/* Frames received on the outputs of f and of its shards. */
+uint32_t
+sched_rx(struct sched_all *f, uint32_t budget, sched_rx_cb_t cb, void *arg)
+{
+    uint32_t i, n = 0;
+
+    if (f->sched_rx_f)
+        n = f->sched_rx_f(f, budget, cb, arg);
+    for (i = 0; i < f->n_shards && n < budget; i++) {
+        struct sched_all *s = f->shards[i];
+
+        if (s->sched_rx_f) {
+            uint32_t k = s->sched_rx_f(s, budget - n, cb, arg);
+
+            s->stat_rx += k;
+            n += k;
+        }
+    }
+    f->stat_rx += n;
+    return n;
+}
+
+/* File descriptors to poll for received frames, at most 'max'. */
+uint32_t
+sched_rx_fds(struct sched_all *f, int *fds, uint32_t max)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i <= f->n_shards && n < max; i++) {
+        struct sched_all *s = i == 0 ? f : f->shards[i - 1];
+
+        if (s->sched_rx_f == NULL)
+            continue;
+        fds[n++] = s->nmd ? s->nmd->fd : s->out_fd;
+    }
+    return n;
+}
+
+/* Dispatcher: release the mbufs the shards are done with. */
+static uint32_t
+sched_shards_collect(struct sched_all *f)
+{
+    struct mbuf *m[64];
+    uint32_t i, j, n, tot = 0;
+
+    for (i = 0; i < f->n_shards; i++) {
+        struct sched_all *s = f->shards[i];
+
+        while ((n = sched_ring_get_bulk(s->done, m, 64)) > 0) {
+            for (j = 0; j < n; j++)
+                sched_release_mbuf(f, m[j]);
+            tot += n;
+        }
+    }
+    f->shard_inflight -= tot;
+    return tot;
+}
+
+/* Shard: move the packets from the dispatcher to the scheduler. */
+static uint32_t
+sched_shard_fetch(struct sched_all *f)
+{
+    struct mbuf *m[64];
+    uint32_t i, n, tot = 0;
+
+    while (tot < f->sched_batch_limit &&
+           (n = sched_ring_get_bulk(f->in, m, 64)) > 0) {
+        for (i = 0; i < n; i++) {
+            /* marks checked against an older configuration */
+            if (unlikely(m[i]->flow_id >= f->max_mark ||
+                         sched_enq(f->sched, m[i]))) {
+                f->n_sch_dropped++;
+                sched_release_mbuf(f, m[i]);
+            }
+        }
+        tot += n;
+    }
+    f->n_sch_fetch += tot;
+    return tot;
+}
+
+/*
+ * Runtime reconfiguration. The control thread builds the new
+ * scheduler, or asks for a new weight, and posts the request to
+ * each instance; the thread of the instance applies it between two
+ * iterations, moving the queued packets to the new scheduler, and
+ * hands back the old one for the control thread to destroy.
+ */
+struct sched_ctl {
+    int fs, weight;     /* new weight, if sched is NULL */
+    void *sched;        /* the new scheduler, the old one when done */
+    int ret;
+    int done;
+};
+
+static void
+sched_ctl_apply(struct sched_all *f)
+{
+    struct sched_ctl *r = __atomic_load_n(&f->ctl, __ATOMIC_ACQUIRE);
+    void *old = f->sched;
+
+    /* the control thread may have withdrawn it */
+    if (r == NULL || !__atomic_compare_exchange_n(&f->ctl, &r, NULL, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    if (r->sched == NULL) {
+        r->ret = sched_reweight(f->sched, r->fs, r->weight);
+    } else {
+        D("%d packets moved to the new scheduler",
+          sched_move(r->sched, old));
+        f->sched = r->sched;
+        f->max_mark = get_flow_count(f->sched);
+        r->sched = old;
+        r->ret = 0;
+    }
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+sched_ctl_check(struct sched_all *f)
+{
+    if (unlikely(__atomic_load_n(&f->ctl, __ATOMIC_RELAXED) != NULL))
+        sched_ctl_apply(f);
+}
+
+static void *
+sched_shard_body(void *arg)
+{
+    struct sched_all *f = arg;
+
+    if (f->sched_affinity >= 0)
+        runon("shard", f->sched_affinity);
+    f->sched_start = rdtsc();
+    f->next_link_idle = f->sched_start;
+    while (!__atomic_load_n(&f->stop, __ATOMIC_ACQUIRE)) {
+        uint64_t now = rdtsc();
+        uint32_t nin;
+
+        sched_ctl_check(f);
+        nin = sched_shard_fetch(f);
+        uint32_t ndeq = f->sched_deq_f(f, now);
+
+        /* shards have no kicks to wait for, they only spin */
+        if (nin == 0)
+            sched_idle_sleep(f, now, ndeq);
+    }
+    f->sched_end = rdtsc();
+    return NULL;
+}
+
+uint32_t
+sched_dequeue(struct sched_all *f, uint64_t now, size_t *dropped) {
+    uint64_t n_dropped = f->n_sch_dropped + f->n_out_released;
+    uint32_t ndeq;
+
+    sched_ctl_check(f);
+
+    if (f->n_shards)
+        return sched_shards_collect(f);
+    ndeq = f->sched_deq_f(f,now);
+
+    /* released buffers need a notification even if nothing was sent */
+    *dropped += f->n_sch_dropped + f->n_out_released - n_dropped;
+
+    return ndeq;
 }
 
 uint32_t
@@ -258,18 +920,39 @@ fun_sched_enqueue(struct BpfhvBackendProcess *bp, struct BpfhvBackend *be, Bpfhv
     if(unlikely(mark >= f->max_mark))
         return 1;
 
-    /* be, txq and opaque_idx are needed to eventually release buf */
-    struct mbuf *m = mbuf_cache_get(&f->mbc);
-    m->iov = iov;
-    m->be = be;
-    m->txq = txq;
+    /* txq and opaque_idx are needed to eventually release buf */
+    struct mbuf_cache *mbc = sched_mbuf_cache(f);
+    struct mbuf *m = mbuf_get(mbc);
+    if (unlikely(m == NULL))
+        return 1;
+    (void)be;
+    m->buf = iov.iov_base;
+    m->len = iov.iov_len;
     m->idx = opaque_idx;
+    m->txq = txq->sched_idx;
     m->flow_id = mark;
 
     /* enqueuing = fetching from client */
     f->n_sch_fetch++;
 
-    return sched_enq(f->sched, m);
+    if (f->n_shards) {
+        struct sched_all *s = f->shards[f->shard_policy == SCHED_SHARD_MARK ?
+                                        mark % f->n_shards :
+                                        f->txqs[m->txq].shard];
+
+        if (unlikely(sched_ring_put(s->in, m))) {
+            mbuf_put(mbc, m);
+            return 1;
+        }
+        f->shard_inflight++;
+    } else if (unlikely(sched_enq(f->sched, m))) {
+        /* dropped, the caller releases the buffer */
+        mbuf_put(mbc, m);
+        return 1;
+    }
+    txq->sched_inflight++;
+
+    return 0;
 }
 
 /* Scheduler iteration: fetch from clients */
@@ -329,10 +1012,63 @@ fun_sched_enqueue(struct BpfhvBackendProcess *bp, struct BpfhvBackend *be, Bpfhv
 
 int
 sched_dump(struct sched_all *f) {
-    return dump(f->sched);
+    uint32_t i;
+
+    if (f->n_shards == 0)
+        return dump(f->sched);
+    for (i = 0; i < f->n_shards; i++) {
+        printf("shard %u:\n", i);
+        dump(f->shards[i]->sched);
+    }
+    return 0;
 }
 
-void
+/*
+ * Wait for the next scheduler interval on an idle link, escalating
+ * with the length of the idle period. All stages except the last one
+ * return within sched_interval. The last one is left to the caller,
+ * which is expected to block for at most idle_budget_ns.
+ */
+static int
+sched_idle_wait(struct sched_all *f, uint64_t now, uint32_t ndeq)
+{
+    uint64_t until = now + f->sched_interval_tsc;
+    uint64_t idle_us;
+
+    if (f->idle_budget_ns == 0) {
+        tsc_sleep_till(until);
+        return SCHED_IDLE_NONE;
+    }
+
+    /* any packet in or out restarts the idle period */
+    if (ndeq > 0 || f->idle_fetch != f->n_sch_fetch + f->stat_rx ||
+        f->idle_since == 0) {
+        f->idle_fetch = f->n_sch_fetch + f->stat_rx;
+        f->idle_since = now;
+    }
+    idle_us = (now - f->idle_since) * 1000000 / f->ticks_per_second;
+
+    if (idle_us < SCH_BUSY_WAIT_USECS) {
+        tsc_sleep_till(until);
+    } else if (idle_us >= SCH_TPAUSE_USECS &&
+               f->idle_budget_ns >= SCH_MIN_BLOCK_USECS * 1000 &&
+               (f->n_shards ? f->shard_inflight : (uint32_t)sched_backlog(f->sched)) == 0 &&
+               (f->pipe == NULL || f->pipe->queued == 0) && f->out_pending == NULL &&
+               f->nm_inflight == 0) {
+        /* nothing queued, not even waiting for tokens */
+        f->stat_idle_block++;
+        return SCHED_IDLE_BLOCK;
+    } else if (idle_us >= SCH_PAUSE_USECS && f->has_waitpkg) {
+        f->stat_idle_tpause++;
+        tsc_tpause_till(until);
+    } else {
+        f->stat_idle_pause++;
+        tsc_pause_till(until);
+    }
+    return SCHED_IDLE_NONE;
+}
+
+int
 sched_idle_sleep(struct sched_all *f, uint64_t now, uint32_t ndeq) {
     /*
      *  next    ndeq
@@ -351,7 +1087,7 @@ sched_idle_sleep(struct sched_all *f, uint64_t now, uint32_t ndeq) {
         if (ndeq < f->sched_batch_limit) {
             f->next_link_idle = now; /* no traffic in this interval */
             f->stat_sched_idle++;
-            tsc_sleep_till(now + f->sched_interval_tsc);
+            return sched_idle_wait(f, now, ndeq);
         }
         f->stat_batch_full++;
     /* else continue */
@@ -359,6 +1095,16 @@ sched_idle_sleep(struct sched_all *f, uint64_t now, uint32_t ndeq) {
         f->stat_early++;
         tsc_sleep_till(f->next_link_idle /* now + f->sched_interval_tsc */);
     }
+    f->idle_since = 0;
+
+    return SCHED_IDLE_NONE;
+}
+
+void
+sched_all_set_idle(struct sched_all *f, uint64_t budget_ns) {
+    f->idle_budget_ns = budget_ns;
+    f->has_waitpkg = cpu_has_waitpkg();
+    f->idle_since = 0;
 }
 
 /* Scheduler main loop. Repeatedly invokes do_sched() and carries out
@@ -397,18 +1143,124 @@ sched_idle_sleep(struct sched_all *f, uint64_t now, uint32_t ndeq) {
 //     return NULL;
 // }
 
+/* the pipe may hold all mbufs, so it never drops for lack of room */
+static void
+sched_pipe_start(struct sched_all *f, uint32_t num_mbuf)
+{
+    struct dn_pipe_parms parms = f->pipe->p;
+
+    if (pipe_init(f->pipe, &parms, num_mbuf, rdtsc())) {
+        D("cannot allocate the pipe for %u mbufs", num_mbuf);
+        exit(1);
+    }
+}
+
 void sched_all_start(struct sched_all *f, uint32_t num_mbuf) {
+    uint32_t i;
+
     /* create the scheduler-side views of the cqueues */
     f->cqs = SAFE_CALLOC(sizeof(struct cqueue_sched) * f->n_clients);
-    mbuf_cache_init(&f->mbc, num_mbuf);
+    if (mbuf_pool_init(&f->pool, num_mbuf)) {
+        D("cannot allocate %u mbufs", num_mbuf);
+        exit(1);
+    }
 
     /* set the starting time, very important */
     f->next_link_idle = rdtsc();
+    if (f->pipe)
+        sched_pipe_start(f, num_mbuf);
+
+    /* rings hold all mbufs, so 'done' never fills up */
+    for (i = 0; i < f->n_shards; i++) {
+        struct sched_all *s = f->shards[i];
+        int ret;
+
+        s->in = sched_ring_create(num_mbuf);
+        s->done = sched_ring_create(num_mbuf);
+        if (s->pipe)
+            sched_pipe_start(s, num_mbuf);
+        ret = pthread_create(&s->sched_id, NULL, sched_shard_body, s);
+        if (ret) {
+            D("cannot start shard %u: %s", i, strerror(ret));
+            exit(1);
+        }
+    }
+}
+
+static void
+sched_pipe_free(struct sched_all *f)
+{
+    if (f->pipe == NULL)
+        return;
+    pipe_free(f->pipe);
+    free(f->pipe);
+    f->pipe = NULL;
+}
+
+static void
+sched_out_close(struct sched_all *f)
+{
+    if (f->txr_mem)
+        munmap(f->txr_mem, (size_t)SCHED_TXR_FRAMES * SCHED_TXR_FRAME_SIZE);
+    if (f->out_fd >= 0)
+        close(f->out_fd);
+    free(f->rx_buf);
+}
+
+static void
+sched_all_stats(struct sched_all *f)
+{
+    uint64_t pkts = f->n_sch_released, bytes = f->n_sch_released_bytes;
+    double duration;
+
+    duration = (double)(f->sched_end - f->sched_start)/f->ticks_per_second;
+    D("check_idle: %u", (u_int)f->stat_check_idle);
+    D("stat_early/batch_full: %u/%u", (u_int)f->stat_early, (u_int)f->stat_batch_full);
+    D("sched_idle: %u", (u_int)f->stat_sched_idle);
+    D("aqm dropped: %llu", (_P64)f->n_sch_dropped);
+    D("deadline misses: %llu", (_P64)sched_deadline_misses(f->sched));
+    if (f->idle_budget_ns)
+        D("idle pause/tpause/block: %llu/%llu/%llu",
+          (_P64)f->stat_idle_pause, (_P64)f->stat_idle_tpause,
+          (_P64)f->stat_idle_block);
+    if (f->pipe)
+        D("pipe lost: %llu", (_P64)f->pipe->lost);
+    if (f->stat_tx_err)
+        D("output errors: %llu", (_P64)f->stat_tx_err);
+    if (f->stat_rx || f->stat_rx_err)
+        D("received: %llu errors: %llu", (_P64)f->stat_rx,
+          (_P64)f->stat_rx_err);
+    D("TOTAL: %.3e bits %.3e bps %.3e pkts %.3e pps",
+      8.0*bytes, 8.0*bytes/duration, (double)pkts, pkts/duration);
+}
+
+static void
+sched_args_free(char **av)
+{
+    char **p;
+
+    for (p = av; *p != NULL; p++)
+        free(*p);
+    free(av);
 }
 
 void sched_all_finish(struct sched_all *f) {
+    uint32_t i;
+
     f->sched_end = rdtsc();
 
+    /* stop the shards, and give back all they hold */
+    for (i = 0; i < f->n_shards; i++) {
+        struct sched_all *s = f->shards[i];
+
+        __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(s->sched_id, NULL);
+        while (sched_shard_fetch(s) > 0)
+            ;
+        sched_dequeue_release_all(s);
+    }
+    sched_shards_collect(f);
+
     /* ignore 1 idle at startup */
     if(f->stat_sched_idle != 0)
         f->stat_sched_idle--;
@@ -417,24 +1269,363 @@ void sched_all_finish(struct sched_all *f) {
     sched_dequeue_release_all(f);
 
     /* print stats */
-    {
-        uint64_t pkts = f->n_sch_released, bytes = f->n_sch_released_bytes;
-        double duration;
-        D("waiting for scheduler to terminate");
-        pthread_join(f->sched_id, NULL);
-        duration = (double)(f->sched_end - f->sched_start)/f->ticks_per_second;
-        D("check_idle: %u", (u_int)f->stat_check_idle);
-        D("stat_early/batch_full: %u/%u", (u_int)f->stat_early, (u_int)f->stat_batch_full);
-        D("sched_idle: %u", (u_int)f->stat_sched_idle);
-        D("TOTAL: %.3e bits %.3e bps %.3e pkts %.3e pps",
-          8.0*bytes, 8.0*bytes/duration, (double)pkts, pkts/duration);
+    D("waiting for scheduler to terminate");
+    pthread_join(f->sched_id, NULL);
+    if (f->n_shards == 0)
+        sched_all_stats(f);
+    for (i = 0; i < f->n_shards; i++) {
+        struct sched_all *s = f->shards[i];
+
+        D("shard %u:", i);
+        sched_all_stats(s);
+        sched_pipe_free(s);
+        sched_out_close(s);
+        free(s->nm_slot_mbuf);
+        free(s->in);
+        free(s->done);
+        free(s);
     }
+    free(f->shards);
 
     free(f->cqs);
     f->cqs = NULL;
+    mbuf_cache_destroy(sched_mbc);
+    sched_mbc = NULL;
+    mbuf_pool_fini(&f->pool);
+    sched_pipe_free(f);
+    sched_out_close(f);
+    free(f->nm_slot_mbuf);
+    if (f->sched_av_owned)
+        sched_args_free(f->sched_av);
+    free(f->txqs);
     free(f);
 }
 
+/*
+ * Add a shard, with its own scheduler (configured by ac/av like the
+ * main instance), output interface, bandwidth in bits/s (0 means
+ * unlimited) and thread, pinned to 'cpu' if not negative.
+ * Must be called before sched_all_start().
+ */
+int
+sched_all_add_shard(struct sched_all *f, int ac, char *av[], const char *ifname,
+                    uint iftype, double bw, int cpu)
+{
+    struct sched_all **v, *s;
+
+    v = realloc(f->shards, (f->n_shards + 1) * sizeof(*v));
+    if (v == NULL)
+        return -1;
+    f->shards = v;
+    s = sched_all_create(ac, av, ifname, iftype);
+    if (s == NULL)
+        return -1;
+    if (bw > 0) {
+        s->sched_bw = bw;
+        s->bytes_to_tsc = 8.0 * s->ticks_per_second / bw;
+    }
+    s->sched_affinity = cpu;
+    s->parent = f;
+    f->shards[f->n_shards++] = s;
+    return 0;
+}
+
+void
+sched_all_set_shard_policy(struct sched_all *f, int policy) {
+    f->shard_policy = policy;
+}
+
+/*
+ * Emulate a link after the scheduler output, see pipe_parse() for
+ * the spec. Only for sink outputs; with shards, each one gets its
+ * own pipe. Must be called before sched_all_start().
+ */
+int
+sched_all_set_pipe(struct sched_all *f, const char *spec) {
+    struct dn_pipe_parms parms;
+    uint32_t i;
+
+    if (pipe_parse(&parms, spec))
+        return -1;
+    for (i = 0; i < f->n_shards; i++) {
+        if (sched_all_set_pipe(f->shards[i], spec))
+            return -1;
+    }
+    if (f->n_shards)
+        return 0;
+    if (f->sched_deq_f != sched_dequeue_sink) {
+        D("link emulation needs a sink output");
+        return -1;
+    }
+    if (f->pipe == NULL)
+        f->pipe = SAFE_CALLOC(sizeof(*f->pipe));
+    f->pipe->p = parms;
+    return 0;
+}
+
+/*
+ * Post a request to the thread of f and wait until it is applied,
+ * at most one second. Returns -1 if the thread did not get to it,
+ * e.g. because it does not run when no guest is connected.
+ */
+static int
+sched_ctl_post(struct sched_all *f, struct sched_ctl *r)
+{
+    struct sched_ctl *exp = r;
+    int i;
+
+    r->done = 0;
+    __atomic_store_n(&f->ctl, r, __ATOMIC_RELEASE);
+    for (i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+            return 0;
+        usleep(1000);
+    }
+    if (__atomic_compare_exchange_n(&f->ctl, &exp, NULL, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return -1;
+    /* taken just now */
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    return 0;
+}
+
+/* a copy of av, with 'key' set to 'val' (or appended) */
+static char **
+sched_args_set(int *ac, char **av, const char *key, const char *val)
+{
+    char **v = calloc(*ac + 3, sizeof(*v));
+    int i, n = 0, found = 0;
+
+    if (v == NULL)
+        return NULL;
+    for (i = 0; i < *ac; i++) {
+        int is_val = i > 0 && !strcmp(av[i - 1], key) && (i & 1) == 0;
+
+        v[n++] = strdup(is_val ? val : av[i]);
+        found |= is_val;
+    }
+    if (!found) {
+        v[n++] = strdup(key);
+        v[n++] = strdup(val);
+    }
+    for (i = 0; i < n; i++) {
+        if (v[i] == NULL) {
+            v[n] = NULL;
+            sched_args_free(v);
+            return NULL;
+        }
+    }
+    *ac = n;
+    return v;
+}
+
+/*
+ * Replace the scheduler of f and of its shards with one built from
+ * the current options, with 'key' set to 'val'. The flowsets are
+ * always given explicitly, so that weights changed at runtime stay.
+ */
+static int
+sched_all_rebuild(struct sched_all *f, const char *key, const char *val,
+                  char *out, size_t len)
+{
+    uint32_t i, n = f->n_shards + 1;
+    struct sched_ctl r[n];
+    char fs[4096], **av, **av1;
+    int ac = f->sched_ac, ret = 0;
+    uint32_t applied = 0;
+
+    if (sched_flowsets_spec(f->sched, fs, sizeof(fs)) >= (int)sizeof(fs)) {
+        snprintf(out, len, "error: too many flowsets\n");
+        return -1;
+    }
+    av1 = sched_args_set(&ac, f->sched_av, "-flowsets", fs);
+    if (av1 == NULL || (av = sched_args_set(&ac, av1, key, val)) == NULL) {
+        if (av1)
+            sched_args_free(av1);
+        snprintf(out, len, "error: no memory\n");
+        return -1;
+    }
+    sched_args_free(av1);
+
+    memset(r, 0, sizeof(r));
+    for (i = 0; i < n; i++) {
+        struct sched_all *s = i < f->n_shards ? f->shards[i] : f;
+
+        r[i].sched = sched_init(ac, av);
+        if (r[i].sched == NULL || !strcmp(sched_name(r[i].sched), "NULL")) {
+            snprintf(out, len, "error: invalid configuration\n");
+            ret = -1;
+            break;
+        }
+        sched_set_drop(r[i].sched, sched_drop_mbuf, s);
+    }
+    /* shards first, the dispatcher checks marks against its own */
+    for (i = 0; i < n && ret == 0; i++) {
+        struct sched_all *s = i < f->n_shards ? f->shards[i] : f;
+
+        if (sched_ctl_post(s, &r[i]) == 0) {
+            applied++;
+        } else {
+            snprintf(out, len, "error: scheduler not running, %u of %u "
+                     "instances updated\n", i, n);
+            ret = -1;
+        }
+    }
+    /* old schedulers if applied, unused new ones otherwise */
+    for (i = 0; i < n; i++) {
+        if (r[i].sched)
+            sched_fini(r[i].sched);
+    }
+    /*
+     * Schedulers keep pointers into their options. After a partial
+     * update some still use the old ones, which are then leaked.
+     */
+    if (applied == 0) {
+        sched_args_free(av);
+    } else {
+        if (f->sched_av_owned && applied == n)
+            sched_args_free(f->sched_av);
+        f->sched_av = av;
+        f->sched_ac = ac;
+        f->sched_av_owned = 1;
+    }
+    if (ret == 0)
+        snprintf(out, len, "ok\n");
+    return ret;
+}
+
+/* a -flowsets list with entry 'fs' replaced by 'rep', or removed */
+static int
+sched_flowsets_edit(struct sched_all *f, int fs, const char *rep,
+                    char *spec, size_t len)
+{
+    char cur[4096], *next = cur, *e;
+    size_t n = 0;
+    int i = 0, found = 0;
+
+    if (sched_flowsets_spec(f->sched, cur, sizeof(cur)) >= (int)sizeof(cur))
+        return -1;
+    spec[0] = '\0';
+    while ((e = strsep(&next, ",")) != NULL) {
+        if (i++ == fs) {
+            found = 1;
+            e = (char *)rep;
+        }
+        if (e == NULL)
+            continue;
+        n += snprintf(spec + n, n < len ? len - n : 0, "%s%s", n ? "," : "", e);
+        if (n >= len)
+            return -1;
+    }
+    return found && spec[0] != '\0' ? 0 : -1;
+}
+
+/* entry 'fs' of a -flowsets list, with weight w */
+static int
+sched_flowsets_weight(char *spec, int fs, int w, char *e, size_t len)
+{
+    char *next = spec, *cur = NULL;
+    int i;
+
+    for (i = 0; i <= fs; i++) {
+        if ((cur = strsep(&next, ",")) == NULL)
+            return -1;
+    }
+    cur = strchr(cur, ':');
+    return cur == NULL || snprintf(e, len, "%d%s", w, cur) >= (int)len;
+}
+
+/*
+ * Commands of the control channel, one per line:
+ *     show                     current configuration
+ *     weight FS W              weight of the flows of flowset FS
+ *     alg NAME                 switch scheduling algorithm
+ *     flowsets SPEC            replace all flowsets (as -flowsets)
+ *     add SPEC                 append flowsets (weight:len:flows...)
+ *     del FS                   remove flowset FS
+ *     set -OPTION VALUE        any other scheduler option
+ * Flows are numbered by flowset, so adding or removing a flowset
+ * renumbers the marks of the flowsets after it; options that refer
+ * to flowsets or marks (-shape, -ring, -edf) are kept as they are.
+ * The reply, in 'out', is "ok" or starts with "error:".
+ */
+int
+sched_all_ctl(struct sched_all *f, char *cmd, char *out, size_t len)
+{
+    const char *sep = " \t\r\n";
+    char *op = strtok(cmd, sep), *a = strtok(NULL, sep), *b = strtok(NULL, sep);
+    char spec[4096];
+
+    if (op == NULL) {
+        snprintf(out, len, "error: empty command\n");
+        return -1;
+    }
+    if (!strcmp(op, "show")) {
+        sched_flowsets_spec(f->sched, spec, sizeof(spec));
+        snprintf(out, len, "alg %s flows %u shards %u\nflowsets %s\n",
+                 sched_name(f->sched), f->max_mark, f->n_shards, spec);
+        return 0;
+    }
+    if (!strcmp(op, "weight") && a && b) {
+        uint32_t i, n = f->n_shards + 1, busy = 0;
+        int fs = atoi(a), w = atoi(b);
+        char e[64];
+
+        for (i = 0; i < n; i++) {
+            struct sched_all *s = i < f->n_shards ? f->shards[i] : f;
+            struct sched_ctl r = { .fs = fs, .weight = w };
+
+            if (sched_ctl_post(s, &r)) {
+                snprintf(out, len, "error: scheduler not running\n");
+                return -1;
+            }
+            if (r.ret == EINVAL) {
+                snprintf(out, len, "error: invalid flowset or weight\n");
+                return -1;
+            }
+            busy |= r.ret == EBUSY;
+        }
+        if (!busy) {
+            snprintf(out, len, "ok\n");
+            return 0;
+        }
+        /* backlogged and not supported in place, start over */
+        sched_flowsets_spec(f->sched, spec, sizeof(spec));
+        if (sched_flowsets_weight(spec, fs, w, e, sizeof(e)) ||
+            sched_flowsets_edit(f, fs, e, spec, sizeof(spec))) {
+            snprintf(out, len, "error: invalid flowset\n");
+            return -1;
+        }
+        return sched_all_rebuild(f, "-flowsets", spec, out, len);
+    }
+    if (!strcmp(op, "alg") && a)
+        return sched_all_rebuild(f, "-alg", a, out, len);
+    if (!strcmp(op, "set") && a && b && a[0] == '-')
+        return sched_all_rebuild(f, a, b, out, len);
+    if (!strcmp(op, "flowsets") && a)
+        return sched_all_rebuild(f, "-flowsets", a, out, len);
+    if (!strcmp(op, "add") && a) {
+        char cur[4096];
+
+        sched_flowsets_spec(f->sched, cur, sizeof(cur));
+        if (snprintf(spec, sizeof(spec), "%s,%s", cur, a) >= (int)sizeof(spec)) {
+            snprintf(out, len, "error: too many flowsets\n");
+            return -1;
+        }
+        return sched_all_rebuild(f, "-flowsets", spec, out, len);
+    }
+    if (!strcmp(op, "del") && a) {
+        if (sched_flowsets_edit(f, atoi(a), NULL, spec, sizeof(spec))) {
+            snprintf(out, len, "error: cannot remove flowset %s\n", a);
+            return -1;
+        }
+        return sched_all_rebuild(f, "-flowsets", spec, out, len);
+    }
+    snprintf(out, len, "error: unknown command %s\n", op);
+    return -1;
+}
+
 struct sched_all *sched_all_create(int ac, char *av[], const char *ifname, uint iftype) {
     struct sched_all *f = SAFE_CALLOC(sizeof(struct sched_all));
 
@@ -456,13 +1647,29 @@ struct sched_all *sched_all_create(int ac, char *av[], const char *ifname, uint
     f->sched_byte_limit = 1500;
     f->sched_batch_limit = 500;
     f->use_mmsg = 0;
+    f->out_fd = -1;
 
     switch(iftype) {
         case PSPAT_IF_TYPE_SINK:
             f->sched_deq_f = sched_dequeue_sink; break;
         case PSPAT_IF_TYPE_NETMAP:
             f->sched_deq_f = sched_dequeue_netmap;
+            f->sched_rx_f = sched_rx_netmap;
             f->nmd = netmap_init_realsched(ifname);
+            if (netmap_indirect_ok(ifname))
+                netmap_zerocopy_init(f);
+            break;
+        case PSPAT_IF_TYPE_TAP:
+            f->sched_deq_f = sched_dequeue_tap;
+            f->sched_rx_f = sched_rx_tap;
+            f->rx_buf = SAFE_CALLOC(SCHED_RX_BUF_SIZE);
+            tap_init_realsched(f, ifname);
+            break;
+        case PSPAT_IF_TYPE_PACKET:
+            f->sched_deq_f = sched_dequeue_packet;
+            f->sched_rx_f = sched_rx_packet;
+            f->rx_buf = SAFE_CALLOC(SCHED_RX_BATCH * SCHED_RX_BUF_SIZE);
+            packet_init_realsched(f, ifname);
             break;
         default:
             fprintf(stderr, "sched_all_create: invalid iftype\n");
@@ -486,6 +1693,9 @@ struct sched_all *sched_all_create(int ac, char *av[], const char *ifname, uint
         return NULL;
     }
     f->max_mark = get_flow_count(f->sched);
+    sched_set_drop(f->sched, sched_drop_mbuf, f);
+    f->sched_ac = ac;
+    f->sched_av = av;
     f->stop = 0;
 
     return f;
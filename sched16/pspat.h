@@ -6,8 +6,24 @@
 /* Scheduler instance management */
 #define PSPAT_IF_TYPE_NETMAP   0
 #define PSPAT_IF_TYPE_SINK     1
+#define PSPAT_IF_TYPE_TAP      2   /* to the host stack */
+#define PSPAT_IF_TYPE_PACKET   3   /* AF_PACKET socket with a TX ring */
 struct sched_all *sched_all_create(int ac, char *av[], const char *ifname, uint iftype);
 void sched_all_start(struct sched_all *f, uint32_t num_mbuf);
+uint32_t sched_txq_register(struct sched_all *f, BpfhvBackend *be,
+                            BpfhvBackendQueue *txq);
+
+/* Sharding policies, to map packets to shards */
+#define SCHED_SHARD_GUEST   0   /* all packets of a guest to one shard */
+#define SCHED_SHARD_MARK    1   /* by mark, all guests share the shards */
+int sched_all_add_shard(struct sched_all *f, int ac, char *av[], const char *ifname,
+                        uint iftype, double bw, int cpu);
+void sched_all_set_shard_policy(struct sched_all *f, int policy);
+int sched_all_set_pipe(struct sched_all *f, const char *spec);
+int sched_all_ctl(struct sched_all *f, char *cmd, char *out, size_t len);
+uint32_t sched_rx(struct sched_all *f, uint32_t budget, sched_rx_cb_t cb, void *arg);
+uint32_t sched_rx_fds(struct sched_all *f, int *fds, uint32_t max);
+#define SCHED_RX_MAX_FDS    32  /* enough for the outputs of all shards */
 void sched_all_finish(struct sched_all *f);
 
 uint32_t
@@ -16,7 +32,11 @@ fun_sched_enqueue(struct BpfhvBackendProcess *bp, struct BpfhvBackend *be, Bpfhv
 
 int sched_dump(struct sched_all *f);
 
-void sched_idle_sleep(struct sched_all *f, uint64_t now, uint32_t ndeq);
-uint32_t sched_dequeue(struct sched_all *f, uint64_t now);
+/* sched_idle_sleep() return values */
+#define SCHED_IDLE_NONE     0
+#define SCHED_IDLE_BLOCK    1   /* idle, caller may block up to idle_budget_ns */
+int sched_idle_sleep(struct sched_all *f, uint64_t now, uint32_t ndeq);
+void sched_all_set_idle(struct sched_all *f, uint64_t budget_ns);
+uint32_t sched_dequeue(struct sched_all *f, uint64_t now, size_t *dropped);
 
 #endif
\ No newline at end of file
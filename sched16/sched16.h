@@ -19,6 +19,24 @@
 #define unlikely(x)     __builtin_expect((x),0)
 #endif
 
+/*
+ * Per flow packet queues (struct mq) are rings of mbuf pointers, so
+ * that dequeue does not touch the mbufs to find the next packet.
+ * A ring starts with at most MY_MQ_LEN slots and doubles when full,
+ * up to the limit of its flowset (the -ring option, MY_MQ_MAX by
+ * default, as the old hardwired limit of dn_enqueue()). Build with
+ * -DMY_MQ_LEN=0 to use the linked list through m_nextpkt instead.
+ */
+#ifndef MY_MQ_LEN
+#define MY_MQ_LEN	1024
+#endif
+#ifndef MY_MQ_MAX
+#define MY_MQ_MAX	20000
+#endif
+#if MY_MQ_LEN == 0
+#undef MY_MQ_LEN
+#endif
+
 #include <stdint.h>
 #include <errno.h> // errno ?
 #include <stdio.h>
@@ -118,27 +136,122 @@ pthread_setaffinity_np(pthread_t thread, size_t cpusetsize,
 
 #include <sys/uio.h>
 #include "../proxy/backend.h"
+/*
+ * Packet descriptor used by the scheduler, 32 bytes (40 with linked
+ * list flow queues) so that two of them share a cache line. The guest
+ * buffer is identified by the index of its tx queue in the scheduler
+ * (see sched_txq_register()) and by the opaque id of the device.
+ */
 struct mbuf {
-    struct iovec iov;
-    struct BpfhvBackend *be;
-    struct BpfhvBackendQueue *txq;
-    uint64_t idx;
-	uint16_t flow_id;	/* for testing, index of a flow */
+    void *buf;		/* packet data */
+    uint32_t len;	/* packet length */
+    uint32_t idx;	/* opaque id of the buffer in its tx queue */
+    uint32_t txq;	/* index of the guest tx queue */
+    uint32_t flow_id;	/* mark, index of a flow */
+    uint64_t ts;	/* enqueue time (tsc), used by the AQM */
 #ifndef MY_MQ_LEN
-        struct mbuf *m_nextpkt;
+    struct mbuf *m_nextpkt;
 #endif
-        struct mbuf *m_freelist;	/* XXX testing */
 };
 
-struct mbuf_cache {
-    struct mbuf *cache;
-    struct mbuf *first_free;
+/*
+ * mbufs come from a pool shared by all threads, through a per thread
+ * cache, so the pool lock is only taken once every MBUF_CACHE_BULK
+ * allocations or releases.
+ */
+#define MBUF_CACHE_SIZE	512	/* mbufs in a per thread cache */
+#define MBUF_CACHE_BULK	256	/* moved to/from the pool at once */
+
+struct mbuf_pool {
+    struct mbuf *mbufs;		/* all the mbufs, cache aligned */
+    struct mbuf **free;		/* stack of free mbufs */
+    uint32_t size;
+    uint32_t nfree;
+    char lock;
 };
 
+struct mbuf_cache {
+    struct mbuf_pool *pool;
+    uint32_t count;
+    struct mbuf *m[MBUF_CACHE_SIZE];
+} __attribute__((aligned(64)));
+
+int mbuf_pool_init(struct mbuf_pool *p, uint32_t size);
+void mbuf_pool_fini(struct mbuf_pool *p);
+uint32_t mbuf_pool_get_bulk(struct mbuf_pool *p, struct mbuf **m, uint32_t n);
+void mbuf_pool_put_bulk(struct mbuf_pool *p, struct mbuf **m, uint32_t n);
+struct mbuf_cache *mbuf_cache_create(struct mbuf_pool *p);
+void mbuf_cache_destroy(struct mbuf_cache *c);
+
+/* NULL if the pool is empty */
+static inline struct mbuf *
+mbuf_get(struct mbuf_cache *c)
+{
+    if (unlikely(c->count == 0)) {
+	c->count = mbuf_pool_get_bulk(c->pool, c->m, MBUF_CACHE_BULK);
+	if (c->count == 0)
+	    return NULL;
+    }
+    return c->m[--c->count];
+}
+
+static inline void
+mbuf_put(struct mbuf_cache *c, struct mbuf *m)
+{
+    if (unlikely(c->count == MBUF_CACHE_SIZE)) {
+	c->count -= MBUF_CACHE_BULK;
+	mbuf_pool_put_bulk(c->pool, c->m + c->count, MBUF_CACHE_BULK);
+    }
+    c->m[c->count++] = m;
+}
+
+/* get up to n mbufs, returns how many */
+static inline uint32_t
+mbuf_get_bulk(struct mbuf_cache *c, struct mbuf **m, uint32_t n)
+{
+    uint32_t i;
+
+    if (c->count < n)
+	c->count += mbuf_pool_get_bulk(c->pool, c->m + c->count,
+			MBUF_CACHE_SIZE - c->count);
+    if (n > c->count)
+	n = c->count;
+    for (i = 0; i < n; i++)
+	m[i] = c->m[--c->count];
+    return n;
+}
+
+static inline void
+mbuf_put_bulk(struct mbuf_cache *c, struct mbuf **m, uint32_t n)
+{
+    uint32_t i;
+
+    if (c->count + n > MBUF_CACHE_SIZE) {
+	/* keep what fits, the rest goes to the pool */
+	i = MBUF_CACHE_SIZE - c->count;
+	mbuf_pool_put_bulk(c->pool, m + i, n - i);
+	n = i;
+    }
+    for (i = 0; i < n; i++)
+	c->m[c->count++] = m[i];
+}
+
 void *sched_init(int ac, char *av[]);
 int  sched_enq(void *, struct mbuf *);
 struct mbuf *sched_deq(void *);
 uint32_t get_flow_count(void *c);
+/* called for packets dropped by the scheduler after enqueue (AQM) */
+typedef void (*sched_drop_t)(void *arg, struct mbuf *m);
+void sched_set_drop(void *c, sched_drop_t f, void *arg);
+void sched_flush(void *c);
+int sched_backlog(void *c);
+uint64_t sched_deadline_misses(void *c);
+/* runtime reconfiguration, see sched_main.c */
+const char *sched_name(void *c);
+int sched_reweight(void *c, int fs, int weight);
+int sched_flowsets_spec(void *c, char *buf, size_t len);
+int sched_move(void *to, void *from);
+void sched_fini(void *c);
 
 int dump(void *c);
 
@@ -224,6 +337,9 @@ struct sched_td { /* per thread info */
 
 struct sched_args;
 
+/* a frame received on the scheduler output, see sched_rx() */
+typedef void (*sched_rx_cb_t)(void *arg, const void *buf, uint32_t len);
+
 struct sched_all {
     uint32_t n_clients;
     uint32_t n_active_threads;
@@ -254,15 +370,34 @@ struct sched_all {
 
     /* Dequeue function based on chosen backend */
     uint32_t(*sched_deq_f)(struct sched_all *f, uint64_t now);
+    /* Receive function of the output, NULL if it has none */
+    uint32_t(*sched_rx_f)(struct sched_all *f, uint32_t budget,
+                          sched_rx_cb_t cb, void *arg);
 
     /* Scheduler output interface */
     struct nm_desc *nmd;
+    int out_fd;                 /* TAP or packet socket */
+    struct mbuf *out_pending;   /* not taken by the TAP yet */
+    char *txr_mem;              /* TX ring of the packet socket */
+    uint32_t txr_head;          /* next frame to fill */
+    uint64_t stat_tx_err;
+    char *rx_buf;               /* SCHED_RX_BATCH frames, TAP and packet */
+    uint64_t stat_rx;
+    uint64_t stat_rx_err;
 
     int multi_udp_ports;
 
     /* Structures used by do_sched(). */
     struct cqueue_sched *cqs;
-    struct mbuf_cache mbc;
+    struct mbuf_pool pool;
+
+    /* guest tx queues with buffers in the scheduler, see mbuf->txq */
+    struct sched_txq {
+	struct BpfhvBackend *be;
+	struct BpfhvBackendQueue *txq;
+	uint32_t shard;		/* for SCHED_SHARD_GUEST */
+    } *txqs;
+    uint32_t n_txqs;
 
     uint64_t next_link_idle;
 	/* when the link becomes idle. This is at the end of
@@ -281,6 +416,54 @@ struct sched_all {
     uint64_t n_sch_fetch;
     uint64_t n_sch_released;
     uint64_t n_sch_released_bytes;
+    uint64_t n_sch_dropped; /* by the AQM after enqueue, or on shards */
+
+    /* Adaptive idle: wake-up latency budget (0 means always spin),
+     * start of the current idle period and n_sch_fetch when it was
+     * last checked, whether tpause is available. */
+    uint64_t idle_budget_ns;
+    uint64_t idle_since;
+    uint64_t idle_fetch;
+    int has_waitpkg;
+    uint64_t stat_idle_pause;
+    uint64_t stat_idle_tpause;
+    uint64_t stat_idle_block;
+
+    /* Sharding: with n_shards > 0 this instance only dispatches
+     * packets to the shards, each one a sched_all with its own
+     * scheduler, output, bandwidth and thread. Packets reach a shard
+     * through its 'in' ring and come back through 'done', so that
+     * guest buffers are released by the thread that acquired them. */
+    struct sched_all **shards;
+    uint32_t n_shards;
+    int shard_policy;
+    uint32_t shard_inflight;	/* mbufs held by the shards */
+    uint32_t n_guests;		/* for SCHED_SHARD_GUEST */
+    struct sched_all *parent;	/* set in shards */
+    struct sched_ring *in, *done;
+
+    /* Link emulation on the sink output, see dn_pipe.h. Packets
+     * leaving the pipe (or lost in it) are released from there. */
+    struct dn_pipe *pipe;
+
+    /* Zero copy netmap output (NS_INDIRECT, VALE ports only): the
+     * mbufs referenced by TX slots, released when netmap gives the
+     * slot back, i.e. when ring->tail moves past it. */
+    struct mbuf **nm_slot_mbuf;
+    uint32_t nm_done;           /* first slot not reclaimed yet */
+    uint32_t nm_inflight;
+
+    /* mbufs released after sched_deq_f() returned them (pipe, zero
+     * copy), which need a notification too */
+    uint64_t n_out_released;
+
+    /* Runtime reconfiguration: the scheduler options (copied when
+     * changed), and the request the thread of this instance applies
+     * between iterations, see sched_all_ctl(). */
+    int sched_ac;
+    char **sched_av;
+    int sched_av_owned;
+    struct sched_ctl *ctl;
 };
 
 
@@ -56,6 +56,7 @@ struct cfg_s {
 	int cur_fs;	/* used in generation, between 0 and max_y - 1 */
 #endif /* USE_CUR */
 	const char *fs_config; /* flowset config */
+	const char *ring_config; /* queue sizes per flowset */
 	int can_dequeue;
 	int burst;	/* count of packets sent in a burst */
 	struct mbuf *tosend;	/* packet to send -- also flag to enqueue */
@@ -107,8 +108,45 @@ struct cfg_s {
 	const char *shm_name;
 	int  shm_fd;
 	void *shm;
+
+	/* AQM: set if some flowset uses CoDel, default parameters (us)
+	 * for flowsets that do not specify them, and the callback
+	 * releasing packets dropped on dequeue.
+	 */
+	int codel;
+	int codel_target, codel_interval;
+	int32_t aqm_drop;
+	sched_drop_t drop_f;
+	void *drop_arg;
+
+	/* Shaping: token bucket parameters per flowset, shapers per
+	 * flow (NULL if no flowset is shaped), the wheel of flows
+	 * waiting for tokens and the number of packets they hold.
+	 */
+	const char *shape_config;
+	struct tb_parms *tb;
+	struct dn_shaper *shp;
+	struct dn_wheel wheel;
+	int32_t shaped;
+
+	/* EDF: relative deadline and deadline queue state per flow
+	 * (NULL if no flow has a deadline), and the deadline queue.
+	 */
+	const char *edf_config;
+	struct dn_edf_flow *edf_f;
+	struct dn_edf edf;
+
+	/* rate caps of the bands of the prio schedulers */
+	const char *band_config;
+
+	/* how far init() got, so that sched_fini() can undo it */
+	int si_ready;	/* new_sched() done */
+	int n_fsk;	/* flowsets through new_fsk() */
+	int n_queues;	/* queues through new_queue() */
 };
 
+#define SHAPER_WHEEL_SLOTS	4096	/* 1us each, ~4ms per turn */
+
 /* FI2Q and Q2FI converts from flow_id (i.e. queue index)
  * to dn_queue and back. We cannot simply use pointer arithmetic
  * because the queu has variable size, q_len
@@ -158,7 +196,7 @@ drop(struct cfg_s *c, struct mbuf *m)
 static int
 default_enqueue(struct dn_sch_inst *si, struct dn_queue *q, struct mbuf *m)
 {
-	struct mq *mq = (struct mq *)si;
+	struct mq *mq = (struct mq *)(si + 1);
 
 	(void)q;
 	/* this is the default function if no scheduler is provided */
@@ -169,7 +207,7 @@ default_enqueue(struct dn_sch_inst *si, struct dn_queue *q, struct mbuf *m)
 static struct mbuf *
 default_dequeue(struct dn_sch_inst *si)
 {
-	struct mq *mq = (struct mq *)si;
+	struct mq *mq = (struct mq *)(si + 1);
 	/* this is the default function if no scheduler is provided */
 	return mq_dequeue(mq);
 }
@@ -201,7 +239,7 @@ gnet_stats_deq(struct cfg_s *c, struct mbuf *mb)
 {
 	struct dn_sch_inst *si = c->si;
 	struct dn_queue *_q = FI2Q(c, mb->flow_id);
-	int len = mb->iov.iov_len;
+	int len = mb->len;
 
 	_q->ni.bytes += len;
 	si->ni.bytes += len;
@@ -225,6 +263,15 @@ get_flow_count(void *_c) {
 	return c->flows;
 }
 
+void
+sched_set_drop(void *_c, sched_drop_t f, void *arg)
+{
+	struct cfg_s *c = _c;
+
+	c->drop_f = f;
+	c->drop_arg = arg;
+}
+
 #if 0
 static int
 mainloop(struct cfg_s *c)
@@ -282,8 +329,17 @@ dump(void *_c)
 
 	for (i=0; i < c->flows; i++) {
 		struct dn_queue *q = FI2Q(c, i);
-		printf("queue %4d tot %10llu\n", i, (unsigned long long)q->ni.tot_bytes);
+		printf("queue %4d tot %10llu", i, (unsigned long long)q->ni.tot_bytes);
+		if (c->edf_f && c->edf_f[i].rel)
+			printf(" deadline misses %u", c->edf_f[i].misses);
+		printf("\n");
 	}
+	if (c->codel)
+		printf("aqm drops %d\n", c->aqm_drop);
+	if (c->shp)
+		printf("shaped %d\n", c->shaped);
+	if (c->edf_f)
+		printf("deadline misses %llu\n", (unsigned long long)c->edf.misses);
 	return 0;
 }
 
@@ -336,13 +392,16 @@ getnum(const char *s, char **next, const char *key)
 
 /*
  * flowsets are a comma-separated list of
- *     weight:maxlen:flows
+ *     weight:maxlen:flows[:codel_target[:codel_interval]]
  * indicating how many flows are hooked to that fs.
+ * CoDel times are in microseconds, if missing the -codel
+ * values are used, a target of 0 disables the AQM.
  * Both weight and range can be min-max-steps.
  * The first pass (fs != NULL) justs count the number of flowsets and flows,
  * the second pass (fs == NULL) we complete the setup.
+ * Returns -1 if the list is invalid.
  */
-static void
+static int
 parse_flowsets(struct cfg_s *c, const char *fs)
 {
 	char *s, *cur, *next;
@@ -362,13 +421,14 @@ parse_flowsets(struct cfg_s *c, const char *fs)
 	if (s == NULL) {
 		if (pass == 0)
 			D("no fsconfig");
-		return;
+		return c->fs_config ? -1 : 0;
 	}
 	for (next = s; (cur = strsep(&next, ","));) {
 		char *p = NULL;
 		int w, w_h, w_steps, wi;
 		int len, len_h, l_steps, li;
 		int flows;
+		int codel_target, codel_interval, prio;
 
 		w = getnum(strsep(&cur, ":"), &p, "weight");
 		if (w <= 0)
@@ -383,12 +443,19 @@ parse_flowsets(struct cfg_s *c, const char *fs)
 		flows = getnum(strsep(&cur, ":"), NULL, "flows");
 		if (flows == 0)
 			flows = 1;
+		p = strsep(&cur, ":");
+		codel_target = p ? getnum(p, NULL, "codel_target") : -1;
+		p = strsep(&cur, ":");
+		codel_interval = p ? getnum(p, NULL, "codel_interval") : -1;
+		p = strsep(&cur, ":");
+		prio = p ? getnum(p, NULL, "prio") : 0;
 		DX(4, "weight %d..%d (%d) len %d..%d (%d) flows %d",
 			w, w_h, w_steps, len, len_h, l_steps, flows);
 		if (w == 0 || w_h < w || len == 0 || len_h < len ||
 				flows == 0) {
-			DX(4,"wrong parameters %s", s);
-			return;
+			D("wrong parameters %s", c->fs_config);
+			free(s);
+			return -1;
 		}
 		n_flows += flows * w_steps * l_steps;
 		for (i = 0; i < w_steps; i++) {
@@ -405,11 +472,17 @@ parse_flowsets(struct cfg_s *c, const char *fs)
 					continue;
 				if (c->fs == NULL || c->flowsets <= n_fs) {
 					D("error in number of flowsets");
-					return;
+					free(s);
+					return -1;
 				}
 				wsum += wi * flows;
 				fs->par[0] = wi;
 				fs->par[1] = li;
+				fs->par[2] = prio;
+				fs->codel_target = codel_target >= 0 ?
+				    codel_target : c->codel_target;
+				fs->codel_interval = codel_interval >= 0 ?
+				    codel_interval : c->codel_interval;
 				fs->index = n_fs;
 				fs->n_flows = flows;
 				fs->cur = fs->first_flow = prev==NULL ? 0 : prev->next_flow;
@@ -421,11 +494,12 @@ parse_flowsets(struct cfg_s *c, const char *fs)
 			}
 		}
 	}
+	free(s);
 	c->flows = n_flows;
 	c->flowsets = n_fs;
 	c->wsum = wsum;
 	if (pass == 0)
-		return;
+		return 0;
 
 	/* now link all flows to their parent flowsets */
 	DX(1,"%d flows on %d flowsets", c->flows, c->flowsets);
@@ -444,6 +518,211 @@ parse_flowsets(struct cfg_s *c, const char *fs)
 			q->fs = &c->fs[i];
 		}
 	}
+	return 0;
+}
+
+/*
+ * shapers are a comma-separated list of
+ *     flowset:rate[:burst]
+ * The rate (bit/s, K M G suffixes) applies to each flow of the
+ * flowset. The burst (bytes) defaults to 1ms at the given rate,
+ * and is at least twice the flowset maxlen.
+ * Called once queues and flowsets are set up.
+ */
+static int
+parse_shapers(struct cfg_s *c)
+{
+	char *s, *cur, *next;
+	int i, n = 0;
+
+	s = strdup(c->shape_config);
+	c->tb = calloc(c->flowsets, sizeof(*c->tb));
+	c->shp = calloc(c->flows, sizeof(*c->shp));
+	if (!s || !c->tb || !c->shp) {
+		D("error allocating memory");
+		free(s);
+		return -1;
+	}
+	for (next = s; (cur = strsep(&next, ","));) {
+		int fs = getnum(strsep(&cur, ":"), NULL, "shape_fs");
+		uint64_t rate = parse_bw(strsep(&cur, ":"));
+		char *b = strsep(&cur, ":");
+		uint64_t burst = b ? parse_qsize(b) : 0;
+		uint64_t min_burst;
+
+		if (fs >= c->flowsets || rate == U_PARSE_ERR ||
+				burst == U_PARSE_ERR) {
+			D("invalid shaper %d, ignore", fs);
+			continue;
+		}
+		min_burst = 2 * c->fs[fs].fs.par[1];
+		if (burst == 0)
+			burst = rate / 8 / 1000;
+		if (burst < min_burst)
+			burst = min_burst;
+		tb_config(&c->tb[fs], rate, burst);
+		DX(1, "fs %3d shaped at %llu bps burst %llu bytes", fs,
+			(unsigned long long)rate, (unsigned long long)burst);
+		if (rate)
+			n++;
+	}
+	free(s);
+	if (n == 0) {
+		free(c->tb);
+		free(c->shp);
+		c->tb = NULL;
+		c->shp = NULL;
+		return 0;
+	}
+	for (i = 0; i < c->flows; i++) {
+		struct dn_shaper *sh = &c->shp[i];
+
+		sh->q = FI2Q(c, i);
+		sh->tb = &c->tb[sh->q->fs - c->fs];
+		sh->mq.fid = i;
+#ifdef MY_MQ_LEN
+		if (mq_init(&sh->mq, sh->q->fs->fs.qlen))
+			return -1;
+#endif
+	}
+	if (wheel_init(&c->wheel, SHAPER_WHEEL_SLOTS,
+			NS2TSC(1000) ? NS2TSC(1000) : 1, rdtsc())) {
+		D("cannot create the shaper wheel");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * queue sizes are a comma-separated list of
+ *     [flowset:]slots
+ * giving the most packets in each flow queue of the flowset, or of
+ * all flowsets if the flowset is omitted.
+ */
+static int
+parse_rings(struct cfg_s *c)
+{
+	char *s, *cur, *next;
+
+	s = strdup(c->ring_config);
+	if (s == NULL) {
+		D("error allocating memory");
+		return -1;
+	}
+	for (next = s; (cur = strsep(&next, ","));) {
+		char *a = strsep(&cur, ":");
+		int fs = cur ? getnum(a, NULL, "ring_fs") : -1;
+		int len = getnum(cur ? cur : a, NULL, "ring_slots");
+		int i;
+
+		if (fs >= c->flowsets || len <= 0) {
+			D("invalid ring size %d for fs %d, ignore", len, fs);
+			continue;
+		}
+		for (i = 0; i < c->flowsets; i++) {
+			if (fs < 0 || fs == i)
+				c->fs[i].fs.qlen = len;
+		}
+	}
+	free(s);
+	return 0;
+}
+
+/*
+ * deadlines are a comma-separated list of
+ *     mark:deadline
+ * giving the relative deadline (us) of the flow with that id, i.e.
+ * of the packets with that mark. Flows without a deadline are best
+ * effort and are served by the -alg scheduler.
+ * Called once queues are set up.
+ */
+static int
+parse_edf(struct cfg_s *c)
+{
+	char *s, *cur, *next;
+	uint64_t max_rel = 0;
+	int i, n = 0;
+
+	s = strdup(c->edf_config);
+	c->edf_f = calloc(c->flows, sizeof(*c->edf_f));
+	if (!s || !c->edf_f) {
+		D("error allocating memory");
+		free(s);
+		return -1;
+	}
+	for (next = s; (cur = strsep(&next, ","));) {
+		int mark = getnum(strsep(&cur, ":"), NULL, "edf_mark");
+		int dl = getnum(strsep(&cur, ":"), NULL, "edf_deadline");
+
+		if (mark >= c->flows || dl <= 0) {
+			D("invalid deadline %d for mark %d, ignore", dl, mark);
+			continue;
+		}
+		c->edf_f[mark].rel = NS2TSC(1000ULL * dl);
+		if (max_rel < c->edf_f[mark].rel)
+			max_rel = c->edf_f[mark].rel;
+		DX(1, "flow %4d deadline %d us", mark, dl);
+		n++;
+	}
+	free(s);
+	if (n == 0) {
+		free(c->edf_f);
+		c->edf_f = NULL;
+		return 0;
+	}
+	for (i = 0; i < c->flows; i++)
+		c->edf_f[i].q = FI2Q(c, i);
+	if (edf_init(&c->edf, max_rel)) {
+		D("cannot create the deadline queue");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * band caps of the prio schedulers are a comma-separated list of
+ *     rate[:burst]
+ * one per band, highest priority first. The rate (bit/s, K M G
+ * suffixes) 0 leaves the band uncapped, the burst is in bytes.
+ * They reach the scheduler as extra parameters, rate and burst of
+ * band b in par[2b] and par[2b+1].
+ */
+static int
+parse_bands(struct cfg_s *c)
+{
+	struct dn_extra_parms *ep;
+	char *s, *cur, *next;
+
+	s = strdup(c->band_config);
+	ep = calloc(1, sizeof(*ep));
+	if (!s || !ep) {
+		D("error allocating memory");
+		free(s);
+		free(ep);
+		return -1;
+	}
+	ep->oid.len = sizeof(*ep);
+	strncpy(ep->name, "bands", sizeof(ep->name) - 1);
+	for (next = s; (cur = strsep(&next, ","));) {
+		uint64_t rate = parse_bw(strsep(&cur, ":"));
+		char *b = strsep(&cur, ":");
+		uint64_t burst = b ? parse_qsize(b) : 0;
+
+		if (ep->nr + 2 > DN_MAX_EXTRA_PARM) {
+			D("at most %d bands, ignore the rest",
+				DN_MAX_EXTRA_PARM / 2);
+			break;
+		}
+		if (rate == U_PARSE_ERR || burst == U_PARSE_ERR) {
+			D("invalid cap for band %u, ignore", ep->nr / 2);
+			rate = burst = 0;
+		}
+		ep->par[ep->nr++] = rate;
+		ep->par[ep->nr++] = burst;
+	}
+	free(s);
+	c->sched->cfg = &ep->oid;
+	return 0;
 }
 
 /* available schedulers */
@@ -451,6 +730,8 @@ extern moduledata_t *_g_dn_fifo;
 extern moduledata_t *_g_dn_wf2qp;
 extern moduledata_t *_g_dn_rr;
 extern moduledata_t *_g_dn_qfq;
+extern moduledata_t *_g_dn_prio;
+extern moduledata_t *_g_dn_prio_qfq;
 #ifdef WITH_QFQP
 extern moduledata_t *_g_dn_qfqp;
 #endif
@@ -492,6 +773,10 @@ init(struct cfg_s *c)
 				mod = _g_dn_fifo;
 			else if (!strcmp(av[1], "qfq"))
 				mod = _g_dn_qfq;
+			else if (!strcmp(av[1], "prio"))
+				mod = _g_dn_prio;
+			else if (!strcmp(av[1], "prio_qfq"))
+				mod = _g_dn_prio_qfq;
 #ifdef WITH_QFQP
 			else if (!strcmp(av[1], "qfq+") ||
 			    !strcmp(av[1], "qfqp") )
@@ -505,6 +790,14 @@ init(struct cfg_s *c)
 				mod = NULL;
 			c->name = mod ? mod->name : "NULL";
 			D("using scheduler %s", c->name);
+		} else if (!strcmp(*av, "-heap")) {
+			/* must be set before new_sched() creates the heaps */
+			int t = dn_heap_type_parse(av[1]);
+			if (t < 0)
+				D("unknown heap %s, ignore", av[1]);
+			else
+				dn_heap_type = t;
+			DX(3, "setting heap to %d", dn_heap_type);
 		} else if (!strcmp(*av, "-len")) {
 			c->lmin = getnum(av[1], NULL, av[0]);
 			c->lmax = c->lmin;
@@ -524,8 +817,28 @@ init(struct cfg_s *c)
 			c->flows = getnum(av[1], NULL, av[0]);
 			DX(3, "setting flows to %d", c->flows);
 		} else if (!strcmp(*av, "-flowsets")) {
-			parse_flowsets(c, av[1]); /* first pass */
+			if (parse_flowsets(c, av[1])) /* first pass */
+				return -1;
 			DX(3, "setting flowsets to %d", c->flowsets);
+		} else if (!strcmp(*av, "-codel")) {
+			/* default AQM for all flowsets, target[:interval] */
+			char *s = strdup(av[1]), *cur = s;
+			c->codel_target = getnum(strsep(&cur, ":"), NULL, "codel_target");
+			c->codel_interval = getnum(strsep(&cur, ":"), NULL, "codel_interval");
+			free(s);
+			DX(3, "setting codel to %d:%d", c->codel_target, c->codel_interval);
+		} else if (!strcmp(*av, "-shape")) {
+			c->shape_config = av[1];
+			DX(3, "setting shapers to %s", c->shape_config);
+		} else if (!strcmp(*av, "-ring")) {
+			c->ring_config = av[1];
+			DX(3, "setting rings to %s", c->ring_config);
+		} else if (!strcmp(*av, "-edf")) {
+			c->edf_config = av[1];
+			DX(3, "setting deadlines to %s", c->edf_config);
+		} else if (!strcmp(*av, "-bands")) {
+			c->band_config = av[1];
+			DX(3, "setting band caps to %s", c->band_config);
 		} else if (!strcmp(*av, "-shmem")) {
 			c->shm_name = strdup(av[1]);
 			DX(3, "setting shmem to %s", c->shm_name);
@@ -571,6 +884,7 @@ init(struct cfg_s *c)
 		/* make sure c->si has room for a queue */
 		c->enq = default_enqueue;
 		c->deq = default_dequeue;
+		c->si_len += sizeof(struct mq);
 	}
 
 	/* allocate queues, flowsets and one scheduler */
@@ -584,26 +898,51 @@ init(struct cfg_s *c)
 	c->q = calloc(c->flows, c->q_len);	/* one queue per flow */
 	if (!c->sched || !c->si || !c->fs || !c->q) {
 		D("error allocating memory");
-		exit(1);
+		return -1;
 	}
 	c->si->sched = c->sched; /* link scheduler instance to template */
+	c->sched->fp = p; /* for the free_* hooks in sched_fini() */
+	if (c->band_config && parse_bands(c))
+		return -1;
 	if (p) {
 		/* run initialization code if needed */
-		if (p->config)
-			p->config(c->si->sched);
-		if (p->new_sched)
-			p->new_sched(c->si);
+		if (p->config && p->config(c->si->sched)) {
+			D("cannot configure %s", p->name);
+			return -1;
+		}
+		if (p->new_sched && p->new_sched(c->si)) {
+			D("cannot create a %s instance", p->name);
+			return -1;
+		}
+		c->si_ready = 1;
 	}
+#ifdef MY_MQ_LEN
+	else if (mq_init((struct mq *)(c->si + 1), MY_MQ_MAX)) /* as in fifo */
+		return -1;
+#endif
 	/* parse_flowsets links queues to their flowsets */
-	parse_flowsets(c, NULL); /* second pass */
+	if (parse_flowsets(c, NULL)) /* second pass */
+		return -1;
 	/* complete the work calling new_fsk */
 	for (i = 0; i < c->flowsets; i++) {
 		struct dn_fsk *fsk = &c->fs[i];
 		if (fsk->fs.par[1] == 0)
 			fsk->fs.par[1] = 1000;	/* default pkt len */
+		if (c->fs_config == NULL) { /* no -flowsets, use defaults */
+			fsk->fs.codel_target = c->codel_target;
+			fsk->fs.codel_interval = c->codel_interval;
+		}
+		codel_config(&fsk->codel, fsk->fs.codel_target,
+		    fsk->fs.codel_interval);
+		if (fsk->codel.target) {
+			DX(1, "fs %3d codel target %d us interval %d us", i,
+			    fsk->fs.codel_target, fsk->fs.codel_interval);
+			c->codel = 1;
+		}
 		fsk->sched = c->si->sched;
 		if (p && p->new_fsk)
 			p->new_fsk(fsk);
+		c->n_fsk++;
 	}
 	/* --- now the scheduler is initialized --- */
 
@@ -614,22 +953,31 @@ init(struct cfg_s *c)
 	for (i=0; i <= BACKLOG+5; i++)
 		INIT_LIST_HEAD(&c->ll[i]);
 
+	if (c->ring_config && parse_rings(c))
+		return -1;
 	for (i = 0; i < c->flows; i++) {
 		struct dn_queue *q = FI2Q(c, i);
 		q->mq.fid = i;
-#ifdef MY_MQ_LEN
-		q->mq.q_len = MY_MQ_LEN;
-#endif
 		if (q->fs == NULL)
 			q->fs = &c->fs[0]; /* XXX */
+#ifdef MY_MQ_LEN
+		if (mq_init(&q->mq, q->fs->fs.qlen))
+			return -1;
+#endif
 		q->_si = c->si;
 		if (p && p->new_queue)
 			p->new_queue(q);
+		c->n_queues++;
 		INIT_LIST_HEAD(&q->ni.h);
 		list_add_tail(&q->ni.h, &c->ll[0]);
 	}
 	c->llmask = 1; /* all flows are in the first list */
 
+	if (c->shape_config && parse_shapers(c))
+		return -1;
+	if (c->edf_config && parse_edf(c))
+		return -1;
+
 	return 0;
 }
 
@@ -785,46 +1133,347 @@ sched_init(int ac, char *av[])
     bzero(c, sizeof(*c));
     c->ac = ac;
     c->av = av;
-    init(c);
+    if (init(c)) {
+	sched_fini(c);
+	return NULL;
+    }
     return c;
 }
 
-int
-sched_enq(void *opaque, struct mbuf *m)
+/* queue a packet of a flow with a deadline */
+static int
+edf_enqueue(struct cfg_s *c, struct dn_queue *q, struct mbuf *m)
+{
+    struct dn_edf_flow *f = &c->edf_f[m->flow_id];
+
+    if (dn_enqueue(q, m, 0))
+	return 1;
+    if (!f->queued)
+	edf_insert(&c->edf, f, m->ts + f->rel);
+    return 0;
+}
+
+/* serve the EDF class first, best effort flows when it is empty */
+static struct mbuf *
+sched_deq_alg(struct cfg_s *c, uint64_t now)
+{
+    struct dn_edf_flow *f;
+    struct mbuf *m, *next;
+
+    if (c->edf_f == NULL || (f = edf_extract(&c->edf)) == NULL)
+	return c->deq(c->si);
+    if (DN_KEY_LT(f->deadline, now)) {
+	f->misses++;
+	c->edf.misses++;
+    }
+    m = dn_dequeue(f->q);
+    if ((next = mq_peek(&f->q->mq)) != NULL)
+	edf_insert(&c->edf, f, next->ts + f->rel);
+    return m;
+}
+
+/* hand a packet to the scheduling algorithm */
+static int
+sched_enq_alg(struct cfg_s *c, struct dn_queue *q, struct mbuf *m)
 {
-    struct cfg_s *c = opaque;
-    struct dn_queue *q = FI2Q(c, m->flow_id);
     int ret;
 
     c->_enqueue++;
-    ret = c->enq(c->si, q, m);
+    if (c->codel || c->edf_f)
+	m->ts = rdtsc();
+    if (c->edf_f && c->edf_f[m->flow_id].rel)
+	ret = edf_enqueue(c, q, m);
+    else
+	ret = c->enq(c->si, q, m);
     if (ret) {
 	c->drop++;
-	ND("------ DROP (%d) ----- m %zd len %u flow %u", c->drop, m - m->q->queue, m->iov.iov_len, m->flow_id);
+	ND("------ DROP (%d) ----- m %zd len %u flow %u", c->drop, m - m->q->queue, m->len, m->flow_id);
 	return ret;
     }
     c->pending++;
-    gnet_stats_enq(c->si, FI2Q(c, m->flow_id));
+    gnet_stats_enq(c->si, q);
     return 0;
 }
 
+/* wheel callback: move the packets of a flow that got tokens
+ * to the scheduler, and requeue the flow if some are left.
+ */
+static void
+shaper_release(void *arg, struct dn_shaper *s, uint64_t now)
+{
+    struct cfg_s *c = arg;
+    struct mbuf *m;
+
+    while ((m = mq_peek(&s->mq)) != NULL && tb_conform(s, s->tb, now)) {
+	mq_dequeue(&s->mq);
+	c->shaped--;
+	tb_charge(s, s->tb, now, m->len);
+	if (sched_enq_alg(c, s->q, m) && c->drop_f)
+	    c->drop_f(c->drop_arg, m);
+    }
+    if (m != NULL)
+	wheel_insert(&c->wheel, s, tb_eligible(s, s->tb));
+}
+
+int
+sched_enq(void *opaque, struct mbuf *m)
+{
+    struct cfg_s *c = opaque;
+    struct dn_queue *q = FI2Q(c, m->flow_id);
+
+    if (c->shp != NULL && c->shp[m->flow_id].tb->rate) {
+	struct dn_shaper *s = &c->shp[m->flow_id];
+	uint64_t now = rdtsc();
+
+	if (mq_peek(&s->mq) != NULL || !tb_conform(s, s->tb, now)) {
+	    /* out of tokens, wait in the shaper */
+	    if (mq_append(&s->mq, m)) {
+		c->drop++;
+		return 1;
+	    }
+	    c->shaped++;
+	    if (!s->on_wheel)
+		wheel_insert(&c->wheel, s, tb_eligible(s, s->tb));
+	    return 0;
+	}
+	tb_charge(s, s->tb, now, m->len);
+    }
+    return sched_enq_alg(c, q, m);
+}
+
+/* packets in the scheduler, including those waiting for tokens */
+int
+sched_backlog(void *opaque)
+{
+    struct cfg_s *c = opaque;
+
+    return c->pending + c->shaped;
+}
+
+/* packets of EDF flows served after their deadline */
+uint64_t
+sched_deadline_misses(void *opaque)
+{
+    struct cfg_s *c = opaque;
+
+    return c->edf.misses;
+}
+
+/* push all packets held by the shapers to the scheduler */
+void
+sched_flush(void *opaque)
+{
+    struct cfg_s *c = opaque;
+    struct mbuf *m;
+    int i;
+
+    if (c->shp == NULL)
+	return;
+    for (i = 0; i < c->flows; i++) {
+	struct dn_shaper *s = &c->shp[i];
+
+	while ((m = mq_peek(&s->mq)) != NULL) {
+	    mq_dequeue(&s->mq);
+	    c->shaped--;
+	    if (sched_enq_alg(c, s->q, m) && c->drop_f)
+		c->drop_f(c->drop_arg, m);
+	}
+    }
+}
+
 struct mbuf *
 sched_deq(void *opaque)
 {
     struct cfg_s *c = opaque;
     struct mbuf *m = NULL;
+    uint64_t now = (c->codel || c->shp || c->edf_f) ? rdtsc() : 0;
+
+    /* shaped flows that got their tokens join the scheduler */
+    if (c->shp)
+	wheel_run(&c->wheel, now, shaper_release, c);
 
     assert(c->pending >= 0);
-    if (c->pending) {
+    while (c->pending) {
 	c->dequeue++;
-	m = c->deq(c->si);
-	if (m) {
-	    c->pending--;
-	    gnet_stats_deq(c, m);
-	} else {
+	m = sched_deq_alg(c, now);
+	if (m == NULL) {
 	    D("--- ouch, cannot operate, pending %d", c->pending);
+	    break;
 	}
+	c->pending--;
+	gnet_stats_deq(c, m);
+
+	/* AQM: the scheduler picked the packet, CoDel may still
+	 * drop it, in which case we ask the scheduler for another one.
+	 */
+	if (c->codel && c->drop_f) {
+	    struct dn_queue *q = FI2Q(c, m->flow_id);
+	    struct dn_fsk *fs = q->fs;
+
+	    if (fs->codel.target && codel_drop(&q->codel, &fs->codel,
+			m->ts, now, q->ni.length)) {
+		q->ni.drops++;
+		c->aqm_drop++;
+		c->drop_f(c->drop_arg, m);
+		m = NULL;
+		continue;
+	    }
+	}
+	break;
     }
     return m;
 }
 
+
+/*
+ * Runtime reconfiguration. These run in the scheduler thread, between
+ * dequeues, see sched_all_ctl() in pspat.c.
+ */
+
+const char *
+sched_name(void *opaque)
+{
+    struct cfg_s *c = opaque;
+
+    return c->name;
+}
+
+/*
+ * Change the weight of the flows of a flowset in place, as dummynet
+ * does: free_queue takes each queue out of the scheduler, new_queue
+ * puts it back with the new weight. WF2Q+, RR and PRIO reinsert
+ * backlogged queues, the others (QFQ) only handle empty ones; EBUSY
+ * tells the caller to build a new scheduler instead.
+ */
+int
+sched_reweight(void *opaque, int fs, int weight)
+{
+    struct cfg_s *c = opaque;
+    struct dn_alg *p = c->sched->fp;
+    struct dn_fsk *fsk;
+    int i;
+
+    if (fs < 0 || fs >= c->flowsets || weight <= 0)
+	return EINVAL;
+    fsk = &c->fs[fs];
+    if (p && p != _g_dn_wf2qp->p && p != _g_dn_rr->p && p != _g_dn_fifo->p &&
+	    p != _g_dn_prio->p) {
+	for (i = fsk->fs.first_flow; i < fsk->fs.next_flow; i++) {
+	    if (FI2Q(c, i)->mq.head != NULL)
+		return EBUSY;
+	}
+    }
+    for (i = fsk->fs.first_flow; i < fsk->fs.next_flow; i++) {
+	/* EDF flows are not known to the algorithm */
+	if (p && p->free_queue && !(c->edf_f && c->edf_f[i].rel))
+	    p->free_queue(FI2Q(c, i));
+    }
+    c->wsum += (weight - fsk->fs.par[0]) * fsk->fs.n_flows;
+    fsk->fs.par[0] = weight;
+    if (p && p->new_fsk)
+	p->new_fsk(fsk);	/* bounds the weight */
+    for (i = fsk->fs.first_flow; i < fsk->fs.next_flow; i++) {
+	if (p && p->new_queue && !(c->edf_f && c->edf_f[i].rel))
+	    p->new_queue(FI2Q(c, i));
+    }
+    DX(1, "fs %3d weight now %d", fs, fsk->fs.par[0]);
+    return 0;
+}
+
+/*
+ * The flowsets as an explicit -flowsets list, one entry per flowset,
+ * with the current weights. Returns the length, as snprintf.
+ */
+int
+sched_flowsets_spec(void *opaque, char *buf, size_t len)
+{
+    struct cfg_s *c = opaque;
+    size_t n = 0;
+    int i;
+
+    if (len > 0)
+	buf[0] = '\0';
+    for (i = 0; i < c->flowsets; i++) {
+	struct dn_fs *fs = &c->fs[i].fs;
+
+	n += snprintf(buf + (n < len ? n : len), n < len ? len - n : 0,
+	    "%s%d:%d:%d:%d:%d:%d", i ? "," : "", fs->par[0], fs->par[1],
+	    fs->n_flows ? fs->n_flows : c->flows, fs->codel_target,
+	    fs->codel_interval, fs->par[2]);
+    }
+    return n;
+}
+
+/*
+ * Move all queued packets, including those waiting for tokens, to
+ * another scheduler. They leave in the order of the old scheduler,
+ * so each flow stays in FIFO order. Packets of flows that do not
+ * exist in the new scheduler, or that it drops, are dropped.
+ * Returns the number of packets moved.
+ */
+int
+sched_move(void *_to, void *_from)
+{
+    struct cfg_s *to = _to, *c = _from;
+    uint64_t now = rdtsc();
+    struct mbuf *m;
+    int n = 0;
+
+    sched_flush(c);
+    while (c->pending > 0 && (m = sched_deq_alg(c, now)) != NULL) {
+	c->pending--;
+	gnet_stats_deq(c, m);
+	if (m->flow_id < (uint32_t)to->flows && sched_enq(to, m) == 0) {
+	    n++;
+	} else if (c->drop_f) {
+	    c->drop_f(c->drop_arg, m);
+	}
+    }
+    return n;
+}
+
+/*
+ * destroy an empty scheduler, through the free_* hooks, also one
+ * that init() left half built
+ */
+void
+sched_fini(void *opaque)
+{
+    struct cfg_s *c = opaque;
+    struct dn_alg *p = c->sched ? c->sched->fp : NULL;
+    int i;
+
+    for (i = 0; c->q && i < c->flows; i++) {
+	struct dn_queue *q = FI2Q(c, i);
+
+	if (p && p->free_queue && i < c->n_queues &&
+	    !(c->edf_f && c->edf_f[i].rel))
+	    p->free_queue(q);
+	dn_free_mq(&q->mq);
+    }
+    for (i = 0; i < c->n_fsk; i++) {
+	if (p && p->free_fsk)
+	    p->free_fsk(&c->fs[i]);
+    }
+    if (p && p->free_sched && c->si_ready)
+	p->free_sched(c->si);
+    else if (p == NULL && c->si)
+	dn_free_mq((struct mq *)(c->si + 1));
+    if (c->shp) {
+	for (i = 0; i < c->flows; i++)
+	    dn_free_mq(&c->shp[i].mq);
+	wheel_free(&c->wheel);
+    }
+    if (c->edf_f)
+	edf_free(&c->edf);
+    free(c->tb);
+    free(c->shp);
+    free(c->edf_f);
+    if (c->sched)
+	free(c->sched->cfg);
+    free(c->q);
+    free(c->fs);
+    free(c->si);
+    free(c->sched);
+    free(c);
+}
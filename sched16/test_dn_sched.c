@@ -26,11 +26,12 @@ dn_free_mq(struct mq *q)
 {
 #ifdef MY_MQ_LEN
 	uint32_t cur;
-	for (cur = q->q_head; cur != q->q_tail; cur++) {
-		if (cur == q->q_len)
-			cur = 0;
-		m_freem(q->q[cur]);
-	}
+	for (cur = q->q_head; cur != q->q_tail; cur++)
+		m_freem(q->q[cur & (q->q_len - 1)]);
+	free(q->q);
+	q->q = NULL;
+	q->q_head = q->q_tail = 0;
+	q->head = NULL;
 #else
 	dn_free_pkts(q->head);
 #endif
@@ -77,7 +78,7 @@ dn_enqueue(struct dn_queue *q, struct mbuf* m, int drop)
 	if (mq_append(&q->mq, m))
 		goto drop;
         q->ni.length++;
-        q->ni.tot_bytes += m->iov.iov_len;
+        q->ni.tot_bytes += m->len;
         q->ni.tot_pkts++;
         return 0;
 
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>	/* read() */
+#include <cpuid.h>
 
 struct timeval
 D_tod(void)
@@ -62,6 +63,17 @@ calibrate_tsc(void)
     return cy;
 }
 
+/* umonitor/umwait/tpause support, cpuid leaf 7 ecx bit 5 */
+int
+cpu_has_waitpkg(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+	return 0;
+    return (c >> 5) & 1;
+}
+
 void
 runon(const char *name, int i)
 {
@@ -58,6 +58,33 @@ tsc_sleep_till(uint64_t when)
         barrier();
 }
 
+/* same, but with pause to save power and leave the core to the
+ * sibling hyperthread */
+static inline void
+tsc_pause_till(uint64_t when)
+{
+    while (rdtsc() < when)
+        __builtin_ia32_pause();
+}
+
+/*
+ * tpause (WAITPKG) puts the core in a light C0.1 state until the
+ * deadline or an interrupt. The OS may cap the wait time, so loop.
+ * Only call this if cpu_has_waitpkg().
+ */
+static inline void
+tsc_tpause_till(uint64_t when)
+{
+    while (rdtsc() < when) {
+        /* tpause %ecx, encoded by hand for older assemblers */
+        __asm__ __volatile__ (".byte 0x66, 0x0f, 0xae, 0xf1"
+            : : "c"(1), "a"((uint32_t)when), "d"((uint32_t)(when >> 32))
+            : "cc", "memory");
+    }
+}
+
+int cpu_has_waitpkg(void);
+
 void runon(const char *, int);
 
 #endif /* __SCHED_TSC__ */